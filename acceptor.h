@@ -0,0 +1,262 @@
+/**
+ * @file acceptor.h
+ * @brief Accept loop that survives descriptor and memory exhaustion
+ *
+ * A plain blocking accept() turns EMFILE, ENFILE or an aborted handshake into
+ * an error the caller has to handle, and the obvious handling (retrying at
+ * once) spins: the pending connection stays queued and the listener stays
+ * readable. The Acceptor instead
+ *
+ *   - drains the listen queue in batches with accept4() once poll() reports
+ *     it readable,
+ *   - retries transparently on errors that belong to one connection
+ *     (ECONNABORTED, EPROTO and the network errors Linux passes through),
+ *   - keeps one spare descriptor open so that, when out of descriptors, it
+ *     can still accept each queued connection, answer 503 and close it,
+ *     instead of leaving clients to time out,
+ *   - backs off exponentially while a resource stays exhausted, and
+ *   - counts every condition for /metrics.
+ *
+ * raise_fd_limit() lifts the soft RLIMIT_NOFILE to the hard limit at startup,
+ * since every connection costs a descriptor.
+ */
+
+#pragma once
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <system_error>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Raise the soft descriptor limit as far as the hard limit allows
+ * @return rlim_t The soft limit now in effect
+ */
+inline rlim_t raise_fd_limit() {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return 0;
+  }
+  if (limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+      getrlimit(RLIMIT_NOFILE, &limit);
+    }
+  }
+  return limit.rlim_cur;
+}
+
+/**
+ * @brief Accept failures and shed connections, exported by /metrics
+ *
+ * Written by the accepting thread only.
+ */
+struct AcceptStats {
+  std::atomic<uint64_t> emfile{0};     ///< Process out of descriptors
+  std::atomic<uint64_t> enfile{0};     ///< System out of descriptors
+  std::atomic<uint64_t> nomem{0};      ///< ENOBUFS or ENOMEM
+  std::atomic<uint64_t> aborted{0};    ///< Connection gone before accept
+  std::atomic<uint64_t> shed{0};       ///< Answered 503 and closed
+  std::atomic<uint64_t> backoffs{0};   ///< Pauses after an exhaustion error
+  std::atomic<uint64_t> batches{0};    ///< Wakeups that accepted anything
+};
+
+/**
+ * @brief Batched, exhaustion-tolerant accept loop for one listener
+ *
+ * Not thread-safe; one thread runs it.
+ */
+class Acceptor {
+public:
+  static constexpr unsigned BATCH = 64;            ///< Max accepts per wakeup
+  static constexpr unsigned BACKOFF_MIN_MS = 10;   ///< First pause
+  static constexpr unsigned BACKOFF_MAX_MS = 1000; ///< Longest pause
+
+  /**
+   * @param listen_fd Listening socket, made non-blocking; not owned
+   * @throws std::system_error if the socket or reserve cannot be set up
+   */
+  explicit Acceptor(int listen_fd) : fd_(listen_fd) {
+    int flags = fcntl(fd_, F_GETFL);
+    if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "fcntl(O_NONBLOCK) on listener failed");
+    }
+    if (!open_reserve()) {
+      throw std::system_error(errno, std::generic_category(),
+                              "open() of reserve descriptor failed");
+    }
+  }
+
+  ~Acceptor() {
+    if (reserve_ >= 0) {
+      close(reserve_);
+    }
+  }
+
+  Acceptor(const Acceptor &) = delete;
+  Acceptor &operator=(const Acceptor &) = delete;
+
+  /**
+   * @brief Wait for connections and pass each one to on_client
+   *
+   * Calls on_client(int fd, const sockaddr_in &peer) for up to BATCH new
+   * connections, which are blocking and close-on-exec. on_client owns the
+   * descriptor; if it cannot serve it, it may hand it back to shed(), and
+   * once it serves it, it should call handed_off().
+   *
+   * @throws std::system_error on errors that are not transient
+   */
+  template <typename Fn> void accept_batch(Fn on_client) {
+    pollfd pfd = {fd_, POLLIN, 0};
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      throw std::system_error(errno, std::generic_category(), "poll() failed");
+    }
+    unsigned n = 0;
+    while (n < BATCH) {
+      sockaddr_in peer{};
+      socklen_t len = sizeof(peer);
+      int client_fd = accept4(fd_, reinterpret_cast<sockaddr *>(&peer), &len,
+                              SOCK_CLOEXEC);
+      if (client_fd >= 0) {
+        n++;
+        on_client(client_fd, peer);
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      Recovery r = recover(errno);
+      if (r == FATAL) {
+        throw std::system_error(errno, std::generic_category(),
+                                "accept4() failed");
+      }
+      if (r == BACK_OFF) {
+        back_off();
+        break;
+      }
+    }
+    if (n > 0) {
+      metrics::add(stats_.batches, 1);
+    }
+  }
+
+  /**
+   * @brief Answer 503 on a connection that cannot be served and close it
+   */
+  void shed(int client_fd) {
+    static constexpr char RESPONSE[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Content-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+    send(client_fd, RESPONSE, sizeof(RESPONSE) - 1,
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_fd);
+    metrics::add(stats_.shed, 1);
+  }
+
+  /**
+   * @brief Pause accepting after a resource ran out, doubling each time
+   *
+   * The pause resets once a connection is handed off again; a successful
+   * accept4() alone does not, since the connection may still be shed.
+   */
+  void back_off() {
+    backoff_ms_ = std::clamp(backoff_ms_ * 2, BACKOFF_MIN_MS, BACKOFF_MAX_MS);
+    metrics::add(stats_.backoffs, 1);
+    timespec pause = {static_cast<time_t>(backoff_ms_ / 1000),
+                      static_cast<long>(backoff_ms_ % 1000) * 1000000};
+    while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {
+    }
+  }
+
+  /**
+   * @brief Note that a connection is being served, ending any back-off
+   */
+  void handed_off() { backoff_ms_ = 0; }
+
+  const AcceptStats &stats() const { return stats_; }
+
+private:
+  int fd_;
+  int reserve_ = -1;        ///< Spare descriptor given up to shed with
+  unsigned backoff_ms_ = 0; ///< Current pause, 0 while hand-offs succeed
+  AcceptStats stats_;
+
+  enum Recovery { RETRY, BACK_OFF, FATAL };
+
+  bool open_reserve() {
+    reserve_ = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return reserve_ >= 0;
+  }
+
+  /**
+   * @brief Count an accept4() error and deal with it
+   * @return Recovery What the accept loop should do next
+   */
+  Recovery recover(int err) {
+    switch (err) {
+    case EINTR:
+      return RETRY;
+    case ECONNABORTED:
+    case EPROTO:
+    case ENETDOWN:
+    case ENOPROTOOPT:
+    case EHOSTDOWN:
+    case ENONET:
+    case EHOSTUNREACH:
+    case EOPNOTSUPP:
+    case ENETUNREACH:
+      // Pending errors of a connection that is already gone
+      metrics::add(stats_.aborted, 1);
+      return RETRY;
+    case EMFILE:
+    case ENFILE:
+      metrics::add(err == EMFILE ? stats_.emfile : stats_.enfile, 1);
+      shed_queued();
+      return BACK_OFF;
+    case ENOBUFS:
+    case ENOMEM:
+      metrics::add(stats_.nomem, 1);
+      return BACK_OFF;
+    default:
+      return FATAL;
+    }
+  }
+
+  /**
+   * @brief Use the reserve descriptor to turn away what is queued
+   *
+   * Each queued connection is accepted into the slot the reserve frees and
+   * shed; the reserve is reopened after each, so if another thread takes
+   * the slot meanwhile, shedding simply stops.
+   */
+  void shed_queued() {
+    if (reserve_ < 0) {
+      open_reserve();
+    }
+    for (unsigned i = 0; i < BATCH && reserve_ >= 0; i++) {
+      close(reserve_);
+      reserve_ = -1;
+      int client_fd =
+          accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client_fd >= 0) {
+        shed(client_fd);
+      }
+      int err = errno;
+      open_reserve();
+      if (client_fd < 0 && err != EINTR) {
+        break;
+      }
+    }
+  }
+};
@@ -0,0 +1,260 @@
+/**
+ * @file access_log.h
+ * @brief Asynchronous structured access log
+ *
+ * Request threads never format or write log lines themselves. Each one
+ * copies a fixed-size AccessRecord into its own single-producer ring, and a
+ * background writer drains all rings every few milliseconds, formats the
+ * records as JSON lines and writes them out in one batch. If the writer
+ * falls behind and a ring is full the record is dropped and counted instead
+ * of blocking the request. In binary mode the writer appends the records to
+ * memory-mapped segments (see binlog.h) instead of formatting them.
+ */
+
+#pragma once
+
+#include "access_record.h"
+#include "binlog.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Bounded single-producer single-consumer queue
+ *
+ * The producer only writes tail_ and the consumer only writes head_, each on
+ * its own cache line, so neither ever waits for the other.
+ */
+template <typename T, size_t N> class SpscRing {
+  static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+  alignas(metrics::CACHE_LINE) std::atomic<size_t> head_{0};
+  alignas(metrics::CACHE_LINE) std::atomic<size_t> tail_{0};
+  T items_[N];
+
+public:
+  /**
+   * @brief Append an item; producer only
+   * @return false if the ring is full
+   */
+  bool push(const T &item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    items_[tail % N] = item;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Pass every queued item to fn(const T &) and remove them;
+   *        consumer only
+   * @return size_t Number of items consumed
+   */
+  template <typename Fn> size_t drain(Fn fn) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    for (size_t i = head; i != tail; i++) {
+      fn(items_[i % N]);
+    }
+    head_.store(tail, std::memory_order_release);
+    return tail - head;
+  }
+};
+
+/**
+ * @brief Access log settings
+ */
+struct AccessLogConfig {
+  enum Format { JSON, BINARY };
+  Format format = JSON;
+  std::string path = "-";     ///< File to append to, "-" for stdout; for
+                              ///< BINARY, the segment directory
+  unsigned sample = 1;        ///< Log one request in this many (errors always)
+  unsigned flush_ms = 50;     ///< How often the writer drains the rings
+};
+
+/**
+ * @brief Per-thread rings drained by one writer thread
+ */
+class AccessLog {
+public:
+  static constexpr size_t RING_SIZE = 8; ///< Records buffered per thread
+
+private:
+  struct Slot {
+    SpscRing<AccessRecord, RING_SIZE> ring;
+    std::atomic<uint64_t> dropped{0}; ///< Written by the ring's producer
+  };
+
+  AccessLogConfig config_;
+  int fd_ = -1;
+  std::unique_ptr<binlog::SegmentWriter> segments_; ///< BINARY format only
+  metrics::PerThread<Slot> slots_;
+  std::atomic<uint64_t> written_{0};
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  bool stopping_ = false;
+  std::thread writer_;
+
+  void write_out(const std::string &batch) {
+    const char *p = batch.data();
+    size_t left = batch.size();
+    while (left > 0) {
+      ssize_t n = write(fd_, p, left);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        perror("access log write failed");
+        return;
+      }
+      p += n;
+      left -= n;
+    }
+  }
+
+  /**
+   * @brief Drain the rings every flush_ms until close(), then once more
+   */
+  void writer_loop() {
+    std::string batch;
+    bool last = false;
+    while (!last) {
+      {
+        std::unique_lock<std::mutex> lock(stop_mutex_);
+        last = stop_cv_.wait_for(lock,
+                                 std::chrono::milliseconds(config_.flush_ms),
+                                 [this] { return stopping_; });
+      }
+      batch.clear();
+      uint64_t n = 0;
+      if (segments_) {
+        slots_.for_each([&](Slot &slot) {
+          slot.ring.drain([&](const AccessRecord &r) {
+            n += segments_->append(r) ? 1 : 0;
+          });
+        });
+        segments_->commit();
+      } else {
+        slots_.for_each([&](Slot &slot) {
+          n += slot.ring.drain(
+              [&batch](const AccessRecord &r) { format_json(batch, r); });
+        });
+        if (n > 0) {
+          write_out(batch);
+        }
+      }
+      written_.fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+
+  bool sampled_out(const AccessRecord &record) const {
+    if (config_.sample <= 1 || record.status >= 500) {
+      return false;
+    }
+    // xorshift64, seeded per thread; good enough to pick 1 in N
+    static thread_local uint64_t state =
+        metrics::now_ns() ^ reinterpret_cast<uintptr_t>(&state);
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state % config_.sample != 0;
+  }
+
+public:
+  /**
+   * @brief Open the log and start the writer thread
+   * @throws std::system_error if the log file cannot be opened
+   */
+  explicit AccessLog(AccessLogConfig config) : config_(std::move(config)) {
+    if (config_.format == AccessLogConfig::BINARY) {
+      segments_ = std::make_unique<binlog::SegmentWriter>(config_.path);
+    } else if (config_.path == "-") {
+      fd_ = STDOUT_FILENO;
+    } else {
+      fd_ = open(config_.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                 0644);
+      if (fd_ < 0) {
+        throw std::system_error(errno, std::generic_category(),
+                                "open() failed for " + config_.path);
+      }
+    }
+    writer_ = std::thread(&AccessLog::writer_loop, this);
+  }
+
+  ~AccessLog() { close(); }
+
+  AccessLog(const AccessLog &) = delete;
+  AccessLog &operator=(const AccessLog &) = delete;
+
+  /**
+   * @brief Stop the writer after it has written out every queued record
+   *
+   * The log file, or the active binary segment with its header count, is
+   * synced to disk. Records appended afterwards stay in their rings and are
+   * lost; call this only on the way out.
+   */
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(stop_mutex_);
+      if (stopping_) {
+        return;
+      }
+      stopping_ = true;
+    }
+    stop_cv_.notify_one();
+    writer_.join();
+    if (segments_) {
+      segments_->sync();
+    } else if (fd_ >= 0 && fd_ != STDOUT_FILENO) {
+      fsync(fd_);
+    }
+  }
+
+  /**
+   * @brief Queue a record without blocking; drops it if the ring is full
+   */
+  void append(const AccessRecord &record) {
+    if (sampled_out(record)) {
+      return;
+    }
+    Slot &slot = slots_.local();
+    if (!slot.ring.push(record)) {
+      metrics::add(slot.dropped, 1);
+    }
+  }
+
+  /**
+   * @brief Records dropped because the writer fell behind
+   */
+  uint64_t dropped() const {
+    uint64_t total = 0;
+    slots_.for_each([&total](const Slot &slot) {
+      total += slot.dropped.load(std::memory_order_relaxed);
+    });
+    return total;
+  }
+
+  /**
+   * @brief Records written so far
+   */
+  uint64_t written() const { return written_.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,108 @@
+/**
+ * @file access_record.h
+ * @brief The per-request access log record and its JSON form
+ *
+ * Shared by the access log writer and the log query tool.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <time.h>
+
+/**
+ * @brief Everything logged about one request, fixed size and trivially
+ *        copyable
+ */
+struct AccessRecord {
+  int64_t time_ns = 0;       ///< CLOCK_REALTIME when the request finished
+  uint32_t client_ip = 0;    ///< IPv4 address, network byte order
+  uint16_t client_port = 0;  ///< Host byte order
+  uint16_t status = 0;       ///< Response status, 0 if none was sent
+  uint64_t bytes_sent = 0;   ///< Headers and body
+  uint64_t content_size = 0; ///< Size of the file served, 0 if none
+  int64_t range_start = -1;  ///< First body byte of a 206, -1 otherwise
+  uint64_t range_length = 0; ///< Body bytes of a 206
+  uint64_t duration_us = 0;  ///< Accept to last byte sent (or to close)
+  uint32_t ttfb_us = 0;      ///< Accept to response headers written
+  uint32_t rtt_us = 0;       ///< Mean sampled RTT, 0 if no body was sent
+  uint32_t retransmits = 0;  ///< Segments retransmitted
+  uint16_t rwnd_limited = 0; ///< Per mille of busy time
+  uint16_t sndbuf_limited = 0; ///< Per mille of busy time
+  char method[8] = {};       ///< NUL-padded, truncated
+  char path[128] = {};       ///< Request target without query, truncated
+
+  /**
+   * @brief Copy a string into one of the fixed-size fields
+   */
+  template <size_t N> static void set(char (&field)[N], std::string_view s) {
+    size_t n = std::min(s.size(), N - 1);
+    memcpy(field, s.data(), n);
+    memset(field + n, 0, N - n);
+  }
+};
+
+/**
+ * @brief Append s as a JSON string literal
+ */
+inline void append_json_string(std::string &out, std::string_view s) {
+  out += '"';
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out += esc;
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
+  out += '"';
+}
+
+/**
+ * @brief Append a record as one JSON line
+ */
+inline void format_json(std::string &out, const AccessRecord &r) {
+  time_t secs = r.time_ns / 1000000000;
+  tm utc;
+  gmtime_r(&secs, &utc);
+  char time_buf[32];
+  strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &utc);
+  char ip[INET_ADDRSTRLEN];
+  in_addr addr{r.client_ip};
+  inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "{\"time\":\"%s.%03dZ\",\"client\":\"%s:%u\",\"method\":", time_buf,
+           static_cast<int>(r.time_ns / 1000000 % 1000), ip, r.client_port);
+  out += buf;
+  append_json_string(out, std::string_view(r.method, strnlen(r.method, 8)));
+  out += ",\"path\":";
+  append_json_string(out, std::string_view(r.path, strnlen(r.path, 128)));
+  snprintf(buf, sizeof(buf), ",\"status\":%u,\"bytes\":%llu,\"size\":%llu",
+           r.status, static_cast<unsigned long long>(r.bytes_sent),
+           static_cast<unsigned long long>(r.content_size));
+  out += buf;
+  if (r.range_start >= 0) {
+    snprintf(buf, sizeof(buf), ",\"range\":\"%lld-%lld\"",
+             static_cast<long long>(r.range_start),
+             static_cast<long long>(r.range_start + r.range_length - 1));
+    out += buf;
+  }
+  snprintf(buf, sizeof(buf),
+           ",\"duration_us\":%llu,\"ttfb_us\":%u,\"rtt_us\":%u,"
+           "\"retrans\":%u,\"rwnd_limited\":%.3f,\"sndbuf_limited\":%.3f}\n",
+           static_cast<unsigned long long>(r.duration_us), r.ttfb_us, r.rtt_us,
+           r.retransmits, r.rwnd_limited / 1000.0, r.sndbuf_limited / 1000.0);
+  out += buf;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file alloc_tracking.h
+ * @brief Optional per-thread count of heap allocations
+ *
+ * Built with -DSTREAMIX_ALLOC_TRACKING (see `make alloc-check`), this file
+ * replaces malloc() and friends with wrappers that forward to glibc's
+ * allocator and count calls per thread. Everything that allocates goes
+ * through them, including operator new and the C library itself. The
+ * server measures the count across each request and the accept loop, and
+ * exports the totals in /metrics.
+ *
+ * Without the define, calls() is a constant 0 and nothing is replaced.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+namespace alloc_tracking {
+
+#ifdef STREAMIX_ALLOC_TRACKING
+constexpr bool ENABLED = true;
+
+// Trivially constructed and initial-exec, so safe to touch inside malloc()
+inline thread_local uint64_t thread_calls = 0;
+
+inline uint64_t calls() { return thread_calls; }
+#else
+constexpr bool ENABLED = false;
+
+inline uint64_t calls() { return 0; }
+#endif
+
+} // namespace alloc_tracking
+
+#ifdef STREAMIX_ALLOC_TRACKING
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size) noexcept {
+  alloc_tracking::thread_calls++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) noexcept {
+  alloc_tracking::thread_calls++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept {
+  alloc_tracking::thread_calls++;
+  return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept {
+  alloc_tracking::thread_calls++;
+  return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) noexcept {
+  alloc_tracking::thread_calls++;
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) noexcept {
+  alloc_tracking::thread_calls++;
+  void *p = __libc_memalign(alignment, size);
+  if (p == nullptr) {
+    return ENOMEM;
+  }
+  *out = p;
+  return 0;
+}
+} // extern "C"
+#endif
@@ -0,0 +1,101 @@
+#!/bin/sh
+# Run the benchmark scenarios against several builds and compare them.
+#
+# Usage: bench/compare_builds.sh SERVER...
+#
+# Each SERVER (make build-report passes the default, release and PGO builds)
+# goes through bench/run.sh in turn. The first one is the reference: the table
+# on stdout shows requests/s, MB/s and p50/p99 latency for every scenario and
+# build, with the change against the reference. The bench/run.sh reports are
+# collected into one JSON object.
+#
+# Environment:
+#   BUILD_REPORT  Output file (default build_report.json)
+#   BENCH_*       Passed on to bench/run.sh
+
+set -eu
+
+if [ "$#" -eq 0 ]; then
+  echo "usage: $0 SERVER..." >&2
+  exit 2
+fi
+REPORT=${BUILD_REPORT:-build_report.json}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+i=0
+for server in "$@"; do
+  i=$((i + 1))
+  echo "build-report: benchmarking $server" >&2
+  BENCH_REPORT="$dir/$i.json" ./bench/run.sh "$server" >&2
+done
+
+{
+  printf '{"builds":['
+  sep=
+  j=0
+  while [ "$j" -lt "$i" ]; do
+    j=$((j + 1))
+    printf '%s' "$sep"
+    tr -d '\n' <"$dir/$j.json"
+    sep=,
+  done
+  printf ']}\n'
+} >"$REPORT"
+
+# One record per scenario; the first build's figures are the reference
+awk 'BEGIN { RS = "[{]\"scenario\":" }
+function num(key,    at) {
+  at = index($0, "\"" key "\":")
+  return at ? substr($0, at + length(key) + 3) + 0 : 0
+}
+function latency(q,    rest) {
+  rest = substr($0, index($0, "\"latency_us\":"))
+  return substr(rest, index(rest, "\"" q "\":") + length(q) + 3) / 1000
+}
+function change(now, ref) {
+  return ref > 0 ? sprintf("%+5.1f%%", (now - ref) * 100 / ref) : "     -"
+}
+FNR == 1 {
+  build++
+  server = $0
+  sub(/.*"server":"/, "", server)
+  sub(/".*/, "", server)
+  next
+}
+{
+  name = $0
+  sub(/^"/, "", name)
+  sub(/".*/, "", name)
+  if (!(name in order)) {
+    order[name] = ++scenarios
+    names[scenarios] = name
+  }
+  rps = num("requests_per_s")
+  mbps = num("bytes_per_s") / 1e6
+  p50 = latency("p50")
+  p99 = latency("p99")
+  if (build == 1) {
+    ref_rps[name] = rps
+    ref_p50[name] = p50
+    ref_p99[name] = p99
+  }
+  row[name, build] = sprintf("  %-20s %10.1f %6s %9.1f %9.2f %6s %9.2f %6s",
+                             server, rps, change(rps, ref_rps[name]), mbps,
+                             p50, change(p50, ref_p50[name]), p99,
+                             change(p99, ref_p99[name]))
+}
+END {
+  printf "%-22s %10s %6s %9s %9s %6s %9s %6s\n", "scenario / build",
+         "req/s", "", "MB/s", "p50 ms", "", "p99 ms", ""
+  for (s = 1; s <= scenarios; s++) {
+    print names[s]
+    for (b = 1; b <= build; b++) {
+      if ((names[s], b) in row) {
+        print row[names[s], b]
+      }
+    }
+  }
+}' "$dir"/*.json
+echo "build-report: reports written to $REPORT" >&2
@@ -0,0 +1,452 @@
+/**
+ * @file http_client.h
+ * @brief Non-blocking HTTP/1.1 client connections driven by one epoll loop
+ *
+ * Shared by the load generator and the access-log replayer. The caller
+ * formats each request and decides when to start it; ClientLoop connects (or
+ * reuses a kept-alive connection), sends it, reads the response head and
+ * body, and reports the outcome. One thread can drive thousands of
+ * connections this way, including slow ones: reads can be throttled to a
+ * byte rate per connection, refilled every TICK_NS.
+ *
+ * With ClientOptions::verify, the body of every 2xx response is checked
+ * against the server's --synthetic pattern as it arrives, at the offset given
+ * by Content-Range, and a mismatch ends the request as CORRUPT.
+ */
+
+#pragma once
+
+#include "../http.h"
+#include "../metrics.h"
+#include "../synthetic.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace bench {
+
+/**
+ * @brief Settings that apply to every connection of a loop
+ */
+struct ClientOptions {
+  bool keepalive = false;      ///< Reuse connections the server keeps open
+  uint64_t read_rate = 0;      ///< Bytes per second per connection; 0 = no limit
+  int rcvbuf = 0;              ///< SO_RCVBUF for client sockets; 0 = default
+  unsigned timeout_ms = 30000; ///< Per request, from when it was started
+  bool verify = false;         ///< Check 2xx bodies against synthetic::verify()
+  bool fastopen = false;       ///< Send requests in the SYN (TCP Fast Open)
+};
+
+/**
+ * @brief How one request ended
+ */
+struct Response {
+  enum Outcome { OK, ERROR, TIMEOUT, CORRUPT };
+
+  Outcome outcome = OK;
+  uint64_t tag = 0;           ///< As passed to start()
+  int status = 0;             ///< 0 if no head was received
+  uint64_t bytes = 0;         ///< Received, head included
+  uint64_t start_ns = 0;      ///< When start() was called
+  uint64_t first_byte_ns = 0; ///< First response byte, 0 if none
+  uint64_t end_ns = 0;
+};
+
+class ClientLoop {
+public:
+  static constexpr uint64_t TICK_NS = 10000000; ///< Throttle refill period
+
+private:
+  enum class State { IDLE, CONNECTING, SENDING, READING_HEAD, READING_BODY };
+
+  struct Conn {
+    int fd = -1;
+    State state = State::IDLE;
+    std::string request;
+    size_t sent = 0;
+    char head[4096];
+    size_t head_len = 0;
+    uint64_t body_left = 0;
+    bool server_closes = false;
+    bool head_only = false; ///< HEAD request: the response has no body
+    bool verify = false;    ///< Check the body as it arrives
+    uint64_t body_offset = 0; ///< Offset of the next body byte in the file
+    Response response;
+    uint64_t budget = 0; ///< Bytes that may be read before the next refill
+    bool paused = false; ///< EPOLLIN removed until the next refill
+    sockaddr_in addr;    ///< Server address this connection uses
+  };
+
+  ClientOptions opts_;
+  int epfd_;
+  std::vector<Conn> conns_;
+  std::vector<Conn *> idle_;
+  std::vector<Conn *> failed_; ///< Could not connect; reported by poll()
+  std::vector<char> scratch_;
+  std::vector<epoll_event> events_;
+  uint64_t next_tick_ = 0;
+
+  void watch(Conn &c, uint32_t events, int op = EPOLL_CTL_MOD) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.ptr = &c;
+    epoll_ctl(epfd_, op, c.fd, &ev);
+  }
+
+  uint64_t budget_per_tick() const {
+    if (opts_.read_rate == 0) {
+      return UINT64_MAX;
+    }
+    return std::max<uint64_t>(1, opts_.read_rate * TICK_NS / 1000000000);
+  }
+
+  template <typename Fn>
+  void finish(Conn &c, Response::Outcome outcome, uint64_t now, Fn &on_done) {
+    c.response.outcome = outcome;
+    c.response.end_ns = now;
+    bool reuse = outcome == Response::OK && opts_.keepalive && !c.server_closes;
+    if (reuse) {
+      watch(c, 0);
+    } else if (c.fd >= 0) {
+      close(c.fd);
+      c.fd = -1;
+    }
+    c.state = State::IDLE;
+    c.paused = false;
+    idle_.push_back(&c);
+    on_done(static_cast<const Response &>(c.response));
+  }
+
+  /**
+   * @brief Where a response body starts in the file: 0, or the first byte of
+   *        a Content-Range such as "bytes 100-199/1000"
+   */
+  static uint64_t body_start(std::string_view headers) {
+    std::string_view range = find_header(headers, "Content-Range");
+    off_t start = 0;
+    if (range.compare(0, 6, "bytes ") != 0 ||
+        !parse_offset(range.substr(6, range.find('-') - 6), start)) {
+      return 0;
+    }
+    return start;
+  }
+
+  /**
+   * @brief Parse the response head once it is complete
+   * @return false on a malformed response, or bytes past the head that fail
+   *         verification
+   */
+  bool parse_head(Conn &c, size_t head_end) {
+    std::string_view head(c.head, head_end);
+    if (head.size() < 12 || head.compare(0, 5, "HTTP/") != 0) {
+      return false;
+    }
+    c.response.status = atoi(c.head + head.find(' ') + 1);
+    std::string_view headers = head.substr(head.find("\r\n") + 2);
+    off_t length = 0;
+    if (!parse_offset(find_header(headers, "Content-Length"), length)) {
+      length = 0;
+    }
+    c.server_closes = iequals(find_header(headers, "Connection"), "close") ||
+                      head.compare(0, 8, "HTTP/1.0") == 0;
+    // Bytes read past the head belong to the body
+    uint64_t extra = c.head_len - head_end;
+    c.body_left = !c.head_only && static_cast<uint64_t>(length) > extra
+                      ? length - extra
+                      : 0;
+    c.verify = opts_.verify && !c.head_only && c.response.status >= 200 &&
+               c.response.status < 300;
+    if (c.verify) {
+      c.body_offset = body_start(headers);
+      size_t n = std::min<uint64_t>(extra, length);
+      if (!synthetic::verify(c.head + head_end, c.body_offset, n)) {
+        return false;
+      }
+      c.body_offset += n;
+    }
+    return true;
+  }
+
+  template <typename Fn> void on_writable(Conn &c, uint64_t now, Fn &on_done) {
+    if (c.state == State::CONNECTING) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err != 0) {
+        finish(c, Response::ERROR, now, on_done);
+        return;
+      }
+      c.state = State::SENDING;
+    }
+    while (c.sent < c.request.size()) {
+      ssize_t n = send(c.fd, c.request.data() + c.sent,
+                       c.request.size() - c.sent, MSG_NOSIGNAL);
+      if (n < 0) {
+        // EINPROGRESS: a Fast Open SYN went out without data (no cookie yet)
+        if (errno != EAGAIN && errno != EINPROGRESS) {
+          finish(c, Response::ERROR, now, on_done);
+        }
+        return;
+      }
+      c.sent += n;
+    }
+    c.state = State::READING_HEAD;
+    watch(c, EPOLLIN);
+  }
+
+  template <typename Fn> void on_readable(Conn &c, uint64_t now, Fn &on_done) {
+    while (true) {
+      if (c.budget == 0) {
+        c.paused = true;
+        watch(c, 0);
+        return;
+      }
+      char *buf;
+      size_t cap;
+      if (c.state == State::READING_HEAD) {
+        buf = c.head + c.head_len;
+        cap = sizeof(c.head) - c.head_len;
+      } else {
+        buf = scratch_.data();
+        cap = std::min<uint64_t>(scratch_.size(), c.body_left);
+      }
+      cap = std::min<uint64_t>(cap, c.budget);
+      ssize_t n = recv(c.fd, buf, cap, 0);
+      if (n < 0) {
+        if (errno != EAGAIN) {
+          finish(c, Response::ERROR, now, on_done);
+        }
+        return;
+      }
+      if (n == 0) {
+        // Closed before the response was complete
+        finish(c, Response::ERROR, now, on_done);
+        return;
+      }
+      if (c.response.first_byte_ns == 0) {
+        c.response.first_byte_ns = now;
+      }
+      c.response.bytes += n;
+      if (c.budget != UINT64_MAX) {
+        c.budget -= n;
+      }
+
+      if (c.state == State::READING_HEAD) {
+        c.head_len += n;
+        std::string_view head(c.head, c.head_len);
+        size_t end = head.find("\r\n\r\n");
+        if (end == std::string_view::npos) {
+          if (c.head_len == sizeof(c.head)) {
+            finish(c, Response::ERROR, now, on_done);
+            return;
+          }
+          continue;
+        }
+        if (!parse_head(c, end + 4)) {
+          finish(c, c.verify ? Response::CORRUPT : Response::ERROR, now,
+                 on_done);
+          return;
+        }
+        c.state = State::READING_BODY;
+      } else {
+        if (c.verify) {
+          if (!synthetic::verify(buf, c.body_offset, n)) {
+            finish(c, Response::CORRUPT, now, on_done);
+            return;
+          }
+          c.body_offset += n;
+        }
+        c.body_left -= n;
+      }
+      if (c.body_left == 0) {
+        finish(c, Response::OK, now, on_done);
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief Refill read budgets and expire requests that took too long
+   */
+  template <typename Fn> void tick(uint64_t now, Fn &on_done) {
+    uint64_t timeout = static_cast<uint64_t>(opts_.timeout_ms) * 1000000;
+    for (Conn &c : conns_) {
+      if (c.state == State::IDLE) {
+        continue;
+      }
+      if (now - c.response.start_ns > timeout) {
+        finish(c, Response::TIMEOUT, now, on_done);
+        continue;
+      }
+      c.budget = budget_per_tick();
+      if (c.paused) {
+        c.paused = false;
+        watch(c, EPOLLIN);
+      }
+    }
+  }
+
+public:
+  /**
+   * @param addrs Server addresses, assigned to connections in turn; more
+   *        than one lifts the limit of one ephemeral port range per address
+   * @param connections Maximum requests in flight at once
+   * @param opts Per-connection settings
+   */
+  ClientLoop(const std::vector<sockaddr_in> &addrs, unsigned connections,
+             const ClientOptions &opts)
+      : opts_(opts), epfd_(epoll_create1(EPOLL_CLOEXEC)), conns_(connections),
+        scratch_(256 * 1024), events_(256) {
+    for (size_t i = 0; i < conns_.size(); i++) {
+      conns_[i].addr = addrs[i % addrs.size()];
+      idle_.push_back(&conns_[i]);
+    }
+  }
+
+  ClientLoop(const sockaddr_in &addr, unsigned connections,
+             const ClientOptions &opts)
+      : ClientLoop(std::vector<sockaddr_in>{addr}, connections, opts) {}
+
+  ~ClientLoop() {
+    for (Conn &c : conns_) {
+      if (c.fd >= 0) {
+        close(c.fd);
+      }
+    }
+    close(epfd_);
+  }
+
+  ClientLoop(const ClientLoop &) = delete;
+  ClientLoop &operator=(const ClientLoop &) = delete;
+
+  size_t idle() const { return idle_.size(); }
+  size_t in_flight() const { return conns_.size() - idle_.size(); }
+
+  /**
+   * @brief Start a request on an idle connection
+   * @param request Complete request head
+   * @param tag Returned in the Response
+   * @return false if every connection is busy
+   */
+  bool start(std::string_view request, uint64_t tag) {
+    if (idle_.empty()) {
+      return false;
+    }
+    Conn &c = *idle_.back();
+    idle_.pop_back();
+    c.request.assign(request.data(), request.size());
+    c.sent = 0;
+    c.head_len = 0;
+    c.body_left = 0;
+    c.server_closes = false;
+    c.head_only = request.compare(0, 5, "HEAD ") == 0;
+    c.verify = false;
+    c.response = Response{};
+    c.response.tag = tag;
+    c.response.start_ns = metrics::now_ns();
+    c.budget = budget_per_tick();
+
+    if (c.fd >= 0) {
+      c.state = State::SENDING;
+      watch(c, EPOLLOUT);
+      return true;
+    }
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c.fd >= 0 && opts_.rcvbuf > 0) {
+      setsockopt(c.fd, SOL_SOCKET, SO_RCVBUF, &opts_.rcvbuf,
+                 sizeof(opts_.rcvbuf));
+    }
+    if (c.fd >= 0 && opts_.fastopen) {
+      // connect() returns at once and the first send() carries the SYN
+      int on = 1;
+      setsockopt(c.fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on));
+    }
+    if (c.fd < 0 || (connect(c.fd, reinterpret_cast<const sockaddr *>(&c.addr),
+                             sizeof(c.addr)) < 0 &&
+                     errno != EINPROGRESS)) {
+      // Reported by the next poll(), like any other failure
+      c.state = State::CONNECTING;
+      failed_.push_back(&c);
+      return true;
+    }
+    c.state = State::CONNECTING;
+    watch(c, EPOLLOUT, EPOLL_CTL_ADD);
+    return true;
+  }
+
+  /**
+   * @brief Wait up to timeout_ns for progress, calling on_done(const
+   *        Response &) for every request that ends
+   *
+   * on_done must not call start(); start the next requests after poll()
+   * returns.
+   */
+  template <typename Fn> void poll(uint64_t timeout_ns, Fn on_done) {
+    uint64_t now = metrics::now_ns();
+    if (!failed_.empty()) {
+      for (Conn *c : failed_) {
+        finish(*c, Response::ERROR, now, on_done);
+      }
+      failed_.clear();
+      timeout_ns = 0;
+    }
+    if (next_tick_ == 0) {
+      next_tick_ = now + TICK_NS;
+    }
+    uint64_t wait =
+        std::min(timeout_ns, next_tick_ > now ? next_tick_ - now : 0);
+    // epoll_pwait2() takes the timeout in ns, which keeps open-loop
+    // schedules accurate below a millisecond
+    timespec ts{static_cast<time_t>(wait / 1000000000),
+                static_cast<long>(wait % 1000000000)};
+    int n = epoll_pwait2(epfd_, events_.data(), events_.size(), &ts, nullptr);
+    if (n < 0 && errno == ENOSYS) {
+      n = epoll_wait(epfd_, events_.data(), events_.size(),
+                     static_cast<int>((wait + 999999) / 1000000));
+    }
+    now = metrics::now_ns();
+    for (int i = 0; i < n; i++) {
+      Conn &c = *static_cast<Conn *>(events_[i].data.ptr);
+      if (c.state == State::CONNECTING || c.state == State::SENDING) {
+        if ((events_[i].events & (EPOLLERR | EPOLLHUP)) &&
+            !(events_[i].events & EPOLLOUT)) {
+          finish(c, Response::ERROR, now, on_done);
+        } else {
+          on_writable(c, now, on_done);
+        }
+      } else if (c.state == State::READING_HEAD ||
+                 c.state == State::READING_BODY) {
+        on_readable(c, now, on_done);
+      }
+    }
+    if (now >= next_tick_) {
+      tick(now, on_done);
+      next_tick_ = now + TICK_NS;
+    }
+  }
+
+  /**
+   * @brief End every request still in flight as timed out
+   */
+  template <typename Fn> void abandon(Fn on_done) {
+    uint64_t now = metrics::now_ns();
+    for (Conn &c : conns_) {
+      if (c.state != State::IDLE) {
+        finish(c, Response::TIMEOUT, now, on_done);
+      }
+    }
+  }
+};
+
+} // namespace bench
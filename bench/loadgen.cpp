@@ -0,0 +1,488 @@
+/**
+ * @file loadgen.cpp
+ * @brief HTTP load generator for benchmarking streamix
+ *
+ * Each worker thread drives its share of the connections from one epoll loop
+ * with non-blocking sockets, so thousands of (possibly slow) clients need no
+ * more threads than cores.
+ *
+ * In closed-loop mode every connection sends its next request as soon as the
+ * previous one completes, which measures capacity. In open-loop mode (--rate)
+ * requests are due on a fixed schedule whether or not earlier ones have
+ * finished, and latency is measured from when a request was due rather than
+ * when a free connection got around to sending it. A stalled server then
+ * shows up as the queueing delay it causes instead of being hidden by the
+ * requests that were never sent (coordinated omission); the uncorrected
+ * service time is reported alongside.
+ *
+ * The report is one JSON object on stdout; a human summary goes to stderr.
+ */
+
+#include "../access_record.h"
+#include "http_client.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using metrics::now_ns;
+
+/**
+ * @brief A path requested with some relative frequency
+ */
+struct Target {
+  std::string path;
+  unsigned weight = 1;
+  off_t size = -1; ///< Learned with a probe request, for --range
+};
+
+struct Config {
+  std::string scenario = "custom"; ///< Label copied into the report
+  std::string host = "127.0.0.1";
+  int port = 8080;
+  std::vector<Target> targets;
+  unsigned connections = 16;  ///< Concurrent connections (max in flight)
+  double rate = 0;            ///< Requests per second; 0 = closed loop
+  double duration_s = 10;
+  unsigned threads = 1;
+  bool keepalive = false;     ///< Ask to reuse connections
+  off_t range_bytes = 0;      ///< Request random ranges of this size
+  uint64_t read_rate = 0;     ///< Bytes per second per connection; 0 = no limit
+  int rcvbuf = 0;             ///< SO_RCVBUF for client sockets; 0 = default
+  unsigned timeout_ms = 30000; ///< Per request, from when it was sent
+  bool verify = false;        ///< Check bodies against the synthetic pattern
+  bool fastopen = false;      ///< Send requests in the SYN (TCP Fast Open)
+};
+
+/**
+ * @brief Results shared by all workers
+ */
+struct Stats {
+  metrics::Histogram latency; ///< ns from due time to last byte
+  metrics::Histogram service; ///< ns from first byte sent to last received
+  metrics::Histogram ttfb;    ///< ns from first byte sent to first received
+  std::atomic<uint64_t> requests{0};
+  std::atomic<uint64_t> errors{0};   ///< Connect, reset or malformed
+  std::atomic<uint64_t> timeouts{0};
+  std::atomic<uint64_t> corrupt{0};  ///< Failed --verify
+  std::atomic<uint64_t> bytes{0};    ///< Response bytes, headers included
+  std::atomic<uint64_t> status[6] = {}; ///< By class; [0] = other
+  std::atomic<uint64_t> unsent{0};   ///< Open loop: due but never sent
+};
+
+/**
+ * @brief One thread's share of the connections and of the request rate
+ */
+class Worker {
+  const Config &cfg_;
+  Stats &stats_;
+  bench::ClientLoop loop_;
+  std::deque<uint64_t> due_; ///< Open loop: due times not yet sent
+  std::mt19937_64 rng_;
+  std::vector<unsigned> cumulative_; ///< Running sum of target weights
+  std::string request_;
+
+  const Target &pick_target() {
+    unsigned r = rng_() % cumulative_.back();
+    size_t i = std::upper_bound(cumulative_.begin(), cumulative_.end(), r) -
+               cumulative_.begin();
+    return cfg_.targets[i];
+  }
+
+  const std::string &next_request() {
+    const Target &t = pick_target();
+    request_ = "GET " + t.path + " HTTP/1.1\r\nHost: " + cfg_.host + "\r\n";
+    if (cfg_.range_bytes > 0 && t.size > cfg_.range_bytes) {
+      off_t start = rng_() % (t.size - cfg_.range_bytes + 1);
+      request_ += "Range: bytes=" + std::to_string(start) + "-" +
+                  std::to_string(start + cfg_.range_bytes - 1) + "\r\n";
+    }
+    request_ += cfg_.keepalive ? "Connection: keep-alive\r\n\r\n"
+                               : "Connection: close\r\n\r\n";
+    return request_;
+  }
+
+  /// The tag of each request is the time it was due
+  void record(const bench::Response &r) {
+    stats_.bytes.fetch_add(r.bytes, std::memory_order_relaxed);
+    if (r.first_byte_ns != 0) {
+      stats_.ttfb.record(r.first_byte_ns - r.start_ns);
+    }
+    if (r.outcome == bench::Response::ERROR) {
+      stats_.errors.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (r.outcome == bench::Response::TIMEOUT) {
+      stats_.timeouts.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    if (r.outcome == bench::Response::CORRUPT) {
+      stats_.corrupt.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    stats_.requests.fetch_add(1, std::memory_order_relaxed);
+    int cls = r.status / 100;
+    stats_.status[cls >= 1 && cls <= 5 ? cls : 0].fetch_add(
+        1, std::memory_order_relaxed);
+    stats_.latency.record(r.end_ns - r.tag);
+    stats_.service.record(r.end_ns - r.start_ns);
+  }
+
+public:
+  Worker(const Config &cfg, Stats &stats, const sockaddr_in &addr,
+         unsigned connections, uint64_t seed)
+      : cfg_(cfg), stats_(stats),
+        loop_(addr, connections,
+              {cfg.keepalive, cfg.read_rate, cfg.rcvbuf, cfg.timeout_ms,
+               cfg.verify, cfg.fastopen}),
+        rng_(seed) {
+    unsigned sum = 0;
+    for (const Target &t : cfg_.targets) {
+      sum += t.weight;
+      cumulative_.push_back(sum);
+    }
+  }
+
+  /**
+   * @brief Run until the deadline, then let in-flight requests finish
+   * @param rate This worker's share of the open-loop rate, 0 = closed loop
+   */
+  void run(uint64_t start_ns, uint64_t end_ns, double rate) {
+    uint64_t interval = rate > 0 ? static_cast<uint64_t>(1e9 / rate) : 0;
+    uint64_t next_due = start_ns;
+    uint64_t drain_until = end_ns + cfg_.timeout_ms * 1000000ULL;
+    auto on_done = [this](const bench::Response &r) { record(r); };
+
+    while (true) {
+      uint64_t now = now_ns();
+      bool running = now < end_ns;
+      if (running && interval > 0) {
+        while (next_due <= now && next_due < end_ns) {
+          due_.push_back(next_due);
+          next_due += interval;
+        }
+      }
+      // Hand work to idle connections
+      while (running && loop_.idle() > 0) {
+        uint64_t due = now;
+        if (interval > 0) {
+          if (due_.empty()) {
+            break;
+          }
+          due = due_.front();
+          due_.pop_front();
+        }
+        loop_.start(next_request(), due);
+      }
+      if ((!running && loop_.in_flight() == 0) || now >= drain_until) {
+        break;
+      }
+
+      uint64_t wake = running ? end_ns : drain_until;
+      if (running && interval > 0 && due_.empty()) {
+        wake = std::min(wake, next_due);
+      }
+      loop_.poll(wake > now ? wake - now : 0, on_done);
+    }
+    stats_.unsent.fetch_add(due_.size(), std::memory_order_relaxed);
+    loop_.abandon(on_done);
+  }
+};
+
+/**
+ * @brief Learn a target's size with a blocking HEAD request
+ */
+off_t probe_size(const sockaddr_in &addr, const Config &cfg,
+                 const std::string &path) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr *>(&addr),
+                        sizeof(addr)) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  std::string req = "HEAD " + path + " HTTP/1.1\r\nHost: " + cfg.host +
+                    "\r\nConnection: close\r\n\r\n";
+  send(fd, req.data(), req.size(), MSG_NOSIGNAL);
+  std::string resp;
+  char buf[4096];
+  ssize_t n;
+  while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    resp.append(buf, n);
+  }
+  close(fd);
+  off_t size = -1;
+  size_t eol = resp.find("\r\n");
+  if (eol == std::string::npos ||
+      !parse_offset(find_header(std::string_view(resp).substr(eol + 2),
+                                "Content-Length"),
+                    size)) {
+    return -1;
+  }
+  return size;
+}
+
+void append_quantiles(std::string &out, const char *name,
+                      const metrics::Histogram &h) {
+  metrics::Histogram::Snapshot s = h.snapshot();
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "\"%s\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+           "\"p999\":%.1f,\"max\":%.1f}",
+           name, s.count > 0 ? s.sum / 1e3 / s.count : 0.0,
+           s.quantile(0.5) / 1e3, s.quantile(0.9) / 1e3,
+           s.quantile(0.99) / 1e3, s.quantile(0.999) / 1e3,
+           s.quantile(1.0) / 1e3);
+  out += buf;
+}
+
+std::string report(const Config &cfg, const Stats &stats, double elapsed_s) {
+  uint64_t requests = stats.requests.load();
+  uint64_t bytes = stats.bytes.load();
+  std::string out = "{\"scenario\":";
+  append_json_string(out, cfg.scenario);
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           ",\"mode\":\"%s\",\"connections\":%u,\"rate\":%.1f,\"threads\":%u,"
+           "\"keepalive\":%s,\"fastopen\":%s,\"range_bytes\":%lld,"
+           "\"read_rate\":%llu,"
+           "\"duration_s\":%.3f,\"requests\":%llu,\"errors\":%llu,"
+           "\"timeouts\":%llu,\"corrupt\":%llu,\"unsent\":%llu,"
+           "\"bytes\":%llu,"
+           "\"requests_per_s\":%.1f,\"bytes_per_s\":%.0f,",
+           cfg.rate > 0 ? "open" : "closed", cfg.connections, cfg.rate,
+           cfg.threads, cfg.keepalive ? "true" : "false",
+           cfg.fastopen ? "true" : "false",
+           static_cast<long long>(cfg.range_bytes),
+           static_cast<unsigned long long>(cfg.read_rate), elapsed_s,
+           static_cast<unsigned long long>(requests),
+           static_cast<unsigned long long>(stats.errors.load()),
+           static_cast<unsigned long long>(stats.timeouts.load()),
+           static_cast<unsigned long long>(stats.corrupt.load()),
+           static_cast<unsigned long long>(stats.unsent.load()),
+           static_cast<unsigned long long>(bytes), requests / elapsed_s,
+           bytes / elapsed_s);
+  out += buf;
+  snprintf(buf, sizeof(buf),
+           "\"status\":{\"2xx\":%llu,\"3xx\":%llu,\"4xx\":%llu,\"5xx\":%llu,"
+           "\"other\":%llu},",
+           static_cast<unsigned long long>(stats.status[2].load()),
+           static_cast<unsigned long long>(stats.status[3].load()),
+           static_cast<unsigned long long>(stats.status[4].load()),
+           static_cast<unsigned long long>(stats.status[5].load()),
+           static_cast<unsigned long long>(stats.status[0].load() +
+                                           stats.status[1].load()));
+  out += buf;
+  append_quantiles(out, "latency_us", stats.latency);
+  out += ',';
+  append_quantiles(out, "service_us", stats.service);
+  out += ',';
+  append_quantiles(out, "ttfb_us", stats.ttfb);
+  out += "}\n";
+  return out;
+}
+
+void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] PATH[:WEIGHT]...\n"
+          "  -H, --host HOST         Server address (default 127.0.0.1)\n"
+          "  -p, --port PORT         Server port (default 8080)\n"
+          "  -c, --connections N     Concurrent connections (default 16)\n"
+          "  -r, --rate N            Open loop: N requests/s in total;\n"
+          "                          default closed loop\n"
+          "  -d, --duration SECS     Test length (default 10)\n"
+          "  -t, --threads N         Worker threads (default 1)\n"
+          "  -k, --keepalive         Reuse connections the server keeps open\n"
+          "      --range BYTES       Request random ranges of this size\n"
+          "      --read-rate BPS     Read at most BPS bytes/s per connection\n"
+          "      --rcvbuf BYTES      Client socket receive buffer\n"
+          "      --timeout-ms N      Per-request timeout (default 30000)\n"
+          "      --verify            Check bodies against the server's\n"
+          "                          --synthetic pattern; exit 1 on mismatch\n"
+          "      --fastopen          Send requests in the SYN (TCP Fast Open)\n"
+          "      --scenario NAME     Label for the report\n"
+          "Targets are picked at random in proportion to their weights.\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  enum {
+    OPT_RANGE = 256,
+    OPT_READ_RATE,
+    OPT_RCVBUF,
+    OPT_TIMEOUT_MS,
+    OPT_SCENARIO,
+    OPT_VERIFY,
+    OPT_FASTOPEN,
+  };
+  static const option long_options[] = {
+      {"host", required_argument, nullptr, 'H'},
+      {"port", required_argument, nullptr, 'p'},
+      {"connections", required_argument, nullptr, 'c'},
+      {"rate", required_argument, nullptr, 'r'},
+      {"duration", required_argument, nullptr, 'd'},
+      {"threads", required_argument, nullptr, 't'},
+      {"keepalive", no_argument, nullptr, 'k'},
+      {"range", required_argument, nullptr, OPT_RANGE},
+      {"read-rate", required_argument, nullptr, OPT_READ_RATE},
+      {"rcvbuf", required_argument, nullptr, OPT_RCVBUF},
+      {"timeout-ms", required_argument, nullptr, OPT_TIMEOUT_MS},
+      {"scenario", required_argument, nullptr, OPT_SCENARIO},
+      {"verify", no_argument, nullptr, OPT_VERIFY},
+      {"fastopen", no_argument, nullptr, OPT_FASTOPEN},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  Config cfg;
+  int c;
+  while ((c = getopt_long(argc, argv, "H:p:c:r:d:t:kh", long_options,
+                          nullptr)) != -1) {
+    switch (c) {
+    case 'H':
+      cfg.host = optarg;
+      break;
+    case 'p':
+      cfg.port = atoi(optarg);
+      break;
+    case 'c':
+      cfg.connections = atoi(optarg);
+      break;
+    case 'r':
+      cfg.rate = atof(optarg);
+      break;
+    case 'd':
+      cfg.duration_s = atof(optarg);
+      break;
+    case 't':
+      cfg.threads = std::max(1, atoi(optarg));
+      break;
+    case 'k':
+      cfg.keepalive = true;
+      break;
+    case OPT_RANGE:
+      cfg.range_bytes = atoll(optarg);
+      break;
+    case OPT_READ_RATE:
+      cfg.read_rate = strtoull(optarg, nullptr, 10);
+      break;
+    case OPT_RCVBUF:
+      cfg.rcvbuf = atoi(optarg);
+      break;
+    case OPT_TIMEOUT_MS:
+      cfg.timeout_ms = atoi(optarg);
+      break;
+    case OPT_SCENARIO:
+      cfg.scenario = optarg;
+      break;
+    case OPT_VERIFY:
+      cfg.verify = true;
+      break;
+    case OPT_FASTOPEN:
+      cfg.fastopen = true;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+  for (int i = optind; i < argc; i++) {
+    Target t;
+    t.path = argv[i];
+    size_t colon = t.path.rfind(':');
+    if (colon != std::string::npos) {
+      t.weight = atoi(t.path.c_str() + colon + 1);
+      t.path.resize(colon);
+    }
+    if (t.path.empty() || t.path[0] != '/' || t.weight == 0) {
+      fprintf(stderr, "Invalid target: %s\n", argv[i]);
+      return 2;
+    }
+    cfg.targets.push_back(t);
+  }
+  if (cfg.targets.empty() || cfg.connections == 0 || cfg.duration_s <= 0) {
+    print_usage(argv[0]);
+    return 2;
+  }
+  cfg.threads = std::min(cfg.threads, cfg.connections);
+
+  addrinfo hints{};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *res = nullptr;
+  if (getaddrinfo(cfg.host.c_str(), nullptr, &hints, &res) != 0) {
+    fprintf(stderr, "Cannot resolve %s\n", cfg.host.c_str());
+    return 1;
+  }
+  sockaddr_in addr = *reinterpret_cast<sockaddr_in *>(res->ai_addr);
+  addr.sin_port = htons(cfg.port);
+  freeaddrinfo(res);
+
+  // Every connection needs a descriptor
+  rlimit nofile;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 &&
+      nofile.rlim_cur < nofile.rlim_max) {
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+  }
+
+  if (cfg.range_bytes > 0) {
+    for (Target &t : cfg.targets) {
+      t.size = probe_size(addr, cfg, t.path);
+      if (t.size < 0) {
+        fprintf(stderr, "Cannot get the size of %s\n", t.path.c_str());
+        return 1;
+      }
+    }
+  }
+
+  Stats stats;
+  uint64_t start = now_ns();
+  uint64_t end = start + static_cast<uint64_t>(cfg.duration_s * 1e9);
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < cfg.threads; i++) {
+    unsigned share = cfg.connections / cfg.threads +
+                     (i < cfg.connections % cfg.threads ? 1 : 0);
+    threads.emplace_back([&, i, share] {
+      Worker worker(cfg, stats, addr, share, start + i);
+      worker.run(start, end, cfg.rate / cfg.threads);
+    });
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  std::string json = report(cfg, stats, elapsed);
+  fputs(json.c_str(), stdout);
+  metrics::Histogram::Snapshot lat = stats.latency.snapshot();
+  fprintf(stderr,
+          "%s: %llu requests in %.1fs, %.1f req/s, %.1f MB/s, %llu errors, "
+          "%llu timeouts, %llu corrupt, latency p50 %.2f ms p99 %.2f ms\n",
+          cfg.scenario.c_str(),
+          static_cast<unsigned long long>(stats.requests.load()), elapsed,
+          stats.requests.load() / elapsed, stats.bytes.load() / elapsed / 1e6,
+          static_cast<unsigned long long>(stats.errors.load()),
+          static_cast<unsigned long long>(stats.timeouts.load()),
+          static_cast<unsigned long long>(stats.corrupt.load()),
+          lat.quantile(0.5) / 1e6, lat.quantile(0.99) / 1e6);
+  return stats.corrupt.load() == 0 ? 0 : 1;
+}
@@ -0,0 +1,341 @@
+/**
+ * @file microbench.cpp
+ * @brief Google Benchmark microbenchmarks for the per-request CPU path
+ *
+ * Covers the work every request does before the first byte of the body goes
+ * out: parsing the request, formatting the response head, mapping the target
+ * to a path and the per-path and block cache lookups. End-to-end benchmarks
+ * bury these in syscall and network noise; here a regression shows up in
+ * nanoseconds.
+ *
+ * The requests are header sets captured from real clients, so the header
+ * scans see realistic lengths and orders (Range is often near the end).
+ *
+ * Run with `make microbench`, or pass Google Benchmark flags directly:
+ *   ./bench/streamix-microbench --benchmark_filter=Parse
+ */
+
+#include "../block_cache.h"
+#include "../http.h"
+#include "../residency.h"
+
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory_resource>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+/**
+ * @brief A captured request head
+ */
+struct Fixture {
+  const char *name;
+  const char *raw;
+};
+
+const Fixture FIXTURES[] = {
+    {"curl",
+     "GET /videos/trailer.mp4 HTTP/1.1\r\n"
+     "Host: media.example.com\r\n"
+     "User-Agent: curl/8.4.0\r\n"
+     "Accept: */*\r\n"
+     "\r\n"},
+    {"chrome",
+     "GET /static/img/hero-banner-2x.webp HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Connection: keep-alive\r\n"
+     "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+     "\"Not-A.Brand\";v=\"99\"\r\n"
+     "sec-ch-ua-mobile: ?0\r\n"
+     "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+     "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 "
+     "Safari/537.36\r\n"
+     "sec-ch-ua-platform: \"Windows\"\r\n"
+     "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;"
+     "q=0.8\r\n"
+     "Sec-Fetch-Site: same-origin\r\n"
+     "Sec-Fetch-Mode: no-cors\r\n"
+     "Sec-Fetch-Dest: image\r\n"
+     "Referer: https://www.example.com/products/cameras?sort=popular\r\n"
+     "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+     "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+     "Cookie: session=4f9c2a7e1b3d5f60a8c4e2b1d9f7a3c5; consent=1; "
+     "_ga=GA1.2.1234567890.1700000000\r\n"
+     "\r\n"},
+    {"video-player",
+     "GET /vod/2024/09/ep-104/1080p/segment-000317.m4s HTTP/1.1\r\n"
+     "Host: cdn.example.net\r\n"
+     "User-Agent: AppleCoreMedia/1.0.0.21E236 (iPhone; U; CPU OS 17_4 like "
+     "Mac OS X; en_us)\r\n"
+     "Accept: */*\r\n"
+     "Accept-Language: en-US,en;q=0.9\r\n"
+     "X-Playback-Session-Id: 8E1B7C0A-5F4D-4B2E-9A3C-6D8F2E1A7B90\r\n"
+     "Accept-Encoding: identity\r\n"
+     "Connection: keep-alive\r\n"
+     "Range: bytes=1048576-2097151\r\n"
+     "\r\n"},
+    {"cdn-edge",
+     "GET /downloads/releases/v3.2.1/installer-x86_64.dmg HTTP/1.1\r\n"
+     "Host: origin.example.com\r\n"
+     "Via: 1.1 varnish, 1.1 edge-fra-03\r\n"
+     "X-Forwarded-For: 203.0.113.54, 198.51.100.23\r\n"
+     "X-Forwarded-Proto: https\r\n"
+     "X-Request-Id: 0a1b2c3d4e5f60718293a4b5c6d7e8f9\r\n"
+     "CDN-Loop: example-cdn; count=1\r\n"
+     "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 14_4_1) "
+     "AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.4.1 "
+     "Safari/605.1.15\r\n"
+     "Accept: */*\r\n"
+     "Accept-Encoding: gzip\r\n"
+     "If-Range: \"5f3a-61b2c9d8e4f70\"\r\n"
+     "Range: bytes=73400320-\r\n"
+     "\r\n"},
+};
+
+void register_fixtures(const char *prefix,
+                       void (*fn)(benchmark::State &, const Fixture &)) {
+  for (const Fixture &f : FIXTURES) {
+    benchmark::RegisterBenchmark((std::string(prefix) + "/" + f.name).c_str(),
+                                 fn, f);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Request parsing
+
+void BM_ParseRequest(benchmark::State &state, const Fixture &f) {
+  std::string_view raw = f.raw;
+  for (auto _ : state) {
+    HttpRequest req;
+    benchmark::DoNotOptimize(parse_request(raw, req));
+    benchmark::DoNotOptimize(req);
+  }
+  state.SetBytesProcessed(state.iterations() * raw.size());
+}
+
+/// Looking up a header the request does not have scans every line
+void BM_FindHeaderAbsent(benchmark::State &state, const Fixture &f) {
+  HttpRequest req;
+  parse_request(f.raw, req);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(find_header(req.headers, "If-None-Match"));
+  }
+}
+
+void BM_ParseRange(benchmark::State &state) {
+  const std::string_view values[] = {"bytes=1048576-2097151", "bytes=73400320-",
+                                     "bytes=-500", "bytes=0-0"};
+  size_t i = 0;
+  for (auto _ : state) {
+    off_t start;
+    off_t length;
+    benchmark::DoNotOptimize(
+        parse_range(values[i++ % 4], 104857600, start, length));
+    benchmark::DoNotOptimize(start);
+    benchmark::DoNotOptimize(length);
+  }
+}
+BENCHMARK(BM_ParseRange);
+
+// ---------------------------------------------------------------------------
+// Response head construction, as in send_http_response() and
+// send_content_headers()
+
+void BM_FormatFullResponse(benchmark::State &state) {
+  for (auto _ : state) {
+    char headers[256];
+    char status_line[128];
+    char framing[64];
+    size_t n = format_content_headers(headers, sizeof(headers), 0,
+                                      10737418240, 10737418240, false);
+    n += format_status_line(status_line, sizeof(status_line), 200, "OK");
+    n += format_framing(framing, sizeof(framing), 0);
+    benchmark::DoNotOptimize(n);
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_FormatFullResponse);
+
+void BM_FormatPartialResponse(benchmark::State &state) {
+  for (auto _ : state) {
+    char headers[256];
+    char status_line[128];
+    char framing[64];
+    size_t n = format_content_headers(headers, sizeof(headers), 1048576,
+                                      1048576, 10737418240, true);
+    n += format_status_line(status_line, sizeof(status_line), 206,
+                            "Partial Content");
+    n += format_framing(framing, sizeof(framing), 0);
+    benchmark::DoNotOptimize(n);
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_FormatPartialResponse);
+
+void BM_FormatErrorResponse(benchmark::State &state) {
+  std::string_view body = "404 Not Found\n";
+  for (auto _ : state) {
+    char status_line[128];
+    char framing[64];
+    size_t n =
+        format_status_line(status_line, sizeof(status_line), 404, "Not Found");
+    n += format_framing(framing, sizeof(framing), body.size());
+    benchmark::DoNotOptimize(n);
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_FormatErrorResponse);
+
+// ---------------------------------------------------------------------------
+// Path lookup
+
+/// Normalization into a per-request arena, as serve_request() does
+void BM_NormalizeTarget(benchmark::State &state, const Fixture &f) {
+  HttpRequest req;
+  parse_request(f.raw, req);
+  char buffer[1024];
+  for (auto _ : state) {
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+    std::pmr::string rel(&arena);
+    benchmark::DoNotOptimize(normalize_target(req.target, rel));
+    benchmark::DoNotOptimize(rel.data());
+  }
+}
+
+void BM_NormalizeTargetEscaped(benchmark::State &state) {
+  std::string_view target =
+      "/library/Season%201/./Episode%2004%20-%20The%20Long%20Night/"
+      "../Episode%2005/video%5B1080p%5D.mkv?token=abc123&t=1700000000";
+  char buffer[1024];
+  for (auto _ : state) {
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+    std::pmr::string rel(&arena);
+    benchmark::DoNotOptimize(normalize_target(target, rel));
+    benchmark::DoNotOptimize(rel.data());
+  }
+}
+BENCHMARK(BM_NormalizeTargetEscaped);
+
+std::vector<std::string> catalog_paths(size_t n) {
+  std::vector<std::string> paths;
+  paths.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    paths.push_back("vod/2024/" + std::to_string(i % 97) + "/episode-" +
+                    std::to_string(i) + "/1080p/playlist.m3u8");
+  }
+  return paths;
+}
+
+/// Per-path page-cache counters, looked up once per request
+void BM_ResidencyLookup(benchmark::State &state) {
+  ResidencyTracker tracker;
+  tracker.set_max_paths(1024);
+  std::vector<std::string> paths = catalog_paths(state.range(0));
+  for (const std::string &p : paths) {
+    tracker.for_file(p);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tracker.for_file(paths[i]));
+    i = (i + 7919) % paths.size();
+  }
+}
+BENCHMARK(BM_ResidencyLookup)->Arg(16)->Arg(1024)->Arg(65536);
+
+// ---------------------------------------------------------------------------
+// Block cache lookup
+
+/**
+ * @brief A block cache filled from a scratch file, shared by the benchmarks
+ */
+struct CacheFixture {
+  static constexpr uint64_t BLOCKS = BlockCache::STRIPES * 2;
+
+  IoScheduler io{IoPoolConfig{}};
+  BlockCache cache{BLOCKS * BlockCache::BLOCK_SIZE};
+  std::vector<BlockKey> cached; ///< Keys that made it into the cache
+  std::vector<BlockKey> absent; ///< Keys that are not cached
+
+  CacheFixture() {
+    char path[] = "/tmp/streamix-microbench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || ftruncate(fd, BLOCKS * BlockCache::BLOCK_SIZE) < 0) {
+      abort();
+    }
+    unlink(path);
+    struct stat st;
+    fstat(fd, &st);
+    std::vector<BlockKey> keys;
+    for (uint64_t i = 0; i < BLOCKS; i++) {
+      keys.push_back({st.st_dev, st.st_ino, 1, i});
+      cache.admit(keys.back(), io, fd, st.st_dev, BlockCache::BLOCK_SIZE);
+      // A newer version of the file: never cached
+      absent.push_back({st.st_dev, st.st_ino, 2, i});
+    }
+    close(fd);
+    // Fills complete in the background and a lookup publishes each one.
+    // Stripes are sized evenly, so keys that hash to a full one are skipped.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    for (const BlockKey &key : keys) {
+      while (!cache.lookup(key)) {
+        if (std::chrono::steady_clock::now() > deadline) {
+          break;
+        }
+        std::this_thread::yield();
+      }
+      if (cache.lookup(key)) {
+        cached.push_back(key);
+      }
+    }
+    if (cached.empty()) {
+      abort();
+    }
+  }
+
+  static CacheFixture &get() {
+    static CacheFixture fixture;
+    return fixture;
+  }
+};
+
+void BM_BlockCacheHit(benchmark::State &state) {
+  CacheFixture &f = CacheFixture::get();
+  size_t i = 0;
+  for (auto _ : state) {
+    BlockCache::Ref ref = f.cache.lookup(f.cached[i++ % f.cached.size()]);
+    benchmark::DoNotOptimize(ref.data());
+  }
+}
+BENCHMARK(BM_BlockCacheHit)->ThreadRange(1, 4)->UseRealTime();
+
+void BM_BlockCacheMiss(benchmark::State &state) {
+  CacheFixture &f = CacheFixture::get();
+  size_t i = 0;
+  for (auto _ : state) {
+    BlockCache::Ref ref = f.cache.lookup(f.absent[i++ % f.absent.size()]);
+    benchmark::DoNotOptimize(static_cast<bool>(ref));
+  }
+}
+BENCHMARK(BM_BlockCacheMiss)->ThreadRange(1, 4)->UseRealTime();
+
+} // namespace
+
+int main(int argc, char **argv) {
+  register_fixtures("BM_ParseRequest", BM_ParseRequest);
+  register_fixtures("BM_FindHeaderAbsent", BM_FindHeaderAbsent);
+  register_fixtures("BM_NormalizeTarget", BM_NormalizeTarget);
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
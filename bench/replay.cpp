@@ -0,0 +1,645 @@
+/**
+ * @file replay.cpp
+ * @brief Replay a recorded access log against a server
+ *
+ * Reads JSON access logs or binary segments (--access-log-format binary) and
+ * sends the same requests (method, path, byte range) at the same relative
+ * times, optionally sped up or slowed down. Requests that overlapped in the
+ * original traffic overlap again, so client concurrency and burstiness are
+ * reproduced along with the mix of paths and sizes.
+ *
+ * Each request's latency is measured from when it was due, so if the replay
+ * cannot keep up the delay shows in the results rather than stretching the
+ * schedule. The report compares the replay with the timings recorded in the
+ * log.
+ *
+ * With --generate, files missing under a directory are created with the
+ * sizes the log implies, so a log from production can be replayed against a
+ * test server that has none of the original content.
+ */
+
+#include "../binlog.h"
+#include "http_client.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <getopt.h>
+#include <map>
+#include <netdb.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+using metrics::now_ns;
+
+/**
+ * @brief One logged request
+ */
+struct Entry {
+  int64_t start_ns;     ///< CLOCK_REALTIME when it was accepted
+  bool head;            ///< HEAD rather than GET
+  std::string path;
+  int64_t range_start;  ///< -1 if the whole file was requested
+  uint64_t range_length;
+  uint64_t size;        ///< Size of the file served, 0 if not known
+  uint16_t status;
+  uint64_t bytes;       ///< Response bytes sent
+  uint64_t duration_us; ///< Accept to last byte
+  uint64_t ttfb_us;     ///< Accept to response head
+};
+
+/**
+ * @brief Keep a record if it is a request the server answered from a file
+ *
+ * Start time is recovered from the completion time and the duration.
+ */
+void add_entry(std::vector<Entry> &entries, const AccessRecord &r) {
+  std::string_view method(r.method, strnlen(r.method, sizeof(r.method)));
+  if ((method != "GET" && method != "HEAD") || r.path[0] != '/') {
+    return;
+  }
+  entries.push_back({r.time_ns - static_cast<int64_t>(r.duration_us) * 1000,
+                     method == "HEAD",
+                     std::string(r.path, strnlen(r.path, sizeof(r.path))),
+                     r.range_start, r.range_length, r.content_size, r.status,
+                     r.bytes_sent, r.duration_us, r.ttfb_us});
+}
+
+// ---------------------------------------------------------------------------
+// JSON access log
+
+/**
+ * @brief Raw value of a field in one flat JSON object, as format_json()
+ *        writes them
+ * @return The value without quotes (escapes left in), empty if absent
+ */
+std::string_view json_field(std::string_view line, std::string_view key) {
+  std::string pattern = "\"" + std::string(key) + "\":";
+  size_t pos = line.find(pattern);
+  if (pos == std::string_view::npos) {
+    return {};
+  }
+  std::string_view rest = line.substr(pos + pattern.size());
+  if (!rest.empty() && rest[0] == '"') {
+    size_t end = 1;
+    while (end < rest.size() && rest[end] != '"') {
+      end += rest[end] == '\\' ? 2 : 1;
+    }
+    return rest.substr(1, std::min(end, rest.size()) - 1);
+  }
+  return rest.substr(0, rest.find_first_of(",}"));
+}
+
+/**
+ * @brief Undo append_json_string()
+ */
+std::string json_unescape(std::string_view s) {
+  std::string out;
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] != '\\' || i + 1 == s.size()) {
+      out += s[i];
+    } else if (s[i + 1] == 'u' && i + 5 < s.size()) {
+      out += static_cast<char>(
+          strtol(std::string(s.substr(i + 2, 4)).c_str(), nullptr, 16));
+      i += 5;
+    } else {
+      out += s[++i];
+    }
+  }
+  return out;
+}
+
+uint64_t json_number(std::string_view line, std::string_view key) {
+  return strtoull(std::string(json_field(line, key)).c_str(), nullptr, 10);
+}
+
+/**
+ * @brief Parse "2026-10-16T15:39:49.296Z"
+ * @return ns since the epoch, -1 if malformed
+ */
+int64_t parse_time(std::string_view s) {
+  tm utc{};
+  std::string text(s);
+  const char *rest = strptime(text.c_str(), "%Y-%m-%dT%H:%M:%S", &utc);
+  if (rest == nullptr) {
+    return -1;
+  }
+  int64_t ns = static_cast<int64_t>(timegm(&utc)) * 1000000000;
+  if (*rest == '.') {
+    int64_t scale = 100000000;
+    for (rest++; *rest >= '0' && *rest <= '9' && scale > 0; rest++) {
+      ns += (*rest - '0') * scale;
+      scale /= 10;
+    }
+  }
+  return ns;
+}
+
+/**
+ * @return false if the file cannot be read
+ */
+bool read_json_log(const char *path, std::vector<Entry> &entries) {
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "re");
+  if (f == nullptr) {
+    return false;
+  }
+  char *line = nullptr;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, f)) > 0) {
+    std::string_view l(line, len);
+    int64_t time_ns = parse_time(json_field(l, "time"));
+    if (time_ns < 0) {
+      continue;
+    }
+    AccessRecord r;
+    r.time_ns = time_ns;
+    AccessRecord::set(r.method, json_unescape(json_field(l, "method")));
+    AccessRecord::set(r.path, json_unescape(json_field(l, "path")));
+    r.status = json_number(l, "status");
+    r.bytes_sent = json_number(l, "bytes");
+    r.content_size = json_number(l, "size");
+    r.duration_us = json_number(l, "duration_us");
+    r.ttfb_us = json_number(l, "ttfb_us");
+    std::string_view range = json_field(l, "range");
+    size_t dash = range.find('-');
+    off_t first;
+    off_t last;
+    if (dash != std::string_view::npos &&
+        parse_offset(range.substr(0, dash), first) &&
+        parse_offset(range.substr(dash + 1), last) && last >= first) {
+      r.range_start = first;
+      r.range_length = last - first + 1;
+    }
+    add_entry(entries, r);
+  }
+  free(line);
+  if (f != stdin) {
+    fclose(f);
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Binary segments
+
+/**
+ * @return false if the segment cannot be read
+ */
+bool read_segment(const std::string &path, std::vector<Entry> &entries) {
+  try {
+    binlog::SegmentReader segment(path);
+    for (size_t bi = 0; bi < segment.blocks(); bi++) {
+      const binlog::Block &b = segment.block(bi);
+      for (size_t i = 0; i < segment.block_count(bi); i++) {
+        auto name = segment.paths().find(b.path_hash[i]);
+        if (name == segment.paths().end()) {
+          continue;
+        }
+        AccessRecord r;
+        r.time_ns = b.time_ns[i];
+        AccessRecord::set(r.method, binlog::decode_method(b.method[i]));
+        AccessRecord::set(r.path, name->second);
+        r.status = b.status[i];
+        r.bytes_sent = b.bytes_sent[i];
+        r.content_size = b.content_size[i];
+        r.range_start = b.range_start[i];
+        r.range_length = b.range_length[i];
+        r.duration_us = b.duration_us[i];
+        r.ttfb_us = b.ttfb_us[i];
+        add_entry(entries, r);
+      }
+    }
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return false;
+  }
+  return true;
+}
+
+bool is_binary_log(const char *path) {
+  struct stat st;
+  size_t n = strlen(path);
+  size_t suffix = strlen(binlog::SEGMENT_SUFFIX);
+  return (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) ||
+         (n > suffix && strcmp(path + n - suffix, binlog::SEGMENT_SUFFIX) == 0);
+}
+
+// ---------------------------------------------------------------------------
+// Fileset generation
+
+/**
+ * @brief Size of the file behind a logged request, 0 if the log cannot tell
+ *
+ * Older records carry no size; for a full GET it is the bytes sent minus
+ * the response head, which depends on the number of digits in the size.
+ */
+uint64_t implied_size(const Entry &e) {
+  if (e.size > 0) {
+    return e.size;
+  }
+  if (e.range_start >= 0) {
+    return e.range_start + e.range_length;
+  }
+  if (e.status != 200 || e.head) {
+    return 0;
+  }
+  char head[512];
+  for (int digits = 1; digits <= 19; digits++) {
+    size_t len = format_status_line(head, sizeof(head), 200, "OK");
+    len += format_framing(head, sizeof(head), 0);
+    std::string probe(digits, '9');
+    len += format_content_headers(head, sizeof(head), 0, atoll(probe.c_str()),
+                                  0, false);
+    if (e.bytes <= len) {
+      break;
+    }
+    uint64_t size = e.bytes - len;
+    if (std::to_string(size).size() == static_cast<size_t>(digits)) {
+      return size;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Create the files missing under root at their logged sizes
+ * @return Number of files created, or -1 on error
+ */
+long generate_fileset(const std::string &root,
+                      const std::vector<Entry> &entries) {
+  std::map<std::string, uint64_t> sizes;
+  for (const Entry &e : entries) {
+    std::string rel;
+    // Paths that were never found are left missing
+    if (e.status / 100 == 2 && normalize_target(e.path, rel) && !rel.empty()) {
+      uint64_t &size = sizes[rel];
+      size = std::max(size, implied_size(e));
+    }
+  }
+
+  // Non-repeating within a block so the data does not compress away
+  std::vector<char> block(1 << 20);
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < block.size(); i += sizeof(x)) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    memcpy(&block[i], &x, sizeof(x));
+  }
+
+  long created = 0;
+  for (const auto &[rel, size] : sizes) {
+    std::string path = root + "/" + rel;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+      continue;
+    }
+    for (size_t slash = root.size() + 1;
+         (slash = path.find('/', slash)) != std::string::npos; slash++) {
+      mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      perror(path.c_str());
+      return -1;
+    }
+    for (uint64_t written = 0; written < size;) {
+      ssize_t n = write(fd, block.data(),
+                        std::min<uint64_t>(block.size(), size - written));
+      if (n <= 0) {
+        perror(path.c_str());
+        close(fd);
+        return -1;
+      }
+      written += n;
+    }
+    close(fd);
+    created++;
+  }
+  return created;
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+
+struct Config {
+  std::string host = "127.0.0.1";
+  int port = 8080;
+  double speed = 1;
+  unsigned connections = 10000; ///< Max requests in flight
+  size_t limit = 0;             ///< 0 = all
+  unsigned timeout_ms = 60000;
+  std::string generate;         ///< Root to create missing files under
+  bool dry_run = false;         ///< Stop after loading and generating
+};
+
+/**
+ * @brief Latency and throughput of one side of the comparison
+ */
+struct Side {
+  metrics::Histogram latency; ///< ns, accept (or due time) to last byte
+  metrics::Histogram ttfb;    ///< ns
+  uint64_t requests = 0;
+  uint64_t bytes = 0;
+  uint64_t status[6] = {};
+  double span_s = 0; ///< First start to last finish
+};
+
+void append_side(std::string &out, const char *name, const Side &side) {
+  metrics::Histogram::Snapshot lat = side.latency.snapshot();
+  metrics::Histogram::Snapshot ttfb = side.ttfb.snapshot();
+  char buf[768];
+  snprintf(buf, sizeof(buf),
+           "\"%s\":{\"requests\":%llu,\"bytes\":%llu,\"duration_s\":%.3f,"
+           "\"requests_per_s\":%.1f,\"bytes_per_s\":%.0f,"
+           "\"status\":{\"2xx\":%llu,\"3xx\":%llu,\"4xx\":%llu,\"5xx\":%llu,"
+           "\"other\":%llu},"
+           "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+           "\"p999\":%.1f},"
+           "\"ttfb_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+           "\"p999\":%.1f}}",
+           name, static_cast<unsigned long long>(side.requests),
+           static_cast<unsigned long long>(side.bytes), side.span_s,
+           side.span_s > 0 ? side.requests / side.span_s : 0.0,
+           side.span_s > 0 ? side.bytes / side.span_s : 0.0,
+           static_cast<unsigned long long>(side.status[2]),
+           static_cast<unsigned long long>(side.status[3]),
+           static_cast<unsigned long long>(side.status[4]),
+           static_cast<unsigned long long>(side.status[5]),
+           static_cast<unsigned long long>(side.status[0] + side.status[1]),
+           lat.quantile(0.5) / 1e3, lat.quantile(0.9) / 1e3,
+           lat.quantile(0.99) / 1e3, lat.quantile(0.999) / 1e3,
+           ttfb.quantile(0.5) / 1e3, ttfb.quantile(0.9) / 1e3,
+           ttfb.quantile(0.99) / 1e3, ttfb.quantile(0.999) / 1e3);
+  out += buf;
+}
+
+void count(Side &side, uint16_t status, uint64_t bytes, uint64_t latency_ns,
+           uint64_t ttfb_ns) {
+  side.requests++;
+  side.bytes += bytes;
+  int cls = status / 100;
+  side.status[cls >= 1 && cls <= 5 ? cls : 0]++;
+  side.latency.record(latency_ns);
+  if (ttfb_ns > 0) {
+    side.ttfb.record(ttfb_ns);
+  }
+}
+
+std::string build_request(const Config &cfg, const Entry &e) {
+  std::string req = (e.head ? "HEAD " : "GET ") + e.path +
+                    " HTTP/1.1\r\nHost: " + cfg.host + "\r\n";
+  if (e.range_start >= 0) {
+    req += "Range: bytes=" + std::to_string(e.range_start) + "-" +
+           std::to_string(e.range_start + e.range_length - 1) + "\r\n";
+  }
+  return req + "Connection: close\r\n\r\n";
+}
+
+void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] LOG...\n"
+          "LOG is a JSON access log (- for stdin), or a binary log segment or\n"
+          "directory of segments.\n"
+          "  -H, --host HOST         Server address (default 127.0.0.1)\n"
+          "  -p, --port PORT         Server port (default 8080)\n"
+          "  -s, --speed X           Replay X times faster (default 1)\n"
+          "  -c, --connections N     Max requests in flight (default 10000)\n"
+          "  -n, --limit N           Replay only the first N requests\n"
+          "      --timeout-ms N      Per-request timeout (default 60000)\n"
+          "      --generate DIR      Create files missing under DIR with the\n"
+          "                          sizes seen in the log\n"
+          "      --dry-run           Load (and generate), but send nothing\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  enum { OPT_TIMEOUT_MS = 256, OPT_GENERATE, OPT_DRY_RUN };
+  static const option long_options[] = {
+      {"host", required_argument, nullptr, 'H'},
+      {"port", required_argument, nullptr, 'p'},
+      {"speed", required_argument, nullptr, 's'},
+      {"connections", required_argument, nullptr, 'c'},
+      {"limit", required_argument, nullptr, 'n'},
+      {"timeout-ms", required_argument, nullptr, OPT_TIMEOUT_MS},
+      {"generate", required_argument, nullptr, OPT_GENERATE},
+      {"dry-run", no_argument, nullptr, OPT_DRY_RUN},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  Config cfg;
+  int c;
+  while ((c = getopt_long(argc, argv, "H:p:s:c:n:h", long_options,
+                          nullptr)) != -1) {
+    switch (c) {
+    case 'H':
+      cfg.host = optarg;
+      break;
+    case 'p':
+      cfg.port = atoi(optarg);
+      break;
+    case 's':
+      cfg.speed = atof(optarg);
+      break;
+    case 'c':
+      cfg.connections = atoi(optarg);
+      break;
+    case 'n':
+      cfg.limit = strtoull(optarg, nullptr, 10);
+      break;
+    case OPT_TIMEOUT_MS:
+      cfg.timeout_ms = atoi(optarg);
+      break;
+    case OPT_GENERATE:
+      cfg.generate = optarg;
+      while (cfg.generate.size() > 1 && cfg.generate.back() == '/') {
+        cfg.generate.pop_back();
+      }
+      break;
+    case OPT_DRY_RUN:
+      cfg.dry_run = true;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+  if (optind == argc || cfg.speed <= 0 || cfg.connections == 0) {
+    print_usage(argv[0]);
+    return 2;
+  }
+
+  std::vector<Entry> entries;
+  for (int i = optind; i < argc; i++) {
+    bool ok = true;
+    if (is_binary_log(argv[i])) {
+      for (const std::string &segment : binlog::list_segments(argv + i, 1)) {
+        ok = read_segment(segment, entries) && ok;
+      }
+    } else {
+      ok = read_json_log(argv[i], entries);
+      if (!ok) {
+        perror(argv[i]);
+      }
+    }
+    if (!ok) {
+      return 1;
+    }
+  }
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const Entry &a, const Entry &b) {
+                     return a.start_ns < b.start_ns;
+                   });
+  if (cfg.limit > 0 && entries.size() > cfg.limit) {
+    entries.resize(cfg.limit);
+  }
+  if (entries.empty()) {
+    fprintf(stderr, "No GET or HEAD requests in the log\n");
+    return 1;
+  }
+  fprintf(stderr, "Loaded %zu requests spanning %.1fs\n", entries.size(),
+          (entries.back().start_ns - entries.front().start_ns) / 1e9);
+
+  if (!cfg.generate.empty()) {
+    long created = generate_fileset(cfg.generate, entries);
+    if (created < 0) {
+      return 1;
+    }
+    fprintf(stderr, "Created %ld files under %s\n", created,
+            cfg.generate.c_str());
+  }
+  if (cfg.dry_run) {
+    return 0;
+  }
+
+  addrinfo hints{};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *res = nullptr;
+  if (getaddrinfo(cfg.host.c_str(), nullptr, &hints, &res) != 0) {
+    fprintf(stderr, "Cannot resolve %s\n", cfg.host.c_str());
+    return 1;
+  }
+  sockaddr_in addr = *reinterpret_cast<sockaddr_in *>(res->ai_addr);
+  addr.sin_port = htons(cfg.port);
+  freeaddrinfo(res);
+
+  rlimit nofile;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 &&
+      nofile.rlim_cur < nofile.rlim_max) {
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+  }
+
+  // The recorded side, from the log's own timings
+  Side original;
+  int64_t original_end = entries.front().start_ns;
+  for (const Entry &e : entries) {
+    count(original, e.status, e.bytes, e.duration_us * 1000,
+          e.ttfb_us * 1000);
+    original_end = std::max<int64_t>(
+        original_end, e.start_ns + static_cast<int64_t>(e.duration_us) * 1000);
+  }
+  original.span_s = (original_end - entries.front().start_ns) / 1e9;
+
+  // Entry i is due at begin + (start_i - start_0) / speed; its index is the
+  // request's tag
+  bench::ClientLoop loop(addr, cfg.connections,
+                         {false, 0, 0, cfg.timeout_ms});
+  Side replay;
+  metrics::Histogram slowdown; ///< Replay latency / original, per mille
+  uint64_t errors = 0;
+  uint64_t timeouts = 0;
+  uint64_t mismatched = 0; ///< Status differs from the log
+  uint64_t max_lag_ns = 0; ///< Worst delay between due and sent
+  const uint64_t begin = now_ns() + 100000000;
+  auto due = [&](size_t i) {
+    return begin + static_cast<uint64_t>(
+                       (entries[i].start_ns - entries.front().start_ns) /
+                       cfg.speed);
+  };
+  auto on_done = [&](const bench::Response &r) {
+    const Entry &e = entries[r.tag];
+    uint64_t due_ns = due(r.tag);
+    if (r.outcome == bench::Response::ERROR) {
+      errors++;
+      return;
+    }
+    if (r.outcome == bench::Response::TIMEOUT) {
+      timeouts++;
+      return;
+    }
+    uint64_t latency = r.end_ns - due_ns;
+    count(replay, r.status, r.bytes, latency,
+          r.first_byte_ns != 0 ? r.first_byte_ns - r.start_ns : 0);
+    if (r.status != e.status) {
+      mismatched++;
+    }
+    slowdown.record(latency * 1000 /
+                    std::max<uint64_t>(1000, e.duration_us * 1000ULL));
+  };
+
+  size_t next = 0;
+  while (next < entries.size() || loop.in_flight() > 0) {
+    uint64_t now = now_ns();
+    while (next < entries.size() && due(next) <= now && loop.idle() > 0) {
+      max_lag_ns = std::max(max_lag_ns, now - due(next));
+      loop.start(build_request(cfg, entries[next]), next);
+      next++;
+    }
+    uint64_t wait = 100000000;
+    if (next < entries.size() && loop.idle() > 0) {
+      wait = due(next) > now ? due(next) - now : 0;
+    }
+    loop.poll(wait, on_done);
+  }
+  replay.span_s = (now_ns() - begin) / 1e9;
+
+  std::string out = "{";
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "\"speed\":%.3f,\"errors\":%llu,\"timeouts\":%llu,"
+           "\"status_mismatches\":%llu,\"max_lag_us\":%.1f,",
+           cfg.speed, static_cast<unsigned long long>(errors),
+           static_cast<unsigned long long>(timeouts),
+           static_cast<unsigned long long>(mismatched), max_lag_ns / 1e3);
+  out += buf;
+  append_side(out, "original", original);
+  out += ',';
+  append_side(out, "replay", replay);
+  metrics::Histogram::Snapshot s = slowdown.snapshot();
+  snprintf(buf, sizeof(buf),
+           ",\"latency_ratio\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f}}\n",
+           s.quantile(0.5) / 1e3, s.quantile(0.9) / 1e3,
+           s.quantile(0.99) / 1e3);
+  out += buf;
+  fputs(out.c_str(), stdout);
+
+  metrics::Histogram::Snapshot a = original.latency.snapshot();
+  metrics::Histogram::Snapshot b = replay.latency.snapshot();
+  fprintf(stderr,
+          "Replayed %llu of %zu requests at %.2fx: %llu errors, %llu "
+          "timeouts, %llu status changes\n"
+          "  p50 latency %.2f ms (logged %.2f ms), p99 %.2f ms (logged "
+          "%.2f ms)\n",
+          static_cast<unsigned long long>(replay.requests), entries.size(),
+          cfg.speed, static_cast<unsigned long long>(errors),
+          static_cast<unsigned long long>(timeouts),
+          static_cast<unsigned long long>(mismatched), b.quantile(0.5) / 1e6,
+          a.quantile(0.5) / 1e6, b.quantile(0.99) / 1e6,
+          a.quantile(0.99) / 1e6);
+  return 0;
+}
@@ -0,0 +1,142 @@
+#!/bin/sh
+# Run the benchmark scenarios against a local server and write one report.
+#
+# Usage: bench/run.sh [SERVER]
+#
+# Each scenario starts SERVER on loopback with a scratch content root and
+# drives it with bench/streamix-loadgen (make bench builds both and runs
+# this). The report is a JSON object with one loadgen result per scenario:
+#
+#   small-rps        4 KiB objects as fast as possible, mixed with a few
+#                    64 KiB ones
+#   small-latency    the same objects at a fixed rate, for latency without
+#                    coordinated omission
+#   large-throughput whole 256 MiB files
+#   large-ranges     1 MiB random ranges of the same files
+#   small-fastopen   small-latency against a server with --defer-accept-s
+#                    and --fastopen, the client sending requests in the SYN
+#                    (needs bit 2 of net.ipv4.tcp_fastopen for the server)
+#   synthetic-throughput
+#                    64 MiB and 1 MiB responses of --synthetic content, which
+#                    never touch a disk, with every body verified
+#   slow-clients     many clients reading at a trickle, plus a fixed-rate
+#                    probe measuring how the server treats everyone else
+#
+# Environment:
+#   BENCH_REPORT        Output file (default bench_report.json)
+#   BENCH_DURATION      Seconds per scenario (default 10)
+#   BENCH_PORT          Server port (default 18280; PORT+1 is the admin port)
+#   BENCH_THREADS       Load generator threads (default: number of CPUs)
+#   BENCH_SLOW_CLIENTS  Clients in slow-clients (default 10000)
+
+set -eu
+
+SERVER=${1:-./streamix}
+LOADGEN=${LOADGEN:-./bench/streamix-loadgen}
+REPORT=${BENCH_REPORT:-bench_report.json}
+DURATION=${BENCH_DURATION:-10}
+PORT=${BENCH_PORT:-18280}
+ADMIN_PORT=$((PORT + 1))
+THREADS=${BENCH_THREADS:-$(nproc)}
+SLOW_CLIENTS=${BENCH_SLOW_CLIENTS:-10000}
+
+# Thousands of connections need thousands of descriptors on both ends
+ulimit -n "$(ulimit -Hn)" 2>/dev/null || true
+
+dir=$(mktemp -d)
+pid=
+cleanup() {
+  if [ -n "$pid" ]; then
+    kill "$pid" 2>/dev/null || true
+    wait "$pid" 2>/dev/null || true
+  fi
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+mkdir -p "$dir/root/small" "$dir/root/large"
+for i in 0 1 2 3 4 5 6 7; do
+  head -c 4096 /dev/urandom >"$dir/root/small/$i.bin"
+done
+head -c 65536 /dev/urandom >"$dir/root/small/medium.bin"
+head -c 268435456 /dev/zero >"$dir/root/large/a.bin"
+head -c 268435456 /dev/zero >"$dir/root/large/b.bin"
+
+# start_server [SERVER-ARGS...]
+start_server() {
+  "$SERVER" -p "$PORT" --admin-port "$ADMIN_PORT" -r "$dir/root" \
+    --access-log off --status-shm off "$@" >"$dir/server.log" 2>&1 &
+  pid=$!
+  for _ in 1 2 3 4 5 6 7 8 9 10; do
+    curl -sf -o /dev/null "http://127.0.0.1:$ADMIN_PORT/metrics" && return
+    sleep 0.2
+  done
+  echo "bench: server did not start" >&2
+  cat "$dir/server.log" >&2
+  exit 1
+}
+
+stop_server() {
+  kill "$pid"
+  wait "$pid" 2>/dev/null || true
+  pid=
+}
+
+# scenario NAME LOADGEN-ARGS...: one loadgen run against a fresh server
+scenario() {
+  name=$1
+  shift
+  start_server
+  "$LOADGEN" -p "$PORT" -t "$THREADS" -d "$DURATION" --scenario "$name" \
+    "$@" >"$dir/$name.json"
+  stop_server
+}
+
+small="/small/0.bin /small/1.bin /small/2.bin /small/3.bin /small/4.bin"
+small="$small /small/5.bin /small/6.bin /small/7.bin /small/medium.bin:1"
+
+# shellcheck disable=SC2086
+scenario small-rps -c 64 -k $small
+# shellcheck disable=SC2086
+scenario small-latency -c 256 -r 2000 -k $small
+scenario large-throughput -c 8 /large/a.bin /large/b.bin
+scenario large-ranges -c 32 -k --range 1048576 /large/a.bin /large/b.bin
+
+start_server --defer-accept-s 5 --fastopen 4096
+# shellcheck disable=SC2086
+"$LOADGEN" -p "$PORT" -t "$THREADS" -d "$DURATION" --scenario small-fastopen \
+  -c 256 -r 2000 -k --fastopen $small >"$dir/small-fastopen.json"
+stop_server
+
+start_server --synthetic
+"$LOADGEN" -p "$PORT" -t "$THREADS" -d "$DURATION" \
+  --scenario synthetic-throughput -c 8 -k --verify /synthetic/64m \
+  /synthetic/1m:4 >"$dir/synthetic-throughput.json"
+stop_server
+
+# Slow clients each read a 64 KiB range at 16 KiB/s with small receive
+# buffers, so the server has to hold their connections open
+start_server
+"$LOADGEN" -p "$PORT" -t "$THREADS" -d "$DURATION" --scenario slow-clients \
+  -c "$SLOW_CLIENTS" --range 65536 --read-rate 16384 --rcvbuf 4096 \
+  --timeout-ms 60000 /large/a.bin >"$dir/slow-clients.json" &
+slow=$!
+sleep 1
+# shellcheck disable=SC2086
+"$LOADGEN" -p "$PORT" -t 1 -d "$((DURATION > 1 ? DURATION - 1 : 1))" \
+  --scenario slow-clients-probe -c 16 -r 100 $small >"$dir/slow-clients-probe.json"
+wait "$slow"
+stop_server
+
+{
+  printf '{"server":"%s","duration_s":%s,"scenarios":[' "$SERVER" "$DURATION"
+  sep=
+  for name in small-rps small-latency large-throughput large-ranges \
+    small-fastopen synthetic-throughput slow-clients slow-clients-probe; do
+    printf '%s' "$sep"
+    tr -d '\n' <"$dir/$name.json"
+    sep=,
+  done
+  printf ']}\n'
+} >"$REPORT"
+echo "bench: report written to $REPORT"
@@ -0,0 +1,425 @@
+/**
+ * @file binlog.h
+ * @brief Fixed-width binary access-log segments
+ *
+ * An alternative to the JSON access log for high request rates. Records are
+ * written into memory-mapped segment files of BLOCKS_PER_SEGMENT blocks,
+ * each holding BLOCK_RECORDS records column by column (PAX layout): all
+ * timestamps of the block, then all byte counts, and so on. A query that
+ * filters on status and sums bytes therefore reads two dense arrays per
+ * block, which the compiler turns into SIMD loops.
+ *
+ * Paths are stored as 64-bit FNV-1a hashes; the text of each distinct path
+ * is appended once per segment to a "<segment>.paths" sidecar. Values are in
+ * host byte order. A segment is complete once its header count reaches
+ * capacity, after which the writer moves on to a new file.
+ *
+ * Read with tools/streamix-logq.
+ */
+
+#pragma once
+
+#include "access_record.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace binlog {
+
+constexpr char MAGIC[8] = {'S', 'X', 'L', 'O', 'G', '0', '1', '\0'};
+constexpr uint32_t VERSION = 3;
+constexpr size_t BLOCK_RECORDS = 1024;
+constexpr size_t BLOCKS_PER_SEGMENT = 64;
+constexpr size_t SEGMENT_RECORDS = BLOCK_RECORDS * BLOCKS_PER_SEGMENT;
+constexpr const char *SEGMENT_SUFFIX = ".sxl";
+
+/**
+ * @brief Request methods, stored in one byte
+ */
+enum Method : uint8_t { OTHER = 0, GET = 1, HEAD = 2, INVALID = 3 };
+
+inline Method encode_method(std::string_view m) {
+  if (m == "GET") {
+    return GET;
+  }
+  if (m == "HEAD") {
+    return HEAD;
+  }
+  return m == "-" ? INVALID : OTHER;
+}
+
+inline const char *decode_method(uint8_t m) {
+  static constexpr const char *NAMES[] = {"OTHER", "GET", "HEAD", "-"};
+  return m < 4 ? NAMES[m] : "OTHER";
+}
+
+/**
+ * @brief 64-bit FNV-1a, the path key in segments and sidecars
+ */
+inline uint64_t path_hash(std::string_view s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : s) {
+    h = (h ^ c) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/**
+ * @brief First 64 bytes of a segment file
+ */
+struct SegmentHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_records;
+  uint32_t blocks;
+  uint32_t reserved;
+  uint64_t count;      ///< Records written; published with release order
+  int64_t created_ns;  ///< CLOCK_REALTIME when the segment was started
+  char padding[24];
+};
+static_assert(sizeof(SegmentHeader) == 64, "header must stay 64 bytes");
+
+/**
+ * @brief BLOCK_RECORDS records, one array per field, widest first so every
+ *        array is naturally aligned
+ */
+struct Block {
+  int64_t time_ns[BLOCK_RECORDS];
+  uint64_t bytes_sent[BLOCK_RECORDS];
+  uint64_t content_size[BLOCK_RECORDS];
+  int64_t range_start[BLOCK_RECORDS];
+  uint64_t range_length[BLOCK_RECORDS];
+  uint64_t path_hash[BLOCK_RECORDS];
+  uint64_t duration_us[BLOCK_RECORDS];
+  uint32_t client_ip[BLOCK_RECORDS];
+  uint32_t ttfb_us[BLOCK_RECORDS];
+  uint32_t rtt_us[BLOCK_RECORDS];
+  uint32_t retransmits[BLOCK_RECORDS];
+  uint16_t client_port[BLOCK_RECORDS];
+  uint16_t status[BLOCK_RECORDS];
+  uint16_t rwnd_limited[BLOCK_RECORDS];
+  uint16_t sndbuf_limited[BLOCK_RECORDS];
+  uint8_t method[BLOCK_RECORDS];
+};
+
+constexpr size_t SEGMENT_BYTES =
+    sizeof(SegmentHeader) + sizeof(Block) * BLOCKS_PER_SEGMENT;
+
+inline Block *blocks_of(void *segment) {
+  return reinterpret_cast<Block *>(static_cast<char *>(segment) +
+                                   sizeof(SegmentHeader));
+}
+
+inline const Block *blocks_of(const void *segment) {
+  return reinterpret_cast<const Block *>(static_cast<const char *>(segment) +
+                                         sizeof(SegmentHeader));
+}
+
+/**
+ * @brief Appends records to rotating segments in a directory; single thread
+ */
+class SegmentWriter {
+  std::string dir_;
+  void *map_ = nullptr;
+  SegmentHeader *header_ = nullptr;
+  uint64_t count_ = 0;
+  FILE *paths_ = nullptr;
+  std::unordered_set<uint64_t> paths_seen_; ///< Paths in this segment's sidecar
+  unsigned sequence_ = 0; ///< Segments opened by this writer
+
+  void close_segment() {
+    if (map_ != nullptr) {
+      munmap(map_, SEGMENT_BYTES);
+      map_ = nullptr;
+      header_ = nullptr;
+    }
+    if (paths_ != nullptr) {
+      fclose(paths_);
+      paths_ = nullptr;
+    }
+    paths_seen_.clear();
+  }
+
+  /**
+   * @brief Start a new segment file
+   *
+   * Named access-<UTC time to the microsecond>-<pid>-<sequence>, with fixed
+   * width fields so that names sort in the order the segments were started;
+   * the pid keeps a restarted server from colliding with its predecessor.
+   */
+  void open_segment() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    tm utc;
+    gmtime_r(&now.tv_sec, &utc);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%S", &utc);
+    char name[96];
+    snprintf(name, sizeof(name), "/access-%s.%06ld-%07d-%06u%s", stamp,
+             now.tv_nsec / 1000, static_cast<int>(getpid()), sequence_++,
+             SEGMENT_SUFFIX);
+    std::string path = dir_ + name;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "open() failed for " + path);
+    }
+    // Sparse until written, so a part-filled segment only takes what it uses
+    if (ftruncate(fd, SEGMENT_BYTES) < 0) {
+      int err = errno;
+      close(fd);
+      throw std::system_error(err, std::generic_category(), "ftruncate()");
+    }
+    map_ = mmap(nullptr, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                0);
+    close(fd);
+    if (map_ == MAP_FAILED) {
+      map_ = nullptr;
+      throw std::system_error(errno, std::generic_category(), "mmap()");
+    }
+    header_ = static_cast<SegmentHeader *>(map_);
+    memcpy(header_->magic, MAGIC, sizeof(MAGIC));
+    header_->version = VERSION;
+    header_->block_records = BLOCK_RECORDS;
+    header_->blocks = BLOCKS_PER_SEGMENT;
+    header_->created_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    count_ = 0;
+
+    paths_ = fopen((path + ".paths").c_str(), "we");
+    if (paths_ == nullptr) {
+      throw std::system_error(errno, std::generic_category(),
+                              "fopen() failed for " + path + ".paths");
+    }
+  }
+
+public:
+  /**
+   * @param dir Directory for the segments, created if missing
+   * @throws std::system_error if the first segment cannot be created
+   */
+  explicit SegmentWriter(std::string dir) : dir_(std::move(dir)) {
+    if (mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+      throw std::system_error(errno, std::generic_category(),
+                              "mkdir() failed for " + dir_);
+    }
+    open_segment();
+  }
+
+  ~SegmentWriter() {
+    commit();
+    close_segment();
+  }
+
+  SegmentWriter(const SegmentWriter &) = delete;
+  SegmentWriter &operator=(const SegmentWriter &) = delete;
+
+  /**
+   * @brief Add one record; visible to readers after the next commit()
+   * @return false if no segment could be opened to hold it
+   */
+  bool append(const AccessRecord &r) {
+    if (map_ == nullptr || count_ == SEGMENT_RECORDS) {
+      commit();
+      close_segment();
+      try {
+        open_segment();
+      } catch (const std::system_error &e) {
+        close_segment();
+        fprintf(stderr, "access log: %s\n", e.what());
+        return false;
+      }
+    }
+    Block &b = blocks_of(map_)[count_ / BLOCK_RECORDS];
+    size_t i = count_ % BLOCK_RECORDS;
+    std::string_view path(r.path, strnlen(r.path, sizeof(r.path)));
+    uint64_t hash = path_hash(path);
+    b.time_ns[i] = r.time_ns;
+    b.bytes_sent[i] = r.bytes_sent;
+    b.content_size[i] = r.content_size;
+    b.range_start[i] = r.range_start;
+    b.range_length[i] = r.range_length;
+    b.path_hash[i] = hash;
+    b.client_ip[i] = r.client_ip;
+    b.duration_us[i] = r.duration_us;
+    b.ttfb_us[i] = r.ttfb_us;
+    b.rtt_us[i] = r.rtt_us;
+    b.retransmits[i] = r.retransmits;
+    b.client_port[i] = r.client_port;
+    b.status[i] = r.status;
+    b.rwnd_limited[i] = r.rwnd_limited;
+    b.sndbuf_limited[i] = r.sndbuf_limited;
+    b.method[i] = encode_method(
+        std::string_view(r.method, strnlen(r.method, sizeof(r.method))));
+    count_++;
+
+    if (paths_seen_.insert(hash).second) {
+      fprintf(paths_, "%016llx\t%.*s\n", static_cast<unsigned long long>(hash),
+              static_cast<int>(path.size()), path.data());
+    }
+    return true;
+  }
+
+  /**
+   * @brief Publish the records appended so far
+   */
+  void commit() {
+    if (header_ == nullptr || paths_ == nullptr) {
+      return;
+    }
+    fflush(paths_);
+    __atomic_store_n(&header_->count, count_, __ATOMIC_RELEASE);
+  }
+
+  /**
+   * @brief Commit, then write the active segment and its sidecar to disk
+   *
+   * For shutdown: the blocks written so far and the header count must not
+   * be left for the kernel to write back after the process is gone.
+   */
+  void sync() {
+    commit();
+    if (header_ == nullptr) {
+      return;
+    }
+    size_t used = sizeof(SegmentHeader) +
+                  sizeof(Block) * std::min<uint64_t>(
+                                      count_ / BLOCK_RECORDS + 1,
+                                      BLOCKS_PER_SEGMENT);
+    msync(map_, used, MS_SYNC);
+    fsync(fileno(paths_));
+  }
+};
+
+/**
+ * @brief Read-only view of one segment file and its path sidecar
+ */
+class SegmentReader {
+  const void *map_ = nullptr;
+  uint64_t count_ = 0;
+  std::unordered_map<uint64_t, std::string> paths_;
+
+public:
+  /**
+   * @throws std::system_error if the file cannot be mapped
+   * @throws std::runtime_error if it is not a segment of this version
+   */
+  explicit SegmentReader(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "open() failed for " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < SEGMENT_BYTES) {
+      close(fd);
+      throw std::runtime_error(path + ": not a streamix log segment");
+    }
+    map_ = mmap(nullptr, SEGMENT_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map_ == MAP_FAILED) {
+      map_ = nullptr;
+      throw std::system_error(errno, std::generic_category(), "mmap()");
+    }
+    const SegmentHeader *h = static_cast<const SegmentHeader *>(map_);
+    if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != VERSION ||
+        h->block_records != BLOCK_RECORDS || h->blocks != BLOCKS_PER_SEGMENT) {
+      munmap(const_cast<void *>(map_), SEGMENT_BYTES);
+      throw std::runtime_error(path + ": not a streamix log segment");
+    }
+    count_ = std::min<uint64_t>(__atomic_load_n(&h->count, __ATOMIC_ACQUIRE),
+                                SEGMENT_RECORDS);
+    madvise(const_cast<void *>(map_), SEGMENT_BYTES, MADV_SEQUENTIAL);
+
+    if (FILE *f = fopen((path + ".paths").c_str(), "re")) {
+      char line[4096];
+      while (fgets(line, sizeof(line), f) != nullptr) {
+        char *tab = strchr(line, '\t');
+        if (tab == nullptr) {
+          continue;
+        }
+        size_t len = strcspn(tab + 1, "\n");
+        paths_[strtoull(line, nullptr, 16)] = std::string(tab + 1, len);
+      }
+      fclose(f);
+    }
+  }
+
+  ~SegmentReader() {
+    if (map_ != nullptr) {
+      munmap(const_cast<void *>(map_), SEGMENT_BYTES);
+    }
+  }
+
+  SegmentReader(const SegmentReader &) = delete;
+  SegmentReader &operator=(const SegmentReader &) = delete;
+
+  uint64_t count() const { return count_; }
+  const Block &block(size_t index) const { return blocks_of(map_)[index]; }
+
+  /**
+   * @brief Records in block index (BLOCK_RECORDS except for the last)
+   */
+  size_t block_count(size_t index) const {
+    uint64_t start = static_cast<uint64_t>(index) * BLOCK_RECORDS;
+    return start >= count_ ? 0 : std::min<uint64_t>(count_ - start,
+                                                    BLOCK_RECORDS);
+  }
+
+  size_t blocks() const {
+    return (count_ + BLOCK_RECORDS - 1) / BLOCK_RECORDS;
+  }
+
+  const std::unordered_map<uint64_t, std::string> &paths() const {
+    return paths_;
+  }
+};
+
+/**
+ * @brief Expand directories into the segment files they contain, oldest
+ *        first
+ */
+inline std::vector<std::string> list_segments(char **paths, int count) {
+  std::vector<std::string> files;
+  for (int i = 0; i < count; i++) {
+    struct stat st;
+    if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      std::vector<std::string> found;
+      if (DIR *dir = opendir(paths[i])) {
+        while (dirent *e = readdir(dir)) {
+          std::string name = e->d_name;
+          size_t suffix = strlen(SEGMENT_SUFFIX);
+          if (name.size() > suffix &&
+              name.compare(name.size() - suffix, suffix,
+                           SEGMENT_SUFFIX) == 0) {
+            found.push_back(std::string(paths[i]) + "/" + name);
+          }
+        }
+        closedir(dir);
+      }
+      std::sort(found.begin(), found.end());
+      files.insert(files.end(), found.begin(), found.end());
+    } else {
+      files.push_back(paths[i]);
+    }
+  }
+  return files;
+}
+
+} // namespace binlog
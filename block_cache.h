@@ -0,0 +1,447 @@
+/**
+ * @file block_cache.h
+ * @brief Optional user-space cache of fixed-size file blocks
+ *
+ * For files on slow or networked storage the kernel page cache gives no
+ * control over what stays hot. This cache keeps 2MB blocks in one arena
+ * (backed by huge pages where the system allows) and serves them straight
+ * from memory. The index is split into lock stripes, each owning a share of
+ * the arena and running its own segmented LRU: blocks enter a probation
+ * segment and are only promoted to the protected segment on a second hit, so
+ * a sequential scan of a large file cannot flush the working set.
+ */
+
+#pragma once
+
+#include "io_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Identifies one block of one version of a file
+ *
+ * The modification time is part of the key, so a rewritten file simply stops
+ * matching its old blocks, which then age out of the cache.
+ */
+struct BlockKey {
+  dev_t dev;
+  ino_t ino;
+  int64_t mtime_ns;
+  uint64_t index; ///< Block number within the file
+
+  bool operator==(const BlockKey &o) const {
+    return dev == o.dev && ino == o.ino && mtime_ns == o.mtime_ns &&
+           index == o.index;
+  }
+};
+
+/**
+ * @brief Hash for BlockKey (64-bit mix of all fields)
+ */
+struct BlockKeyHash {
+  size_t operator()(const BlockKey &k) const noexcept {
+    uint64_t h = k.index * 0x9e3779b97f4a7c15ULL;
+    h ^= (static_cast<uint64_t>(k.ino) + (h << 6) + (h >> 2));
+    h ^= (static_cast<uint64_t>(k.dev) + (h << 6) + (h >> 2));
+    h ^= (static_cast<uint64_t>(k.mtime_ns) + (h << 6) + (h >> 2));
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return static_cast<size_t>(h);
+  }
+};
+
+/**
+ * @brief Fixed-capacity, lock-striped cache of file blocks
+ */
+class BlockCache {
+public:
+  static constexpr size_t BLOCK_SIZE = 2 * 1024 * 1024; ///< One huge page
+  static constexpr unsigned STRIPES = 16;               ///< Index lock stripes
+  /// Smallest arena, one block per stripe; capacities are multiples of it
+  static constexpr size_t MIN_CAPACITY = BLOCK_SIZE * STRIPES;
+
+  /**
+   * @brief Cache-wide counters
+   */
+  struct Stats {
+    std::atomic<uint64_t> hits{0};        ///< Lookups served from memory
+    std::atomic<uint64_t> misses{0};      ///< Lookups that fell back to disk
+    std::atomic<uint64_t> fills{0};       ///< Blocks loaded into the cache
+    std::atomic<uint64_t> fill_errors{0}; ///< Loads that failed or were short
+    std::atomic<uint64_t> evictions{0};   ///< Blocks dropped to make room
+  };
+
+private:
+  static constexpr uint32_t NIL = UINT32_MAX;
+
+  enum class State : uint8_t { FREE, FILLING, READY };
+
+  struct Slot {
+    BlockKey key{};
+    State state = State::FREE;
+    bool hot = false;          ///< In the protected segment
+    bool referenced = false;   ///< Hit in probation since it was admitted
+    std::atomic<uint32_t> refs{0}; ///< Outstanding Refs; pinned while > 0
+    uint32_t prev = NIL;
+    uint32_t next = NIL;
+    size_t length = 0; ///< Valid bytes (the last block of a file is short)
+    char *data = nullptr;
+    int fill_fd = -1; ///< dup() of the source file while FILLING
+    IoRequest fill;
+  };
+
+  /**
+   * @brief Doubly-linked list of slot indices, most recently used at head
+   */
+  struct List {
+    uint32_t head = NIL;
+    uint32_t tail = NIL;
+    uint32_t size = 0;
+  };
+
+  struct Stripe {
+    std::mutex mutex;
+    std::unordered_map<BlockKey, uint32_t, BlockKeyHash> index;
+    std::unique_ptr<Slot[]> slots;
+    uint32_t nslots = 0;
+    uint32_t protected_cap = 0; ///< Max slots in the protected segment
+    List probation;
+    List protected_;
+    std::vector<uint32_t> free;
+    std::vector<uint32_t> filling; ///< Slots with a fill in flight
+  };
+
+public:
+  /**
+   * @brief A pinned reference to a cached block
+   *
+   * The block cannot be evicted or reused while a Ref to it exists.
+   */
+  class Ref {
+    Slot *slot_ = nullptr;
+
+  public:
+    Ref() = default;
+    explicit Ref(Slot *slot) : slot_(slot) {}
+    ~Ref() { reset(); }
+
+    Ref(const Ref &) = delete;
+    Ref &operator=(const Ref &) = delete;
+    Ref(Ref &&other) noexcept : slot_(other.slot_) { other.slot_ = nullptr; }
+    Ref &operator=(Ref &&other) noexcept {
+      if (this != &other) {
+        reset();
+        slot_ = other.slot_;
+        other.slot_ = nullptr;
+      }
+      return *this;
+    }
+
+    explicit operator bool() const { return slot_ != nullptr; }
+    const char *data() const { return slot_->data; }
+    size_t length() const { return slot_->length; }
+
+    void reset() {
+      if (slot_ != nullptr) {
+        slot_->refs.fetch_sub(1, std::memory_order_release);
+        slot_ = nullptr;
+      }
+    }
+  };
+
+private:
+  char *arena_ = nullptr;
+  size_t arena_size_ = 0;
+  bool huge_pages_ = false;
+  Stripe stripes_[STRIPES];
+  Stats stats_;
+
+  Stripe &stripe_for(const BlockKey &key) {
+    return stripes_[BlockKeyHash{}(key) % STRIPES];
+  }
+
+  static void unlink(Stripe &st, List &list, uint32_t i) {
+    Slot &s = st.slots[i];
+    if (s.prev != NIL) {
+      st.slots[s.prev].next = s.next;
+    } else {
+      list.head = s.next;
+    }
+    if (s.next != NIL) {
+      st.slots[s.next].prev = s.prev;
+    } else {
+      list.tail = s.prev;
+    }
+    s.prev = s.next = NIL;
+    list.size--;
+  }
+
+  static void push_front(Stripe &st, List &list, uint32_t i) {
+    Slot &s = st.slots[i];
+    s.prev = NIL;
+    s.next = list.head;
+    if (list.head != NIL) {
+      st.slots[list.head].prev = i;
+    } else {
+      list.tail = i;
+    }
+    list.head = i;
+    list.size++;
+  }
+
+  /**
+   * @brief Return a slot to the free list, dropping it from the index
+   */
+  static void release(Stripe &st, uint32_t i) {
+    Slot &s = st.slots[i];
+    st.index.erase(s.key);
+    s.state = State::FREE;
+    s.hot = false;
+    s.referenced = false;
+    st.free.push_back(i);
+  }
+
+  /**
+   * @brief Finish a fill whose I/O has completed (stripe lock held)
+   * @return true if the slot is no longer FILLING
+   */
+  bool finish_fill(Stripe &st, uint32_t i) {
+    Slot &s = st.slots[i];
+    if (!s.fill.done()) {
+      return false;
+    }
+    close(s.fill_fd);
+    s.fill_fd = -1;
+    if (s.fill.result() == static_cast<ssize_t>(s.length)) {
+      s.state = State::READY;
+      push_front(st, st.probation, i);
+      stats_.fills.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      release(st, i);
+      stats_.fill_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  void reap_fills(Stripe &st) {
+    for (size_t n = 0; n < st.filling.size();) {
+      if (finish_fill(st, st.filling[n])) {
+        st.filling[n] = st.filling.back();
+        st.filling.pop_back();
+      } else {
+        n++;
+      }
+    }
+  }
+
+  /**
+   * @brief Evict the least recently used unpinned block of a segment
+   */
+  bool evict_from(Stripe &st, List &list) {
+    for (uint32_t i = list.tail; i != NIL; i = st.slots[i].prev) {
+      if (st.slots[i].refs.load(std::memory_order_acquire) == 0) {
+        unlink(st, list, i);
+        release(st, i);
+        stats_.evictions.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @brief Take a free slot, evicting probation before protected blocks
+   * @return Slot index, or NIL if every slot is pinned or filling
+   */
+  uint32_t take_slot(Stripe &st) {
+    if (st.free.empty() && !evict_from(st, st.probation) &&
+        !evict_from(st, st.protected_)) {
+      return NIL;
+    }
+    uint32_t i = st.free.back();
+    st.free.pop_back();
+    return i;
+  }
+
+public:
+  /**
+   * @brief Allocate the arena and split it across the stripes
+   * @param capacity Cache size in bytes, rounded down to a multiple of
+   *        MIN_CAPACITY (and raised to MIN_CAPACITY if smaller)
+   * @throws std::system_error if the arena cannot be mapped
+   */
+  explicit BlockCache(size_t capacity) {
+    size_t per_stripe = std::max<size_t>(1, capacity / BLOCK_SIZE / STRIPES);
+    arena_size_ = per_stripe * STRIPES * BLOCK_SIZE;
+
+    void *mem = mmap(nullptr, arena_size_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    huge_pages_ = mem != MAP_FAILED;
+    if (!huge_pages_) {
+      // No reserved huge pages: fall back to transparent huge pages
+      mem = mmap(nullptr, arena_size_, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(),
+                                "mmap() failed for block cache");
+      }
+      madvise(mem, arena_size_, MADV_HUGEPAGE);
+    }
+    arena_ = static_cast<char *>(mem);
+
+    for (unsigned s = 0; s < STRIPES; s++) {
+      Stripe &st = stripes_[s];
+      st.nslots = static_cast<uint32_t>(per_stripe);
+      st.protected_cap = std::max<uint32_t>(1, st.nslots * 4 / 5);
+      st.slots = std::make_unique<Slot[]>(st.nslots);
+      st.index.reserve(st.nslots);
+      st.free.reserve(st.nslots);
+      st.filling.reserve(st.nslots);
+      for (uint32_t i = 0; i < st.nslots; i++) {
+        st.slots[i].data = arena_ + (s * per_stripe + i) * BLOCK_SIZE;
+        st.free.push_back(st.nslots - 1 - i);
+      }
+    }
+  }
+
+  ~BlockCache() {
+    // Fills write into the arena, so they must finish before it is unmapped
+    for (Stripe &st : stripes_) {
+      for (uint32_t i = 0; i < st.nslots; i++) {
+        st.slots[i].fill.wait();
+        if (st.slots[i].fill_fd >= 0) {
+          close(st.slots[i].fill_fd);
+        }
+      }
+    }
+    munmap(arena_, arena_size_);
+  }
+
+  BlockCache(const BlockCache &) = delete;
+  BlockCache &operator=(const BlockCache &) = delete;
+
+  /**
+   * @brief Look up a block, pinning it if it is cached
+   * @return A Ref to the block, or an empty Ref on a miss
+   */
+  Ref lookup(const BlockKey &key) {
+    Stripe &st = stripe_for(key);
+    std::lock_guard<std::mutex> lock(st.mutex);
+
+    auto it = st.index.find(key);
+    if (it == st.index.end()) {
+      stats_.misses.fetch_add(1, std::memory_order_relaxed);
+      return Ref();
+    }
+    uint32_t i = it->second;
+    Slot &s = st.slots[i];
+    if (s.state == State::FILLING) {
+      if (!finish_fill(st, i)) {
+        stats_.misses.fetch_add(1, std::memory_order_relaxed);
+        return Ref();
+      }
+      for (auto &f : st.filling) {
+        if (f == i) {
+          f = st.filling.back();
+          st.filling.pop_back();
+          break;
+        }
+      }
+      if (s.state != State::READY) {
+        stats_.misses.fetch_add(1, std::memory_order_relaxed);
+        return Ref();
+      }
+    }
+
+    // The first hit after admission only marks the block and requeues it in
+    // probation: a miss admits the next block too, so a sequential reader
+    // hits every other block once. A second hit promotes into the protected
+    // segment; overflow from there drops back to the head of probation, still
+    // marked, rather than out of the cache
+    if (s.hot) {
+      unlink(st, st.protected_, i);
+      push_front(st, st.protected_, i);
+    } else if (!s.referenced) {
+      unlink(st, st.probation, i);
+      s.referenced = true;
+      push_front(st, st.probation, i);
+    } else {
+      unlink(st, st.probation, i);
+      s.hot = true;
+      if (st.protected_.size >= st.protected_cap) {
+        uint32_t demoted = st.protected_.tail;
+        unlink(st, st.protected_, demoted);
+        st.slots[demoted].hot = false;
+        push_front(st, st.probation, demoted);
+      }
+      push_front(st, st.protected_, i);
+    }
+
+    s.refs.fetch_add(1, std::memory_order_relaxed);
+    stats_.hits.fetch_add(1, std::memory_order_relaxed);
+    return Ref(&s);
+  }
+
+  /**
+   * @brief Start loading a block in the background if it is not cached
+   *
+   * The read runs on the I/O pool for the file's device into the block's
+   * arena slot; the slot becomes visible to lookup() once the read has
+   * completed. Does nothing if the block is already cached or loading, if
+   * every slot in its stripe is busy, or if the device queue is full.
+   *
+   * @param key Block to load
+   * @param io Scheduler providing the device pools
+   * @param fd Source file; duplicated so the caller may close it at any time
+   * @param dev Device of the source file
+   * @param length Bytes in this block (short for the last block of a file)
+   */
+  void admit(const BlockKey &key, IoScheduler &io, int fd, dev_t dev,
+             size_t length) {
+    Stripe &st = stripe_for(key);
+    std::lock_guard<std::mutex> lock(st.mutex);
+    if (st.index.count(key) != 0) {
+      return;
+    }
+    reap_fills(st);
+
+    uint32_t i = take_slot(st);
+    if (i == NIL) {
+      return;
+    }
+    Slot &s = st.slots[i];
+    s.fill_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (s.fill_fd < 0) {
+      st.free.push_back(i);
+      return;
+    }
+    s.key = key;
+    s.length = length;
+    if (!io.read_into(s.fill, s.fill_fd, dev, key.index * BLOCK_SIZE, length,
+                      s.data)) {
+      close(s.fill_fd);
+      s.fill_fd = -1;
+      st.free.push_back(i);
+      return;
+    }
+    s.state = State::FILLING;
+    st.index.emplace(key, i);
+    st.filling.push_back(i);
+  }
+
+  const Stats &stats() const { return stats_; }
+  size_t capacity() const { return arena_size_; }
+  bool huge_pages() const { return huge_pages_; }
+};
@@ -0,0 +1,358 @@
+/**
+ * @file deadlines.h
+ * @brief Per-connection deadlines kept in a hierarchical timing wheel
+ *
+ * Each client thread blocks in recv() or sendfile() on its own socket, so a
+ * client that never finishes its request or stops reading would hold the
+ * thread forever. Every connection therefore carries one deadline at a time:
+ *
+ *   IDLE      from accept until the first request byte
+ *   HEADER    from the first request byte until the head is complete
+ *   TRANSFER  while the response is sent: every window, at least
+ *             min_send_rate bytes per second must have gone out
+ *
+ * Deadlines live in a TimerWheel owned by one reaper thread. Scheduling and
+ * cancelling are O(1) list operations under one mutex, and expiring a
+ * deadline calls shutdown() on the socket, which wakes the blocked thread.
+ * The reaper sleeps until the next occupied slot of the wheel, or until a
+ * deadline is scheduled when there are none. It calls shutdown() after
+ * releasing the mutex; the handler still owns and closes its descriptor, and
+ * cancels its deadline first, which waits out a shutdown() in progress, so
+ * one can never hit a reused descriptor.
+ */
+
+#pragma once
+
+#include "metrics.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <sys/socket.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Hashed hierarchical timing wheel with intrusive timers
+ *
+ * LEVELS wheels of SLOTS slots each; level L slots are SLOTS^L ticks wide, so
+ * four levels of 64 cover 2^24 ticks. A timer is placed on the lowest level
+ * whose range holds its expiry and moves down a level each time the wheel
+ * above it turns over (cascading), as in the classic Linux timer wheel.
+ * Timers further out than the wheel covers are clamped to its range.
+ *
+ * Not thread-safe; the owner serializes access.
+ */
+class TimerWheel {
+public:
+  static constexpr unsigned SLOT_BITS = 6;
+  static constexpr unsigned SLOTS = 1u << SLOT_BITS;
+  static constexpr unsigned LEVELS = 4;
+  static constexpr uint64_t MAX_TICKS = (1ULL << (SLOT_BITS * LEVELS)) - 1;
+
+  /**
+   * @brief List node embedded in whatever is being timed
+   */
+  struct Timer {
+    Timer *prev = nullptr; ///< Null while not scheduled
+    Timer *next = nullptr;
+    uint64_t expires = 0; ///< Tick
+
+    bool scheduled() const { return prev != nullptr; }
+  };
+
+  /**
+   * @param now Current tick
+   */
+  explicit TimerWheel(uint64_t now) : now_(now) {
+    for (auto &level : slots_) {
+      for (Timer &head : level) {
+        head.prev = head.next = &head;
+      }
+    }
+  }
+
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  uint64_t now() const { return now_; }
+
+  /**
+   * @brief Earliest tick at which advance() may have work, UINT64_MAX if no
+   *        timer is scheduled
+   *
+   * For a timer on an upper level that is the tick its slot is cascaded,
+   * which can be before it expires.
+   */
+  uint64_t next_event() const {
+    uint64_t next = UINT64_MAX;
+    for (unsigned level = 0; level < LEVELS; level++) {
+      unsigned shift = SLOT_BITS * level;
+      // Slots are visited in turn from the one after the current position
+      uint64_t base = (now_ >> shift) + 1;
+      for (unsigned n = 0; n < SLOTS; n++) {
+        uint64_t slot = base + n;
+        const Timer &head = slots_[level][slot & (SLOTS - 1)];
+        if (head.next != &head) {
+          next = std::min(next, slot << shift);
+          break;
+        }
+      }
+    }
+    return next;
+  }
+
+  /**
+   * @brief (Re)schedule a timer; an expiry not after now() fires next tick
+   */
+  void schedule(Timer &t, uint64_t expires) {
+    cancel(t);
+    t.expires = std::min(std::max(expires, now_ + 1), now_ + MAX_TICKS);
+    place(t);
+  }
+
+  void cancel(Timer &t) {
+    if (!t.scheduled()) {
+      return;
+    }
+    t.prev->next = t.next;
+    t.next->prev = t.prev;
+    t.prev = t.next = nullptr;
+  }
+
+  /**
+   * @brief Move time forward, calling on_expire(Timer &) for every timer due
+   *
+   * Timers are unscheduled before on_expire runs, which may schedule them
+   * again.
+   */
+  template <typename Fn> void advance(uint64_t to, Fn on_expire) {
+    while (now_ < to) {
+      now_++;
+      // Bring timers down from every level that has just turned over
+      for (unsigned level = 1; level < LEVELS; level++) {
+        if ((now_ & ((1ULL << (SLOT_BITS * level)) - 1)) != 0) {
+          break;
+        }
+        Timer &head = slots_[level][index(now_, level)];
+        while (head.next != &head) {
+          Timer &t = *head.next;
+          cancel(t);
+          place(t);
+        }
+      }
+      Timer &head = slots_[0][index(now_, 0)];
+      while (head.next != &head) {
+        Timer &t = *head.next;
+        cancel(t);
+        on_expire(t);
+      }
+    }
+  }
+
+private:
+  Timer slots_[LEVELS][SLOTS]; ///< List heads
+  uint64_t now_;
+
+  static size_t index(uint64_t tick, unsigned level) {
+    return (tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+  }
+
+  void place(Timer &t) {
+    uint64_t delta = t.expires > now_ ? t.expires - now_ : 0;
+    unsigned level = 0;
+    while (level + 1 < LEVELS && delta >= (1ULL << (SLOT_BITS * (level + 1)))) {
+      level++;
+    }
+    Timer &head = slots_[level][index(t.expires, level)];
+    t.prev = head.prev;
+    t.next = &head;
+    head.prev->next = &t;
+    head.prev = &t;
+  }
+};
+
+/**
+ * @brief Timeouts applied to client connections; 0 disables each one
+ */
+struct DeadlineConfig {
+  unsigned idle_timeout_ms = 30000;   ///< Accept to first request byte
+  unsigned header_timeout_ms = 10000; ///< First request byte to complete head
+  uint64_t min_send_rate = 256;       ///< Bytes per second while sending
+  unsigned send_window_ms = 30000;    ///< Period min_send_rate is checked over
+
+  bool enabled() const {
+    return idle_timeout_ms != 0 || header_timeout_ms != 0 ||
+           min_send_rate != 0;
+  }
+};
+
+/**
+ * @brief Reaper thread enforcing DeadlineConfig on client connections
+ */
+class Deadlines {
+public:
+  static constexpr uint64_t TICK_NS = 10000000; ///< Wheel resolution
+
+  enum Kind { NONE, IDLE, HEADER, TRANSFER, NUM_KINDS };
+
+  /**
+   * @brief One connection's deadline, owned by its handler thread
+   */
+  struct Entry : TimerWheel::Timer {
+    int fd = -1;
+    Kind kind = NONE;
+    bool reaping = false; ///< The reaper is shutting fd down, unlocked
+    std::atomic<Kind> expired{NONE};    ///< Which deadline was missed, if any
+    std::atomic<uint64_t> progress{0};  ///< Bytes sent, kept by the handler
+    uint64_t window_progress = 0;       ///< progress when the window began
+  };
+
+  struct Stats {
+    std::atomic<uint64_t> expired[NUM_KINDS] = {}; ///< Connections reaped
+  };
+
+  explicit Deadlines(const DeadlineConfig &config)
+      : config_(config), wheel_(tick_of(metrics::now_ns())),
+        reaper_(&Deadlines::run, this) {}
+
+  ~Deadlines() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_cv_.notify_one();
+    reaper_.join();
+  }
+
+  Deadlines(const Deadlines &) = delete;
+  Deadlines &operator=(const Deadlines &) = delete;
+
+  /**
+   * @brief Start timing a new connection, which must send a request byte
+   *        within idle_timeout_ms of being accepted
+   */
+  void start_idle(Entry &e, int fd, uint64_t accepted_ns) {
+    e.fd = fd;
+    arm(e, IDLE, accepted_ns, config_.idle_timeout_ms);
+  }
+
+  /// The first request byte arrived at now_ns; the rest of the head is due
+  void start_header(Entry &e, uint64_t now_ns) {
+    arm(e, HEADER, now_ns, config_.header_timeout_ms);
+  }
+
+  /// Response headers were sent at now_ns; the body must keep moving
+  void start_transfer(Entry &e, uint64_t now_ns) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    e.window_progress = e.progress.load(std::memory_order_relaxed);
+    schedule(e, config_.min_send_rate != 0 ? TRANSFER : NONE, now_ns,
+             config_.send_window_ms);
+  }
+
+  /**
+   * @brief Stop timing the connection; call before closing its descriptor
+   *
+   * Waits for a shutdown() the reaper is making on it to return.
+   */
+  void cancel(Entry &e) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    reaped_cv_.wait(lock, [&e] { return !e.reaping; });
+    wheel_.cancel(e);
+    e.kind = NONE;
+  }
+
+  const Stats &stats() const { return stats_; }
+
+private:
+  DeadlineConfig config_;
+  Stats stats_;
+  std::mutex mutex_;
+  std::condition_variable wake_cv_;   ///< Wakes the reaper early
+  std::condition_variable reaped_cv_; ///< Signals the end of a reaping round
+  bool stopping_ = false;
+  uint64_t wake_tick_ = 0;            ///< When the reaper will next look
+  std::vector<std::pair<Entry *, int>> reaping_; ///< Sockets to shut down
+                                                 ///< this round, and how
+  TimerWheel wheel_;
+  std::thread reaper_;
+
+  static uint64_t tick_of(uint64_t ns) { return ns / TICK_NS; }
+
+  void arm(Entry &e, Kind kind, uint64_t from_ns, unsigned timeout_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    schedule(e, timeout_ms != 0 ? kind : NONE, from_ns, timeout_ms);
+  }
+
+  void schedule(Entry &e, Kind kind, uint64_t from_ns, unsigned timeout_ms) {
+    e.kind = kind;
+    if (kind == NONE) {
+      wheel_.cancel(e);
+      return;
+    }
+    uint64_t due = from_ns + timeout_ms * 1000000ULL;
+    wheel_.schedule(e, (due + TICK_NS - 1) / TICK_NS);
+    if (e.expires < wake_tick_) {
+      wake_tick_ = e.expires;
+      wake_cv_.notify_one();
+    }
+  }
+
+  /// Called with mutex_ held
+  void expire(Entry &e) {
+    if (e.kind == TRANSFER) {
+      uint64_t progress = e.progress.load(std::memory_order_relaxed);
+      uint64_t required = config_.min_send_rate * config_.send_window_ms / 1000;
+      if (progress - e.window_progress >= required) {
+        // Fast enough; check the next window
+        e.window_progress = progress;
+        schedule(e, TRANSFER, wheel_.now() * TICK_NS, config_.send_window_ms);
+        return;
+      }
+    }
+    // Published first: the handler looks at it as soon as it wakes. The
+    // socket is shut down once the mutex is released; a request head cut
+    // short still gets a 408, so then only the reading is stopped.
+    e.expired.store(e.kind, std::memory_order_relaxed);
+    e.reaping = true;
+    reaping_.emplace_back(&e, e.kind == HEADER ? SHUT_RD : SHUT_RDWR);
+    stats_.expired[e.kind].fetch_add(1, std::memory_order_relaxed);
+    e.kind = NONE;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      wheel_.advance(tick_of(metrics::now_ns()), [this](TimerWheel::Timer &t) {
+        expire(static_cast<Entry &>(t));
+      });
+      if (!reaping_.empty()) {
+        // The descriptors stay open: their handlers wait in cancel() until
+        // we are done
+        lock.unlock();
+        for (const auto &[e, how] : reaping_) {
+          shutdown(e->fd, how);
+        }
+        lock.lock();
+        for (const auto &reaped : reaping_) {
+          reaped.first->reaping = false;
+        }
+        reaping_.clear();
+        reaped_cv_.notify_all();
+      }
+
+      wake_tick_ = wheel_.next_event();
+      if (wake_tick_ == UINT64_MAX) {
+        wake_cv_.wait(lock);
+      } else {
+        uint64_t now = metrics::now_ns();
+        uint64_t wake_ns = wake_tick_ * TICK_NS;
+        wake_cv_.wait_for(lock, std::chrono::nanoseconds(
+                                    wake_ns > now ? wake_ns - now : 0));
+      }
+    }
+  }
+};
@@ -0,0 +1,308 @@
+/**
+ * @file egress.h
+ * @brief Egress bandwidth limits per connection, per client IP and overall
+ *
+ * Without limits one client pulling a large file at line rate can take the
+ * whole uplink. Three limits, each in bytes per second and 0 for none, can
+ * be set at startup and changed while connections are running:
+ *
+ *   connection  enforced by the kernel with SO_MAX_PACING_RATE, which TCP
+ *               paces itself (or the fq qdisc does, where installed); a
+ *               private token bucket takes over if the option is refused
+ *   client      one token bucket shared by every connection from an IP
+ *   global      one token bucket shared by every connection
+ *
+ * Senders ask their Flow for permission before each write and sleep when a
+ * bucket is empty, so a throttled transfer holds no more socket memory than
+ * an unthrottled one. Each Flow notices a change of limits on its next write
+ * and applies it to its own socket; no connection is interrupted.
+ */
+
+#pragma once
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sys/socket.h>
+#include <time.h>
+#include <unordered_map>
+
+/**
+ * @brief Egress limits in bytes per second; 0 disables each one
+ */
+struct EgressConfig {
+  uint64_t connection_rate = 0; ///< Per connection
+  uint64_t client_rate = 0;     ///< Per client IP, over all its connections
+  uint64_t global_rate = 0;     ///< Over all connections
+};
+
+/**
+ * @brief Thread-safe token bucket holding up to 100 ms of its rate
+ */
+class TokenBucket {
+public:
+  static constexpr uint64_t MIN_BURST = 64 * 1024; ///< Smallest capacity
+
+  /// 0 makes the bucket unlimited
+  void set_rate(uint64_t rate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    refill(metrics::now_ns());
+    rate_.store(rate, std::memory_order_relaxed);
+    tokens_ = std::min(tokens_, burst());
+  }
+
+  uint64_t rate() const { return rate_.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Take up to want tokens
+   * @param wait_ns Set, when nothing could be granted, to roughly how long
+   *        until a useful amount is available
+   * @return uint64_t Tokens granted, 0 if the bucket is empty
+   */
+  uint64_t take(uint64_t want, uint64_t now, uint64_t &wait_ns) {
+    if (rate() == 0) {
+      return want;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    refill(now);
+    uint64_t granted = std::min(want, tokens_);
+    tokens_ -= granted;
+    if (granted == 0) {
+      uint64_t rate = rate_.load(std::memory_order_relaxed);
+      uint64_t needed = std::min(want, burst() / 4);
+      wait_ns = std::max(wait_ns, static_cast<uint64_t>(
+                                      static_cast<unsigned __int128>(needed) *
+                                      1000000000 / rate));
+    }
+    return granted;
+  }
+
+  /// Return tokens that were taken but not used
+  void refund(uint64_t n) {
+    if (rate() == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    tokens_ = std::min(tokens_ + n, burst());
+  }
+
+private:
+  std::mutex mutex_;
+  std::atomic<uint64_t> rate_{0};
+  uint64_t tokens_ = UINT64_MAX; ///< Clamped to burst() on first refill
+  uint64_t last_ns_ = 0;
+
+  uint64_t burst() const {
+    return std::max(rate_.load(std::memory_order_relaxed) / 10, MIN_BURST);
+  }
+
+  void refill(uint64_t now) {
+    if (last_ns_ != 0 && now > last_ns_) {
+      uint64_t elapsed = std::min<uint64_t>(now - last_ns_, 1000000000);
+      uint64_t added = static_cast<unsigned __int128>(elapsed) *
+                       rate_.load(std::memory_order_relaxed) / 1000000000;
+      tokens_ = std::min(tokens_ + added, UINT64_MAX - 1);
+    }
+    tokens_ = std::min(tokens_, burst());
+    last_ns_ = now;
+  }
+};
+
+/**
+ * @brief Server-wide egress limits and the buckets shared between flows
+ */
+class EgressShaper {
+  struct ClientEntry;
+
+public:
+  static constexpr uint64_t MIN_SLEEP_NS = 1000000;   ///< 1 ms
+  static constexpr uint64_t MAX_SLEEP_NS = 100000000; ///< 100 ms, so changes
+                                                      ///< apply promptly
+
+  struct Stats {
+    std::atomic<uint64_t> throttles{0};   ///< Sleeps waiting for tokens
+    std::atomic<uint64_t> throttled_ns{0}; ///< Time spent in them
+  };
+
+  /**
+   * @param config Initial limits
+   * @param base_pacing SO_MAX_PACING_RATE connections inherit from their
+   *        listener, restored when the connection limit is lifted; 0 = none
+   */
+  EgressShaper(const EgressConfig &config, uint64_t base_pacing)
+      : base_pacing_(base_pacing) {
+    set_config(config);
+  }
+
+  EgressShaper(const EgressShaper &) = delete;
+  EgressShaper &operator=(const EgressShaper &) = delete;
+
+  /**
+   * @brief Change the limits; running flows pick them up on their next write
+   */
+  void set_config(const EgressConfig &config) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    config_ = config;
+    global_.set_rate(config.global_rate);
+    for (auto &entry : clients_) {
+      entry.second.bucket.set_rate(config.client_rate);
+    }
+    generation_.fetch_add(1, std::memory_order_release);
+  }
+
+  EgressConfig config() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return config_;
+  }
+
+  /// Client IPs with a bucket, i.e. with connections while client_rate is set
+  size_t clients() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return clients_.size();
+  }
+
+  const Stats &stats() const { return stats_; }
+
+  /**
+   * @brief One connection's view of the limits, owned by its thread
+   */
+  class Flow {
+  public:
+    /**
+     * @param fd Client socket, paced directly for the connection limit
+     * @param ip Client IPv4 address, keying its shared bucket
+     */
+    Flow(EgressShaper &shaper, int fd, uint32_t ip)
+        : shaper_(shaper), fd_(fd), ip_(ip) {}
+
+    ~Flow() { detach_client(); }
+
+    Flow(const Flow &) = delete;
+    Flow &operator=(const Flow &) = delete;
+
+    /**
+     * @brief Wait until some of want bytes may be sent
+     * @param slept_ns Increased by the time spent waiting
+     * @return uint64_t Bytes that may be sent now, between 1 and want
+     */
+    uint64_t acquire(uint64_t want, uint64_t &slept_ns) {
+      while (true) {
+        unsigned generation =
+            shaper_.generation_.load(std::memory_order_acquire);
+        if (generation != generation_) {
+          generation_ = generation;
+          apply(shaper_.config());
+        }
+        uint64_t now = metrics::now_ns();
+        uint64_t wait_ns = 0;
+        uint64_t granted = own_.take(want, now, wait_ns);
+        if (granted > 0 && client_ != nullptr) {
+          uint64_t got = client_->bucket.take(granted, now, wait_ns);
+          own_.refund(granted - got);
+          granted = got;
+        }
+        if (granted > 0) {
+          uint64_t got = shaper_.global_.take(granted, now, wait_ns);
+          refund_local(granted - got);
+          granted = got;
+        }
+        if (granted > 0) {
+          return granted;
+        }
+        wait_ns = std::clamp(wait_ns, MIN_SLEEP_NS, MAX_SLEEP_NS);
+        timespec pause = {static_cast<time_t>(wait_ns / 1000000000),
+                          static_cast<long>(wait_ns % 1000000000)};
+        nanosleep(&pause, nullptr);
+        uint64_t slept = metrics::now_ns() - now;
+        slept_ns += slept;
+        shaper_.stats_.throttles.fetch_add(1, std::memory_order_relaxed);
+        shaper_.stats_.throttled_ns.fetch_add(slept,
+                                              std::memory_order_relaxed);
+      }
+    }
+
+    /**
+     * @brief Give back what acquire() granted but the write did not use
+     */
+    void refund(uint64_t unused) {
+      if (unused == 0) {
+        return;
+      }
+      refund_local(unused);
+      shaper_.global_.refund(unused);
+    }
+
+  private:
+    EgressShaper &shaper_;
+    int fd_;
+    uint32_t ip_;
+    unsigned generation_ = 0; ///< Limits last applied; 0 = never
+    ClientEntry *client_ = nullptr;
+    TokenBucket own_;         ///< Connection limit, if the kernel refused it
+    uint64_t paced_rate_ = 0; ///< Connection limit set on the socket, 0 = none
+
+    void refund_local(uint64_t unused) {
+      own_.refund(unused);
+      if (client_ != nullptr) {
+        client_->bucket.refund(unused);
+      }
+    }
+
+    void apply(const EgressConfig &config) {
+      if (config.connection_rate != paced_rate_ ||
+          (config.connection_rate != 0 && own_.rate() != 0)) {
+        // The tighter of our limit and the socket profile's, or none at all
+        uint64_t rate = config.connection_rate;
+        if (shaper_.base_pacing_ != 0) {
+          rate = rate == 0 ? shaper_.base_pacing_
+                           : std::min(rate, shaper_.base_pacing_);
+        }
+        if (rate == 0) {
+          rate = UINT64_MAX;
+        }
+        bool paced = setsockopt(fd_, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+                                sizeof(rate)) == 0;
+        paced_rate_ = config.connection_rate;
+        own_.set_rate(paced ? 0 : config.connection_rate);
+      }
+      if (config.client_rate != 0 && client_ == nullptr) {
+        std::lock_guard<std::mutex> lock(shaper_.mutex_);
+        client_ = &shaper_.clients_[ip_];
+        if (client_->refs++ == 0) {
+          client_->bucket.set_rate(shaper_.config_.client_rate);
+        }
+      } else if (config.client_rate == 0) {
+        detach_client();
+      }
+    }
+
+    void detach_client() {
+      if (client_ == nullptr) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(shaper_.mutex_);
+      if (--client_->refs == 0) {
+        shaper_.clients_.erase(ip_);
+      }
+      client_ = nullptr;
+    }
+  };
+
+private:
+  struct ClientEntry {
+    TokenBucket bucket;
+    unsigned refs = 0; ///< Flows using the bucket
+  };
+
+  mutable std::mutex mutex_; ///< Guards config_ and clients_
+  EgressConfig config_;
+  uint64_t base_pacing_;
+  std::atomic<unsigned> generation_{0}; ///< Bumped by set_config()
+  TokenBucket global_;
+  std::unordered_map<uint32_t, ClientEntry> clients_;
+  Stats stats_;
+};
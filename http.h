@@ -0,0 +1,402 @@
+/**
+ * @file http.h
+ * @brief Minimal HTTP/1.1 request parsing and response formatting
+ *
+ * Only what the server needs: the request line, individual header lookup,
+ * request target normalization and single byte-range specifications. Parsed
+ * results are views into the caller's request buffer. Response heads are
+ * formatted into caller-provided buffers.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+/**
+ * @brief Parsed request line plus the headers the server acts on
+ *
+ * Every field is a view into the buffer passed to parse_request() and is only
+ * valid while that buffer is.
+ */
+struct HttpRequest {
+  std::string_view method;  ///< e.g. "GET"
+  std::string_view target;  ///< Request target as sent, e.g. "/index.html"
+  std::string_view version; ///< e.g. "HTTP/1.1"
+  std::string_view headers; ///< Raw header block, one "Name: value" per line
+  std::string_view range;   ///< Value of the Range header, empty if absent
+};
+
+/**
+ * @brief Case-insensitive ASCII comparison
+ */
+inline bool iequals(std::string_view a, std::string_view b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); i++) {
+    char x = a[i] >= 'A' && a[i] <= 'Z' ? a[i] + ('a' - 'A') : a[i];
+    char y = b[i] >= 'A' && b[i] <= 'Z' ? b[i] + ('a' - 'A') : b[i];
+    if (x != y) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Strip leading and trailing spaces and tabs
+ */
+inline std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+/**
+ * @brief Look up a header value by name (case-insensitive)
+ * @param headers Raw header block as stored in HttpRequest::headers
+ * @param name Header name without the colon
+ * @return std::string_view The trimmed value, or empty if not present
+ */
+inline std::string_view find_header(std::string_view headers,
+                                    std::string_view name) {
+  while (!headers.empty()) {
+    size_t eol = headers.find("\r\n");
+    std::string_view line = headers.substr(0, eol);
+    headers.remove_prefix(eol == std::string_view::npos ? headers.size()
+                                                         : eol + 2);
+
+    size_t colon = line.find(':');
+    if (colon != std::string_view::npos &&
+        iequals(line.substr(0, colon), name)) {
+      return trim(line.substr(colon + 1));
+    }
+  }
+  return {};
+}
+
+/**
+ * @brief Look up a query parameter of a request target
+ * @param target Request target, e.g. "/debug/profile?seconds=5"
+ * @param name Parameter name
+ * @return std::string_view The raw (not percent-decoded) value, or empty if
+ *         not present
+ */
+inline std::string_view find_query_param(std::string_view target,
+                                         std::string_view name) {
+  size_t q = target.find('?');
+  if (q == std::string_view::npos) {
+    return {};
+  }
+  std::string_view query = target.substr(q + 1, target.find('#') - q - 1);
+  while (!query.empty()) {
+    size_t amp = query.find('&');
+    std::string_view pair = query.substr(0, amp);
+    query.remove_prefix(amp == std::string_view::npos ? query.size() : amp + 1);
+
+    size_t eq = pair.find('=');
+    if (pair.substr(0, eq) == name) {
+      return eq == std::string_view::npos ? std::string_view{}
+                                          : pair.substr(eq + 1);
+    }
+  }
+  return {};
+}
+
+/**
+ * @brief Parse the request line and headers of an HTTP request
+ * @param raw Request bytes, at least up to the end of the request line
+ * @param req Receives the parsed fields
+ * @return false if the request line is malformed
+ */
+inline bool parse_request(std::string_view raw, HttpRequest &req) {
+  size_t eol = raw.find("\r\n");
+  if (eol == std::string_view::npos) {
+    return false;
+  }
+  std::string_view line = raw.substr(0, eol);
+
+  size_t sp1 = line.find(' ');
+  size_t sp2 = sp1 == std::string_view::npos ? sp1 : line.find(' ', sp1 + 1);
+  if (sp1 == 0 || sp2 == std::string_view::npos || sp2 == sp1 + 1) {
+    return false;
+  }
+  req.method = line.substr(0, sp1);
+  req.target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+  req.version = line.substr(sp2 + 1);
+
+  std::string_view rest = raw.substr(eol + 2);
+  size_t end = rest.find("\r\n\r\n");
+  req.headers = rest.substr(0, end == std::string_view::npos ? rest.size()
+                                                              : end + 2);
+  req.range = find_header(req.headers, "Range");
+  return true;
+}
+
+/**
+ * @brief Value of a hexadecimal digit, or -1
+ */
+inline int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/**
+ * @brief Turn a request target into a safe path relative to a document root
+ *
+ * Drops the query string, percent-decodes, collapses empty and "." segments
+ * and rejects any ".." segment or control character (raw or encoded), so
+ * the result can never escape the root it is appended to nor smuggle a line
+ * break into a header built from it.
+ *
+ * @param target Request target, e.g. "/videos/a%20b.mp4?x=1"
+ * @param out Receives the relative path, e.g. "videos/a b.mp4"
+ * @return false if the target is not an origin-form path or is unsafe
+ */
+template <typename String>
+inline bool normalize_target(std::string_view target, String &out) {
+  target = target.substr(0, target.find_first_of("?#"));
+  if (target.empty() || target.front() != '/') {
+    return false;
+  }
+
+  out.clear();
+  size_t segment = 0; // Start of the current segment in out
+  for (size_t i = 1; i <= target.size(); i++) {
+    if (i == target.size() || target[i] == '/') {
+      std::string_view seg(out.data() + segment, out.size() - segment);
+      if (seg == "..") {
+        return false;
+      }
+      if (seg.empty() || seg == ".") {
+        out.resize(segment);
+      } else if (i < target.size()) {
+        out += '/';
+        segment = out.size();
+      }
+      continue;
+    }
+
+    char c = target[i];
+    if (c == '%') {
+      int hi = i + 2 < target.size() ? hex_value(target[i + 1]) : -1;
+      int lo = hi >= 0 ? hex_value(target[i + 2]) : -1;
+      if (lo < 0) {
+        return false;
+      }
+      c = static_cast<char>(hi * 16 + lo);
+      i += 2;
+      if (c == '/') {
+        return false; // An encoded slash would hide a segment boundary
+      }
+    }
+    if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+      return false;
+    }
+    out += c;
+  }
+  if (!out.empty() && out.back() == '/') {
+    out.pop_back();
+  }
+  return true;
+}
+
+/**
+ * @brief Turn a path from normalize_target() back into an origin-form target
+ *
+ * Percent-encodes every byte outside the unreserved and sub-delimiter
+ * characters RFC 3986 allows in a path, so equal paths always produce the
+ * same target and nothing else reaches the request line.
+ *
+ * @param path Relative path, e.g. "videos/a b.mp4"
+ * @return std::string The target, e.g. "/videos/a%20b.mp4"
+ */
+inline std::string encode_target(std::string_view path) {
+  static constexpr char HEX[] = "0123456789ABCDEF";
+  std::string out = "/";
+  for (char c : path) {
+    unsigned char u = static_cast<unsigned char>(c);
+    if ((u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z') ||
+        (u >= '0' && u <= '9') ||
+        (u != 0 && strchr("-._~!$&'()*+,;=:@/", u) != nullptr)) {
+      out += c;
+    } else {
+      out += '%';
+      out += HEX[u >> 4];
+      out += HEX[u & 15];
+    }
+  }
+  return out;
+}
+
+/**
+ * @brief Outcome of interpreting a Range header against a file size
+ */
+enum class RangeStatus {
+  NONE,          ///< No usable range; serve the whole representation
+  SATISFIABLE,   ///< Serve the returned slice with 206 Partial Content
+  UNSATISFIABLE, ///< Respond 416 Range Not Satisfiable
+};
+
+/**
+ * @brief Parse a decimal number, rejecting empty input and overflow
+ */
+inline bool parse_offset(std::string_view s, off_t &out) {
+  if (s.empty()) {
+    return false;
+  }
+  uint64_t n = 0;
+  for (char c : s) {
+    if (c < '0' || c > '9' || n > (UINT64_MAX - 9) / 10) {
+      return false;
+    }
+    n = n * 10 + (c - '0');
+  }
+  if (n > static_cast<uint64_t>(INT64_MAX)) {
+    return false;
+  }
+  out = static_cast<off_t>(n);
+  return true;
+}
+
+/**
+ * @brief Interpret a Range header value against a representation size
+ *
+ * Supports a single "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+ * range. Multiple ranges and malformed values are ignored (the whole
+ * representation is served), which RFC 9110 permits.
+ *
+ * @param value Range header value
+ * @param size Size of the representation in bytes
+ * @param start Receives the first byte of the slice
+ * @param length Receives the slice length
+ * @return RangeStatus How the request should be answered
+ */
+inline RangeStatus parse_range(std::string_view value, off_t size,
+                               off_t &start, off_t &length) {
+  constexpr std::string_view unit = "bytes=";
+  if (value.size() < unit.size() || !iequals(value.substr(0, 6), unit)) {
+    return RangeStatus::NONE;
+  }
+  std::string_view spec = trim(value.substr(unit.size()));
+  size_t dash = spec.find('-');
+  if (dash == std::string_view::npos ||
+      spec.find(',') != std::string_view::npos) {
+    return RangeStatus::NONE;
+  }
+  std::string_view first = trim(spec.substr(0, dash));
+  std::string_view last = trim(spec.substr(dash + 1));
+
+  off_t a = 0;
+  off_t b = 0;
+  if (first.empty()) {
+    // Suffix range: the final N bytes
+    if (!parse_offset(last, b)) {
+      return RangeStatus::NONE;
+    }
+    if (b == 0 || size == 0) {
+      return RangeStatus::UNSATISFIABLE;
+    }
+    start = b >= size ? 0 : size - b;
+    length = size - start;
+    return RangeStatus::SATISFIABLE;
+  }
+
+  if (!parse_offset(first, a) || (!last.empty() && !parse_offset(last, b)) ||
+      (!last.empty() && b < a)) {
+    return RangeStatus::NONE;
+  }
+  if (a >= size) {
+    return RangeStatus::UNSATISFIABLE;
+  }
+  start = a;
+  length = (last.empty() || b >= size ? size - 1 : b) - a + 1;
+  return RangeStatus::SATISFIABLE;
+}
+
+/**
+ * @brief Clamp an snprintf() result to what was actually written
+ */
+inline size_t formatted_length(int n, size_t cap) {
+  if (n < 0 || cap == 0) {
+    return 0;
+  }
+  return static_cast<size_t>(n) < cap ? static_cast<size_t>(n) : cap - 1;
+}
+
+/**
+ * @brief Format "HTTP/1.1 <code> <text>\r\n"
+ * @return Bytes written to buf, truncated to fit cap
+ */
+inline size_t format_status_line(char *buf, size_t cap, int status_code,
+                                 std::string_view status_text) {
+  return formatted_length(snprintf(buf, cap, "HTTP/1.1 %d %.*s\r\n",
+                                   status_code,
+                                   static_cast<int>(status_text.size()),
+                                   status_text.data()),
+                          cap);
+}
+
+/**
+ * @brief Format the headers that frame a response and end its head
+ *
+ * Content-Length is only included for a non-empty body; every response is
+ * followed by closing the connection.
+ *
+ * @return Bytes written to buf, truncated to fit cap
+ */
+inline size_t format_framing(char *buf, size_t cap, size_t body_length) {
+  size_t len = 0;
+  if (body_length > 0) {
+    len = formatted_length(
+        snprintf(buf, cap, "Content-Length: %zu\r\n", body_length), cap);
+  }
+  return len + formatted_length(snprintf(buf + len, cap - len,
+                                         "Connection: close\r\n\r\n"),
+                                cap - len);
+}
+
+/**
+ * @brief Format the headers describing a file body
+ * @param start First byte sent
+ * @param length Bytes sent
+ * @param size Size of the whole file
+ * @param partial Add Content-Range, for a 206 response
+ * @return Bytes written to buf, truncated to fit cap
+ */
+inline size_t format_content_headers(char *buf, size_t cap, off_t start,
+                                     off_t length, off_t size, bool partial) {
+  size_t len = formatted_length(
+      snprintf(buf, cap,
+               "Content-Length: %lld\r\n"
+               "Content-Type: application/octet-stream\r\n"
+               "Accept-Ranges: bytes\r\n",
+               static_cast<long long>(length)),
+      cap);
+  if (partial) {
+    len += formatted_length(snprintf(buf + len, cap - len,
+                                     "Content-Range: bytes %lld-%lld/%lld\r\n",
+                                     static_cast<long long>(start),
+                                     static_cast<long long>(start + length - 1),
+                                     static_cast<long long>(size)),
+                            cap - len);
+  }
+  return len;
+}
@@ -0,0 +1,325 @@
+/**
+ * @file io_pool.h
+ * @brief Per-device disk I/O thread pools
+ *
+ * sendfile() blocks the calling thread whenever it touches a page that is not
+ * in the page cache. These pools pull the next range of a transfer into the
+ * page cache on a dedicated thread while the current range is on the wire, so
+ * disk reads overlap network sends and a slow device only delays the
+ * transfers that actually read from it.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <fcntl.h>
+#include <linux/ioprio.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * @brief Tuning for the pool that serves one block device
+ */
+struct IoPoolConfig {
+  unsigned threads = 2;     ///< Worker threads reading from the device
+  unsigned queue_depth = 8; ///< Max prefetches queued or in flight
+  int io_class = IOPRIO_CLASS_BE; ///< ioprio class of the worker threads
+  int io_level = IOPRIO_NORM;     ///< ioprio level within the class (0-7)
+};
+
+/**
+ * @brief Parse an ioprio specification such as "be", "be/4", "rt/0" or "idle"
+ * @param spec Class name, optionally followed by "/level"
+ * @param cfg Pool configuration to update
+ * @return true if the specification was valid
+ */
+inline bool parse_io_class(const std::string &spec, IoPoolConfig &cfg) {
+  std::string name = spec.substr(0, spec.find('/'));
+  int level = IOPRIO_NORM;
+  if (name.size() < spec.size()) {
+    std::string digits = spec.substr(name.size() + 1);
+    if (digits.size() != 1 || digits[0] < '0' || digits[0] > '7') {
+      return false;
+    }
+    level = digits[0] - '0';
+  }
+
+  if (name == "rt") {
+    cfg.io_class = IOPRIO_CLASS_RT;
+  } else if (name == "be") {
+    cfg.io_class = IOPRIO_CLASS_BE;
+  } else if (name == "idle") {
+    cfg.io_class = IOPRIO_CLASS_IDLE;
+    level = 0; // The idle class has no levels
+  } else {
+    return false;
+  }
+  cfg.io_level = level;
+  return true;
+}
+
+/**
+ * @brief A single range to be pulled into the page cache
+ *
+ * Owned by the caller (typically on the stack of the transfer loop, or inside
+ * a cache slot). The pool only holds a pointer while the request is pending,
+ * so the destructor waits for completion before the storage can go away.
+ */
+class IoRequest {
+  friend class IoPool;
+
+  int fd_ = -1;
+  off_t offset_ = 0;
+  size_t length_ = 0;
+  char *dest_ = nullptr;      ///< Read into this buffer instead of scratch
+  ssize_t result_ = 0;        ///< Bytes read, or -errno on failure
+  IoRequest *next_ = nullptr; ///< Intrusive link in the pool queue
+
+  std::mutex mutex_;
+  std::condition_variable done_cv_;
+  bool pending_ = false;
+
+  void complete() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ = false;
+    done_cv_.notify_all();
+  }
+
+public:
+  IoRequest() = default;
+  IoRequest(const IoRequest &) = delete;
+  IoRequest &operator=(const IoRequest &) = delete;
+
+  ~IoRequest() { wait(); }
+
+  /**
+   * @brief Block until the pool has finished with this request
+   */
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return !pending_; });
+  }
+
+  /**
+   * @brief Check for completion without blocking
+   */
+  bool done() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !pending_;
+  }
+
+  /**
+   * @brief Bytes read by the last completed request, or -errno on failure
+   */
+  ssize_t result() const { return result_; }
+};
+
+/**
+ * @brief Worker threads and a bounded queue for one block device
+ */
+class IoPool {
+  static constexpr size_t SCRATCH_SIZE = 1024 * 1024; ///< Per-worker buffer
+
+  IoPoolConfig cfg_;
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  IoRequest *head_ = nullptr; ///< Oldest queued request
+  IoRequest *tail_ = nullptr; ///< Newest queued request
+  unsigned outstanding_ = 0;  ///< Queued plus in-flight requests
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+
+  void run() {
+    int prio = IOPRIO_PRIO_VALUE(cfg_.io_class, cfg_.io_level);
+    // With who == 0 the kernel applies the priority to the calling thread only
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio) < 0) {
+      perror("Warning: ioprio_set() failed for disk I/O thread");
+    }
+
+    std::vector<char> scratch(SCRATCH_SIZE);
+    while (IoRequest *req = next()) {
+      fill(*req, scratch);
+      req->complete();
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      outstanding_--;
+    }
+  }
+
+  IoRequest *next() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    work_cv_.wait(lock, [this] { return stopping_ || head_ != nullptr; });
+    if (head_ == nullptr) {
+      return nullptr;
+    }
+    IoRequest *req = head_;
+    head_ = req->next_;
+    if (head_ == nullptr) {
+      tail_ = nullptr;
+    }
+    return req;
+  }
+
+  /**
+   * @brief Read the requested range so it ends up in the page cache
+   *
+   * readahead() lets the block layer see the whole range at once but may
+   * return before the I/O completes, so the range is then read through a
+   * scratch buffer (or the caller's destination) to make completion mean
+   * "resident".
+   */
+  static void fill(IoRequest &req, std::vector<char> &scratch) {
+    readahead(req.fd_, req.offset_, req.length_);
+
+    off_t pos = req.offset_;
+    off_t end = req.offset_ + static_cast<off_t>(req.length_);
+    req.result_ = 0;
+    while (pos < end) {
+      size_t want = static_cast<size_t>(end - pos);
+      char *buf = req.dest_ + (pos - req.offset_);
+      if (req.dest_ == nullptr) {
+        want = std::min(scratch.size(), want);
+        buf = scratch.data();
+      }
+      ssize_t got = pread(req.fd_, buf, want, pos);
+      if (got <= 0) {
+        if (got < 0 && errno == EINTR) {
+          continue;
+        }
+        if (got < 0) {
+          req.result_ = -errno;
+        }
+        return; // EOF or a real error; sendfile() will report it
+      }
+      pos += got;
+      req.result_ += got;
+    }
+  }
+
+public:
+  explicit IoPool(const IoPoolConfig &cfg) : cfg_(cfg) {
+    for (unsigned i = 0; i < cfg_.threads; i++) {
+      workers_.emplace_back(&IoPool::run, this);
+    }
+  }
+
+  ~IoPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  IoPool(const IoPool &) = delete;
+  IoPool &operator=(const IoPool &) = delete;
+
+  /**
+   * @brief Queue a range for prefetching
+   * @param req Request to fill in; must not already be pending
+   * @param fd File to read from; must stay open until the request completes
+   * @param offset Start of the range
+   * @param length Length of the range in bytes
+   * @param dest Buffer of at least length bytes to read into, or nullptr to
+   *        only populate the page cache
+   * @return false if the device is at its queue depth (nothing was queued)
+   */
+  bool submit(IoRequest &req, int fd, off_t offset, size_t length,
+              char *dest = nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (workers_.empty() || outstanding_ >= cfg_.queue_depth) {
+      return false;
+    }
+    outstanding_++;
+
+    req.fd_ = fd;
+    req.offset_ = offset;
+    req.length_ = length;
+    req.dest_ = dest;
+    req.next_ = nullptr;
+    {
+      std::lock_guard<std::mutex> req_lock(req.mutex_);
+      req.pending_ = true;
+    }
+    if (tail_ != nullptr) {
+      tail_->next_ = &req;
+    } else {
+      head_ = &req;
+    }
+    tail_ = &req;
+
+    work_cv_.notify_one();
+    return true;
+  }
+};
+
+/**
+ * @brief Routes prefetches to a pool per block device
+ *
+ * Pools are created lazily the first time a device is seen, using either the
+ * per-device override registered with configure_device() or the defaults.
+ */
+class IoScheduler {
+  IoPoolConfig defaults_;
+  std::map<dev_t, IoPoolConfig> overrides_;
+  std::mutex mutex_;
+  std::map<dev_t, std::unique_ptr<IoPool>> pools_;
+
+public:
+  explicit IoScheduler(const IoPoolConfig &defaults) : defaults_(defaults) {}
+
+  /**
+   * @brief Override the pool configuration for one device
+   *
+   * Must be called before the first prefetch for that device.
+   */
+  void configure_device(dev_t dev, const IoPoolConfig &cfg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    overrides_[dev] = cfg;
+  }
+
+  /**
+   * @brief Get (creating if needed) the pool for a device
+   */
+  IoPool &pool_for(dev_t dev) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &pool = pools_[dev];
+    if (!pool) {
+      auto it = overrides_.find(dev);
+      pool = std::make_unique<IoPool>(it != overrides_.end() ? it->second
+                                                             : defaults_);
+    }
+    return *pool;
+  }
+
+  /**
+   * @brief Queue a prefetch on the pool for the file's device
+   * @return false if the range was not queued (pool disabled or full)
+   */
+  bool prefetch(IoRequest &req, int fd, dev_t dev, off_t offset,
+                size_t length) {
+    return pool_for(dev).submit(req, fd, offset, length);
+  }
+
+  /**
+   * @brief Queue a read of a file range into a buffer on the device's pool
+   * @return false if the read was not queued (pool disabled or full)
+   */
+  bool read_into(IoRequest &req, int fd, dev_t dev, off_t offset,
+                 size_t length, char *dest) {
+    return pool_for(dev).submit(req, fd, offset, length, dest);
+  }
+};
@@ -0,0 +1,307 @@
+/**
+ * @file listener.h
+ * @brief Socket options of the listening sockets and their connections
+ *
+ * A client of a one-request-per-connection server pays for the handshake on
+ * every request. Two listener options take some of that back:
+ *
+ *   TCP_DEFER_ACCEPT  the kernel completes the handshake but only queues the
+ *                     connection for accept() once request bytes arrive, so
+ *                     the acceptor and client threads never wake up for a
+ *                     connection that has nothing to read yet
+ *   TCP_FASTOPEN      clients holding a cookie from an earlier connection
+ *                     send the request in the SYN, which saves a round trip
+ *                     before the server sees it
+ *
+ * Fast Open also needs bit 2 of net.ipv4.tcp_fastopen, which the server
+ * checks at startup. Whether a connection's SYN carried data shows up in its
+ * TCP_INFO; the host's TcpExt counters tell why others did not.
+ *
+ * Each listener also has a SocketProfile: congestion control, Nagle, send
+ * buffer sizing, the unsent-data watermark and a pacing cap. They are set on
+ * the listening socket, and accepted sockets inherit them from it, so they
+ * cost no system calls per connection. TCP_NOTSENT_LOWAT matters most with
+ * thousands of bulk transfers: a blocking sendfile() only queues more once
+ * the unsent part of the send buffer drops below it, so data waits in the
+ * page cache rather than in socket memory, while what is in flight is still
+ * limited by the congestion window alone. A congestion control algorithm
+ * the kernel does not offer (its module is missing, or unprivileged use is
+ * not allowed) leaves the socket on the system default with a warning, so a
+ * preset naming BBR still starts on a host without it.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <system_error>
+#include <unistd.h>
+
+/**
+ * @brief Per-connection socket options, inherited from the listener
+ */
+struct SocketProfile {
+  std::string name = "default";  ///< Preset it started from
+  std::string congestion;        ///< TCP_CONGESTION, "" = system default
+  bool nodelay = false;          ///< TCP_NODELAY
+  int sndbuf = 0;                ///< SO_SNDBUF bytes, 0 = kernel autotuning
+  unsigned notsent_lowat = 0;    ///< TCP_NOTSENT_LOWAT bytes, 0 = unset
+  uint64_t max_pacing_rate = 0;  ///< SO_MAX_PACING_RATE bytes/s, 0 = none
+
+  /**
+   * @brief Look up a preset
+   *
+   *   default      kernel defaults
+   *   bulk         BBR, autotuned send buffer, 128 KiB unsent watermark:
+   *                large transfers at full rate with little socket memory
+   *   interactive  no Nagle delay, 16 KiB unsent watermark: small
+   *                responses such as /metrics go out at once
+   *
+   * @return false if name is not a preset
+   */
+  static bool preset(std::string_view name, SocketProfile &out) {
+    out = SocketProfile{};
+    out.name = name;
+    if (name == "bulk") {
+      out.congestion = "bbr";
+      out.notsent_lowat = 128 * 1024;
+    } else if (name == "interactive") {
+      out.nodelay = true;
+      out.notsent_lowat = 16 * 1024;
+    } else if (name != "default") {
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Summary for the startup banner, e.g. "bulk (bbr, lowat 131072)"
+   */
+  std::string describe() const {
+    std::string out;
+    auto add = [&out](const std::string &s) {
+      out += out.empty() ? "" : ", ";
+      out += s;
+    };
+    if (!congestion.empty()) {
+      add(congestion);
+    }
+    if (nodelay) {
+      add("nodelay");
+    }
+    add(sndbuf > 0 ? "sndbuf " + std::to_string(sndbuf) : "sndbuf auto");
+    if (notsent_lowat > 0) {
+      add("lowat " + std::to_string(notsent_lowat));
+    }
+    if (max_pacing_rate > 0) {
+      add("pacing " + std::to_string(max_pacing_rate) + " B/s");
+    }
+    return name + " (" + out + ")";
+  }
+};
+
+/**
+ * @brief Options applied to a listener; 0 disables each one
+ */
+struct ListenerConfig {
+  unsigned defer_accept_s = 0; ///< TCP_DEFER_ACCEPT timeout in seconds
+  unsigned fastopen_queue = 0; ///< Pending Fast Open connections allowed
+  SocketProfile profile;       ///< Inherited by accepted connections
+};
+
+/// Sockets left on the default congestion control by apply_profile()
+inline std::atomic<uint64_t> congestion_fallbacks{0};
+
+/**
+ * @brief Apply a SocketProfile to a listening or connected socket
+ *
+ * An unavailable congestion control (ENOENT, or EPERM when it is not in
+ * net.ipv4.tcp_allowed_congestion_control) is warned about and counted in
+ * congestion_fallbacks rather than rejected.
+ *
+ * @throws std::system_error if an option is rejected
+ */
+inline void apply_profile(int fd, const SocketProfile &profile) {
+  auto set = [fd](int level, int option, const void *value, socklen_t len,
+                  const char *what) {
+    if (setsockopt(fd, level, option, value, len) < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              std::string("setsockopt(") + what + ") failed");
+    }
+  };
+  if (!profile.congestion.empty() &&
+      setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, profile.congestion.data(),
+                 profile.congestion.size()) < 0) {
+    if (errno != ENOENT && errno != EPERM) {
+      throw std::system_error(errno, std::generic_category(),
+                              "setsockopt(TCP_CONGESTION) failed");
+    }
+    fprintf(stderr,
+            "Warning: congestion control %s is not available (%s); using "
+            "the system default\n",
+            profile.congestion.c_str(), strerror(errno));
+    congestion_fallbacks.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (profile.nodelay) {
+    int on = 1;
+    set(IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on), "TCP_NODELAY");
+  }
+  if (profile.sndbuf > 0) {
+    set(SOL_SOCKET, SO_SNDBUF, &profile.sndbuf, sizeof(profile.sndbuf),
+        "SO_SNDBUF");
+  }
+  if (profile.notsent_lowat > 0) {
+    set(IPPROTO_TCP, TCP_NOTSENT_LOWAT, &profile.notsent_lowat,
+        sizeof(profile.notsent_lowat), "TCP_NOTSENT_LOWAT");
+  }
+  if (profile.max_pacing_rate > 0) {
+    set(SOL_SOCKET, SO_MAX_PACING_RATE, &profile.max_pacing_rate,
+        sizeof(profile.max_pacing_rate), "SO_MAX_PACING_RATE");
+  }
+}
+
+/**
+ * @brief Apply a ListenerConfig to a socket; call before listen()
+ * @throws std::system_error if an option is rejected
+ */
+inline void configure_listener(int fd, const ListenerConfig &config) {
+  apply_profile(fd, config.profile);
+  if (config.defer_accept_s > 0) {
+    int secs = config.defer_accept_s;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)) <
+        0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "setsockopt(TCP_DEFER_ACCEPT) failed");
+    }
+  }
+  if (config.fastopen_queue > 0) {
+    int qlen = config.fastopen_queue;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "setsockopt(TCP_FASTOPEN) failed");
+    }
+  }
+}
+
+/**
+ * @brief Whether net.ipv4.tcp_fastopen lets servers accept data in a SYN
+ */
+inline bool fastopen_server_enabled() {
+  FILE *f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "re");
+  if (f == nullptr) {
+    return false;
+  }
+  unsigned mode = 0;
+  bool read = fscanf(f, "%u", &mode) == 1;
+  fclose(f);
+  return read && (mode & 2) != 0;
+}
+
+/**
+ * @brief Whether the SYN of an accepted connection carried data we accepted
+ */
+inline bool syn_carried_data(int fd) {
+  tcp_info info{};
+  socklen_t len = sizeof(info);
+  return getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+         (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+}
+
+/**
+ * @brief Host-wide TCP socket usage from /proc/net/sockstat
+ */
+struct TcpSockstat {
+  uint64_t inuse = 0;        ///< Sockets open
+  uint64_t orphan = 0;       ///< Closed but still sending
+  uint64_t time_wait = 0;
+  uint64_t memory_bytes = 0; ///< Buffer memory charged to TCP
+
+  /**
+   * @return false if /proc/net/sockstat could not be read
+   */
+  bool read() {
+    FILE *f = fopen("/proc/net/sockstat", "re");
+    if (f == nullptr) {
+      return false;
+    }
+    char line[256];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f) != nullptr) {
+      unsigned long long in, orph, tw, alloc, pages;
+      if (sscanf(line, "TCP: inuse %llu orphan %llu tw %llu alloc %llu mem %llu",
+                 &in, &orph, &tw, &alloc, &pages) == 5) {
+        found = true;
+        inuse = in;
+        orphan = orph;
+        time_wait = tw;
+        memory_bytes = pages * sysconf(_SC_PAGESIZE);
+      }
+    }
+    fclose(f);
+    return found;
+  }
+};
+
+/**
+ * @brief Host-wide TcpExt counters about connection setup
+ *
+ * Read from /proc/net/netstat, so they cover every socket in the network
+ * namespace, not just this server's.
+ */
+struct TcpExtCounters {
+  uint64_t fastopen_passive = 0;         ///< SYNs whose data was accepted
+  uint64_t fastopen_passive_fail = 0;    ///< Fast Open SYNs handled normally
+  uint64_t fastopen_listen_overflow = 0; ///< Fast Open queue was full
+  uint64_t fastopen_cookie_reqd = 0;     ///< SYNs asking for a cookie
+  uint64_t defer_accept_acks = 0;        ///< Bare ACKs held back by deferral
+
+  /**
+   * @return false if /proc/net/netstat could not be read
+   */
+  bool read() {
+    FILE *f = fopen("/proc/net/netstat", "re");
+    if (f == nullptr) {
+      return false;
+    }
+    // Pairs of lines: "TcpExt: Name ..." then "TcpExt: value ..."
+    char names[8192], values[8192];
+    bool found = false;
+    while (!found && fgets(names, sizeof(names), f) != nullptr &&
+           fgets(values, sizeof(values), f) != nullptr) {
+      if (strncmp(names, "TcpExt:", 7) != 0) {
+        continue;
+      }
+      found = true;
+      char *name_save = nullptr, *value_save = nullptr;
+      char *name = strtok_r(names + 7, " \n", &name_save);
+      char *value = strtok_r(values + 7, " \n", &value_save);
+      while (name != nullptr && value != nullptr) {
+        uint64_t n = strtoull(value, nullptr, 10);
+        if (strcmp(name, "TCPFastOpenPassive") == 0) {
+          fastopen_passive = n;
+        } else if (strcmp(name, "TCPFastOpenPassiveFail") == 0) {
+          fastopen_passive_fail = n;
+        } else if (strcmp(name, "TCPFastOpenListenOverflow") == 0) {
+          fastopen_listen_overflow = n;
+        } else if (strcmp(name, "TCPFastOpenCookieReqd") == 0) {
+          fastopen_cookie_reqd = n;
+        } else if (strcmp(name, "TCPDeferAcceptDrop") == 0) {
+          defer_accept_acks = n;
+        }
+        name = strtok_r(nullptr, " \n", &name_save);
+        value = strtok_r(nullptr, " \n", &value_save);
+      }
+    }
+    fclose(f);
+    return found;
+  }
+};
@@ -0,0 +1,395 @@
+/**
+ * @file metrics.h
+ * @brief Per-thread metric slots and Prometheus text formatting
+ *
+ * Instrumentation on the request path must not add shared-cache-line traffic.
+ * Each thread therefore writes to its own cache-line-aligned slot, with plain
+ * relaxed loads and stores (there is exactly one writer per slot), and the
+ * slots are only summed when /metrics is scraped. Slots of exited threads go
+ * back to a free list with their values intact, so totals never go backwards
+ * even though the server starts a thread per connection.
+ *
+ * Latency and throughput distributions use log-linear (HDR-style) histograms
+ * instead. A per-thread copy would be too large to keep for every connection
+ * thread, so each histogram has a few cache-line-aligned shards that threads
+ * are spread across and updated with relaxed atomic adds.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <string_view>
+#include <time.h>
+#include <vector>
+
+namespace metrics {
+
+constexpr size_t CACHE_LINE = 64;
+constexpr unsigned MAX_REGISTRIES = 16; ///< PerThread instances per process
+
+/**
+ * @brief Type-erased owner of per-thread slots, for release on thread exit
+ */
+class SlotOwner {
+public:
+  virtual void release(void *slot) = 0;
+
+protected:
+  ~SlotOwner() = default;
+};
+
+/**
+ * @brief The slots the current thread holds, returned when it exits
+ *
+ * Returned from a pthread key destructor rather than a thread_local
+ * destructor, because registering the latter calls calloc() in every new
+ * thread.
+ */
+struct ThreadSlots {
+  struct Held {
+    SlotOwner *owner = nullptr;
+    void *slot = nullptr;
+  };
+  Held held[MAX_REGISTRIES];
+  bool registered = false; ///< Whether thread_slots_key points here
+
+  static void release_all(void *self) {
+    for (Held &h : static_cast<ThreadSlots *>(self)->held) {
+      if (h.slot != nullptr) {
+        h.owner->release(h.slot);
+        h.slot = nullptr;
+      }
+    }
+  }
+};
+
+inline thread_local ThreadSlots thread_slots;
+inline pthread_key_t thread_slots_key = [] {
+  pthread_key_t key;
+  if (pthread_key_create(&key, ThreadSlots::release_all) != 0) {
+    fprintf(stderr, "metrics: pthread_key_create() failed\n");
+    abort();
+  }
+  return key;
+}();
+inline std::atomic<unsigned> next_registry_id{0};
+
+/**
+ * @brief One T per live thread, summed on demand
+ *
+ * Slots are allocated in chunks that are never freed, so a reader can walk
+ * all of them under the registry lock while writers keep going without it.
+ *
+ * @tparam T Slot contents; must be default-constructible and safe to read
+ *         concurrently with its single writer (e.g. made of atomics)
+ */
+template <typename T> class PerThread final : public SlotOwner {
+  struct alignas(CACHE_LINE) Padded {
+    T value;
+  };
+  static constexpr size_t CHUNK = 64;
+
+  unsigned id_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Padded[]>> chunks_;
+  size_t used_ = 0; ///< Slots handed out at least once
+  std::vector<Padded *> free_;
+
+  Padded *acquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_.empty()) {
+      Padded *slot = free_.back();
+      free_.pop_back();
+      return slot;
+    }
+    if (used_ == chunks_.size() * CHUNK) {
+      chunks_.push_back(std::make_unique<Padded[]>(CHUNK));
+    }
+    Padded *slot = &chunks_[used_ / CHUNK][used_ % CHUNK];
+    used_++;
+    return slot;
+  }
+
+public:
+  PerThread() : id_(next_registry_id.fetch_add(1)) {
+    if (id_ >= MAX_REGISTRIES) {
+      fprintf(stderr, "metrics: too many PerThread registries\n");
+      abort();
+    }
+  }
+
+  PerThread(const PerThread &) = delete;
+  PerThread &operator=(const PerThread &) = delete;
+
+  void release(void *slot) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(static_cast<Padded *>(slot));
+  }
+
+  /**
+   * @brief This thread's slot, acquired on first use
+   */
+  T &local() {
+    ThreadSlots::Held &h = thread_slots.held[id_];
+    if (h.slot == nullptr) {
+      h.owner = this;
+      h.slot = acquire();
+      if (!thread_slots.registered) {
+        pthread_setspecific(thread_slots_key, &thread_slots);
+        thread_slots.registered = true;
+      }
+    }
+    return static_cast<Padded *>(h.slot)->value;
+  }
+
+  /**
+   * @brief Call fn(const T &) for every slot ever handed out
+   */
+  template <typename Fn> void for_each(Fn fn) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < used_; i++) {
+      fn(static_cast<const T &>(chunks_[i / CHUNK][i % CHUNK].value));
+    }
+  }
+
+  /**
+   * @brief Call fn(T &) for every slot ever handed out, e.g. to consume
+   *        from a single-producer queue in each
+   *
+   * Only the list of slots is taken under the registry lock, so fn may block
+   * (on I/O, say) without stalling threads acquiring their first slot. Slots
+   * are never freed; one handed out meanwhile is visited on the next call.
+   */
+  template <typename Fn> void for_each(Fn fn) {
+    std::vector<Padded *> slots;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      slots.reserve(used_);
+      for (size_t i = 0; i < used_; i++) {
+        slots.push_back(&chunks_[i / CHUNK][i % CHUNK]);
+      }
+    }
+    for (Padded *slot : slots) {
+      fn(slot->value);
+    }
+  }
+};
+
+/**
+ * @brief Add to a counter that only the calling thread writes
+ *
+ * A plain load and store instead of a locked read-modify-write; readers on
+ * other threads may see a slightly stale value but never a torn one.
+ */
+inline void add(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+/**
+ * @brief Monotonic time in nanoseconds
+ *
+ * CLOCK_MONOTONIC is read through the vDSO, so this costs tens of
+ * nanoseconds and no system call.
+ */
+inline uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+inline std::atomic<unsigned> next_shard{0};
+inline thread_local unsigned thread_shard = next_shard.fetch_add(1);
+
+/**
+ * @brief Lock-free log-linear histogram of non-negative integer values
+ *
+ * Every power-of-two range is split into SUB_COUNT equal buckets, so any
+ * recorded value is known to within 1/SUB_COUNT of itself (about 6%) across
+ * the whole range, like an HDR histogram with a fixed precision. Values of
+ * 2^MAX_BITS and above land in the last bucket.
+ */
+class Histogram {
+public:
+  static constexpr unsigned SUB_BITS = 4;
+  static constexpr unsigned SUB_COUNT = 1u << SUB_BITS;
+  static constexpr unsigned MAX_BITS = 48; ///< ~78 hours in nanoseconds
+  static constexpr size_t NUM_BUCKETS =
+      SUB_COUNT + (MAX_BITS - SUB_BITS) * SUB_COUNT;
+  static constexpr unsigned SHARDS = 8;
+
+  /**
+   * @brief Merged contents of all shards at one point in time
+   */
+  struct Snapshot {
+    std::vector<uint64_t> counts; ///< Per bucket
+    uint64_t count = 0;           ///< Values recorded
+    uint64_t sum = 0;             ///< Sum of values recorded
+
+    /**
+     * @brief Estimate the value below which a fraction q of values fall
+     * @return The middle of the bucket holding that value, 0 if empty
+     */
+    double quantile(double q) const {
+      if (count == 0) {
+        return 0;
+      }
+      uint64_t rank = static_cast<uint64_t>(std::ceil(q * count));
+      rank = rank == 0 ? 1 : rank;
+      uint64_t seen = 0;
+      for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+          return bucket_lower(i) + (bucket_width(i) - 1) / 2.0;
+        }
+      }
+      return bucket_lower(NUM_BUCKETS - 1);
+    }
+  };
+
+  static size_t bucket_of(uint64_t value) {
+    if (value < SUB_COUNT) {
+      return value;
+    }
+    unsigned e = 63 - __builtin_clzll(value);
+    if (e >= MAX_BITS) {
+      return NUM_BUCKETS - 1;
+    }
+    return SUB_COUNT + (e - SUB_BITS) * SUB_COUNT +
+           ((value >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+  }
+
+  static uint64_t bucket_lower(size_t index) {
+    if (index < SUB_COUNT) {
+      return index;
+    }
+    size_t j = index - SUB_COUNT;
+    return (SUB_COUNT + j % SUB_COUNT) << (j / SUB_COUNT);
+  }
+
+  static uint64_t bucket_width(size_t index) {
+    return index < SUB_COUNT ? 1 : 1ULL << ((index - SUB_COUNT) / SUB_COUNT);
+  }
+
+  void record(uint64_t value) {
+    Shard &shard = shards_[thread_shard % SHARDS];
+    shard.counts[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  Snapshot snapshot() const {
+    Snapshot snap;
+    snap.counts.assign(NUM_BUCKETS, 0);
+    for (const Shard &shard : shards_) {
+      for (size_t i = 0; i < NUM_BUCKETS; i++) {
+        uint64_t n = shard.counts[i].load(std::memory_order_relaxed);
+        snap.counts[i] += n;
+        snap.count += n;
+      }
+      snap.sum += shard.sum.load(std::memory_order_relaxed);
+    }
+    return snap;
+  }
+
+private:
+  struct alignas(CACHE_LINE) Shard {
+    std::atomic<uint64_t> counts[NUM_BUCKETS] = {};
+    std::atomic<uint64_t> sum{0};
+  };
+  Shard shards_[SHARDS];
+};
+
+/**
+ * @brief Builder for the Prometheus text exposition format (version 0.0.4)
+ */
+class TextWriter {
+  std::string out_;
+
+public:
+  /**
+   * @brief Start a metric family with its HELP and TYPE lines
+   * @param type "counter", "gauge", "histogram" or "summary"
+   */
+  void family(std::string_view name, std::string_view type,
+              std::string_view help) {
+    out_.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out_.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+  }
+
+  /**
+   * @brief Add one sample line
+   * @param labels Pre-formatted label pairs without braces, e.g.
+   *        code="200"; use label() to escape values
+   */
+  void sample(std::string_view name, std::string_view labels, double value) {
+    char buf[32];
+    if (std::floor(value) == value && std::fabs(value) < 9e18) {
+      snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(value));
+    } else {
+      snprintf(buf, sizeof(buf), "%.9g", value);
+    }
+    out_.append(name);
+    if (!labels.empty()) {
+      out_.append("{").append(labels).append("}");
+    }
+    out_.append(" ").append(buf).append("\n");
+  }
+
+  void sample(std::string_view name, double value) { sample(name, {}, value); }
+
+  /**
+   * @brief Add the samples of a summary: quantiles, _sum and _count
+   * @param labels As for sample(), without the quantile label
+   * @param snap Histogram contents
+   * @param scale Multiplier from recorded units to exported ones, e.g. 1e-9
+   *        for nanoseconds exported as seconds
+   */
+  void summary(std::string_view name, std::string_view labels,
+               const Histogram::Snapshot &snap, double scale) {
+    static constexpr const char *QUANTILES[] = {"0.5", "0.9", "0.99",
+                                                "0.999"};
+    std::string prefix(labels);
+    if (!prefix.empty()) {
+      prefix += ",";
+    }
+    for (const char *q : QUANTILES) {
+      sample(name, prefix + "quantile=\"" + q + "\"",
+             snap.quantile(atof(q)) * scale);
+    }
+    std::string base(name);
+    sample(base + "_sum", labels, snap.sum * scale);
+    sample(base + "_count", labels, snap.count);
+  }
+
+  /**
+   * @brief Format name="value" with the value escaped for the text format
+   */
+  static std::string label(std::string_view name, std::string_view value) {
+    std::string s(name);
+    s += "=\"";
+    for (char c : value) {
+      if (c == '\\' || c == '"') {
+        s += '\\';
+        s += c;
+      } else if (c == '\n') {
+        s += "\\n";
+      } else {
+        s += c;
+      }
+    }
+    s += '"';
+    return s;
+  }
+
+  const std::string &str() const { return out_; }
+};
+
+} // namespace metrics
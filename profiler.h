@@ -0,0 +1,217 @@
+/**
+ * @file profiler.h
+ * @brief On-demand sampling CPU profiler producing folded stacks
+ *
+ * While a profile runs, ITIMER_PROF delivers SIGPROF for every 1/hz seconds
+ * of CPU time the process uses, to whichever thread is using it. The handler
+ * only records the thread's return addresses with backtrace() into a buffer
+ * allocated up front. When the profile ends the stacks are counted,
+ * symbolized with dladdr() and returned in the folded format read by
+ * flamegraph.pl and speedscope ("outer;inner;leaf count" per line).
+ *
+ * Names are only found for exported symbols, so the server is linked with
+ * -rdynamic; anything else shows up as module+offset.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <map>
+#include <string>
+#include <sys/time.h>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace profiler {
+
+constexpr int MAX_DEPTH = 48;           ///< Frames kept per sample
+constexpr size_t MAX_SAMPLES = 1 << 15; ///< Samples kept per profile
+constexpr int SKIPPED_FRAMES = 2;       ///< The handler and the signal frame
+
+/**
+ * @brief One captured stack, innermost frame first
+ */
+struct Sample {
+  int depth;
+  void *pcs[MAX_DEPTH];
+};
+
+/**
+ * @brief Where the signal handler writes; only set while a profile runs
+ */
+struct Buffer {
+  std::vector<Sample> samples;
+  std::atomic<size_t> next{0};
+};
+
+inline std::atomic<Buffer *> active{nullptr};
+inline std::atomic<int> in_handler{0};
+
+inline void on_sigprof(int, siginfo_t *, void *) {
+  int saved_errno = errno;
+  in_handler.fetch_add(1, std::memory_order_acquire);
+  Buffer *buffer = active.load(std::memory_order_acquire);
+  if (buffer != nullptr) {
+    size_t i = buffer->next.fetch_add(1, std::memory_order_relaxed);
+    if (i < buffer->samples.size()) {
+      Sample &sample = buffer->samples[i];
+      sample.depth = backtrace(sample.pcs, MAX_DEPTH);
+    }
+  }
+  in_handler.fetch_sub(1, std::memory_order_release);
+  errno = saved_errno;
+}
+
+/**
+ * @brief Name of the function containing pc, demangled
+ */
+inline std::string symbolize(void *pc) {
+  // pc is a return address; look up the call instruction before it
+  void *lookup = static_cast<char *>(pc) - 1;
+  Dl_info info{};
+  if (dladdr(lookup, &info) == 0) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "[%p]", pc);
+    return buf;
+  }
+  if (info.dli_sname != nullptr) {
+    int status = 0;
+    char *demangled =
+        abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    std::string name = status == 0 ? demangled : info.dli_sname;
+    free(demangled);
+    // ';' separates frames in the folded format
+    std::replace(name.begin(), name.end(), ';', ':');
+    return name;
+  }
+  const char *module = info.dli_fname != nullptr ? info.dli_fname : "?";
+  if (const char *slash = strrchr(module, '/')) {
+    module = slash + 1;
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), "+0x%zx",
+           static_cast<size_t>(static_cast<char *>(lookup) -
+                               static_cast<char *>(info.dli_fbase)));
+  return module + std::string(buf);
+}
+
+/**
+ * @brief Result of one profile
+ */
+struct Profile {
+  std::string folded;   ///< One "frame;frame;... count" line per stack
+  uint64_t samples = 0; ///< Samples taken
+  uint64_t dropped = 0; ///< Samples beyond MAX_SAMPLES
+};
+
+/**
+ * @brief Sample the whole process for a while
+ *
+ * Blocks the calling thread for the duration. Only one profile can run at a
+ * time.
+ *
+ * @param seconds How long to sample
+ * @param hz Samples per second of CPU time
+ * @param out Receives the profile
+ * @return false if another profile is already running
+ * @throws std::system_error if the timer or handler cannot be set up
+ */
+inline bool run(unsigned seconds, unsigned hz, Profile &out) {
+  static std::atomic<bool> busy{false};
+  if (busy.exchange(true)) {
+    return false;
+  }
+  struct Release {
+    ~Release() { busy.store(false); }
+  } release;
+
+  // The handler stays installed once set: a SIGPROF still pending after the
+  // timer is disarmed would otherwise kill the process.
+  static bool installed = false;
+  if (!installed) {
+    // backtrace() loads the unwinder on first use, which is not safe to do
+    // inside a signal handler
+    void *warm[1];
+    backtrace(warm, 1);
+    struct sigaction sa{};
+    sa.sa_sigaction = on_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, nullptr) < 0) {
+      throw std::system_error(errno, std::generic_category(), "sigaction()");
+    }
+    installed = true;
+  }
+
+  Buffer buffer;
+  buffer.samples.resize(MAX_SAMPLES);
+  active.store(&buffer, std::memory_order_release);
+
+  itimerval timer{};
+  timer.it_interval.tv_usec = 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr) < 0) {
+    active.store(nullptr);
+    throw std::system_error(errno, std::generic_category(), "setitimer()");
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  timer = {};
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  active.store(nullptr, std::memory_order_release);
+  while (in_handler.load(std::memory_order_acquire) != 0) {
+    std::this_thread::yield();
+  }
+
+  // Count identical stacks, then name each distinct address once
+  size_t taken = std::min(buffer.next.load(), MAX_SAMPLES);
+  out.samples = buffer.next.load();
+  out.dropped = out.samples - taken;
+  std::map<std::vector<void *>, uint64_t> stacks;
+  for (size_t i = 0; i < taken; i++) {
+    const Sample &sample = buffer.samples[i];
+    if (sample.depth <= SKIPPED_FRAMES) {
+      continue;
+    }
+    // Outermost frame first, as the folded format expects
+    std::vector<void *> stack(sample.pcs + SKIPPED_FRAMES,
+                              sample.pcs + sample.depth);
+    std::reverse(stack.begin(), stack.end());
+    stacks[std::move(stack)]++;
+  }
+  // Different addresses in the same functions fold into one line
+  std::unordered_map<void *, std::string> names;
+  std::map<std::string, uint64_t> folded;
+  for (const auto &[stack, count] : stacks) {
+    std::string line;
+    for (size_t i = 0; i < stack.size(); i++) {
+      auto it = names.find(stack[i]);
+      if (it == names.end()) {
+        it = names.emplace(stack[i], symbolize(stack[i])).first;
+      }
+      if (i > 0) {
+        line += ';';
+      }
+      line += it->second;
+    }
+    folded[line] += count;
+  }
+  for (const auto &[line, count] : folded) {
+    out.folded += line + ' ' + std::to_string(count) + '\n';
+  }
+  return true;
+}
+
+} // namespace profiler
@@ -0,0 +1,941 @@
+/**
+ * @file proxy_cache.h
+ * @brief Caching reverse-proxy storage with request collapsing
+ *
+ * Objects fetched from the upstream origin are stored as fixed-size range
+ * slices, one file per slice, so a partial request only ever pulls the slices
+ * it overlaps. A missing slice is queued for a small pool of fetch threads,
+ * which write it to a temporary file; every request that needs the slice
+ * while the fetch is running streams from that same file as it grows, so
+ * concurrent misses collapse into one upstream request. Completed slices are
+ * renamed into place and served like any other file.
+ *
+ * Files are named after a 64-bit hash of the key, so each slice file starts
+ * with a header holding the full key, checked before the slice is served;
+ * the data follows at the next page boundary. Complete slices are kept
+ * within a byte budget, dropping the least recently served first.
+ */
+
+#pragma once
+
+#include "http.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <string>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Settings for ProxyCache
+ */
+struct ProxyConfig {
+  std::string upstream;                   ///< Origin as "host:port"
+  std::string cache_dir;                  ///< Where slices are stored
+  off_t slice_size = 4 * 1024 * 1024;     ///< Bytes per cached slice
+  uint64_t cache_budget = 10240ULL << 20; ///< Max bytes of cached slices
+  unsigned fetch_threads = 8;             ///< Concurrent origin fetches
+  unsigned upstream_timeout_secs = 30;    ///< Socket timeout for the origin
+};
+
+namespace proxy_slice {
+
+constexpr char MAGIC[8] = {'S', 'X', 'S', 'L', 'I', 'C', 'E', '1'};
+constexpr off_t ALIGN = 4096; ///< Slice data starts on a page boundary
+
+/**
+ * @brief Start of every slice file, followed by the key
+ */
+struct Header {
+  char magic[8];
+  uint32_t key_size;
+  uint32_t reserved;
+};
+
+/**
+ * @brief Offset of the slice data in the file of a key of key_size bytes
+ */
+inline off_t data_offset(size_t key_size) {
+  off_t head = static_cast<off_t>(sizeof(Header) + key_size);
+  return (head + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+/**
+ * @brief Write the header for key at the start of fd
+ */
+inline bool write_header(int fd, const std::string &key) {
+  std::string head(sizeof(Header), '\0');
+  Header h{};
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.key_size = static_cast<uint32_t>(key.size());
+  memcpy(&head[0], &h, sizeof(h));
+  head += key;
+  return pwrite(fd, head.data(), head.size(), 0) ==
+         static_cast<ssize_t>(head.size());
+}
+
+/**
+ * @brief Check that fd holds the slice of key, with data_size bytes of data
+ */
+inline bool matches(int fd, const std::string &key, off_t data_size) {
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size != data_offset(key.size()) + data_size) {
+    return false;
+  }
+  std::string head(sizeof(Header) + key.size(), '\0');
+  if (pread(fd, &head[0], head.size(), 0) !=
+      static_cast<ssize_t>(head.size())) {
+    return false;
+  }
+  Header h;
+  memcpy(&h, head.data(), sizeof(h));
+  return memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+         h.key_size == key.size() &&
+         head.compare(sizeof(Header), std::string::npos, key) == 0;
+}
+
+} // namespace proxy_slice
+
+/**
+ * @brief One slice being fetched from the origin
+ *
+ * Shared between the fetch thread and every request streaming from it; the
+ * temporary file stays readable through the fetch's descriptor even after it
+ * has been renamed into place. Until a fetch thread takes it up, it waits in
+ * the HEADERS state like one that is connecting.
+ */
+class SliceFetch {
+  friend class ProxyCache;
+
+public:
+  enum class State { HEADERS, BODY, DONE, FAILED };
+
+private:
+  std::string key_;
+  uint64_t index_;
+  off_t data_offset_; ///< Where the slice data starts in the file
+  int fd_ = -1;
+
+  mutable std::mutex mutex_;
+  mutable std::condition_variable cv_;
+  State state_ = State::HEADERS;
+  int status_ = 0;          ///< Origin status, or 502 if it was unreachable
+  off_t object_size_ = -1;  ///< Total object size, once known
+  off_t written_ = 0;       ///< Bytes of the slice on disk so far
+
+  void set_state(State state) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    state_ = state;
+    cv_.notify_all();
+  }
+
+public:
+  SliceFetch(std::string key, uint64_t index)
+      : key_(std::move(key)), index_(index),
+        data_offset_(proxy_slice::data_offset(key_.size())) {}
+  ~SliceFetch() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  SliceFetch(const SliceFetch &) = delete;
+  SliceFetch &operator=(const SliceFetch &) = delete;
+
+  /**
+   * @brief Wait for the origin's response headers
+   * @param object_size Receives the total object size if known
+   * @return int HTTP status from the origin (200/206 on success)
+   */
+  int wait_headers(off_t &object_size) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return state_ != State::HEADERS; });
+    object_size = object_size_;
+    return status_;
+  }
+
+  /**
+   * @brief Send part of the slice to a client as it arrives
+   *
+   * Sends whatever is already on disk with sendfile() and then waits for the
+   * fetch to write more, until [from, to) has been sent.
+   *
+   * @param client_fd Client socket
+   * @param from Offset within the slice of the first byte to send
+   * @param to Offset within the slice one past the last byte to send
+   * @param sent Incremented by the number of bytes written to the client
+   * @param allow Called as allow(want) before each write; returns how many
+   *        of want bytes (at least 1) may be written now, e.g. to shape it
+   * @param unused Called as unused(allowed, written) after each write
+   * @return false if the fetch failed or the client went away
+   */
+  template <typename Allow, typename Unused>
+  bool stream_to(int client_fd, off_t from, off_t to, uint64_t &sent,
+                 Allow allow, Unused unused) const {
+    off_t pos = from;
+    while (pos < to) {
+      off_t available;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&] {
+          return written_ > pos || state_ == State::DONE ||
+                 state_ == State::FAILED;
+        });
+        if (written_ <= pos) {
+          return false; // Finished or failed short of what we need
+        }
+        available = std::min(written_, to);
+      }
+      while (pos < available) {
+        off_t allowed = allow(available - pos);
+        off_t file_pos = data_offset_ + pos;
+        ssize_t n = sendfile(client_fd, fd_, &file_pos, allowed);
+        pos = file_pos - data_offset_;
+        unused(allowed, n);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+          continue;
+        }
+        if (n <= 0) {
+          return false;
+        }
+        sent += n;
+      }
+    }
+    return true;
+  }
+};
+
+/**
+ * @brief Slice store and collapsed-fetch table for one origin
+ */
+class ProxyCache {
+public:
+  /**
+   * @brief Counters exported for monitoring
+   */
+  struct Stats {
+    std::atomic<uint64_t> slice_hits{0};      ///< Slices served from disk
+    std::atomic<uint64_t> slice_misses{0};    ///< Slices fetched from origin
+    std::atomic<uint64_t> collapsed{0};       ///< Requests joining a fetch
+    std::atomic<uint64_t> upstream_errors{0}; ///< Origin unreachable, or its
+                                              ///< response unusable
+    std::atomic<uint64_t> upstream_responses[6] = {}; ///< Origin responses
+                                                      ///< by status class
+    std::atomic<uint64_t> upstream_bytes{0};  ///< Body bytes from the origin
+    std::atomic<uint64_t> evictions{0};       ///< Slices dropped for space
+    std::atomic<uint64_t> invalidations{0};   ///< Objects found changed at
+                                              ///< the origin
+    std::atomic<uint64_t> cached_bytes{0};    ///< Slice files on disk
+  };
+
+  /**
+   * @brief Where to read one slice from
+   *
+   * Either fd (a complete cached slice, opened for the caller) or fetch (an
+   * in-flight fetch to stream from) is set. The slice data starts at offset
+   * in fd; the descriptor stays readable if the slice is evicted meanwhile.
+   */
+  class Slice {
+  public:
+    std::shared_ptr<SliceFetch> fetch;
+    off_t offset = 0;
+
+    explicit Slice(std::shared_ptr<SliceFetch> f) : fetch(std::move(f)) {}
+    Slice(int fd, off_t data_offset) : offset(data_offset), fd_(fd) {}
+    ~Slice() {
+      if (fd_ >= 0) {
+        close(fd_);
+      }
+    }
+    Slice(Slice &&other) noexcept
+        : fetch(std::move(other.fetch)), offset(other.offset), fd_(other.fd_) {
+      other.fd_ = -1;
+    }
+    Slice(const Slice &) = delete;
+    Slice &operator=(const Slice &) = delete;
+
+    /// Take ownership of the cached slice's descriptor
+    int release() {
+      int fd = fd_;
+      fd_ = -1;
+      return fd;
+    }
+
+  private:
+    int fd_ = -1;
+  };
+
+private:
+  /// Objects whose info is kept in memory; the rest is read from .meta files
+  static constexpr size_t MAX_KNOWN_OBJECTS = 65536;
+
+  /**
+   * @brief What the origin last said about an object
+   */
+  struct ObjectInfo {
+    off_t size = -1;
+    std::string etag;          ///< Empty if the origin sent none
+    std::string last_modified; ///< Empty if the origin sent none
+
+    /// Validator for If-Range: a strong ETag, else the modification date
+    const std::string &if_range() const {
+      return etag.empty() || etag.compare(0, 2, "W/") == 0 ? last_modified
+                                                             : etag;
+    }
+
+    /// Whether other describes the same version (validators both sent agree)
+    bool same_version(const ObjectInfo &other) const {
+      return size == other.size &&
+             (etag.empty() || other.etag.empty() || etag == other.etag) &&
+             (last_modified.empty() || other.last_modified.empty() ||
+              last_modified == other.last_modified);
+    }
+  };
+
+  struct KnownObject {
+    ObjectInfo info;
+    std::list<std::string>::iterator lru; ///< Position in objects_lru_
+  };
+
+  /**
+   * @brief A complete slice file counted against the budget
+   */
+  struct CachedSlice {
+    off_t bytes;
+    std::list<std::string>::iterator lru; ///< Position in lru_
+  };
+
+  ProxyConfig cfg_;
+  sockaddr_storage addr_{};
+  socklen_t addr_len_ = 0;
+  std::string host_header_;
+
+  std::mutex mutex_; ///< Guards everything below
+  std::map<std::pair<std::string, uint64_t>, std::shared_ptr<SliceFetch>>
+      inflight_;
+  std::unordered_map<std::string_view, KnownObject> objects_; ///< Keys live
+                                                             ///< in objects_lru_
+  std::list<std::string> objects_lru_; ///< Object keys, most recent first
+  std::unordered_map<std::string, CachedSlice> cached_; ///< By file path
+  std::list<std::string> lru_;  ///< Cached slice paths, most recent first
+  uint64_t cached_bytes_ = 0;   ///< Sum of cached_ sizes
+  std::deque<std::pair<std::shared_ptr<SliceFetch>, std::string>> queue_;
+  std::condition_variable work_cv_;
+  bool stopping_ = false;
+  std::vector<std::thread> fetchers_;
+  Stats stats_;
+
+  /**
+   * @brief Name of the cache files for a key (64-bit FNV-1a of the path)
+   */
+  std::string base_path(const std::string &key) const {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : key) {
+      h = (h ^ c) * 0x100000001b3ULL;
+    }
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(h));
+    return cfg_.cache_dir + "/" + name;
+  }
+
+  std::string slice_path(const std::string &key, uint64_t index) const {
+    return base_path(key) + "." + std::to_string(index);
+  }
+
+  /**
+   * @brief Keep an object's info in memory (mutex_ held)
+   */
+  void remember(const std::string &key, const ObjectInfo &info) {
+    auto it = objects_.find(key);
+    if (it != objects_.end()) {
+      objects_lru_.splice(objects_lru_.begin(), objects_lru_, it->second.lru);
+      it->second.info = info;
+      return;
+    }
+    if (objects_.size() >= MAX_KNOWN_OBJECTS) {
+      objects_.erase(objects_lru_.back());
+      objects_lru_.pop_back();
+    }
+    objects_lru_.push_front(key);
+    objects_.emplace(objects_lru_.front(),
+                     KnownObject{info, objects_lru_.begin()});
+  }
+
+  /**
+   * @brief Write an object's info to its .meta file
+   *
+   * The meta file also stores the path, so a colliding key is not mistaken
+   * for this one when the info is loaded back.
+   */
+  void write_meta(const std::string &key, const ObjectInfo &info) const {
+    std::string meta = base_path(key) + ".meta";
+    std::string tmp = meta + ".tmp" + std::to_string(gettid());
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == nullptr) {
+      return;
+    }
+    fprintf(f, "%lld\n%s\n%s\n%s\n", static_cast<long long>(info.size),
+            key.c_str(), info.etag.c_str(), info.last_modified.c_str());
+    if (fclose(f) != 0 || rename(tmp.c_str(), meta.c_str()) < 0) {
+      unlink(tmp.c_str());
+    }
+  }
+
+  /**
+   * @brief Load an object's info from memory or its .meta file
+   * @return false if the object is unknown
+   */
+  bool known_object(const std::string &key, ObjectInfo &info) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = objects_.find(key);
+      if (it != objects_.end()) {
+        objects_lru_.splice(objects_lru_.begin(), objects_lru_,
+                            it->second.lru);
+        info = it->second.info;
+        return true;
+      }
+    }
+    FILE *f = fopen((base_path(key) + ".meta").c_str(), "r");
+    if (f == nullptr) {
+      return false;
+    }
+    long long size = -1;
+    char line[4096];
+    bool ok = fscanf(f, "%lld\n", &size) == 1 &&
+              fgets(line, sizeof(line), f) != nullptr && key + "\n" == line;
+    // Validators follow on their own lines; meta files from before they were
+    // stored end here
+    std::string *validators[] = {&info.etag, &info.last_modified};
+    for (std::string *v : validators) {
+      v->clear();
+      if (ok && fgets(line, sizeof(line), f) != nullptr) {
+        v->assign(line, strcspn(line, "\n"));
+      }
+    }
+    fclose(f);
+    if (!ok || size < 0) {
+      return false;
+    }
+    info.size = size;
+    std::lock_guard<std::mutex> lock(mutex_);
+    remember(key, info);
+    return true;
+  }
+
+  /**
+   * @brief Record what a fetch learned about an object
+   *
+   * If the size or a validator differs from what was known, the object has
+   * changed at the origin: its cached slices are dropped before the new info
+   * replaces the old.
+   *
+   * @param key Object key
+   * @param seen Info from the origin's response
+   * @param known Info the fetch started with, if any
+   */
+  void update_object(const std::string &key, const ObjectInfo &seen,
+                     const ObjectInfo *known) {
+    ObjectInfo info = seen;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = objects_.find(key);
+      const ObjectInfo *current = it != objects_.end() ? &it->second.info
+                                                       : known;
+      if (current != nullptr && current->same_version(info)) {
+        // Keep validators this response did not repeat (a 416 has none)
+        if (info.etag.empty()) {
+          info.etag = current->etag;
+        }
+        if (info.last_modified.empty()) {
+          info.last_modified = current->last_modified;
+        }
+        if (info.etag == current->etag &&
+            info.last_modified == current->last_modified) {
+          remember(key, info);
+          return;
+        }
+      } else if (current != nullptr) {
+        drop_slices(key, current->size);
+        stats_.invalidations.fetch_add(1, std::memory_order_relaxed);
+      }
+      remember(key, info);
+    }
+    write_meta(key, info);
+  }
+
+  /**
+   * @brief Remove the cached slices of an object of size bytes (mutex_ held)
+   */
+  void drop_slices(const std::string &key, off_t size) {
+    uint64_t count = (size + cfg_.slice_size - 1) / cfg_.slice_size;
+    for (uint64_t index = 0; index < count; index++) {
+      auto it = cached_.find(slice_path(key, index));
+      if (it != cached_.end()) {
+        unlink(it->first.c_str());
+        cached_bytes_ -= it->second.bytes;
+        lru_.erase(it->second.lru);
+        cached_.erase(it);
+      }
+    }
+    stats_.cached_bytes.store(cached_bytes_, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Count a slice file against the budget, or mark it recently used
+   *
+   * Called with mutex_ held. Drops the least recently used slices (other
+   * than this one) while the budget is exceeded.
+   */
+  void use_cached(const std::string &path, off_t bytes) {
+    auto it = cached_.find(path);
+    if (it != cached_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru);
+      cached_bytes_ += bytes - it->second.bytes;
+      it->second.bytes = bytes;
+    } else {
+      lru_.push_front(path);
+      cached_.emplace(path, CachedSlice{bytes, lru_.begin()});
+      cached_bytes_ += bytes;
+    }
+    while (cfg_.cache_budget != 0 && cached_bytes_ > cfg_.cache_budget &&
+           lru_.size() > 1) {
+      auto victim = cached_.find(lru_.back());
+      unlink(victim->first.c_str());
+      cached_bytes_ -= victim->second.bytes;
+      cached_.erase(victim);
+      lru_.pop_back();
+      stats_.evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    stats_.cached_bytes.store(cached_bytes_, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Mark a slice file recently used, if it is still counted
+   *
+   * A slice evicted or dropped after the caller opened it is not added back.
+   */
+  void touch_cached(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = cached_.find(path);
+    if (it != cached_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru);
+    }
+  }
+
+  /**
+   * @brief Count the slices already in the cache directory
+   *
+   * Oldest first by modification time, so they are dropped in that order;
+   * temporary files of fetches cut short by a restart are removed.
+   */
+  void load_cached() {
+    DIR *dir = opendir(cfg_.cache_dir.c_str());
+    if (dir == nullptr) {
+      return;
+    }
+    std::vector<std::pair<int64_t, std::string>> found;
+    while (dirent *entry = readdir(dir)) {
+      std::string_view name = entry->d_name;
+      size_t dot = name.find('.');
+      if (dot != 16 || name.size() == 17) {
+        continue;
+      }
+      std::string path = cfg_.cache_dir + "/" + std::string(name);
+      std::string_view suffix = name.substr(17);
+      if (suffix.find(".tmp") != std::string_view::npos) {
+        unlink(path.c_str());
+        continue;
+      }
+      struct stat st;
+      if (suffix.find_first_not_of("0123456789") == std::string_view::npos &&
+          stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        found.emplace_back(st.st_mtim.tv_sec * 1000000000LL +
+                               st.st_mtim.tv_nsec,
+                           std::move(path));
+      }
+    }
+    closedir(dir);
+    std::sort(found.begin(), found.end());
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &file : found) {
+      struct stat st;
+      if (stat(file.second.c_str(), &st) == 0) {
+        use_cached(file.second, st.st_size);
+      }
+    }
+  }
+
+  /**
+   * @brief Run queued fetches until the cache is destroyed
+   */
+  void fetcher() {
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      auto job = std::move(queue_.front());
+      queue_.pop_front();
+      lock.unlock();
+      fetch(std::move(job.first), std::move(job.second));
+    }
+  }
+
+  /**
+   * @brief Open a connection to the origin with I/O timeouts applied
+   * @return Connected socket, or -1 on failure
+   */
+  int connect_upstream() const {
+    int fd = socket(addr_.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    timeval tv{static_cast<time_t>(cfg_.upstream_timeout_secs), 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&addr_), addr_len_) <
+        0) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  /**
+   * @brief Fetch one slice from the origin into its temporary file
+   *
+   * Runs on a fetch thread. Asks for exactly the slice's byte range; an origin
+   * that ignores Range and answers 200 is handled by skipping ahead in the
+   * body.
+   */
+  void fetch(std::shared_ptr<SliceFetch> f, std::string target) {
+    const off_t slice_start = static_cast<off_t>(f->index_) * cfg_.slice_size;
+    const off_t slice_end = slice_start + cfg_.slice_size - 1;
+    std::string final_path = slice_path(f->key_, f->index_);
+    std::string tmp_path = final_path + ".tmp" + std::to_string(gettid());
+
+    ObjectInfo known;
+    bool have_known = known_object(f->key_, known);
+
+    int status = 502;
+    int origin_status = 0; ///< As received, 0 if there was no response
+    off_t object_size = -1;
+    ObjectInfo seen; ///< Validators from the response
+    off_t expected = 0;
+    bool ok = false;
+    std::vector<char> buf(256 * 1024);
+
+    int up = connect_upstream();
+    f->fd_ = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (up >= 0 && f->fd_ >= 0 && proxy_slice::write_header(f->fd_, f->key_)) {
+      std::string req = "GET " + target + " HTTP/1.1\r\nHost: " +
+                        host_header_ + "\r\nRange: bytes=" +
+                        std::to_string(slice_start) + "-" +
+                        std::to_string(slice_end) + "\r\n";
+      // A changed object then comes back whole (200) rather than as a slice
+      // of the new version spliced onto the cached ones
+      if (have_known && !known.if_range().empty()) {
+        req += "If-Range: " + known.if_range() + "\r\n";
+      }
+      req += "Connection: close\r\nUser-Agent: streamix\r\n\r\n";
+      size_t used = 0;
+      size_t head_end = std::string_view::npos;
+      if (send(up, req.data(), req.size(), MSG_NOSIGNAL) ==
+          static_cast<ssize_t>(req.size())) {
+        while (head_end == std::string_view::npos && used < buf.size()) {
+          ssize_t n = recv(up, buf.data() + used, buf.size() - used, 0);
+          if (n < 0 && errno == EINTR) {
+            continue;
+          }
+          if (n <= 0) {
+            break;
+          }
+          used += n;
+          head_end = std::string_view(buf.data(), used).find("\r\n\r\n");
+        }
+      }
+
+      off_t skip = 0; // Body bytes to discard before the slice starts
+      if (head_end != std::string_view::npos) {
+        std::string_view head(buf.data(), head_end + 2);
+        std::string_view headers = head.substr(head.find("\r\n") + 2);
+        if (head.size() > 12 && head.substr(0, 5) == "HTTP/") {
+          status = atoi(head.substr(9, 3).data());
+          if (status >= 100 && status < 600) {
+            origin_status = status;
+            stats_.upstream_responses[status / 100].fetch_add(
+                1, std::memory_order_relaxed);
+          }
+        }
+
+        seen.etag = find_header(headers, "ETag");
+        seen.last_modified = find_header(headers, "Last-Modified");
+
+        std::string_view cr = find_header(headers, "Content-Range");
+        size_t slash = cr.rfind('/');
+        off_t first = -1;
+        if (slash != std::string_view::npos) {
+          parse_offset(cr.substr(slash + 1), object_size);
+          size_t space = cr.find(' ');
+          size_t dash = cr.find('-');
+          if (space != std::string_view::npos && dash != std::string_view::npos) {
+            parse_offset(cr.substr(space + 1, dash - space - 1), first);
+          }
+        }
+        if (status == 200) {
+          parse_offset(find_header(headers, "Content-Length"), object_size);
+          skip = slice_start;
+        } else if (status == 206 && first != slice_start) {
+          status = 502; // Origin answered with a different range
+        }
+        if (object_size >= 0) {
+          expected = std::max<off_t>(
+              0, std::min(object_size, slice_end + 1) - slice_start);
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(f->mutex_);
+        f->status_ = status;
+        f->object_size_ = object_size;
+      }
+      if (object_size >= 0 && (status == 200 || status == 206 || status == 416)) {
+        seen.size = object_size;
+        update_object(f->key_, seen, have_known ? &known : nullptr);
+      }
+
+      if ((status == 200 || status == 206) && object_size >= 0) {
+        f->set_state(SliceFetch::State::BODY);
+
+        // Body bytes that arrived along with the headers come first
+        size_t body_off = head_end + 4;
+        off_t written = 0;
+        bool io_ok = true;
+        for (;;) {
+          size_t n = used - body_off;
+          if (skip > 0) {
+            size_t drop = std::min<off_t>(skip, n);
+            skip -= drop;
+            body_off += drop;
+            n -= drop;
+          }
+          n = std::min<off_t>(n, expected - written);
+          if (n > 0) {
+            if (pwrite(f->fd_, buf.data() + body_off, n,
+                       f->data_offset_ + written) != static_cast<ssize_t>(n)) {
+              io_ok = false;
+              break;
+            }
+            written += n;
+            stats_.upstream_bytes.fetch_add(n, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(f->mutex_);
+            f->written_ = written;
+            f->cv_.notify_all();
+          }
+          if (written >= expected) {
+            break;
+          }
+          ssize_t got = recv(up, buf.data(), buf.size(), 0);
+          if (got < 0 && errno == EINTR) {
+            got = 0;
+          } else if (got <= 0) {
+            break;
+          }
+          used = got;
+          body_off = 0;
+        }
+        ok = io_ok && written == expected;
+      }
+    }
+    if (up >= 0) {
+      close(up);
+    }
+
+    // Publish the slice before leaving the in-flight table so that a request
+    // arriving in between always finds one or the other
+    bool published = ok && rename(tmp_path.c_str(), final_path.c_str()) == 0;
+    if (published) {
+      f->set_state(SliceFetch::State::DONE);
+    } else {
+      unlink(tmp_path.c_str());
+      // A 404 or the like is the origin's answer, not a failure to get one
+      bool refused = origin_status == status && status != 200 && status != 206;
+      if (!refused) {
+        stats_.upstream_errors.fetch_add(1, std::memory_order_relaxed);
+      }
+      f->set_state(SliceFetch::State::FAILED);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (published) {
+      use_cached(final_path, f->data_offset_ + expected);
+    }
+    inflight_.erase({f->key_, f->index_});
+  }
+
+public:
+  /**
+   * @brief Resolve the origin and prepare the cache directory
+   * @throws std::system_error if the origin cannot be resolved or the
+   *         directory cannot be created
+   */
+  explicit ProxyCache(const ProxyConfig &cfg) : cfg_(cfg) {
+    size_t colon = cfg_.upstream.rfind(':');
+    if (colon == std::string::npos) {
+      throw std::system_error(EINVAL, std::generic_category(),
+                              "--upstream must be host:port");
+    }
+    std::string host = cfg_.upstream.substr(0, colon);
+    std::string port = cfg_.upstream.substr(colon + 1);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 ||
+        res == nullptr) {
+      throw std::system_error(EHOSTUNREACH, std::generic_category(),
+                              "cannot resolve upstream " + cfg_.upstream);
+    }
+    memcpy(&addr_, res->ai_addr, res->ai_addrlen);
+    addr_len_ = res->ai_addrlen;
+    freeaddrinfo(res);
+    host_header_ = cfg_.upstream;
+
+    if (mkdir(cfg_.cache_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+      throw std::system_error(errno, std::generic_category(),
+                              "cannot create " + cfg_.cache_dir);
+    }
+    load_cached();
+    for (unsigned i = 0; i < std::max(cfg_.fetch_threads, 1u); i++) {
+      fetchers_.emplace_back(&ProxyCache::fetcher, this);
+    }
+  }
+
+  /**
+   * @brief Finish the queued fetches and stop the fetch threads
+   */
+  ~ProxyCache() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread &t : fetchers_) {
+      t.join();
+    }
+  }
+
+  ProxyCache(const ProxyCache &) = delete;
+  ProxyCache &operator=(const ProxyCache &) = delete;
+
+  off_t slice_size() const { return cfg_.slice_size; }
+
+  /**
+   * @brief Get a complete slice or the fetch that is producing it
+   *
+   * Queues a fetch if the slice is neither cached nor already being fetched.
+   *
+   * @param key Object key (normalized request path)
+   * @param target Path to request from the origin
+   * @param index Slice number
+   * @param object_size Total object size, or -1 if not yet known
+   */
+  Slice acquire(const std::string &key, const std::string &target,
+                uint64_t index, off_t object_size) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = inflight_.find({key, index});
+      if (it != inflight_.end()) {
+        stats_.collapsed.fetch_add(1, std::memory_order_relaxed);
+        return Slice(it->second);
+      }
+    }
+
+    // The slice file is opened and checked unlocked; once open it stays
+    // readable even if it is evicted or replaced meanwhile
+    if (object_size >= 0) {
+      std::string path = slice_path(key, index);
+      off_t expected = std::min(object_size,
+                                static_cast<off_t>(index + 1) * cfg_.slice_size) -
+                       static_cast<off_t>(index) * cfg_.slice_size;
+      int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd >= 0 && proxy_slice::matches(fd, key, expected)) {
+        stats_.slice_hits.fetch_add(1, std::memory_order_relaxed);
+        touch_cached(path);
+        return Slice(fd, proxy_slice::data_offset(key.size()));
+      }
+      if (fd >= 0) {
+        close(fd); // Another key with the same hash, or a stale format
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = inflight_.find({key, index});
+    if (it != inflight_.end()) {
+      stats_.collapsed.fetch_add(1, std::memory_order_relaxed);
+      return Slice(it->second); // Queued while we were looking on disk
+    }
+    auto f = std::make_shared<SliceFetch>(key, index);
+    inflight_.emplace(std::make_pair(key, index), f);
+    stats_.slice_misses.fetch_add(1, std::memory_order_relaxed);
+    queue_.emplace_back(f, target);
+    work_cv_.notify_one();
+    return Slice(f);
+  }
+
+  /**
+   * @brief Find the total size of an object, asking the origin if needed
+   *
+   * When the size is not cached, the slice containing hint_offset is fetched
+   * (or joined) and its response headers supply the size; the fetch carries
+   * on in the background so the slice is ready when the request gets to it.
+   *
+   * @param key Object key (normalized request path)
+   * @param target Path to request from the origin
+   * @param hint_offset First byte the client is interested in
+   * @param size Receives the object size on success
+   * @return int 200 if the size is known, otherwise the status to send
+   */
+  int object_size(const std::string &key, const std::string &target,
+                  off_t hint_offset, off_t &size) {
+    ObjectInfo info;
+    if (known_object(key, info)) {
+      size = info.size;
+      return 200;
+    }
+    Slice slice = acquire(key, target, hint_offset / cfg_.slice_size, -1);
+    if (!slice.fetch) {
+      return 502; // Cannot happen without a known size
+    }
+    int status = slice.fetch->wait_headers(size);
+    if (size >= 0) {
+      return 200;
+    }
+    return status == 404 || status == 403 || status == 410 ? status : 502;
+  }
+
+  const Stats &stats() const { return stats_; }
+};
@@ -0,0 +1,254 @@
+/**
+ * @file residency.h
+ * @brief Page-cache residency probing and hit rates
+ *
+ * Before a range is handed to sendfile() the transfer loop asks the kernel
+ * which of its pages are already cached. Resident data is sent immediately on
+ * the connection's own thread; only misses go through the disk I/O pools, so
+ * hot transfers never queue behind cold ones.
+ *
+ * The kernel is asked with cachestat() (Linux 6.5+), which counts cached
+ * pages without touching the process's address space. Older kernels fall
+ * back to mincore(), which needs the range mapped, and unmapping it flushes
+ * the TLB of every CPU running one of the server's threads.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#ifndef __NR_cachestat
+#define __NR_cachestat 451 // The same on every architecture
+#endif
+
+/**
+ * @brief Largest range examined by a single probe
+ *
+ * Bounds the size of the mincore() vector so it can live on the stack.
+ */
+constexpr size_t MAX_PROBE_BYTES = 16 * 1024 * 1024;
+
+/**
+ * @brief Arguments and result of cachestat(), missing from older headers
+ */
+struct CachestatRange {
+  uint64_t off;
+  uint64_t len;
+};
+struct Cachestat {
+  uint64_t nr_cache;
+  uint64_t nr_dirty;
+  uint64_t nr_writeback;
+  uint64_t nr_evicted;
+  uint64_t nr_recently_evicted;
+};
+
+/**
+ * @brief Number of pages of [offset, offset + length) in the page cache
+ * @return int64_t The count, or -1 if cachestat() failed or is unavailable
+ */
+inline int64_t cached_pages(int fd, off_t offset, size_t length) {
+  static std::atomic<bool> unavailable{false};
+  if (unavailable.load(std::memory_order_relaxed)) {
+    return -1;
+  }
+  CachestatRange range{static_cast<uint64_t>(offset), length};
+  Cachestat stat{};
+  if (syscall(__NR_cachestat, fd, &range, &stat, 0) != 0) {
+    if (errno == ENOSYS || errno == EPERM) {
+      unavailable.store(true, std::memory_order_relaxed);
+    }
+    return -1;
+  }
+  return static_cast<int64_t>(stat.nr_cache);
+}
+
+/**
+ * @brief resident_prefix() through mincore(), for kernels before cachestat()
+ */
+inline size_t resident_prefix_mincore(int fd, off_t map_start, size_t lead,
+                                      size_t length) {
+  static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t map_len = lead + length;
+  void *map = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, map_start);
+  if (map == MAP_FAILED) {
+    return length;
+  }
+
+  unsigned char vec[MAX_PROBE_BYTES / 4096 + 2];
+  size_t pages = (map_len + page - 1) / page;
+  size_t resident = length;
+  if (pages <= sizeof(vec) && mincore(map, map_len, vec) == 0) {
+    size_t first_miss = 0;
+    while (first_miss < pages && (vec[first_miss] & 1)) {
+      first_miss++;
+    }
+    if (first_miss < pages) {
+      resident = first_miss * page > lead ? first_miss * page - lead : 0;
+      resident = std::min(resident, length);
+    }
+  }
+  munmap(map, map_len);
+  return resident;
+}
+
+/**
+ * @brief Count the bytes at the start of a file range that are in page cache
+ *
+ * Neither faults pages in nor triggers readahead. A range that is cached
+ * entirely or not at all takes one cachestat(); a partly cached one is
+ * bisected, a dozen calls at most for MAX_PROBE_BYTES.
+ *
+ * @param fd File descriptor of a regular file
+ * @param offset Start of the range
+ * @param length Length of the range (probes at most MAX_PROBE_BYTES)
+ * @return size_t Length of the resident prefix; on any probe failure the
+ *         whole range is reported resident so the caller just sends it
+ */
+inline size_t resident_prefix(int fd, off_t offset, size_t length) {
+  static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  length = std::min(length, MAX_PROBE_BYTES);
+  if (length == 0) {
+    return 0;
+  }
+
+  off_t map_start = offset - offset % static_cast<off_t>(page);
+  size_t lead = static_cast<size_t>(offset - map_start);
+  size_t pages = (lead + length + page - 1) / page;
+
+  int64_t cached = cached_pages(fd, map_start, pages * page);
+  if (cached < 0) {
+    return resident_prefix_mincore(fd, map_start, lead, length);
+  }
+  if (static_cast<size_t>(cached) >= pages) {
+    return length;
+  }
+  // The first lo pages are all cached, the first hi pages are not
+  size_t lo = 0;
+  size_t hi = pages;
+  while (cached != 0 && hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    int64_t n = cached_pages(fd, map_start, mid * page);
+    if (n < 0) {
+      return length;
+    }
+    if (static_cast<size_t>(n) == mid) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  size_t resident = lo * page > lead ? lo * page - lead : 0;
+  return std::min(resident, length);
+}
+
+/**
+ * @brief Residency counters for one file
+ */
+struct ResidencyStats {
+  std::atomic<uint64_t> hit_bytes{0};  ///< Bytes found resident and sent inline
+  std::atomic<uint64_t> miss_bytes{0}; ///< Bytes that needed a disk read
+  ResidencyStats *total = nullptr;     ///< Also credited, if set
+
+  void record(size_t hit, size_t miss) {
+    hit_bytes.fetch_add(hit, std::memory_order_relaxed);
+    miss_bytes.fetch_add(miss, std::memory_order_relaxed);
+    if (total != nullptr) {
+      total->record(hit, miss);
+    }
+  }
+
+  /**
+   * @brief Fraction of probed bytes that were resident (1.0 if none probed)
+   */
+  double hit_rate() const {
+    uint64_t hit = hit_bytes.load(std::memory_order_relaxed);
+    uint64_t miss = miss_bytes.load(std::memory_order_relaxed);
+    return hit + miss == 0 ? 1.0 : static_cast<double>(hit) / (hit + miss);
+  }
+};
+
+/**
+ * @brief Page-cache counters for all files, and optionally per path
+ *
+ * The total is always kept. Per-path counters are opt-in and bounded: up to
+ * max_paths of the most recently served paths are tracked, and the least
+ * recently served one is dropped to make room, so neither memory nor the
+ * number of exported series grows with the size of the catalog. While
+ * per-path tracking is off, for_file() takes no lock at all.
+ */
+class ResidencyTracker {
+  struct Entry {
+    std::shared_ptr<ResidencyStats> stats;
+    std::list<std::string>::iterator lru; ///< Position in lru_
+  };
+
+  ResidencyStats total_;
+  size_t max_paths_ = 0;
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string_view, Entry> files_; ///< Keys live in lru_
+  std::list<std::string> lru_;                       ///< Most recent first
+
+public:
+  /**
+   * @brief Set how many paths get their own counters; call before serving
+   */
+  void set_max_paths(size_t n) { max_paths_ = n; }
+
+  size_t max_paths() const { return max_paths_; }
+
+  /**
+   * @brief Counters to record a transfer of path against
+   *
+   * They also feed the total. Hold the pointer for the whole transfer: a
+   * path dropped from the table meanwhile keeps its counters alive until
+   * then.
+   */
+  std::shared_ptr<ResidencyStats> for_file(std::string_view path) {
+    if (max_paths_ == 0) {
+      // Aliases total_ without owning it, so nothing is allocated
+      return std::shared_ptr<ResidencyStats>(std::shared_ptr<void>(), &total_);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = files_.find(path);
+    if (it != files_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru);
+      return it->second.stats;
+    }
+    if (files_.size() >= max_paths_) {
+      files_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    lru_.emplace_front(path);
+    auto stats = std::make_shared<ResidencyStats>();
+    stats->total = &total_;
+    files_.emplace(lru_.front(), Entry{stats, lru_.begin()});
+    return stats;
+  }
+
+  /// Counters over every file served
+  const ResidencyStats &total() const { return total_; }
+
+  /**
+   * @brief Call fn(path, stats) for every tracked path, most recent first
+   */
+  template <typename Fn> void for_each(Fn fn) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const std::string &path : lru_) {
+      fn(path, *files_.find(path)->second.stats);
+    }
+  }
+};
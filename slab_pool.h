@@ -0,0 +1,90 @@
+/**
+ * @file slab_pool.h
+ * @brief Fixed-size object pool for per-connection state
+ *
+ * Objects are carved out of chunks that are never returned to the heap and
+ * recycled through a free list, so once the pool has grown to the peak
+ * number of live objects, creating and destroying them no longer calls
+ * malloc(). Any thread may create or destroy objects.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Pool of T, grown CHUNK objects at a time
+ */
+template <typename T, size_t CHUNK = 16> class SlabPool {
+  struct Node {
+    alignas(T) unsigned char storage[sizeof(T)];
+    Node *next;
+  };
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Node[]>> chunks_;
+  Node *free_ = nullptr;
+
+  Node *take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_ == nullptr) {
+      chunks_.push_back(std::make_unique<Node[]>(CHUNK));
+      Node *chunk = chunks_.back().get();
+      for (size_t i = 0; i < CHUNK; i++) {
+        chunk[i].next = free_;
+        free_ = &chunk[i];
+      }
+    }
+    Node *node = free_;
+    free_ = node->next;
+    return node;
+  }
+
+public:
+  SlabPool() = default;
+  SlabPool(const SlabPool &) = delete;
+  SlabPool &operator=(const SlabPool &) = delete;
+
+  /**
+   * @brief Returns objects to their pool; for std::unique_ptr
+   */
+  struct Deleter {
+    SlabPool *pool;
+    void operator()(T *object) const { pool->destroy(object); }
+  };
+  using Ptr = std::unique_ptr<T, Deleter>;
+
+  /**
+   * @brief Construct a T in a pooled slot
+   */
+  template <typename... Args> Ptr make(Args &&...args) {
+    Node *node = take();
+    T *object;
+    try {
+      object = new (node->storage) T(std::forward<Args>(args)...);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      node->next = free_;
+      free_ = node;
+      throw;
+    }
+    return Ptr(object, Deleter{this});
+  }
+
+  /**
+   * @brief Destroy an object made by this pool and recycle its slot
+   */
+  void destroy(T *object) {
+    object->~T();
+    // storage is the first member, so the object's address is the node's
+    Node *node = reinterpret_cast<Node *>(object);
+    std::lock_guard<std::mutex> lock(mutex_);
+    node->next = free_;
+    free_ = node;
+  }
+};
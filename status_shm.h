@@ -0,0 +1,409 @@
+/**
+ * @file status_shm.h
+ * @brief Live server state in a shared-memory region
+ *
+ * The server keeps one slot per active connection (client, path, phase,
+ * progress) plus a header of global counters in a POSIX shared-memory
+ * object. Every slot and the header are guarded by a sequence lock: the
+ * writer makes the sequence odd, updates the fields and makes it even
+ * again, and a reader retries if it saw an odd or changed sequence. Readers
+ * such as tools/streamix-top therefore never block the server, and the
+ * server never makes a system call on their behalf.
+ *
+ * The object is readable by the server's user only, as paths and client
+ * addresses are not for every local account. The server refuses to take over
+ * a region whose recorded pid is still alive, and removes the object when it
+ * shuts down.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace status {
+
+constexpr char MAGIC[8] = {'S', 'X', 'S', 'T', 'A', 'T', '1', '\0'};
+constexpr uint32_t VERSION = 1;
+constexpr uint32_t MAX_SLOTS = 4096; ///< Connections shown at once
+
+/**
+ * @brief What a connection is doing
+ */
+enum Phase : uint8_t {
+  READING = 0, ///< Waiting for the request head
+  OPENING = 1, ///< Request parsed, looking up the file
+  SENDING = 2, ///< Headers sent, body in progress
+  CLOSING = 3, ///< Body sent, logging and closing
+};
+
+inline const char *phase_name(uint8_t phase) {
+  static constexpr const char *NAMES[] = {"read", "open", "send", "close"};
+  return phase < 4 ? NAMES[phase] : "?";
+}
+
+/**
+ * @brief Server-wide totals, refreshed periodically
+ */
+struct Counters {
+  uint64_t accepted = 0;
+  uint64_t active = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t responses[6] = {}; ///< By status class: [2] = 2xx ... [5] = 5xx
+  uint64_t untracked = 0;     ///< Connections that found no free slot
+};
+
+/**
+ * @brief Start of the region
+ */
+struct alignas(64) Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t slots;
+  int32_t pid;
+  uint32_t reserved;
+  int64_t started_realtime_ns;
+  uint64_t started_mono_ns;
+  std::atomic<uint32_t> seq;  ///< Seqlock over the fields below
+  uint64_t heartbeat_mono_ns; ///< When the counters were last published
+  Counters counters;
+};
+
+/**
+ * @brief One connection
+ */
+struct alignas(64) Slot {
+  std::atomic<uint32_t> seq;    ///< Seqlock over the fields below
+  std::atomic<uint32_t> in_use; ///< Claimed by a connection thread
+  uint32_t client_ip;           ///< IPv4, network byte order
+  uint16_t client_port;
+  uint8_t phase;
+  uint8_t reserved;
+  uint64_t started_mono_ns; ///< Accept time; identifies the connection
+  uint64_t bytes_sent;      ///< Headers and body so far
+  uint64_t bytes_total;     ///< Body length to send, 0 if not known yet
+  char path[152];           ///< Request target, truncated
+};
+static_assert(sizeof(Slot) == 192, "slots are three cache lines");
+
+constexpr size_t REGION_BYTES = sizeof(Header) + sizeof(Slot) * MAX_SLOTS;
+
+/**
+ * @brief Consistent copy of one slot
+ */
+struct ConnectionView {
+  uint32_t index;
+  uint32_t client_ip;
+  uint16_t client_port;
+  uint8_t phase;
+  uint64_t started_mono_ns;
+  uint64_t bytes_sent;
+  uint64_t bytes_total;
+  std::string path;
+};
+
+/**
+ * @brief Run fn() as a seqlock write section on seq
+ */
+template <typename Fn>
+inline void write_locked(std::atomic<uint32_t> &seq, Fn fn) {
+  uint32_t s = seq.load(std::memory_order_relaxed);
+  seq.store(s + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  fn();
+  seq.store(s + 2, std::memory_order_release);
+}
+
+/**
+ * @brief Run fn() until it has read a consistent state guarded by seq
+ */
+template <typename Fn>
+inline void read_locked(const std::atomic<uint32_t> &seq, Fn fn) {
+  while (true) {
+    uint32_t before = seq.load(std::memory_order_acquire);
+    if (before & 1) {
+      continue;
+    }
+    fn();
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq.load(std::memory_order_relaxed) == before) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief A mapping of the region, for the server (writable) or a reader
+ */
+class Region {
+  void *map_ = nullptr;
+  std::string owned_name_; ///< Unlinked on destruction; empty for readers
+
+  Region() = default;
+
+  /**
+   * @brief Pid of the server using an existing region, 0 if there is none
+   */
+  static int live_owner(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+      return 0;
+    }
+    struct stat st;
+    int pid = 0;
+    if (fstat(fd, &st) == 0 &&
+        st.st_size >= static_cast<off_t>(sizeof(Header))) {
+      Header h;
+      if (pread(fd, &h, sizeof(h), 0) == static_cast<ssize_t>(sizeof(h)) &&
+          memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0 && h.pid > 0 &&
+          h.pid != getpid() && (kill(h.pid, 0) == 0 || errno == EPERM)) {
+        pid = h.pid;
+      }
+    }
+    close(fd);
+    return pid;
+  }
+
+  Header &header() const { return *static_cast<Header *>(map_); }
+  Slot *slots() const {
+    return reinterpret_cast<Slot *>(static_cast<char *>(map_) +
+                                    sizeof(Header));
+  }
+
+public:
+  /**
+   * @brief Create the region as the server
+   *
+   * A region left behind by a server that is gone is replaced.
+   *
+   * @param name Shared-memory object name, e.g. "/streamix.8080"
+   * @param started_mono_ns Server start time on CLOCK_MONOTONIC
+   * @param started_realtime_ns Server start time on CLOCK_REALTIME
+   * @throws std::system_error on failure
+   * @throws std::runtime_error if a running server still uses the region
+   */
+  static std::unique_ptr<Region> create(const std::string &name,
+                                        uint64_t started_mono_ns,
+                                        int64_t started_realtime_ns) {
+    if (int pid = live_owner(name)) {
+      throw std::runtime_error(name + " is in use by pid " +
+                               std::to_string(pid));
+    }
+    // Never write into an object someone else created, whatever its mode
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                      0600);
+    if (fd < 0 || ftruncate(fd, REGION_BYTES) < 0) {
+      int err = errno;
+      if (fd >= 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+      }
+      throw std::system_error(err, std::generic_category(),
+                              "shm_open() failed for " + name);
+    }
+    void *map = mmap(nullptr, REGION_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      int err = errno;
+      shm_unlink(name.c_str());
+      throw std::system_error(err, std::generic_category(), "mmap()");
+    }
+    memset(map, 0, REGION_BYTES);
+    auto region = std::unique_ptr<Region>(new Region);
+    region->map_ = map;
+    region->owned_name_ = name;
+    Header &h = region->header();
+    h.version = VERSION;
+    h.slots = MAX_SLOTS;
+    h.pid = getpid();
+    h.started_realtime_ns = started_realtime_ns;
+    h.started_mono_ns = started_mono_ns;
+    // Magic last: a reader that sees it sees an initialized region
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    return region;
+  }
+
+  /**
+   * @brief Map an existing region read-only
+   * @throws std::system_error if it does not exist
+   * @throws std::runtime_error if it is not a status region of this version
+   */
+  static std::unique_ptr<Region> open_readonly(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "shm_open() failed for " + name);
+    }
+    // Touching a page past the end of the object would raise SIGBUS
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(REGION_BYTES)) {
+      close(fd);
+      throw std::runtime_error(name + ": not a streamix status region");
+    }
+    void *map = mmap(nullptr, REGION_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(), "mmap()");
+    }
+    auto region = std::unique_ptr<Region>(new Region);
+    region->map_ = map;
+    const Header &h = region->header();
+    if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION ||
+        h.slots != MAX_SLOTS) {
+      throw std::runtime_error(name + ": not a streamix status region");
+    }
+    return region;
+  }
+
+  ~Region() {
+    remove();
+    if (map_ != nullptr) {
+      munmap(map_, REGION_BYTES);
+    }
+  }
+
+  /**
+   * @brief Remove the object the server created, so readers stop finding it
+   *
+   * The mapping stays valid. Safe to call more than once.
+   */
+  void remove() {
+    if (!owned_name_.empty()) {
+      shm_unlink(owned_name_.c_str());
+      owned_name_.clear();
+    }
+  }
+
+  Region(const Region &) = delete;
+  Region &operator=(const Region &) = delete;
+
+  /**
+   * @brief Take a free slot for a new connection
+   * @param hint Where to start looking, e.g. the socket fd, so concurrent
+   *        claims rarely contend
+   * @return Slot* The slot, or nullptr if all are in use
+   */
+  Slot *claim(uint32_t hint, uint32_t client_ip, uint16_t client_port,
+              uint64_t started_mono_ns) {
+    for (uint32_t n = 0; n < MAX_SLOTS; n++) {
+      Slot &slot = slots()[(hint + n) % MAX_SLOTS];
+      uint32_t expected = 0;
+      if (slot.in_use.load(std::memory_order_relaxed) == 0 &&
+          slot.in_use.compare_exchange_strong(expected, 1,
+                                              std::memory_order_acquire)) {
+        write_locked(slot.seq, [&] {
+          slot.client_ip = client_ip;
+          slot.client_port = client_port;
+          slot.phase = READING;
+          slot.started_mono_ns = started_mono_ns;
+          slot.bytes_sent = 0;
+          slot.bytes_total = 0;
+          slot.path[0] = '\0';
+        });
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+
+  static void release(Slot *slot) {
+    slot->in_use.store(0, std::memory_order_release);
+  }
+
+  static void set_phase(Slot *slot, Phase phase) {
+    write_locked(slot->seq, [&] { slot->phase = phase; });
+  }
+
+  static void set_path(Slot *slot, std::string_view path) {
+    write_locked(slot->seq, [&] {
+      size_t n = std::min(path.size(), sizeof(slot->path) - 1);
+      memcpy(slot->path, path.data(), n);
+      slot->path[n] = '\0';
+    });
+  }
+
+  static void set_total(Slot *slot, uint64_t bytes_total) {
+    write_locked(slot->seq, [&] { slot->bytes_total = bytes_total; });
+  }
+
+  static void add_sent(Slot *slot, uint64_t n) {
+    write_locked(slot->seq, [&] { slot->bytes_sent += n; });
+  }
+
+  /**
+   * @brief Publish new global counters
+   */
+  void publish(const Counters &counters, uint64_t now_mono_ns) {
+    Header &h = header();
+    write_locked(h.seq, [&] {
+      h.counters = counters;
+      h.heartbeat_mono_ns = now_mono_ns;
+    });
+  }
+
+  int pid() const { return header().pid; }
+  uint64_t started_mono_ns() const { return header().started_mono_ns; }
+  int64_t started_realtime_ns() const { return header().started_realtime_ns; }
+
+  /**
+   * @brief Consistent copy of the global counters
+   * @param heartbeat_mono_ns Receives when they were published
+   */
+  Counters counters(uint64_t &heartbeat_mono_ns) const {
+    const Header &h = header();
+    Counters c;
+    read_locked(h.seq, [&] {
+      c = h.counters;
+      heartbeat_mono_ns = h.heartbeat_mono_ns;
+    });
+    return c;
+  }
+
+  /**
+   * @brief Consistent copies of all slots in use
+   */
+  std::vector<ConnectionView> connections() const {
+    std::vector<ConnectionView> out;
+    for (uint32_t i = 0; i < MAX_SLOTS; i++) {
+      const Slot &slot = slots()[i];
+      if (slot.in_use.load(std::memory_order_acquire) == 0) {
+        continue;
+      }
+      ConnectionView v;
+      char path[sizeof(slot.path)];
+      read_locked(slot.seq, [&] {
+        v.client_ip = slot.client_ip;
+        v.client_port = slot.client_port;
+        v.phase = slot.phase;
+        v.started_mono_ns = slot.started_mono_ns;
+        v.bytes_sent = slot.bytes_sent;
+        v.bytes_total = slot.bytes_total;
+        memcpy(path, slot.path, sizeof(path));
+      });
+      path[sizeof(path) - 1] = '\0';
+      v.index = i;
+      v.path = path;
+      out.push_back(std::move(v));
+    }
+    return out;
+  }
+};
+
+} // namespace status
@@ -7,28 +7,84 @@
  * threads.
  */
 
+#include "access_log.h"
+#include "acceptor.h"
+#include "alloc_tracking.h"
+#include "block_cache.h"
+#include "deadlines.h"
+#include "egress.h"
+#include "http.h"
+#include "io_pool.h"
+#include "listener.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "proxy_cache.h"
+#include "residency.h"
+#include "slab_pool.h"
+#include "status_shm.h"
+#include "synthetic.h"
+#include "tcp_sampler.h"
+#include "tiering.h"
+#include "trace.h"
+
 #include <arpa/inet.h>
+#include <climits>
 #include <cstring>
 #include <fcntl.h>
+#include <getopt.h>
+#include <iterator>
 #include <memory>
+#include <memory_resource>
+#include <optional>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
 #include <string_view>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <system_error>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 // Server configuration
 namespace config {
-// TODO: Make this configurable either using environment variables or command
-// line arguments
 constexpr int PORT = 8080; ///< Default server port
 // Make sure to run `make test-file` to create the test file
 constexpr std::string_view FILE_PATH = "./test_file";
 constexpr size_t SEND_CHUNK_SIZE = 8 * 1024 * 1024; ///< 8MB chunks for sendfile
+constexpr size_t REQUEST_ARENA_SIZE = 8 * 1024; ///< Per-request scratch memory
+
+/**
+ * @brief Runtime settings, defaulting to the constants above
+ *
+ * Filled in from the command line by parse_options() before the server
+ * starts and read-only afterwards.
+ */
+struct Options {
+  int port = PORT;                      ///< Listening port
+  int admin_port = 0;                   ///< Port for /metrics, 0 = main port
+  in_addr admin_bind{htonl(INADDR_LOOPBACK)}; ///< Admin listener address
+  std::string file_path{FILE_PATH};     ///< File served when root is unset
+  std::string root;                     ///< Serve files under this directory
+  TierConfig tiers;                     ///< Fast tier, if fast_root is set
+  ProxyConfig proxy;                    ///< Reverse proxy, if upstream is set
+  size_t block_cache_mb = 0;            ///< Block cache size, 0 disables it
+  size_t residency_paths = 0;           ///< Paths with own page-cache counts
+  unsigned tcp_sample_ms = 100;         ///< TCP_INFO sampling interval
+  AccessLogConfig access_log;           ///< Path "off" disables the log
+  std::string status_shm;               ///< "" = /streamix.<port>, "off"
+  bool synthetic = false;               ///< Serve /synthetic/SIZE
+  DeadlineConfig deadlines;             ///< Client connection timeouts
+  ListenerConfig listener;              ///< Main listener socket options
+  ListenerConfig admin_listener;        ///< Admin listener socket options
+  EgressConfig egress;                  ///< Initial bandwidth limits
+  IoPoolConfig io_defaults;             ///< Disk I/O pool for unlisted devices
+  std::vector<std::pair<std::string, IoPoolConfig>>
+      io_devices; ///< Per-device pool overrides, keyed by a path on the device
+};
 } // namespace config
 
 /**
@@ -44,18 +100,9 @@ constexpr size_t SEND_CHUNK_SIZE = 8 * 1024 * 1024; ///< 8MB chunks for sendfile
  * @brief Client connection information
  */
 struct ClientInfo {
-  int fd;         ///< Client socket file descriptor
-  std::string ip; ///< Client IP address in string format
-  uint16_t port;  ///< Client port number in host byte order
-
-  /**
-   * @brief Construct a new ClientInfo object
-   * @param fd_ File descriptor of the client socket
-   * @param ip_ Client IP address
-   * @param port_ Client port number
-   */
-  ClientInfo(int fd_, std::string ip_, uint16_t port_)
-      : fd(fd_), ip(std::move(ip_)), port(port_) {}
+  int fd;        ///< Client socket file descriptor
+  uint32_t ip;   ///< Client IPv4 address in network byte order
+  uint16_t port; ///< Client port number in host byte order
 };
 
 // Socket class for RAII management of socket descriptors
@@ -102,6 +149,9 @@ public:
     return *this;
   }
 
+  // Underlying descriptor, still owned by the Socket
+  int fd() const { return fd_; }
+
   // Enable address reuse (useful for quick restarts)
   void set_reuse_addr(bool on = true) {
     int optval = on ? 1 : 0;
@@ -135,32 +185,37 @@ public:
       handle_error("accept() failed");
     }
 
-    // Convert client IP to string
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-
-    return {client_fd, client_ip, ntohs(client_addr.sin_port)};
+    return {client_fd, client_addr.sin_addr.s_addr,
+            ntohs(client_addr.sin_port)};
   }
 };
 
 // Create and configure a server socket
-Socket create_server_socket() {
+Socket create_server_socket(int port, const ListenerConfig &listener = {},
+                            in_addr address = {INADDR_ANY}) {
   // Create TCP socket
   Socket sock(AF_INET, SOCK_STREAM);
   sock.set_reuse_addr(true);
+  configure_listener(sock.fd(), listener);
 
   // Configure server address
   sockaddr_in server_addr{};
   server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(config::PORT);
-  server_addr.sin_addr.s_addr = INADDR_ANY;
+  server_addr.sin_port = htons(port);
+  server_addr.sin_addr = address;
 
   // Bind and listen
   sock.bind(reinterpret_cast<const sockaddr *>(&server_addr),
             sizeof(server_addr));
   sock.listen();
 
-  printf("Server listening on port %d\n", config::PORT);
+  if (address.s_addr == htonl(INADDR_ANY)) {
+    printf("Server listening on port %d\n", port);
+  } else {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &address, ip, sizeof(ip));
+    printf("Server listening on %s:%d\n", ip, port);
+  }
   return sock;
 }
 
@@ -174,6 +229,9 @@ Socket create_server_socket() {
 class File {
   int fd_ = -1;    ///< File descriptor (-1 if invalid)
   off_t size_ = 0; ///< Size of the file in bytes
+  dev_t dev_ = 0;  ///< Device the file lives on
+  ino_t ino_ = 0;  ///< Inode number on that device
+  int64_t mtime_ns_ = 0; ///< Last modification time in nanoseconds
 
 public:
   /**
@@ -182,8 +240,15 @@ public:
    * @throws std::system_error if the file cannot be opened or its size cannot
    * be determined
    */
-  explicit File(const char *path) {
-    fd_ = open(path, O_RDONLY);
+  explicit File(const char *path) : File(open(path, O_RDONLY)) {}
+
+  /**
+   * @brief Take ownership of an open file descriptor
+   * @param fd Descriptor of a regular file; negative if opening it failed,
+   * with errno set
+   * @throws std::system_error if fd is invalid or not a regular file
+   */
+  explicit File(int fd) : fd_(fd) {
     if (fd_ < 0) {
       handle_error("open() failed");
     }
@@ -194,7 +259,15 @@ public:
       close(fd_);
       handle_error("fstat() failed");
     }
+    if (!S_ISREG(st.st_mode)) {
+      close(fd_);
+      errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+      handle_error("not a regular file");
+    }
     size_ = st.st_size;
+    dev_ = st.st_dev;
+    ino_ = st.st_ino;
+    mtime_ns_ = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
   }
 
   /**
@@ -210,7 +283,9 @@ public:
   File &operator=(const File &) = delete;
 
   // Allow moving
-  File(File &&other) noexcept : fd_(other.fd_), size_(other.size_) {
+  File(File &&other) noexcept
+      : fd_(other.fd_), size_(other.size_), dev_(other.dev_),
+        ino_(other.ino_), mtime_ns_(other.mtime_ns_) {
     other.fd_ = -1;
   }
 
@@ -221,6 +296,9 @@ public:
         close(fd_);
       fd_ = other.fd_;
       size_ = other.size_;
+      dev_ = other.dev_;
+      ino_ = other.ino_;
+      mtime_ns_ = other.mtime_ns_;
       other.fd_ = -1;
     }
     return *this;
@@ -237,11 +315,238 @@ public:
    * @return off_t Size of the file in bytes
    */
   off_t size() const { return size_; }
+
+  /**
+   * @brief Get the device the file lives on
+   * @return dev_t Device ID, used to pick the disk I/O pool
+   */
+  dev_t dev() const { return dev_; }
+
+  /**
+   * @brief Get the key of one block of this version of the file
+   * @param index Block number
+   * @return BlockKey Key for the block cache
+   */
+  BlockKey block_key(uint64_t index) const {
+    return {dev_, ino_, mtime_ns_, index};
+  }
+};
+
+// Status codes with their own responses_total series; the rest count as other
+constexpr int COUNTED_STATUSES[] = {200, 206, 400, 403, 404,
+                                    405, 408, 416, 500, 502};
+constexpr size_t NUM_COUNTED_STATUSES = std::size(COUNTED_STATUSES);
+
+/**
+ * @brief Server-wide counters, indexing CounterSlot::values
+ */
+enum Counter : size_t {
+  CONNECTIONS_ACCEPTED,
+  CONNECTIONS_ACTIVE, ///< Incremented and decremented by the same thread
+  BYTES_SENT,
+  SENDFILE_ERRORS,
+  STATUS_UNTRACKED, ///< Connections that found no free status slot
+  CONNECTIONS_FASTOPEN, ///< Connections whose SYN carried request data
+  ACCEPT_ALLOCATIONS,  ///< Heap allocations by the accept loop (tracking only)
+  REQUEST_ALLOCATIONS, ///< Heap allocations by client threads (tracking only)
+  RESPONSES, ///< First of NUM_COUNTED_STATUSES + 1 per-status counters
+  NUM_COUNTERS = RESPONSES + NUM_COUNTED_STATUSES + 1,
+};
+
+/**
+ * @brief One thread's share of the server-wide counters
+ */
+struct CounterSlot {
+  std::atomic<uint64_t> values[NUM_COUNTERS] = {};
+};
+
+/**
+ * @brief Points in a request's life that are timestamped
+ */
+enum Mark : size_t {
+  ACCEPTED,            ///< accept() returned
+  FIRST_BYTE_RECEIVED, ///< First recv() of the request returned data
+  HEADERS_PARSED,      ///< Request head read and parsed
+  FILE_OPENED,         ///< File opened (or proxied object size known)
+  FIRST_BYTE_SENT,     ///< Response headers written
+  LAST_BYTE_SENT,      ///< Response body written
+  NUM_MARKS,
+};
+
+// Phase names for the interval ending at each mark after ACCEPTED
+constexpr const char *PHASE_NAMES[NUM_MARKS] = {
+    "",           "accept_to_first_byte", "first_byte_to_parsed",
+    "parsed_to_opened", "opened_to_first_sent", "first_sent_to_last_sent",
+};
+
+// Upper bounds of the body size classes throughput is broken down by
+constexpr off_t SIZE_CLASS_LIMITS[] = {64 << 10, 1 << 20, 16 << 20, 256 << 20};
+constexpr const char *SIZE_CLASS_NAMES[] = {"0-64k", "64k-1m", "1m-16m",
+                                            "16m-256m", "256m+"};
+constexpr size_t NUM_SIZE_CLASSES = std::size(SIZE_CLASS_NAMES);
+
+/**
+ * @brief Latency and throughput distributions, exported by /metrics
+ */
+struct LatencyMetrics {
+  metrics::Histogram phases[NUM_MARKS]; ///< ns, indexed by end mark
+  metrics::Histogram ttfb;              ///< ns, accept to first byte sent
+  metrics::Histogram total;             ///< ns, accept to last byte sent
+  metrics::Histogram throughput[NUM_SIZE_CLASSES]; ///< Body bytes per second
+};
+
+/**
+ * @brief State shared by the accept loop and all client threads
+ *
+ * Built in main() before the first connection is accepted and not modified
+ * afterwards, so client threads can read it without locking.
+ */
+struct ServerContext {
+  config::Options options;          ///< Runtime settings
+  std::unique_ptr<IoScheduler> io;  ///< Per-device disk I/O pools
+  ResidencyTracker residency;       ///< Page-cache hit rates
+  std::unique_ptr<BlockCache> block_cache; ///< Optional, null if disabled
+  std::unique_ptr<TieredStore<File>> tiers; ///< Optional, null if disabled
+  std::unique_ptr<ProxyCache> proxy;       ///< Optional, null if disabled
+  metrics::PerThread<CounterSlot> counters; ///< Summed by /metrics
+  LatencyMetrics latency;                   ///< Request phase timings
+  TcpMetrics tcp;                           ///< Sampled TCP_INFO values
+  std::unique_ptr<AccessLog> access_log;    ///< Optional, null if disabled
+  std::unique_ptr<status::Region> status;   ///< Optional, null if disabled
+  std::unique_ptr<synthetic::Source> synthetic; ///< Optional, null if disabled
+  std::unique_ptr<Deadlines> deadlines; ///< Optional, null if all disabled
+  std::unique_ptr<Acceptor> acceptor;   ///< Main listener's accept loop
+  std::unique_ptr<EgressShaper> egress; ///< Bandwidth limits, set at runtime
+  rlim_t fd_limit = 0;                  ///< RLIMIT_NOFILE after raising it
+};
+
+ServerContext server;
+
+/**
+ * @brief Add to one of the calling thread's counters
+ */
+inline void count(size_t counter, uint64_t n = 1) {
+  metrics::add(server.counters.local().values[counter], n);
+}
+
+/**
+ * @brief Status and size of the response the current thread is sending
+ *
+ * Client threads serve one request each, so this is per request. Read back
+ * by handle_client() for the access log.
+ */
+struct ResponseTally {
+  int status = 0;
+  uint64_t bytes = 0;
+  off_t content_size = 0;  ///< Size of the file served, if any
+  off_t range_start = -1;  ///< First body byte of a 206
+  off_t range_length = 0;  ///< Body bytes of a 206
+  status::Slot *slot = nullptr; ///< This connection's status slot, if any
+  Deadlines::Entry *deadline = nullptr; ///< This connection's, if any
+  EgressShaper::Flow *egress = nullptr; ///< This connection's limits
+};
+thread_local ResponseTally this_response;
+
+/**
+ * @brief Timestamps of one request, recorded into server.latency when done
+ *
+ * Phases are only recorded when both of their marks were reached, so a
+ * request rejected after parsing contributes to the early phases alone.
+ */
+struct RequestTimeline {
+  uint64_t at[NUM_MARKS] = {}; ///< metrics::now_ns() per mark, 0 if unset
+  off_t body_bytes = 0;        ///< Body length sent, for throughput
+
+  void mark(Mark m) {
+    at[m] = metrics::now_ns();
+    if (this_response.deadline != nullptr) {
+      advance_deadline(m, *this_response.deadline);
+    }
+    if (this_response.slot == nullptr) {
+      return;
+    }
+    if (m == HEADERS_PARSED) {
+      status::Region::set_phase(this_response.slot, status::OPENING);
+    } else if (m == FIRST_BYTE_SENT) {
+      status::Region::set_phase(this_response.slot, status::SENDING);
+    } else if (m == LAST_BYTE_SENT) {
+      status::Region::set_phase(this_response.slot, status::CLOSING);
+    }
+  }
+
+  // Each phase that waits on the client has its own deadline
+  void advance_deadline(Mark m, Deadlines::Entry &deadline) {
+    if (m == FIRST_BYTE_RECEIVED) {
+      server.deadlines->start_header(deadline, at[m]);
+    } else if (m == HEADERS_PARSED || m == LAST_BYTE_SENT) {
+      server.deadlines->cancel(deadline);
+    } else if (m == FIRST_BYTE_SENT) {
+      server.deadlines->start_transfer(deadline, at[m]);
+    }
+  }
+
+  ~RequestTimeline() {
+    LatencyMetrics &latency = server.latency;
+    for (size_t m = FIRST_BYTE_RECEIVED; m < NUM_MARKS; m++) {
+      if (at[m - 1] != 0 && at[m] != 0) {
+        latency.phases[m].record(at[m] - at[m - 1]);
+      }
+    }
+    if (at[ACCEPTED] == 0 || at[FIRST_BYTE_SENT] == 0) {
+      return;
+    }
+    latency.ttfb.record(at[FIRST_BYTE_SENT] - at[ACCEPTED]);
+    if (at[LAST_BYTE_SENT] == 0) {
+      return;
+    }
+    latency.total.record(at[LAST_BYTE_SENT] - at[ACCEPTED]);
+    uint64_t elapsed = at[LAST_BYTE_SENT] - at[FIRST_BYTE_SENT];
+    if (body_bytes > 0 && elapsed > 0) {
+      size_t size_class = 0;
+      while (size_class < std::size(SIZE_CLASS_LIMITS) &&
+             body_bytes >= SIZE_CLASS_LIMITS[size_class]) {
+        size_class++;
+      }
+      latency.throughput[size_class].record(body_bytes * 1000000000ULL /
+                                            elapsed);
+    }
+  }
 };
 
+/**
+ * @brief Count a response against its status code
+ */
+inline void count_response(int status_code) {
+  size_t i = 0;
+  while (i < NUM_COUNTED_STATUSES && COUNTED_STATUSES[i] != status_code) {
+    i++;
+  }
+  count(RESPONSES + i);
+  this_response.status = status_code;
+}
+
+/**
+ * @brief Count bytes written to the client
+ */
+inline void count_sent(uint64_t n) {
+  count(BYTES_SENT, n);
+  this_response.bytes += n;
+  if (this_response.slot != nullptr) {
+    status::Region::add_sent(this_response.slot, n);
+  }
+  if (this_response.deadline != nullptr) {
+    this_response.deadline->progress.store(this_response.bytes,
+                                           std::memory_order_relaxed);
+  }
+}
+
 /**
  * @brief Sends an HTTP error response to the client
  *
+ * The status line and framing are formatted on the stack and sent together
+ * with the caller's headers and body in one sendmsg(), without building the
+ * response in a heap string.
+ *
  * @param client_fd Client socket file descriptor
  * @param status_code HTTP status code
  * @param status_text HTTP status text
@@ -249,188 +554,2162 @@ public:
  * @param body Response body (can be empty)
  */
 void send_http_response(int client_fd, int status_code,
-                        const std::string &status_text,
-                        const std::string &headers, const std::string &body) {
-  std::string response =
-      "HTTP/1.1 " + std::to_string(status_code) + " " + status_text + "\r\n";
-  if (!headers.empty()) {
-    response += headers;
-  }
-  if (!body.empty()) {
-    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
-  }
-  response += "Connection: close\r\n";
-  response += "\r\n";
-  response += body;
-
-  ssize_t sent =
-      send(client_fd, response.c_str(), response.size(), MSG_NOSIGNAL);
+                        std::string_view status_text, std::string_view headers,
+                        std::string_view body) {
+  char status_line[128];
+  size_t status_len = format_status_line(status_line, sizeof(status_line),
+                                         status_code, status_text);
+  char framing[64];
+  size_t framing_len = format_framing(framing, sizeof(framing), body.size());
+
+  iovec parts[] = {
+      {status_line, status_len},
+      {const_cast<char *>(headers.data()), headers.size()},
+      {framing, framing_len},
+      {const_cast<char *>(body.data()), body.size()},
+  };
+  msghdr msg{};
+  msg.msg_iov = parts;
+  msg.msg_iovlen = std::size(parts);
+
+  count_response(status_code);
+  ssize_t sent = sendmsg(client_fd, &msg, MSG_NOSIGNAL);
   if (sent < 0 && errno != EPIPE) {
     perror("Failed to send HTTP response");
   }
+  if (sent > 0) {
+    count_sent(sent);
+  }
+}
+
+/**
+ * @brief Shorten the next body write to what the egress limits allow now
+ *
+ * Sleeps while every byte would exceed a limit. The transfer deadline starts
+ * a new window afterwards, since the client did not cause the wait.
+ *
+ * @param want Bytes the caller is about to send
+ * @return off_t Bytes it may send, between 1 and want
+ */
+off_t egress_allowance(off_t want) {
+  if (this_response.egress == nullptr) {
+    return want;
+  }
+  uint64_t slept_ns = 0;
+  off_t allowed = this_response.egress->acquire(want, slept_ns);
+  if (slept_ns != 0 && this_response.deadline != nullptr) {
+    server.deadlines->start_transfer(*this_response.deadline,
+                                     metrics::now_ns());
+  }
+  return allowed;
+}
+
+/**
+ * @brief Return the part of an allowance a write did not use
+ */
+void egress_unused(off_t allowed, ssize_t sent) {
+  if (this_response.egress != nullptr && sent < allowed) {
+    this_response.egress->refund(allowed - std::max<ssize_t>(sent, 0));
+  }
 }
 
 /**
  * @brief Sends a file to the client using zero-copy sendfile
  *
+ * Each range is probed for page-cache residency first. Resident data is sent
+ * straight away; ranges that would hit the disk are read through the I/O pool
+ * for the file's device, and the chunk after the one being sent is queued
+ * there ahead of time so disk reads overlap the network send. Hot transfers
+ * therefore never wait behind cold ones in the pool queue.
+ *
  * @param client_fd Client socket file descriptor
  * @param file File object to send
+ * @param start Offset of the first byte to send
+ * @param length Number of bytes to send
+ * @param residency Counters to record hits and misses against
+ * @param tcp Sampler for the client connection, polled between sends
  * @return true if successful, false on error
  */
-bool send_file_content(int client_fd, const File &file) {
-  off_t offset = 0;
-  off_t remaining = file.size();
+bool send_file_content(int client_fd, const File &file, off_t start,
+                       off_t length, ResidencyStats &residency,
+                       TcpSampler &tcp) {
+  off_t offset = start;
+  off_t remaining = length;
+  const off_t end = start + length;
   const off_t chunk_size = config::SEND_CHUNK_SIZE;
 
+  // Reads routed to the I/O pool: a miss being served now, and the lookahead
+  // covering [ahead_start, ahead_end). Requests wait for themselves on
+  // destruction, so early returns are safe.
+  IoRequest fetch;
+  IoRequest ahead;
+  off_t ahead_start = 0;
+  off_t ahead_end = 0;
+
   while (remaining > 0) {
-    ssize_t sent = sendfile(client_fd, file.fd(), &offset,
-                            std::min(remaining, chunk_size));
+    off_t send_len = std::min(remaining, chunk_size);
+
+    if (offset >= ahead_start && offset < ahead_end) {
+      // Fetched by the lookahead, which only queues non-resident ranges
+      ahead.wait();
+      send_len = std::min(send_len, ahead_end - offset);
+      residency.record(0, send_len);
+    } else {
+      size_t resident = resident_prefix(file.fd(), offset, send_len);
+      if (resident > 0) {
+        send_len = resident;
+        residency.record(resident, 0);
+      } else {
+        // Read the miss through the pool so the device sees bounded queue
+        // depth and the configured ioprio; if it is full, read inline
+        residency.record(0, send_len);
+        if (server.io->prefetch(fetch, file.fd(), file.dev(), offset,
+                                send_len)) {
+          fetch.wait();
+        }
+      }
+    }
+
+    // Queue the non-resident part of the next chunk unless already queued
+    off_t next = offset + send_len;
+    if (ahead_end <= next && next < end) {
+      ahead.wait();
+      size_t window = std::min(end - next, chunk_size);
+      size_t resident = resident_prefix(file.fd(), next, window);
+      if (resident < window &&
+          server.io->prefetch(ahead, file.fd(), file.dev(), next + resident,
+                              window - resident)) {
+        ahead_start = next + resident;
+        ahead_end = next + window;
+      }
+    }
+
+    off_t sent_from = offset;
+    send_len = egress_allowance(send_len);
+    uint64_t send_begin =
+        STREAMIX_TRACE_ENABLED(sendfile) ? metrics::now_ns() : 0;
+    ssize_t sent = sendfile(client_fd, file.fd(), &offset, send_len);
+    STREAMIX_TRACE(sendfile, client_fd, sent_from, sent,
+                   metrics::now_ns() - send_begin);
+    egress_unused(send_len, sent);
 
     if (sent <= 0) {
       if (errno == EAGAIN || errno == EINTR) {
         continue; // Retry on temporary errors
       }
       if (errno != EPIPE) { // Ignore broken pipe
+        STREAMIX_TRACE(error, client_fd, errno, "sendfile");
         perror("sendfile() failed");
+        count(SENDFILE_ERRORS);
         return false;
       }
       break;
     }
+    count_sent(sent);
     remaining -= sent;
+    tcp.poll();
   }
   return true;
 }
 
 /**
- * @brief Handles a client connection in a separate thread
+ * @brief Write a memory buffer to the client in full
+ * @return true if everything was sent, false on error or disconnect
+ */
+bool send_all(int client_fd, const char *data, size_t length) {
+  while (length > 0) {
+    off_t allowed = egress_allowance(length);
+    ssize_t sent = send(client_fd, data, allowed, MSG_NOSIGNAL);
+    egress_unused(allowed, sent);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EPIPE) {
+        perror("send() failed");
+      }
+      return false;
+    }
+    count_sent(sent);
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+/**
+ * @brief Sends a byte range of a file, using the block cache when enabled
  *
- * This function is executed in a separate thread for each client connection.
- * It processes the HTTP request and sends the appropriate response.
+ * Blocks present in the cache are written straight from memory. For a
+ * missing block the range falls back to send_file_content(), and that block
+ * and the one after it are queued for a background load, so a sequential
+ * reader finds the next block cached by the time it gets there.
  *
- * @param arg Pointer to the client file descriptor (int)
- * @return void* Always returns NULL
+ * @param client_fd Client socket file descriptor
+ * @param file File object to send
+ * @param start Offset of the first byte to send
+ * @param length Number of bytes to send
+ * @param residency Page-cache counters for the file path
+ * @param tcp Sampler for the client connection
+ * @return true if successful, false on error
  */
-void *handle_client(void *arg) {
-  int client_fd = *(int *)arg;
-  free(arg); // Free the allocated memory
+bool send_range(int client_fd, const File &file, off_t start, off_t length,
+                ResidencyStats &residency, TcpSampler &tcp) {
+  BlockCache *cache = server.block_cache.get();
+  if (cache == nullptr) {
+    return send_file_content(client_fd, file, start, length, residency, tcp);
+  }
 
-  try {
-    // Read client request (first 4KB should be enough for headers)
-    char buffer[4096];
-    ssize_t bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_read <= 0) {
-      close(client_fd);
-      return NULL;
+  const off_t block_size = BlockCache::BLOCK_SIZE;
+  const off_t end = start + length;
+  off_t pos = start;
+  while (pos < end) {
+    uint64_t index = pos / block_size;
+    off_t block_start = index * block_size;
+    off_t block_end = std::min(block_start + block_size, end);
+
+    BlockCache::Ref block = cache->lookup(file.block_key(index));
+    if (block) {
+      if (!send_all(client_fd, block.data() + (pos - block_start),
+                    block_end - pos)) {
+        return false;
+      }
+    } else {
+      for (uint64_t i = index; i <= index + 1; i++) {
+        off_t offset = i * block_size;
+        if (offset < file.size()) {
+          cache->admit(file.block_key(i), *server.io, file.fd(), file.dev(),
+                       std::min(block_size, file.size() - offset));
+        }
+      }
+      if (!send_file_content(client_fd, file, pos, block_end - pos,
+                             residency, tcp)) {
+        return false;
+      }
     }
-    buffer[bytes_read] = '\0';
+    pos = block_end;
+    tcp.poll();
+  }
+  return true;
+}
 
-    // Parse request line
-    std::string_view request(buffer);
+/**
+ * @brief Work out the byte range to send and send the response headers
+ *
+ * Sends 200 or 206 with the matching Content-Length/Content-Range, or a
+ * complete 416 response if the requested range lies beyond the end.
+ *
+ * @param client_fd Client socket file descriptor
+ * @param request Parsed request (for its Range header)
+ * @param size Size of the representation
+ * @param start Receives the first byte to send
+ * @param length Receives the number of bytes to send
+ * @return false if the response is already complete (416)
+ */
+bool send_content_headers(int client_fd, const HttpRequest &request,
+                          off_t size, off_t &start, off_t &length) {
+  start = 0;
+  length = size;
+  RangeStatus range = parse_range(request.range, size, start, length);
+  if (range == RangeStatus::UNSATISFIABLE) {
+    send_http_response(client_fd, 416, "Range Not Satisfiable",
+                       "Content-Type: text/plain\r\nContent-Range: bytes */" +
+                           std::to_string(size) + "\r\n",
+                       "416 Range Not Satisfiable\n");
+    return false;
+  }
 
-    // Check for GET or HEAD method
-    bool is_head = (request.find("HEAD ") == 0);
-    if (!is_head && request.find("GET ") != 0) {
-      // Method not allowed
-      std::string allow_header = "Allow: GET, HEAD\r\n";
-      send_http_response(client_fd, 405, "Method Not Allowed",
-                         "Content-Type: text/plain\r\n" + allow_header,
-                         "405 Method Not Allowed\n");
-      shutdown(client_fd, SHUT_RDWR);
-      close(client_fd);
-      return NULL;
+  if (this_response.slot != nullptr && request.method != "HEAD") {
+    status::Region::set_total(this_response.slot, length);
+  }
+
+  // Build and send headers
+  char headers[256];
+  bool partial = range == RangeStatus::SATISFIABLE;
+  this_response.content_size = size;
+  if (partial) {
+    this_response.range_start = start;
+    this_response.range_length = length;
+  }
+  size_t len = format_content_headers(headers, sizeof(headers), start, length,
+                                      size, partial);
+  if (partial) {
+    send_http_response(client_fd, 206, "Partial Content",
+                       std::string_view(headers, len), "");
+  } else {
+    send_http_response(client_fd, 200, "OK", std::string_view(headers, len),
+                       "");
+  }
+  return true;
+}
+
+/**
+ * @brief Sends a range of synthetic content with sendfile() from its memfd
+ *
+ * Each period of the response is a contiguous range of the memfd, starting a
+ * little further on for every period, so the range is sent in pieces that
+ * each end at the next period boundary.
+ *
+ * @param client_fd Client socket file descriptor
+ * @param start Offset of the first byte to send
+ * @param length Number of bytes to send
+ * @param tcp Sampler for the client connection
+ * @return true if successful, false on error
+ */
+bool send_synthetic(int client_fd, off_t start, off_t length,
+                    TcpSampler &tcp) {
+  int source = server.synthetic->fd();
+  off_t period = synthetic::PERIOD;
+  while (length > 0) {
+    off_t offset = synthetic::source_offset(start);
+    off_t send_len =
+        egress_allowance(std::min(length, period - start % period));
+    uint64_t send_begin =
+        STREAMIX_TRACE_ENABLED(sendfile) ? metrics::now_ns() : 0;
+    ssize_t sent = sendfile(client_fd, source, &offset, send_len);
+    STREAMIX_TRACE(sendfile, client_fd, start, sent,
+                   metrics::now_ns() - send_begin);
+    egress_unused(send_len, sent);
+    if (sent <= 0) {
+      if (sent < 0 && (errno == EAGAIN || errno == EINTR)) {
+        continue;
+      }
+      if (sent < 0 && errno != EPIPE) {
+        STREAMIX_TRACE(error, client_fd, errno, "sendfile");
+        perror("sendfile() failed");
+        count(SENDFILE_ERRORS);
+        return false;
+      }
+      break;
     }
+    count_sent(sent);
+    start += sent;
+    length -= sent;
+    tcp.poll();
+  }
+  return true;
+}
 
-    // Open file to send
-    File file(config::FILE_PATH.data());
+/**
+ * @brief Serve /synthetic/SIZE from generated content
+ * @param client_fd Client socket file descriptor
+ * @param request Parsed request, its target starting with synthetic::PREFIX
+ * @param is_head Whether to omit the body
+ * @param timeline Marked as the response is sent
+ * @param tcp Sampler for the client connection
+ */
+void serve_synthetic(int client_fd, const HttpRequest &request, bool is_head,
+                     RequestTimeline &timeline, TcpSampler &tcp) {
+  off_t size = 0;
+  if (!synthetic::parse_size(request.target.substr(synthetic::PREFIX.size()),
+                             size)) {
+    send_http_response(client_fd, 404, "Not Found",
+                       "Content-Type: text/plain\r\n", "404 Not Found\n");
+    return;
+  }
+  timeline.mark(FILE_OPENED);
 
-    // Build and send headers
-    std::string headers =
-        "Content-Length: " + std::to_string(file.size()) + "\r\n";
-    headers += "Content-Type: application/octet-stream\r\n";
+  off_t start = 0;
+  off_t length = size;
+  if (!send_content_headers(client_fd, request, size, start, length)) {
+    return;
+  }
+  timeline.mark(FIRST_BYTE_SENT);
+  if (is_head) {
+    timeline.mark(LAST_BYTE_SENT);
+    return;
+  }
+  if (send_synthetic(client_fd, start, length, tcp)) {
+    timeline.body_bytes = length;
+    timeline.mark(LAST_BYTE_SENT);
+  }
+}
 
-    send_http_response(client_fd, 200, "OK", headers, "");
+/**
+ * @brief Serve a request through the caching reverse proxy
+ *
+ * The object is read slice by slice: complete slices go through the normal
+ * sendfile() path, missing ones are streamed from the (possibly shared)
+ * origin fetch as it is written to the cache.
+ *
+ * @param client_fd Client socket file descriptor
+ * @param request Parsed request
+ * @param is_head Whether to omit the body
+ * @param timeline Marked as the object is looked up and sent
+ * @param tcp Sampler for the client connection
+ */
+void serve_proxied(int client_fd, const HttpRequest &request, bool is_head,
+                   RequestTimeline &timeline, TcpSampler &tcp) {
+  ProxyCache &proxy = *server.proxy;
+  std::string key;
+  if (!normalize_target(request.target, key) || key.empty()) {
+    send_http_response(client_fd, 404, "Not Found",
+                       "Content-Type: text/plain\r\n", "404 Not Found\n");
+    return;
+  }
+  // Ask the origin for exactly what is cached under the key
+  std::string target = encode_target(key);
 
-    // For HEAD requests, we don't send the body
-    if (!is_head) {
-      send_file_content(client_fd, file);
+  // Start the size lookup at the slice the client wants first, so that fetch
+  // is the one already running when we get to it
+  off_t size = -1;
+  off_t start = 0;
+  off_t length = 0;
+  parse_range(request.range, INT64_MAX, start, length);
+  int status = proxy.object_size(key, target, start, size);
+  timeline.mark(FILE_OPENED);
+  STREAMIX_TRACE(file_opened, client_fd, key.c_str(), size);
+  if (status != 200) {
+    if (status == 404 || status == 410) {
+      send_http_response(client_fd, 404, "Not Found",
+                         "Content-Type: text/plain\r\n", "404 Not Found\n");
+    } else if (status == 403) {
+      send_http_response(client_fd, 403, "Forbidden",
+                         "Content-Type: text/plain\r\n", "403 Forbidden\n");
+    } else {
+      send_http_response(client_fd, 502, "Bad Gateway",
+                         "Content-Type: text/plain\r\n", "502 Bad Gateway\n");
     }
-  } catch (const std::exception &e) {
-    send_http_response(client_fd, 500, "Internal Server Error",
-                       "Content-Type: text/plain\r\n",
-                       "500 Internal Server Error\n");
+    return;
   }
 
-  shutdown(client_fd, SHUT_RDWR);
-  close(client_fd);
-  return NULL;
+  if (!send_content_headers(client_fd, request, size, start, length)) {
+    return;
+  }
+  timeline.mark(FIRST_BYTE_SENT);
+  if (is_head) {
+    timeline.mark(LAST_BYTE_SENT);
+    return;
+  }
+
+  std::shared_ptr<ResidencyStats> residency = server.residency.for_file(key);
+  const off_t slice_size = proxy.slice_size();
+  const off_t end = start + length;
+  for (off_t pos = start; pos < end;) {
+    uint64_t index = pos / slice_size;
+    off_t slice_start = index * slice_size;
+    off_t slice_end = std::min(slice_start + slice_size, end);
+
+    ProxyCache::Slice slice = proxy.acquire(key, target, index, size);
+    bool ok;
+    if (slice.fetch) {
+      uint64_t sent = 0;
+      ok = slice.fetch->stream_to(client_fd, pos - slice_start,
+                                  slice_end - slice_start, sent,
+                                  egress_allowance, egress_unused);
+      count_sent(sent);
+    } else {
+      File file(slice.release());
+      ok = send_file_content(client_fd, file, slice.offset + pos - slice_start,
+                             slice_end - pos, *residency, tcp);
+    }
+    if (!ok) {
+      return; // Origin failed mid-body: the short response tells the client
+    }
+    pos = slice_end;
+    tcp.poll();
+  }
+  timeline.body_bytes = length;
+  timeline.mark(LAST_BYTE_SENT);
 }
 
 /**
- * @brief Main entry point of the server
+ * @brief Open the file a request refers to
  *
- * Sets up signal handling, initializes the server socket, and enters the main
- * accept loop to handle incoming client connections.
+ * Without a document root every request is served the configured file.
+ * With one, the normalized target is looked up under the root, going through
+ * the tiered store when a fast tier is configured.
  *
- * @return int Exit status (0 on success, non-zero on error)
+ * @param rel Normalized target relative to the root (ignored without one)
+ * @param arena Request arena for the path and the File itself; must outlive
+ *        the returned pointer
+ * @return std::shared_ptr<File> The file to serve
+ * @throws std::system_error if the file cannot be opened
  */
-int main() {
-  // Ignore SIGPIPE to prevent server from exiting when writing to a closed
-  // socket This allows us to handle broken pipe errors gracefully in our code
-  signal(SIGPIPE, SIG_IGN);
-
-  try {
-    // Open the file at startup to verify it exists and cache its size
-    // This also serves as a quick check that we can access the file before
-    // accepting connections
-    File file(config::FILE_PATH.data());
+std::shared_ptr<File> open_requested_file(std::string_view rel,
+                                          std::pmr::memory_resource &arena) {
+  const config::Options &opts = server.options;
+  std::pmr::polymorphic_allocator<File> alloc(&arena);
+  if (opts.root.empty()) {
+    return std::allocate_shared<File>(alloc, opts.file_path.c_str());
+  }
+  if (server.tiers) {
+    return server.tiers->open(std::string(rel));
+  }
+  std::pmr::string path(opts.root, &arena);
+  path += '/';
+  path += rel;
+  return std::allocate_shared<File>(alloc, path.c_str());
+}
 
-    // Set up server socket
-    Socket server_socket = create_server_socket();
-    printf("Server running. Press Ctrl+C to exit...\n");
+/**
+ * @brief Read the request head (request line and headers) from a client
+ *
+ * Keeps reading until the blank line that ends the headers, the buffer is
+ * full, or the peer stops sending.
+ *
+ * @param client_fd Client socket file descriptor
+ * @param buffer Destination buffer
+ * @param capacity Size of the buffer
+ * @param timeline If set, FIRST_BYTE_RECEIVED is marked on it
+ * @return ssize_t Bytes read, or <= 0 if nothing usable arrived
+ */
+ssize_t read_request_head(int client_fd, char *buffer, size_t capacity,
+                          RequestTimeline *timeline = nullptr) {
+  size_t used = 0;
+  while (used < capacity) {
+    ssize_t n = recv(client_fd, buffer + used, capacity - used, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    if (used == 0 && timeline != nullptr) {
+      timeline->mark(FIRST_BYTE_RECEIVED);
+    }
+    used += n;
+    if (std::string_view(buffer, used).find("\r\n\r\n") !=
+        std::string_view::npos) {
+      break;
+    }
+  }
+  return static_cast<ssize_t>(used);
+}
 
-    // Main server loop: accept connections and handle them in separate threads
-    while (true) {
-      printf("Waiting for connection...\n");
-
-      // Accept a new client connection
-      // This is a blocking call that will wait until a client connects
-      ClientInfo client = server_socket.accept();
-      printf("Accepted connection from %s:%d\n", client.ip.c_str(),
-             client.port);
-
-      // Use unique_ptr for automatic cleanup of client FD in case of errors
-      // This ensures the FD is closed if thread creation fails
-      auto client_fd = std::make_unique<int>(client.fd);
-      if (!client_fd) {
-        // If allocation fails, we need to close the socket manually
-        close(client.fd);
-        handle_error("Failed to allocate client FD");
-      }
-
-      // TODO: In a production environment, consider using a thread pool
-      // to limit the number of concurrent connections and prevent resource
-      // exhaustion
-      pthread_t thread;
-      // Create a new thread to handle the client connection
-      // The client_fd is released to the thread (ownership transfer)
-      if (pthread_create(&thread, NULL, handle_client, client_fd.release()) !=
-          0) {
-        // If thread creation fails, clean up the client socket
-        close(client.fd);
-        handle_error("Failed to create client thread");
-      }
+/**
+ * @brief Sum the per-thread counters
+ */
+void sum_counters(uint64_t (&totals)[NUM_COUNTERS]) {
+  server.counters.for_each([&totals](const CounterSlot &slot) {
+    for (size_t i = 0; i < NUM_COUNTERS; i++) {
+      totals[i] += slot.values[i].load(std::memory_order_relaxed);
+    }
+  });
+}
 
-      // Detach the thread so its resources are automatically released when it
-      // exits This is preferred over joining since we don't need to synchronize
-      // with the thread
-      if (pthread_detach(thread) != 0) {
-        // If detach fails, log a warning but continue
-        // The thread will still run and clean up after itself when it exits
-        perror("Warning: pthread_detach() failed");
-      }
+/**
+ * @brief Render all metrics in the Prometheus text format
+ *
+ * Per-thread counters are summed here, on the scraping thread, so the request
+ * path never touches a shared cache line to update them.
+ */
+std::string render_metrics() {
+  uint64_t totals[NUM_COUNTERS] = {};
+  sum_counters(totals);
 
-      printf("Serving %ld bytes to %s:%d\n", file.size(), client.ip.c_str(),
-             client.port);
+  metrics::TextWriter out;
+  out.family("streamix_connections_accepted_total", "counter",
+             "Client connections accepted");
+  out.sample("streamix_connections_accepted_total",
+             totals[CONNECTIONS_ACCEPTED]);
+  // Slots wrap when a connection ends on a different slot than it started
+  // on, but the sum is exact modulo 2^64
+  out.family("streamix_connections_active", "gauge",
+             "Client connections currently being served");
+  out.sample("streamix_connections_active",
+             static_cast<int64_t>(totals[CONNECTIONS_ACTIVE]));
+  out.family("streamix_bytes_sent_total", "counter",
+             "Bytes written to clients, headers included");
+  out.sample("streamix_bytes_sent_total", totals[BYTES_SENT]);
+  out.family("streamix_sendfile_errors_total", "counter",
+             "sendfile() calls that failed other than by client disconnect");
+  out.sample("streamix_sendfile_errors_total", totals[SENDFILE_ERRORS]);
+  if (alloc_tracking::ENABLED) {
+    out.family("streamix_allocations_total", "counter",
+               "Heap allocations on the connection path (alloc-check build)");
+    out.sample("streamix_allocations_total", "where=\"accept\"",
+               totals[ACCEPT_ALLOCATIONS]);
+    out.sample("streamix_allocations_total", "where=\"request\"",
+               totals[REQUEST_ALLOCATIONS]);
+  }
+  out.family("streamix_responses_total", "counter",
+             "Responses sent, by status code");
+  for (size_t i = 0; i <= NUM_COUNTED_STATUSES; i++) {
+    std::string code = i < NUM_COUNTED_STATUSES
+                           ? std::to_string(COUNTED_STATUSES[i])
+                           : "other";
+    out.sample("streamix_responses_total",
+               metrics::TextWriter::label("code", code),
+               totals[RESPONSES + i]);
+  }
+  if (server.acceptor) {
+    const AcceptStats &stats = server.acceptor->stats();
+    out.family("streamix_accept_errors_total", "counter",
+               "accept() failures on the main listener, by cause");
+    out.sample("streamix_accept_errors_total", "reason=\"emfile\"",
+               stats.emfile.load(std::memory_order_relaxed));
+    out.sample("streamix_accept_errors_total", "reason=\"enfile\"",
+               stats.enfile.load(std::memory_order_relaxed));
+    out.sample("streamix_accept_errors_total", "reason=\"nomem\"",
+               stats.nomem.load(std::memory_order_relaxed));
+    out.sample("streamix_accept_errors_total", "reason=\"aborted\"",
+               stats.aborted.load(std::memory_order_relaxed));
+    out.family("streamix_connections_shed_total", "counter",
+               "Connections answered 503 for lack of descriptors or threads");
+    out.sample("streamix_connections_shed_total",
+               stats.shed.load(std::memory_order_relaxed));
+    out.family("streamix_accept_backoffs_total", "counter",
+               "Pauses in accepting after a resource ran out");
+    out.sample("streamix_accept_backoffs_total",
+               stats.backoffs.load(std::memory_order_relaxed));
+    out.family("streamix_accept_batches_total", "counter",
+               "Listener wakeups that accepted at least one connection");
+    out.sample("streamix_accept_batches_total",
+               stats.batches.load(std::memory_order_relaxed));
+  }
+  const ListenerConfig &listener = server.options.listener;
+  if (listener.fastopen_queue > 0) {
+    out.family("streamix_connections_fastopen_total", "counter",
+               "Connections whose request arrived in the SYN (TCP Fast Open)");
+    out.sample("streamix_connections_fastopen_total",
+               totals[CONNECTIONS_FASTOPEN]);
+  }
+  TcpExtCounters ext;
+  if ((listener.fastopen_queue > 0 || listener.defer_accept_s > 0) &&
+      ext.read()) {
+    out.family("streamix_host_tcp_fastopen_total", "counter",
+               "Host-wide TCP Fast Open events on the server side");
+    out.sample("streamix_host_tcp_fastopen_total", "event=\"passive\"",
+               ext.fastopen_passive);
+    out.sample("streamix_host_tcp_fastopen_total", "event=\"passive_fail\"",
+               ext.fastopen_passive_fail);
+    out.sample("streamix_host_tcp_fastopen_total",
+               "event=\"listen_overflow\"", ext.fastopen_listen_overflow);
+    out.sample("streamix_host_tcp_fastopen_total", "event=\"cookie_reqd\"",
+               ext.fastopen_cookie_reqd);
+    out.family("streamix_host_tcp_defer_accept_acks_total", "counter",
+               "Host-wide handshake ACKs without data held back by "
+               "TCP_DEFER_ACCEPT");
+    out.sample("streamix_host_tcp_defer_accept_acks_total",
+               ext.defer_accept_acks);
+  }
+  out.family("streamix_open_files_limit", "gauge",
+             "Descriptor limit (RLIMIT_NOFILE) of the process");
+  out.sample("streamix_open_files_limit",
+             static_cast<uint64_t>(server.fd_limit));
+  if (server.deadlines) {
+    static constexpr const char *KINDS[] = {"", "idle", "header", "transfer"};
+    const Deadlines::Stats &stats = server.deadlines->stats();
+    out.family("streamix_timeouts_total", "counter",
+               "Connections closed for missing a deadline, by kind");
+    for (size_t k = Deadlines::IDLE; k < Deadlines::NUM_KINDS; k++) {
+      out.sample("streamix_timeouts_total",
+                 metrics::TextWriter::label("kind", KINDS[k]),
+                 stats.expired[k].load(std::memory_order_relaxed));
+    }
+  }
+  EgressConfig egress = server.egress->config();
+  const EgressShaper::Stats &shaping = server.egress->stats();
+  out.family("streamix_egress_limit_bytes_per_second", "gauge",
+             "Egress bandwidth limit in effect, 0 = unlimited, by scope");
+  out.sample("streamix_egress_limit_bytes_per_second", "scope=\"connection\"",
+             egress.connection_rate);
+  out.sample("streamix_egress_limit_bytes_per_second", "scope=\"client\"",
+             egress.client_rate);
+  out.sample("streamix_egress_limit_bytes_per_second", "scope=\"global\"",
+             egress.global_rate);
+  out.family("streamix_egress_throttles_total", "counter",
+             "Waits for an egress token bucket to refill");
+  out.sample("streamix_egress_throttles_total",
+             shaping.throttles.load(std::memory_order_relaxed));
+  out.family("streamix_egress_throttled_seconds_total", "counter",
+             "Time client threads spent waiting on egress limits");
+  out.sample("streamix_egress_throttled_seconds_total",
+             shaping.throttled_ns.load(std::memory_order_relaxed) * 1e-9);
+  out.family("streamix_egress_clients", "gauge",
+             "Client IPs currently sharing a per-client egress bucket");
+  out.sample("streamix_egress_clients",
+             static_cast<uint64_t>(server.egress->clients()));
+
+  const LatencyMetrics &latency = server.latency;
+  out.family("streamix_request_phase_seconds", "summary",
+             "Time spent in each phase of a request");
+  for (size_t m = FIRST_BYTE_RECEIVED; m < NUM_MARKS; m++) {
+    out.summary("streamix_request_phase_seconds",
+                metrics::TextWriter::label("phase", PHASE_NAMES[m]),
+                latency.phases[m].snapshot(), 1e-9);
+  }
+  out.family("streamix_time_to_first_byte_seconds", "summary",
+             "Time from accept to the response headers being written");
+  out.summary("streamix_time_to_first_byte_seconds", {},
+              latency.ttfb.snapshot(), 1e-9);
+  out.family("streamix_request_duration_seconds", "summary",
+             "Time from accept to the last response byte being written");
+  out.summary("streamix_request_duration_seconds", {},
+              latency.total.snapshot(), 1e-9);
+  out.family("streamix_throughput_bytes_per_second", "summary",
+             "Body transfer rate per response, by body size");
+  for (size_t i = 0; i < NUM_SIZE_CLASSES; i++) {
+    out.summary("streamix_throughput_bytes_per_second",
+                metrics::TextWriter::label("size_class", SIZE_CLASS_NAMES[i]),
+                latency.throughput[i].snapshot(), 1);
+  }
+
+  const TcpMetrics &tcp = server.tcp;
+  out.family("streamix_tcp_rtt_seconds", "summary",
+             "Smoothed RTT of client connections, sampled during transfers");
+  out.summary("streamix_tcp_rtt_seconds", {}, tcp.rtt_us.snapshot(), 1e-6);
+  out.family("streamix_tcp_cwnd_segments", "summary",
+             "Congestion window of client connections, sampled");
+  out.summary("streamix_tcp_cwnd_segments", {}, tcp.cwnd.snapshot(), 1);
+  out.family("streamix_tcp_delivery_rate_bytes_per_second", "summary",
+             "Kernel estimate of the delivery rate to clients, sampled");
+  out.summary("streamix_tcp_delivery_rate_bytes_per_second", {},
+              tcp.delivery_rate.snapshot(), 1);
+  out.family("streamix_tcp_retransmits", "summary",
+             "Segments retransmitted per completed transfer");
+  out.summary("streamix_tcp_retransmits", {}, tcp.retransmits.snapshot(), 1);
+  out.family("streamix_tcp_limited_ratio", "summary",
+             "Fraction of busy time per transfer spent limited by the "
+             "client's receive window or by our send buffer");
+  out.summary("streamix_tcp_limited_ratio", "by=\"rwnd\"",
+              tcp.rwnd_limited.snapshot(), 1e-3);
+  out.summary("streamix_tcp_limited_ratio", "by=\"sndbuf\"",
+              tcp.sndbuf_limited.snapshot(), 1e-3);
+  out.family("streamix_tcp_notsent_bytes", "summary",
+             "Response bytes queued in a socket but not yet sent, sampled "
+             "(bounded by --notsent-lowat)");
+  out.summary("streamix_tcp_notsent_bytes", {}, tcp.notsent.snapshot(), 1);
+  out.family("streamix_tcp_memory_bytes", "gauge",
+             "Socket buffer memory held by open client connections (queued "
+             "send plus allocated receive), as of their last TCP sample");
+  out.sample("streamix_tcp_memory_bytes",
+             std::max<int64_t>(0, tcp.socket_memory.load()));
+  out.family("streamix_socket_profile_congestion_fallbacks_total", "counter",
+             "Listeners left on the system default congestion control "
+             "because the socket profile's was not available");
+  out.sample("streamix_socket_profile_congestion_fallbacks_total",
+             congestion_fallbacks.load());
+  TcpSockstat sockstat;
+  if (sockstat.read()) {
+    out.family("streamix_host_tcp_memory_bytes", "gauge",
+               "Host-wide memory held by TCP socket buffers");
+    out.sample("streamix_host_tcp_memory_bytes", sockstat.memory_bytes);
+    out.family("streamix_host_tcp_sockets", "gauge",
+               "Host-wide TCP sockets, by state");
+    out.sample("streamix_host_tcp_sockets", "state=\"inuse\"",
+               sockstat.inuse);
+    out.sample("streamix_host_tcp_sockets", "state=\"orphan\"",
+               sockstat.orphan);
+    out.sample("streamix_host_tcp_sockets", "state=\"time_wait\"",
+               sockstat.time_wait);
+  }
+
+  if (server.access_log) {
+    out.family("streamix_access_log_records_total", "counter",
+               "Access log records written, or dropped because the writer "
+               "fell behind");
+    out.sample("streamix_access_log_records_total", "result=\"written\"",
+               server.access_log->written());
+    out.sample("streamix_access_log_records_total", "result=\"dropped\"",
+               server.access_log->dropped());
+  }
+
+  out.family("streamix_page_cache_bytes_total", "counter",
+             "Bytes sent from files, by page-cache residency at send time");
+  out.sample("streamix_page_cache_bytes_total", "result=\"hit\"",
+             server.residency.total().hit_bytes.load());
+  out.sample("streamix_page_cache_bytes_total", "result=\"miss\"",
+             server.residency.total().miss_bytes.load());
+  if (server.residency.max_paths() > 0) {
+    out.family("streamix_page_cache_path_bytes_total", "counter",
+               "Bytes sent per recently served path, by page-cache residency");
+    server.residency.for_each(
+        [&out](const std::string &path, const ResidencyStats &stats) {
+          std::string label = metrics::TextWriter::label("path", path);
+          out.sample("streamix_page_cache_path_bytes_total",
+                     label + ",result=\"hit\"", stats.hit_bytes.load());
+          out.sample("streamix_page_cache_path_bytes_total",
+                     label + ",result=\"miss\"", stats.miss_bytes.load());
+        });
+  }
+
+  if (server.block_cache) {
+    const BlockCache::Stats &stats = server.block_cache->stats();
+    out.family("streamix_block_cache_lookups_total", "counter",
+               "Block cache lookups");
+    out.sample("streamix_block_cache_lookups_total", "result=\"hit\"",
+               stats.hits.load());
+    out.sample("streamix_block_cache_lookups_total", "result=\"miss\"",
+               stats.misses.load());
+    out.family("streamix_block_cache_fills_total", "counter",
+               "Blocks loaded into the block cache");
+    out.sample("streamix_block_cache_fills_total", "result=\"ok\"",
+               stats.fills.load());
+    out.sample("streamix_block_cache_fills_total", "result=\"error\"",
+               stats.fill_errors.load());
+    out.family("streamix_block_cache_evictions_total", "counter",
+               "Blocks evicted from the block cache");
+    out.sample("streamix_block_cache_evictions_total", stats.evictions.load());
+    out.family("streamix_block_cache_capacity_bytes", "gauge",
+               "Memory reserved for the block cache");
+    out.sample("streamix_block_cache_capacity_bytes",
+               server.block_cache->capacity());
+  }
+
+  if (server.tiers) {
+    const auto &stats = server.tiers->stats();
+    out.family("streamix_tier_opens_total", "counter",
+               "Files opened, by the tier they were served from");
+    out.sample("streamix_tier_opens_total", "tier=\"fast\"",
+               stats.fast_hits.load());
+    out.sample("streamix_tier_opens_total", "tier=\"slow\"",
+               stats.slow_hits.load());
+    out.family("streamix_tier_promotions_total", "counter",
+               "Files copied to the fast tier");
+    out.sample("streamix_tier_promotions_total", stats.promotions.load());
+    out.family("streamix_tier_promote_errors_total", "counter",
+               "Promotions that failed");
+    out.sample("streamix_tier_promote_errors_total",
+               stats.promote_errors.load());
+    out.family("streamix_tier_demotions_total", "counter",
+               "Files removed from the fast tier");
+    out.sample("streamix_tier_demotions_total", stats.demotions.load());
+    out.family("streamix_tier_fast_bytes", "gauge",
+               "Bytes of promoted copies on the fast tier");
+    out.sample("streamix_tier_fast_bytes", stats.fast_bytes.load());
+  }
+
+  if (server.proxy) {
+    const ProxyCache::Stats &stats = server.proxy->stats();
+    out.family("streamix_proxy_slices_total", "counter",
+               "Proxied slices, by how they were obtained");
+    out.sample("streamix_proxy_slices_total", "result=\"hit\"",
+               stats.slice_hits.load());
+    out.sample("streamix_proxy_slices_total", "result=\"miss\"",
+               stats.slice_misses.load());
+    out.sample("streamix_proxy_slices_total", "result=\"collapsed\"",
+               stats.collapsed.load());
+    out.family("streamix_proxy_upstream_responses_total", "counter",
+               "Origin responses, by status class");
+    for (int cls = 2; cls <= 5; cls++) {
+      out.sample("streamix_proxy_upstream_responses_total",
+                 metrics::TextWriter::label("code",
+                                            std::to_string(cls) + "xx"),
+                 stats.upstream_responses[cls].load());
+    }
+    out.family("streamix_proxy_upstream_errors_total", "counter",
+               "Origin requests that got no usable response");
+    out.sample("streamix_proxy_upstream_errors_total",
+               stats.upstream_errors.load());
+    out.family("streamix_proxy_upstream_bytes_total", "counter",
+               "Body bytes received from the origin");
+    out.sample("streamix_proxy_upstream_bytes_total",
+               stats.upstream_bytes.load());
+    out.family("streamix_proxy_cache_bytes", "gauge",
+               "Bytes of cached slices on disk");
+    out.sample("streamix_proxy_cache_bytes", stats.cached_bytes.load());
+    out.family("streamix_proxy_evictions_total", "counter",
+               "Cached slices removed to stay within --proxy-cache-mb");
+    out.sample("streamix_proxy_evictions_total", stats.evictions.load());
+    out.family("streamix_proxy_invalidations_total", "counter",
+               "Objects whose cached slices were dropped because the origin "
+               "reported a new size or validator");
+    out.sample("streamix_proxy_invalidations_total",
+               stats.invalidations.load());
+  }
+  return out.str();
+}
+
+/**
+ * @brief Copy the global counters into the status region twice a second
+ *
+ * Connection slots are written by their own threads as they go; only the
+ * totals, which live in per-thread counters, need publishing.
+ */
+void status_publish_loop() {
+  while (true) {
+    uint64_t totals[NUM_COUNTERS] = {};
+    sum_counters(totals);
+    status::Counters c;
+    c.accepted = totals[CONNECTIONS_ACCEPTED];
+    c.active = totals[CONNECTIONS_ACTIVE];
+    c.bytes_sent = totals[BYTES_SENT];
+    c.untracked = totals[STATUS_UNTRACKED];
+    for (size_t i = 0; i < NUM_COUNTED_STATUSES; i++) {
+      c.responses[COUNTED_STATUSES[i] / 100] += totals[RESPONSES + i];
+    }
+    server.status->publish(c, metrics::now_ns());
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+}
+
+/**
+ * @brief Render the status region as JSON, for /status
+ *
+ * Reads the same shared memory streamix-top does. Rates here are averages
+ * over each connection's lifetime, since there is no previous sample.
+ */
+std::string render_status() {
+  const status::Region &region = *server.status;
+  uint64_t now = metrics::now_ns();
+  uint64_t heartbeat = 0;
+  status::Counters c = region.counters(heartbeat);
+  std::string out = "{\"pid\":" + std::to_string(region.pid()) +
+                    ",\"uptime_s\":" +
+                    std::to_string((now - region.started_mono_ns()) / 1000000000) +
+                    ",\"accepted\":" + std::to_string(c.accepted) +
+                    ",\"active\":" + std::to_string(c.active) +
+                    ",\"bytes_sent\":" + std::to_string(c.bytes_sent) +
+                    ",\"untracked\":" + std::to_string(c.untracked) +
+                    ",\"responses\":{";
+  for (int cls = 2; cls <= 5; cls++) {
+    out += (cls > 2 ? ",\"" : "\"") + std::to_string(cls) + "xx\":" +
+           std::to_string(c.responses[cls]);
+  }
+  out += "},\"connections\":[";
+  bool first = true;
+  for (const status::ConnectionView &v : region.connections()) {
+    char ip[INET_ADDRSTRLEN];
+    in_addr addr{v.client_ip};
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    uint64_t age_ns = now > v.started_mono_ns ? now - v.started_mono_ns : 0;
+    uint64_t rate = age_ns > 0 ? v.bytes_sent * 1000000000ULL / age_ns : 0;
+    out += first ? "{" : ",{";
+    first = false;
+    out += "\"client\":\"" + std::string(ip) + ":" +
+           std::to_string(v.client_port) + "\",\"path\":";
+    append_json_string(out, v.path);
+    out += ",\"phase\":\"" + std::string(status::phase_name(v.phase)) +
+           "\",\"age_ms\":" + std::to_string(age_ns / 1000000) +
+           ",\"bytes_sent\":" + std::to_string(v.bytes_sent) +
+           ",\"bytes_total\":" + std::to_string(v.bytes_total) +
+           ",\"rate_bps\":" + std::to_string(rate) + "}";
+  }
+  out += "]}\n";
+  return out;
+}
+
+/**
+ * @brief Profile the server for ?seconds=N (default 10) at ?hz=N (default 99)
+ *        and answer with folded stacks
+ */
+void serve_profile(int client_fd, const HttpRequest &request) {
+  off_t seconds = 10;
+  off_t hz = 99;
+  std::string_view value = find_query_param(request.target, "seconds");
+  if ((!value.empty() && !parse_offset(value, seconds)) || seconds < 1 ||
+      seconds > 300) {
+    send_http_response(client_fd, 400, "Bad Request",
+                       "Content-Type: text/plain\r\n",
+                       "seconds must be 1-300\n");
+    return;
+  }
+  value = find_query_param(request.target, "hz");
+  if ((!value.empty() && !parse_offset(value, hz)) || hz < 1 || hz > 1000) {
+    send_http_response(client_fd, 400, "Bad Request",
+                       "Content-Type: text/plain\r\n", "hz must be 1-1000\n");
+    return;
+  }
+  profiler::Profile profile;
+  if (!profiler::run(seconds, hz, profile)) {
+    send_http_response(client_fd, 409, "Conflict",
+                       "Content-Type: text/plain\r\n",
+                       "A profile is already running\n");
+    return;
+  }
+  send_http_response(client_fd, 200, "OK",
+                     "Content-Type: text/plain\r\nX-Profile-Samples: " +
+                         std::to_string(profile.samples) +
+                         "\r\nX-Profile-Dropped: " +
+                         std::to_string(profile.dropped) + "\r\n",
+                     profile.folded);
+}
+
+/**
+ * @brief Report the egress limits; a POST first changes any given as
+ *        ?connection=, ?client= or ?global= (bytes/s, 0 = unlimited)
+ *
+ * Running transfers adopt new limits on their next write.
+ */
+void serve_egress(int client_fd, const HttpRequest &request) {
+  bool post = request.method == "POST";
+  if (!post && request.target.find('?') != std::string_view::npos) {
+    send_http_response(client_fd, 405, "Method Not Allowed",
+                       "Content-Type: text/plain\r\nAllow: POST\r\n",
+                       "Use POST to change egress limits\n");
+    return;
+  }
+  EgressConfig config = server.egress->config();
+  static constexpr std::pair<const char *, uint64_t EgressConfig::*> PARAMS[] =
+      {{"connection", &EgressConfig::connection_rate},
+       {"client", &EgressConfig::client_rate},
+       {"global", &EgressConfig::global_rate}};
+  bool changed = false;
+  for (const auto &[name, field] : PARAMS) {
+    std::string_view value = find_query_param(request.target, name);
+    off_t rate = 0;
+    if (value.empty()) {
+      continue;
+    }
+    if (!parse_offset(value, rate)) {
+      send_http_response(client_fd, 400, "Bad Request",
+                         "Content-Type: text/plain\r\n",
+                         std::string(name) + " must be a rate in bytes/s\n");
+      return;
+    }
+    config.*field = rate;
+    changed = true;
+  }
+  if (changed) {
+    server.egress->set_config(config);
+  }
+  send_http_response(
+      client_fd, 200, "OK", "Content-Type: application/json\r\n",
+      "{\"connection_rate\":" + std::to_string(config.connection_rate) +
+          ",\"client_rate\":" + std::to_string(config.client_rate) +
+          ",\"global_rate\":" + std::to_string(config.global_rate) +
+          ",\"clients\":" + std::to_string(server.egress->clients()) + "}\n");
+}
+
+/**
+ * @brief Answer a request for one of the admin endpoints
+ * @param client_fd Client socket file descriptor
+ * @param request Parsed request
+ * @return false if the target is not an admin endpoint
+ */
+bool serve_admin(int client_fd, const HttpRequest &request) {
+  std::string_view path =
+      request.target.substr(0, request.target.find_first_of("?#"));
+  if (path == "/metrics") {
+    send_http_response(client_fd, 200, "OK",
+                       "Content-Type: text/plain; version=0.0.4\r\n",
+                       render_metrics());
+    return true;
+  }
+  // Per-connection status (client addresses and paths), profiling and
+  // egress control are only offered on a separate admin listener, never to
+  // clients
+  if (path == "/status" && server.status && server.options.admin_port != 0) {
+    send_http_response(client_fd, 200, "OK",
+                       "Content-Type: application/json\r\n", render_status());
+    return true;
+  }
+  if (path == "/debug/profile" && server.options.admin_port != 0) {
+    serve_profile(client_fd, request);
+    return true;
+  }
+  if (path == "/egress" && server.options.admin_port != 0) {
+    serve_egress(client_fd, request);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * @brief What the accept loop hands to a client thread
+ */
+struct Connection {
+  int fd;               ///< Client socket file descriptor
+  uint32_t ip;          ///< Client IPv4 address in network byte order
+  uint16_t port;        ///< Client port number in host byte order
+  uint64_t accepted_ns; ///< metrics::now_ns() when accept() returned
+  alignas(std::max_align_t) char arena[config::REQUEST_ARENA_SIZE]; ///< Scratch
+};
+
+// Connections are recycled rather than freed, so accepting one does not
+// allocate once the pool has grown to the peak connection count
+SlabPool<Connection> connection_pool;
+
+/**
+ * @brief Keeps CONNECTIONS_ACTIVE up to date for the lifetime of a handler
+ */
+struct ActiveConnection {
+  ActiveConnection() { count(CONNECTIONS_ACTIVE); }
+  ~ActiveConnection() { count(CONNECTIONS_ACTIVE, UINT64_MAX); } // i.e. -1
+  ActiveConnection(const ActiveConnection &) = delete;
+  ActiveConnection &operator=(const ActiveConnection &) = delete;
+};
+
+/**
+ * @brief Read, parse and answer the request on a client connection
+ *
+ * Leaves the connection open; handle_client() logs and closes it.
+ *
+ * @param client_fd Client socket file descriptor
+ * @param timeline Marked as the request progresses
+ * @param tcp Sampler for the connection
+ * @param record Receives the method and path for the access log
+ * @param arena Scratch memory released when the connection ends
+ */
+void serve_request(int client_fd, RequestTimeline &timeline, TcpSampler &tcp,
+                   AccessRecord &record, std::pmr::memory_resource &arena) {
+  try {
+    // Read client request (first 4KB should be enough for headers)
+    char buffer[4096];
+    ssize_t bytes_read =
+        read_request_head(client_fd, buffer, sizeof(buffer), &timeline);
+    if (bytes_read <= 0) {
+      return;
+    }
+    if (this_response.deadline != nullptr &&
+        this_response.deadline->expired.load(std::memory_order_relaxed) ==
+            Deadlines::HEADER) {
+      AccessRecord::set(record.method, "-");
+      send_http_response(client_fd, 408, "Request Timeout",
+                         "Content-Type: text/plain\r\n",
+                         "408 Request Timeout\n");
+      return;
+    }
+
+    // Parse request line and headers
+    HttpRequest request;
+    if (!parse_request(std::string_view(buffer, bytes_read), request)) {
+      AccessRecord::set(record.method, "-");
+      send_http_response(client_fd, 400, "Bad Request",
+                         "Content-Type: text/plain\r\n",
+                         "400 Bad Request\n");
+      return;
+    }
+    timeline.mark(HEADERS_PARSED);
+    AccessRecord::set(record.method, request.method);
+    AccessRecord::set(record.path, request.target.substr(
+                                       0, request.target.find_first_of("?#")));
+    if (this_response.slot != nullptr) {
+      status::Region::set_path(this_response.slot, record.path);
+    }
+    STREAMIX_TRACE(request_parsed, client_fd,
+                   static_cast<const char *>(record.method),
+                   static_cast<const char *>(record.path));
+
+    // Check for GET or HEAD method
+    bool is_head = request.method == "HEAD";
+    if (!is_head && request.method != "GET") {
+      // Method not allowed
+      std::string allow_header = "Allow: GET, HEAD\r\n";
+      send_http_response(client_fd, 405, "Method Not Allowed",
+                         "Content-Type: text/plain\r\n" + allow_header,
+                         "405 Method Not Allowed\n");
+      return;
+    }
+
+    if (server.options.admin_port == 0 && serve_admin(client_fd, request)) {
+      return;
+    }
+
+    if (server.synthetic &&
+        request.target.substr(0, synthetic::PREFIX.size()) ==
+            synthetic::PREFIX) {
+      serve_synthetic(client_fd, request, is_head, timeline, tcp);
+      return;
+    }
+
+    if (server.proxy) {
+      serve_proxied(client_fd, request, is_head, timeline, tcp);
+      return;
+    }
+
+    // Map the target to a file; in single-file mode any target will do
+    std::pmr::string rel(&arena);
+    if (!server.options.root.empty() &&
+        (!normalize_target(request.target, rel) || rel.empty())) {
+      send_http_response(client_fd, 404, "Not Found",
+                         "Content-Type: text/plain\r\n", "404 Not Found\n");
+      return;
+    }
+    if (server.options.root.empty()) {
+      rel = server.options.file_path;
+    }
+
+    // Open file to send. Held by shared_ptr so the tiered store can switch
+    // the path to another copy without affecting this transfer.
+    std::shared_ptr<File> opened = open_requested_file(rel, arena);
+    const File &file = *opened;
+    timeline.mark(FILE_OPENED);
+    STREAMIX_TRACE(file_opened, client_fd, rel.c_str(), file.size());
+
+    // Honour a single byte range if one was requested
+    off_t start = 0;
+    off_t length = file.size();
+    if (!send_content_headers(client_fd, request, file.size(), start,
+                              length)) {
+      return;
+    }
+    timeline.mark(FIRST_BYTE_SENT);
+
+    // For HEAD requests, we don't send the body
+    if (!is_head) {
+      if (send_range(client_fd, file, start, length,
+                     *server.residency.for_file(rel), tcp)) {
+        timeline.body_bytes = length;
+        timeline.mark(LAST_BYTE_SENT);
+      }
+    } else {
+      timeline.mark(LAST_BYTE_SENT);
+    }
+  } catch (const std::system_error &e) {
+    STREAMIX_TRACE(error, client_fd, e.code().value(), e.what());
+    if (e.code() == std::errc::no_such_file_or_directory ||
+        e.code() == std::errc::not_a_directory ||
+        e.code() == std::errc::is_a_directory) {
+      send_http_response(client_fd, 404, "Not Found",
+                         "Content-Type: text/plain\r\n", "404 Not Found\n");
+    } else {
+      send_http_response(client_fd, 500, "Internal Server Error",
+                         "Content-Type: text/plain\r\n",
+                         "500 Internal Server Error\n");
+    }
+  } catch (const std::exception &e) {
+    STREAMIX_TRACE(error, client_fd, 0, e.what());
+    send_http_response(client_fd, 500, "Internal Server Error",
+                       "Content-Type: text/plain\r\n",
+                       "500 Internal Server Error\n");
+  }
+}
+
+/**
+ * @brief Fill in the response-level fields of an access record
+ * @param timeline Timestamps of the request
+ * @param tcp Summary of the connection's TCP_INFO samples, if any
+ * @param record Record to complete
+ */
+void complete_access_record(const RequestTimeline &timeline,
+                            const TcpSummary *tcp, AccessRecord &record) {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  record.time_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+  record.status = this_response.status;
+  record.bytes_sent = this_response.bytes;
+  record.content_size = this_response.content_size;
+  record.range_start = this_response.range_start;
+  record.range_length = this_response.range_length;
+
+  uint64_t end = timeline.at[LAST_BYTE_SENT] != 0 ? timeline.at[LAST_BYTE_SENT]
+                                                  : metrics::now_ns();
+  record.duration_us = (end - timeline.at[ACCEPTED]) / 1000;
+  if (timeline.at[FIRST_BYTE_SENT] != 0) {
+    record.ttfb_us =
+        (timeline.at[FIRST_BYTE_SENT] - timeline.at[ACCEPTED]) / 1000;
+  }
+  if (tcp != nullptr) {
+    record.rtt_us = tcp->rtt_avg_us;
+    record.retransmits = tcp->retransmits;
+    record.rwnd_limited = tcp->rwnd_limited;
+    record.sndbuf_limited = tcp->sndbuf_limited;
+  }
+}
+
+/**
+ * @brief Handles a client connection in a separate thread
+ *
+ * This function is executed in a separate thread for each client connection.
+ * It serves the request, queues an access log record and closes the
+ * connection.
+ *
+ * Once the pools and maps it touches have warmed up, nothing here allocates
+ * from the heap: per-request strings and objects come from the connection's
+ * arena. `make alloc-check` verifies this.
+ *
+ * @param arg Connection from connection_pool, owned from here on
+ * @return void* Always returns NULL
+ */
+void *handle_client(void *arg) {
+  uint64_t allocs_before = alloc_tracking::calls();
+  SlabPool<Connection>::Ptr conn(static_cast<Connection *>(arg),
+                                 {&connection_pool});
+  int client_fd = conn->fd;
+  ActiveConnection active;
+  RequestTimeline timeline;
+  timeline.at[ACCEPTED] = conn->accepted_ns;
+  TcpSampler tcp(client_fd, server.tcp, server.options.tcp_sample_ms);
+  AccessRecord record;
+  record.client_ip = conn->ip;
+  record.client_port = conn->port;
+  this_response = ResponseTally{};
+  if (server.status) {
+    this_response.slot = server.status->claim(
+        client_fd, record.client_ip, record.client_port, conn->accepted_ns);
+    if (this_response.slot == nullptr) {
+      count(STATUS_UNTRACKED);
+    }
+  }
+  if (server.options.listener.fastopen_queue > 0 &&
+      syn_carried_data(client_fd)) {
+    count(CONNECTIONS_FASTOPEN);
+  }
+  Deadlines::Entry deadline;
+  if (server.deadlines) {
+    this_response.deadline = &deadline;
+    server.deadlines->start_idle(deadline, client_fd, conn->accepted_ns);
+  }
+  EgressShaper::Flow egress(*server.egress, client_fd, conn->ip);
+  this_response.egress = &egress;
+
+  {
+    // Bump allocation from the connection's buffer; the heap only if a
+    // request needs more than it holds
+    std::pmr::monotonic_buffer_resource arena(conn->arena, sizeof(conn->arena));
+    serve_request(client_fd, timeline, tcp, record, arena);
+  }
+  STREAMIX_TRACE(response_complete, client_fd, this_response.status,
+                 this_response.bytes, metrics::now_ns() - conn->accepted_ns);
+
+  // Take the final TCP_INFO sample while the connection is still open
+  TcpSummary summary;
+  bool sampled = timeline.body_bytes > 0 && tcp.finish(summary);
+
+  // Connections that closed without sending a request are not logged
+  if (server.access_log && record.method[0] != '\0') {
+    complete_access_record(timeline, sampled ? &summary : nullptr, record);
+    server.access_log->append(record);
+  }
+
+  // The reaper must be done with the descriptor before it can be reused
+  if (this_response.deadline != nullptr) {
+    server.deadlines->cancel(deadline);
+    this_response.deadline = nullptr;
+    if (deadline.expired.load(std::memory_order_relaxed) ==
+        Deadlines::TRANSFER) {
+      // Reset rather than wait for a stalled reader to drain the send buffer
+      linger abort = {1, 0};
+      setsockopt(client_fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+    }
+  }
+  this_response.egress = nullptr;
+  shutdown(client_fd, SHUT_RDWR);
+  close(client_fd);
+  if (this_response.slot != nullptr) {
+    status::Region::release(this_response.slot);
+  }
+  conn.reset();
+  count(REQUEST_ALLOCATIONS, alloc_tracking::calls() - allocs_before);
+  return NULL;
+}
+
+/**
+ * @brief Serve one connection on the admin port
+ * @param client_fd Client socket file descriptor, closed on return
+ */
+void handle_admin_client(int client_fd) {
+  char buffer[4096];
+  ssize_t bytes_read = read_request_head(client_fd, buffer, sizeof(buffer));
+  HttpRequest request;
+  if (bytes_read > 0 &&
+      parse_request(std::string_view(buffer, bytes_read), request)) {
+    std::string_view path =
+        request.target.substr(0, request.target.find_first_of("?#"));
+    // Only /egress changes anything, and only when POSTed
+    if (request.method != "GET" && request.method != "HEAD" &&
+        !(request.method == "POST" && path == "/egress")) {
+      send_http_response(client_fd, 405, "Method Not Allowed",
+                         "Content-Type: text/plain\r\nAllow: GET, HEAD\r\n",
+                         "405 Method Not Allowed\n");
+    } else if (!serve_admin(client_fd, request)) {
+      send_http_response(client_fd, 404, "Not Found",
+                         "Content-Type: text/plain\r\n", "404 Not Found\n");
+    }
+  }
+  shutdown(client_fd, SHUT_RDWR);
+  close(client_fd);
+}
+
+/**
+ * @brief Accept loop for the admin port
+ *
+ * Kept off the main listener so scrapes are answered even when the file
+ * serving threads are saturated.
+ *
+ * @param listener Listening socket for the admin port
+ */
+void admin_loop(Socket listener) {
+  while (true) {
+    try {
+      ClientInfo client = listener.accept();
+      std::thread(handle_admin_client, client.fd).detach();
+    } catch (const std::system_error &e) {
+      fprintf(stderr, "admin: %s\n", e.what());
+    }
+  }
+}
+
+/**
+ * @brief Dump per-file statistics to stderr whenever SIGUSR1 arrives
+ *
+ * SIGUSR1 is blocked in every thread (the mask is inherited from main()), so
+ * it is only ever consumed here by sigwait() and the printing happens in
+ * ordinary thread context rather than inside a signal handler.
+ *
+ * @param signals Set containing SIGUSR1
+ */
+void stats_signal_loop(sigset_t signals) {
+  int sig;
+  while (sigwait(&signals, &sig) == 0) {
+    const ResidencyStats &total = server.residency.total();
+    fprintf(stderr, "residency: hit_rate=%.3f hit_bytes=%llu miss_bytes=%llu\n",
+            total.hit_rate(),
+            static_cast<unsigned long long>(total.hit_bytes.load()),
+            static_cast<unsigned long long>(total.miss_bytes.load()));
+    server.residency.for_each(
+        [](const std::string &path, const ResidencyStats &stats) {
+          fprintf(stderr,
+                  "residency %s: hit_rate=%.3f hit_bytes=%llu "
+                  "miss_bytes=%llu\n",
+                  path.c_str(), stats.hit_rate(),
+                  static_cast<unsigned long long>(stats.hit_bytes.load()),
+                  static_cast<unsigned long long>(stats.miss_bytes.load()));
+        });
+    if (server.block_cache) {
+      const BlockCache::Stats &stats = server.block_cache->stats();
+      fprintf(stderr,
+              "block cache: hits=%llu misses=%llu fills=%llu "
+              "fill_errors=%llu evictions=%llu\n",
+              static_cast<unsigned long long>(stats.hits.load()),
+              static_cast<unsigned long long>(stats.misses.load()),
+              static_cast<unsigned long long>(stats.fills.load()),
+              static_cast<unsigned long long>(stats.fill_errors.load()),
+              static_cast<unsigned long long>(stats.evictions.load()));
+    }
+    if (server.tiers) {
+      const auto &stats = server.tiers->stats();
+      fprintf(stderr,
+              "tiers: fast_hits=%llu slow_hits=%llu promotions=%llu "
+              "demotions=%llu promote_errors=%llu fast_bytes=%llu\n",
+              static_cast<unsigned long long>(stats.fast_hits.load()),
+              static_cast<unsigned long long>(stats.slow_hits.load()),
+              static_cast<unsigned long long>(stats.promotions.load()),
+              static_cast<unsigned long long>(stats.demotions.load()),
+              static_cast<unsigned long long>(stats.promote_errors.load()),
+              static_cast<unsigned long long>(stats.fast_bytes.load()));
+    }
+    if (server.proxy) {
+      const ProxyCache::Stats &stats = server.proxy->stats();
+      fprintf(stderr,
+              "proxy: slice_hits=%llu slice_misses=%llu collapsed=%llu "
+              "upstream_errors=%llu upstream_bytes=%llu cached_bytes=%llu "
+              "evictions=%llu invalidations=%llu\n",
+              static_cast<unsigned long long>(stats.slice_hits.load()),
+              static_cast<unsigned long long>(stats.slice_misses.load()),
+              static_cast<unsigned long long>(stats.collapsed.load()),
+              static_cast<unsigned long long>(stats.upstream_errors.load()),
+              static_cast<unsigned long long>(stats.upstream_bytes.load()),
+              static_cast<unsigned long long>(stats.cached_bytes.load()),
+              static_cast<unsigned long long>(stats.evictions.load()),
+              static_cast<unsigned long long>(stats.invalidations.load()));
+    }
+  }
+}
+
+/// Defined only in instrumented builds (-fprofile-generate, see make pgo)
+extern "C" void __gcov_dump(void) __attribute__((weak));
+
+/**
+ * @brief Clean up and exit when SIGTERM or SIGINT arrives
+ *
+ * Removes the status region, so streamix-top does not show a stopped
+ * server, writes out the access records still queued in the per-thread
+ * rings (committing the active segment of a binary log), and in
+ * instrumented builds writes the PGO profile, which is only written at exit
+ * otherwise. A normal exit() would run static destructors
+ * under client threads that still use them, so these are done explicitly and
+ * the process leaves with _exit(). The source is the same in every build,
+ * as the profile must match the code it is applied to.
+ *
+ * @param signals Set containing SIGTERM and SIGINT
+ */
+void exit_signal_loop(sigset_t signals) {
+  int sig;
+  if (sigwait(&signals, &sig) == 0) {
+    if (server.status) {
+      server.status->remove();
+    }
+    if (server.access_log) {
+      server.access_log->close();
+    }
+    if (__gcov_dump != nullptr) {
+      __gcov_dump();
+    }
+    _exit(0);
+  }
+}
+
+/**
+ * @brief Print command line usage to stderr
+ * @param prog Program name (argv[0])
+ */
+void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -p, --port PORT         Port to listen on (default %d)\n"
+          "      --admin-port PORT   Serve /metrics on PORT instead of the\n"
+          "                          main port, and /status there only\n"
+          "      --admin-bind ADDR   Address of the admin listener\n"
+          "                          (default 127.0.0.1)\n"
+          "  -f, --file PATH         File to serve (default %s)\n"
+          "  -r, --root DIR          Serve files under DIR by request path\n"
+          "                          instead of a single file\n"
+          "      --fast-root DIR     Promote popular files from --root into "
+          "DIR\n"
+          "      --fast-budget-mb N  Max MB of promoted copies (default 1024)\n"
+          "      --promote-score X   Decayed hit count at which a file is\n"
+          "                          promoted (default %.0f)\n"
+          "      --upstream HOST:PORT\n"
+          "                          Act as a caching proxy for this origin\n"
+          "      --proxy-cache DIR   Where proxied slices are stored\n"
+          "                          (default ./proxy_cache)\n"
+          "      --proxy-cache-mb N  Max MB of cached slices, least recently\n"
+          "                          used dropped first (default %llu, 0 = no "
+          "limit)\n"
+          "      --proxy-fetchers N  Concurrent origin fetches (default %u)\n"
+          "      --slice-mb N        Size of cached range slices (default %lld)"
+          "\n"
+          "      --io-threads N      Disk I/O threads per device (default %u,\n"
+          "                          0 disables prefetching)\n"
+          "      --io-depth N        Max prefetches queued per device "
+          "(default %u)\n"
+          "      --io-class CLASS    ioprio of I/O threads: rt|be|idle[/0-7]\n"
+          "                          (default be/%d)\n"
+          "      --io-device PATH:THREADS:DEPTH:CLASS\n"
+          "                          Override the pool for the device holding "
+          "PATH\n"
+          "      --block-cache-mb N  Cache file blocks in N MB of memory, a\n"
+          "                          multiple of %zu (default 0, disabled)\n"
+          "      --residency-paths N Keep page-cache hit rates for the N most\n"
+          "                          recently served paths (default 0, total "
+          "only)\n"
+          "      --tcp-sample-ms N   Sample TCP_INFO of transfers every N ms\n"
+          "                          (default %u, 0 samples only at the end)\n"
+          "      --access-log PATH   Append JSON access records to PATH, - for\n"
+          "                          stdout, off to disable (default -)\n"
+          "      --log-sample N      Log one request in N; 5xx always logged\n"
+          "                          (default 1)\n"
+          "      --access-log-format json|binary\n"
+          "                          binary writes fixed-width segments into\n"
+          "                          the --access-log directory (default json)\n"
+          "      --status-shm NAME   Publish live connection state in shared\n"
+          "                          memory NAME for streamix-top, off to\n"
+          "                          disable (default /streamix.PORT)\n"
+          "      --synthetic         Serve /synthetic/SIZE[k|m|g|t] from\n"
+          "                          generated content, without disk I/O\n"
+          "      --idle-timeout-ms N Close connections that send no request\n"
+          "                          byte within N ms (default %u, 0 = off)\n"
+          "      --header-timeout-ms N\n"
+          "                          Answer 408 to request heads not complete\n"
+          "                          N ms after their first byte (default %u)\n"
+          "      --min-send-rate N   Close responses sending under N bytes/s\n"
+          "                          (default %llu, 0 = off)\n"
+          "      --send-window-ms N  Period --min-send-rate is measured over\n"
+          "                          (default %u)\n"
+          "      --defer-accept-s N  Accept connections only once request\n"
+          "                          data arrives, waiting up to N seconds\n"
+          "                          (TCP_DEFER_ACCEPT, default 0 = off)\n"
+          "      --fastopen N        Accept requests in the SYN (TCP Fast\n"
+          "                          Open), N pending at most (default 0)\n"
+          "      --socket-profile NAME\n"
+          "                          Client socket options: default, bulk\n"
+          "                          (bbr, 128 KiB unsent watermark) or\n"
+          "                          interactive (nodelay, 16 KiB)\n"
+          "      --admin-socket-profile NAME\n"
+          "                          Same for the admin port (default\n"
+          "                          interactive)\n"
+          "      --congestion NAME   TCP congestion control, e.g. bbr\n"
+          "      --nodelay           Disable Nagle's algorithm\n"
+          "      --sndbuf BYTES      Fixed send buffer; 0 = autotuning\n"
+          "      --notsent-lowat BYTES\n"
+          "                          Max unsent bytes queued per socket\n"
+          "      --max-pacing-rate BPS\n"
+          "                          Cap each connection at BPS bytes/s\n"
+          "                          (paced by TCP or the fq qdisc)\n"
+          "                          These override the --socket-profile\n"
+          "      --egress-connection-rate BPS\n"
+          "                          Limit each connection to BPS bytes/s\n"
+          "      --egress-client-rate BPS\n"
+          "                          Limit each client IP to BPS bytes/s\n"
+          "      --egress-global-rate BPS\n"
+          "                          Limit all responses to BPS bytes/s\n"
+          "                          (0 = unlimited; change them at runtime\n"
+          "                          with /egress on the admin port)\n"
+          "  -h, --help              Show this help\n",
+          prog, config::PORT, config::FILE_PATH.data(),
+          TierConfig{}.promote_score,
+          static_cast<unsigned long long>(ProxyConfig{}.cache_budget >> 20),
+          ProxyConfig{}.fetch_threads,
+          static_cast<long long>(ProxyConfig{}.slice_size >> 20),
+          IoPoolConfig{}.threads,
+          IoPoolConfig{}.queue_depth, IOPRIO_NORM,
+          BlockCache::MIN_CAPACITY >> 20,
+          config::Options{}.tcp_sample_ms, DeadlineConfig{}.idle_timeout_ms,
+          DeadlineConfig{}.header_timeout_ms,
+          static_cast<unsigned long long>(DeadlineConfig{}.min_send_rate),
+          DeadlineConfig{}.send_window_ms);
+}
+
+/**
+ * @brief Parse a non-negative integer option value, exiting on error
+ * @param value Option argument
+ * @param name Option name for the error message
+ * @param max Largest accepted value
+ * @return unsigned long The parsed value
+ */
+unsigned long parse_number(const char *value, const char *name,
+                           unsigned long max) {
+  char *end = nullptr;
+  errno = 0;
+  unsigned long n = strtoul(value, &end, 10);
+  if (errno != 0 || end == value || *end != '\0' || n > max) {
+    fprintf(stderr, "Invalid value for %s: %s\n", name, value);
+    exit(2);
+  }
+  return n;
+}
+
+/**
+ * @brief Parse an --io-device specification (PATH:THREADS:DEPTH:CLASS)
+ *
+ * Fields are split from the right so that PATH may itself contain colons.
+ */
+std::pair<std::string, IoPoolConfig> parse_io_device(const std::string &spec) {
+  std::string fields[4];
+  std::string rest = spec;
+  for (int i = 3; i > 0; i--) {
+    size_t colon = rest.rfind(':');
+    if (colon == std::string::npos) {
+      fprintf(stderr, "Invalid --io-device: %s\n", spec.c_str());
+      exit(2);
+    }
+    fields[i] = rest.substr(colon + 1);
+    rest.resize(colon);
+  }
+  fields[0] = rest;
+
+  IoPoolConfig cfg;
+  cfg.threads = parse_number(fields[1].c_str(), "--io-device threads", 64);
+  cfg.queue_depth = parse_number(fields[2].c_str(), "--io-device depth", 4096);
+  if (fields[0].empty() || !parse_io_class(fields[3], cfg)) {
+    fprintf(stderr, "Invalid --io-device: %s\n", spec.c_str());
+    exit(2);
+  }
+  return {fields[0], cfg};
+}
+
+/**
+ * @brief Parse command line arguments, exiting with usage on error
+ * @param argc Argument count from main()
+ * @param argv Argument vector from main()
+ * @return config::Options The resulting settings
+ */
+config::Options parse_options(int argc, char *argv[]) {
+  enum {
+    OPT_IO_THREADS = 256,
+    OPT_IO_DEPTH,
+    OPT_IO_CLASS,
+    OPT_IO_DEVICE,
+    OPT_BLOCK_CACHE_MB,
+    OPT_RESIDENCY_PATHS,
+    OPT_FAST_ROOT,
+    OPT_FAST_BUDGET_MB,
+    OPT_PROMOTE_SCORE,
+    OPT_UPSTREAM,
+    OPT_PROXY_CACHE,
+    OPT_PROXY_CACHE_MB,
+    OPT_PROXY_FETCHERS,
+    OPT_SLICE_MB,
+    OPT_ADMIN_PORT,
+    OPT_ADMIN_BIND,
+    OPT_TCP_SAMPLE_MS,
+    OPT_ACCESS_LOG,
+    OPT_LOG_SAMPLE,
+    OPT_ACCESS_LOG_FORMAT,
+    OPT_STATUS_SHM,
+    OPT_SYNTHETIC,
+    OPT_IDLE_TIMEOUT_MS,
+    OPT_HEADER_TIMEOUT_MS,
+    OPT_MIN_SEND_RATE,
+    OPT_SEND_WINDOW_MS,
+    OPT_DEFER_ACCEPT_S,
+    OPT_FASTOPEN,
+    OPT_SOCKET_PROFILE,
+    OPT_ADMIN_SOCKET_PROFILE,
+    OPT_CONGESTION,
+    OPT_NODELAY,
+    OPT_SNDBUF,
+    OPT_NOTSENT_LOWAT,
+    OPT_MAX_PACING_RATE,
+    OPT_EGRESS_CONNECTION_RATE,
+    OPT_EGRESS_CLIENT_RATE,
+    OPT_EGRESS_GLOBAL_RATE,
+  };
+  static const option long_options[] = {
+      {"port", required_argument, nullptr, 'p'},
+      {"admin-port", required_argument, nullptr, OPT_ADMIN_PORT},
+      {"admin-bind", required_argument, nullptr, OPT_ADMIN_BIND},
+      {"file", required_argument, nullptr, 'f'},
+      {"root", required_argument, nullptr, 'r'},
+      {"fast-root", required_argument, nullptr, OPT_FAST_ROOT},
+      {"fast-budget-mb", required_argument, nullptr, OPT_FAST_BUDGET_MB},
+      {"promote-score", required_argument, nullptr, OPT_PROMOTE_SCORE},
+      {"upstream", required_argument, nullptr, OPT_UPSTREAM},
+      {"proxy-cache", required_argument, nullptr, OPT_PROXY_CACHE},
+      {"proxy-cache-mb", required_argument, nullptr, OPT_PROXY_CACHE_MB},
+      {"proxy-fetchers", required_argument, nullptr, OPT_PROXY_FETCHERS},
+      {"slice-mb", required_argument, nullptr, OPT_SLICE_MB},
+      {"io-threads", required_argument, nullptr, OPT_IO_THREADS},
+      {"io-depth", required_argument, nullptr, OPT_IO_DEPTH},
+      {"io-class", required_argument, nullptr, OPT_IO_CLASS},
+      {"io-device", required_argument, nullptr, OPT_IO_DEVICE},
+      {"block-cache-mb", required_argument, nullptr, OPT_BLOCK_CACHE_MB},
+      {"residency-paths", required_argument, nullptr, OPT_RESIDENCY_PATHS},
+      {"tcp-sample-ms", required_argument, nullptr, OPT_TCP_SAMPLE_MS},
+      {"access-log", required_argument, nullptr, OPT_ACCESS_LOG},
+      {"log-sample", required_argument, nullptr, OPT_LOG_SAMPLE},
+      {"access-log-format", required_argument, nullptr, OPT_ACCESS_LOG_FORMAT},
+      {"status-shm", required_argument, nullptr, OPT_STATUS_SHM},
+      {"synthetic", no_argument, nullptr, OPT_SYNTHETIC},
+      {"idle-timeout-ms", required_argument, nullptr, OPT_IDLE_TIMEOUT_MS},
+      {"header-timeout-ms", required_argument, nullptr, OPT_HEADER_TIMEOUT_MS},
+      {"min-send-rate", required_argument, nullptr, OPT_MIN_SEND_RATE},
+      {"send-window-ms", required_argument, nullptr, OPT_SEND_WINDOW_MS},
+      {"defer-accept-s", required_argument, nullptr, OPT_DEFER_ACCEPT_S},
+      {"fastopen", required_argument, nullptr, OPT_FASTOPEN},
+      {"socket-profile", required_argument, nullptr, OPT_SOCKET_PROFILE},
+      {"admin-socket-profile", required_argument, nullptr,
+       OPT_ADMIN_SOCKET_PROFILE},
+      {"congestion", required_argument, nullptr, OPT_CONGESTION},
+      {"nodelay", no_argument, nullptr, OPT_NODELAY},
+      {"sndbuf", required_argument, nullptr, OPT_SNDBUF},
+      {"notsent-lowat", required_argument, nullptr, OPT_NOTSENT_LOWAT},
+      {"max-pacing-rate", required_argument, nullptr, OPT_MAX_PACING_RATE},
+      {"egress-connection-rate", required_argument, nullptr,
+       OPT_EGRESS_CONNECTION_RATE},
+      {"egress-client-rate", required_argument, nullptr,
+       OPT_EGRESS_CLIENT_RATE},
+      {"egress-global-rate", required_argument, nullptr,
+       OPT_EGRESS_GLOBAL_RATE},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  config::Options opts;
+  opts.tiers.fast_budget = 1024ULL * 1024 * 1024;
+  opts.proxy.cache_dir = "./proxy_cache";
+  SocketProfile::preset("interactive", opts.admin_listener.profile);
+  // Individual socket options override the main profile in any order
+  std::optional<std::string> congestion;
+  std::optional<bool> nodelay;
+  std::optional<int> sndbuf;
+  std::optional<unsigned> notsent_lowat;
+  std::optional<uint64_t> max_pacing_rate;
+  int c;
+  while ((c = getopt_long(argc, argv, "p:f:r:h", long_options, nullptr)) !=
+         -1) {
+    switch (c) {
+    case 'p':
+      opts.port = parse_number(optarg, "--port", 65535);
+      break;
+    case OPT_ADMIN_PORT:
+      opts.admin_port = parse_number(optarg, "--admin-port", 65535);
+      break;
+    case OPT_ADMIN_BIND:
+      if (inet_pton(AF_INET, optarg, &opts.admin_bind) != 1) {
+        fprintf(stderr, "Invalid value for --admin-bind: %s\n", optarg);
+        exit(2);
+      }
+      break;
+    case 'f':
+      opts.file_path = optarg;
+      break;
+    case 'r':
+      opts.root = optarg;
+      while (opts.root.size() > 1 && opts.root.back() == '/') {
+        opts.root.pop_back();
+      }
+      break;
+    case OPT_FAST_ROOT:
+      opts.tiers.fast_root = optarg;
+      while (opts.tiers.fast_root.size() > 1 &&
+             opts.tiers.fast_root.back() == '/') {
+        opts.tiers.fast_root.pop_back();
+      }
+      break;
+    case OPT_FAST_BUDGET_MB:
+      opts.tiers.fast_budget =
+          parse_number(optarg, "--fast-budget-mb", 1ULL << 30) << 20;
+      break;
+    case OPT_PROMOTE_SCORE: {
+      char *end = nullptr;
+      opts.tiers.promote_score = strtod(optarg, &end);
+      if (end == optarg || *end != '\0' || opts.tiers.promote_score <= 0) {
+        fprintf(stderr, "Invalid value for --promote-score: %s\n", optarg);
+        exit(2);
+      }
+      break;
+    }
+    case OPT_UPSTREAM:
+      opts.proxy.upstream = optarg;
+      break;
+    case OPT_PROXY_CACHE:
+      opts.proxy.cache_dir = optarg;
+      break;
+    case OPT_PROXY_CACHE_MB:
+      opts.proxy.cache_budget =
+          parse_number(optarg, "--proxy-cache-mb", 1ULL << 30) << 20;
+      break;
+    case OPT_PROXY_FETCHERS:
+      opts.proxy.fetch_threads = parse_number(optarg, "--proxy-fetchers", 1024);
+      if (opts.proxy.fetch_threads == 0) {
+        fprintf(stderr, "Invalid value for --proxy-fetchers: %s\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_SLICE_MB:
+      opts.proxy.slice_size =
+          static_cast<off_t>(parse_number(optarg, "--slice-mb", 1024)) << 20;
+      if (opts.proxy.slice_size == 0) {
+        fprintf(stderr, "Invalid value for --slice-mb: %s\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_IO_THREADS:
+      opts.io_defaults.threads = parse_number(optarg, "--io-threads", 64);
+      break;
+    case OPT_IO_DEPTH:
+      opts.io_defaults.queue_depth = parse_number(optarg, "--io-depth", 4096);
+      break;
+    case OPT_IO_CLASS:
+      if (!parse_io_class(optarg, opts.io_defaults)) {
+        fprintf(stderr, "Invalid value for --io-class: %s\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_IO_DEVICE:
+      opts.io_devices.push_back(parse_io_device(optarg));
+      break;
+    case OPT_BLOCK_CACHE_MB:
+      opts.block_cache_mb = parse_number(optarg, "--block-cache-mb", 1 << 24);
+      if (opts.block_cache_mb % (BlockCache::MIN_CAPACITY >> 20) != 0) {
+        fprintf(stderr,
+                "Invalid value for --block-cache-mb: %s (must be a multiple "
+                "of %zu)\n",
+                optarg, BlockCache::MIN_CAPACITY >> 20);
+        exit(2);
+      }
+      break;
+    case OPT_RESIDENCY_PATHS:
+      opts.residency_paths = parse_number(optarg, "--residency-paths", 1 << 20);
+      break;
+    case OPT_TCP_SAMPLE_MS:
+      opts.tcp_sample_ms = parse_number(optarg, "--tcp-sample-ms", 3600000);
+      break;
+    case OPT_ACCESS_LOG:
+      opts.access_log.path = optarg;
+      break;
+    case OPT_LOG_SAMPLE:
+      opts.access_log.sample = parse_number(optarg, "--log-sample", 1 << 30);
+      if (opts.access_log.sample == 0) {
+        fprintf(stderr, "Invalid value for --log-sample: %s\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_ACCESS_LOG_FORMAT:
+      if (strcmp(optarg, "json") == 0) {
+        opts.access_log.format = AccessLogConfig::JSON;
+      } else if (strcmp(optarg, "binary") == 0) {
+        opts.access_log.format = AccessLogConfig::BINARY;
+      } else {
+        fprintf(stderr, "Invalid value for --access-log-format: %s\n",
+                optarg);
+        exit(2);
+      }
+      break;
+    case OPT_STATUS_SHM:
+      // shm_open() names are one path component with a leading slash
+      if (strcmp(optarg, "off") != 0 &&
+          (optarg[0] != '/' || strchr(optarg + 1, '/') != nullptr ||
+           optarg[1] == '\0')) {
+        fprintf(stderr, "Invalid value for --status-shm: %s\n", optarg);
+        exit(2);
+      }
+      opts.status_shm = optarg;
+      break;
+    case OPT_SYNTHETIC:
+      opts.synthetic = true;
+      break;
+    case OPT_IDLE_TIMEOUT_MS:
+      opts.deadlines.idle_timeout_ms =
+          parse_number(optarg, "--idle-timeout-ms", 86400000);
+      break;
+    case OPT_HEADER_TIMEOUT_MS:
+      opts.deadlines.header_timeout_ms =
+          parse_number(optarg, "--header-timeout-ms", 86400000);
+      break;
+    case OPT_MIN_SEND_RATE:
+      opts.deadlines.min_send_rate =
+          parse_number(optarg, "--min-send-rate", 1ULL << 40);
+      break;
+    case OPT_SEND_WINDOW_MS:
+      opts.deadlines.send_window_ms =
+          parse_number(optarg, "--send-window-ms", 86400000);
+      if (opts.deadlines.send_window_ms == 0) {
+        fprintf(stderr, "Invalid value for --send-window-ms: %s\n", optarg);
+        exit(2);
+      }
+      break;
+    case OPT_DEFER_ACCEPT_S:
+      opts.listener.defer_accept_s =
+          parse_number(optarg, "--defer-accept-s", 3600);
+      break;
+    case OPT_FASTOPEN:
+      opts.listener.fastopen_queue = parse_number(optarg, "--fastopen", 65535);
+      break;
+    case OPT_SOCKET_PROFILE:
+    case OPT_ADMIN_SOCKET_PROFILE: {
+      ListenerConfig &listener =
+          c == OPT_SOCKET_PROFILE ? opts.listener : opts.admin_listener;
+      if (!SocketProfile::preset(optarg, listener.profile)) {
+        fprintf(stderr, "Invalid socket profile: %s (default, bulk or "
+                        "interactive)\n", optarg);
+        exit(2);
+      }
+      break;
+    }
+    case OPT_CONGESTION:
+      congestion = optarg;
+      break;
+    case OPT_NODELAY:
+      nodelay = true;
+      break;
+    case OPT_SNDBUF:
+      sndbuf = parse_number(optarg, "--sndbuf", INT_MAX / 2);
+      break;
+    case OPT_NOTSENT_LOWAT:
+      notsent_lowat = parse_number(optarg, "--notsent-lowat", INT_MAX);
+      break;
+    case OPT_MAX_PACING_RATE:
+      max_pacing_rate = parse_number(optarg, "--max-pacing-rate", UINT64_MAX);
+      break;
+    case OPT_EGRESS_CONNECTION_RATE:
+      opts.egress.connection_rate =
+          parse_number(optarg, "--egress-connection-rate", UINT64_MAX);
+      break;
+    case OPT_EGRESS_CLIENT_RATE:
+      opts.egress.client_rate =
+          parse_number(optarg, "--egress-client-rate", UINT64_MAX);
+      break;
+    case OPT_EGRESS_GLOBAL_RATE:
+      opts.egress.global_rate =
+          parse_number(optarg, "--egress-global-rate", UINT64_MAX);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      exit(0);
+    default:
+      print_usage(argv[0]);
+      exit(2);
+    }
+  }
+  if (optind < argc) {
+    print_usage(argv[0]);
+    exit(2);
+  }
+  SocketProfile &profile = opts.listener.profile;
+  profile.congestion = congestion.value_or(profile.congestion);
+  profile.nodelay = nodelay.value_or(profile.nodelay);
+  profile.sndbuf = sndbuf.value_or(profile.sndbuf);
+  profile.notsent_lowat = notsent_lowat.value_or(profile.notsent_lowat);
+  profile.max_pacing_rate = max_pacing_rate.value_or(profile.max_pacing_rate);
+  if (opts.access_log.format == AccessLogConfig::BINARY &&
+      (opts.access_log.path == "-" || opts.access_log.path == "off")) {
+    fprintf(stderr, "--access-log-format binary needs an --access-log "
+                    "directory\n");
+    exit(2);
+  }
+  if (!opts.tiers.fast_root.empty() && opts.root.empty()) {
+    fprintf(stderr, "--fast-root requires --root\n");
+    exit(2);
+  }
+  return opts;
+}
+
+/**
+ * @brief Main entry point of the server
+ *
+ * Parses options, sets up signal handling, initializes the server socket, and
+ * enters the main accept loop to handle incoming client connections.
+ *
+ * @param argc Argument count
+ * @param argv Argument vector
+ * @return int Exit status (0 on success, non-zero on error)
+ */
+int main(int argc, char *argv[]) {
+  server.options = parse_options(argc, argv);
+
+  // Ignore SIGPIPE to prevent server from exiting when writing to a closed
+  // socket This allows us to handle broken pipe errors gracefully in our code
+  signal(SIGPIPE, SIG_IGN);
+
+  // Block SIGUSR1 before any other thread exists so that only the stats
+  // thread receives it
+  sigset_t stats_signals;
+  sigemptyset(&stats_signals);
+  sigaddset(&stats_signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &stats_signals, nullptr);
+  // Likewise SIGTERM and SIGINT, for the cleanup at exit; they stay pending
+  // until the status region exists and the thread waiting for them starts
+  sigset_t exit_signals;
+  sigemptyset(&exit_signals);
+  sigaddset(&exit_signals, SIGTERM);
+  sigaddset(&exit_signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &exit_signals, nullptr);
+  std::thread(stats_signal_loop, stats_signals).detach();
+
+  // Every connection holds a descriptor, so take all the kernel allows
+  server.fd_limit = raise_fd_limit();
+
+  try {
+    // Check what we are going to serve before accepting connections
+    std::string serving;
+    if (!server.options.proxy.upstream.empty()) {
+      server.proxy = std::make_unique<ProxyCache>(server.options.proxy);
+      serving = "objects from " + server.options.proxy.upstream;
+    } else if (server.options.root.empty()) {
+      // Open the file at startup to verify it exists and cache its size
+      File file(server.options.file_path.c_str());
+      serving = std::to_string(file.size()) + " bytes";
+    } else {
+      struct stat st;
+      if (stat(server.options.root.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+        handle_error("--root must be a directory: " + server.options.root);
+      }
+      serving = "files from " + server.options.root;
+    }
+
+    // Start the disk I/O pools, resolving per-device overrides to device IDs
+    server.io = std::make_unique<IoScheduler>(server.options.io_defaults);
+    for (const auto &[path, cfg] : server.options.io_devices) {
+      struct stat st;
+      if (stat(path.c_str(), &st) < 0) {
+        handle_error("stat() failed for --io-device " + path);
+      }
+      server.io->configure_device(st.st_dev, cfg);
+    }
+
+    server.residency.set_max_paths(server.options.residency_paths);
+
+    if (server.options.block_cache_mb > 0) {
+      server.block_cache = std::make_unique<BlockCache>(
+          server.options.block_cache_mb * 1024 * 1024);
+      printf("Block cache: %zu MB%s\n", server.block_cache->capacity() >> 20,
+             server.block_cache->huge_pages() ? " (huge pages)" : "");
+    }
+
+    if (!server.options.tiers.fast_root.empty()) {
+      server.options.tiers.slow_root = server.options.root;
+      server.tiers = std::make_unique<TieredStore<File>>(server.options.tiers);
+      printf("Fast tier: %s (budget %llu MB)\n",
+             server.options.tiers.fast_root.c_str(),
+             static_cast<unsigned long long>(server.options.tiers.fast_budget >>
+                                             20));
+    }
+
+    if (server.options.deadlines.enabled()) {
+      server.deadlines = std::make_unique<Deadlines>(server.options.deadlines);
+    }
+    const EgressConfig &egress = server.options.egress;
+    server.egress = std::make_unique<EgressShaper>(
+        egress, server.options.listener.profile.max_pacing_rate);
+    if (egress.connection_rate != 0 || egress.client_rate != 0 ||
+        egress.global_rate != 0) {
+      printf("Egress limits: connection %llu, client %llu, global %llu B/s\n",
+             static_cast<unsigned long long>(egress.connection_rate),
+             static_cast<unsigned long long>(egress.client_rate),
+             static_cast<unsigned long long>(egress.global_rate));
+    }
+
+    // Set up server socket
+    Socket server_socket =
+        create_server_socket(server.options.port, server.options.listener);
+    if (congestion_fallbacks.load() > 0) {
+      // So the banner shows the congestion control actually in use
+      server.options.listener.profile.congestion.clear();
+    }
+    if (server.options.listener.fastopen_queue > 0 &&
+        !fastopen_server_enabled()) {
+      fprintf(stderr, "Warning: net.ipv4.tcp_fastopen lacks the server bit "
+                      "(2); --fastopen has no effect\n");
+    }
+    // Every descriptor and thread held for the server's lifetime exists
+    // before the admin port answers, so a /metrics scrape sees the steady
+    // state (tests/soak.sh counts both from its first scrape)
+    server.acceptor = std::make_unique<Acceptor>(server_socket.fd());
+    if (server.options.synthetic) {
+      server.synthetic = std::make_unique<synthetic::Source>();
+      serving += ", generated content under " +
+                 std::string(synthetic::PREFIX);
+    }
+    if (server.options.access_log.path != "off") {
+      server.access_log =
+          std::make_unique<AccessLog>(server.options.access_log);
+    }
+    if (server.options.status_shm != "off") {
+      if (server.options.status_shm.empty()) {
+        server.options.status_shm =
+            "/streamix." + std::to_string(server.options.port);
+      }
+      timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      server.status = status::Region::create(
+          server.options.status_shm, metrics::now_ns(),
+          now.tv_sec * 1000000000LL + now.tv_nsec);
+      std::thread(status_publish_loop).detach();
+    }
+    std::thread(exit_signal_loop, exit_signals).detach();
+    if (server.options.admin_port != 0) {
+      std::thread(admin_loop,
+                  create_server_socket(server.options.admin_port,
+                                       server.options.admin_listener,
+                                       server.options.admin_bind))
+          .detach();
+    }
+    printf("Serving %s\n", serving.c_str());
+    printf("Descriptor limit: %llu\n",
+           static_cast<unsigned long long>(server.fd_limit));
+    printf("Socket profile: %s\n",
+           server.options.listener.profile.describe().c_str());
+    printf("Server running. Press Ctrl+C to exit...\n");
+    fflush(stdout); // The access log writes to the same fd unbuffered
+
+    // Main server loop: accept connections and handle them in separate
+    // threads. Nothing is logged here: client threads queue an access record
+    // when they finish, so the acceptor never waits on stdout.
+    Acceptor &acceptor = *server.acceptor;
+    auto start_client = [&acceptor](int client_fd, const sockaddr_in &peer) {
+      uint64_t allocs_before = alloc_tracking::calls();
+      uint64_t accepted_ns = metrics::now_ns();
+      count(CONNECTIONS_ACCEPTED);
+      STREAMIX_TRACE(accept, client_fd, accepted_ns);
+
+      // The pooled connection returns to the pool if thread creation fails
+      SlabPool<Connection>::Ptr conn = connection_pool.make();
+      conn->fd = client_fd;
+      conn->ip = peer.sin_addr.s_addr;
+      conn->port = ntohs(peer.sin_port);
+      conn->accepted_ns = accepted_ns;
+
+      // Create a new thread to handle the client connection
+      // The connection is released to the thread (ownership transfer)
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, handle_client, conn.get()) != 0) {
+        // Out of threads or memory for stacks: turn the client away and let
+        // running connections finish before accepting more
+        acceptor.shed(client_fd);
+        acceptor.back_off();
+        return;
+      }
+      acceptor.handed_off();
+
+      // Detach the thread so its resources are automatically released when it
+      // exits This is preferred over joining since we don't need to synchronize
+      // with the thread
+      if (pthread_detach(thread) != 0) {
+        // If detach fails, log a warning but continue
+        // The thread will still run and clean up after itself when it exits
+        perror("Warning: pthread_detach() failed");
+      }
+      conn.release();
+      count(ACCEPT_ALLOCATIONS, alloc_tracking::calls() - allocs_before);
+    };
+    while (true) {
+      acceptor.accept_batch(start_client);
     }
   } catch (const std::exception &e) {
     handle_error(e.what());
@@ -0,0 +1,190 @@
+/**
+ * @file synthetic.h
+ * @brief Generated content for network-only benchmarks
+ *
+ * With --synthetic, GET /synthetic/SIZE returns SIZE bytes (with an optional
+ * k, m, g or t suffix for powers of 1024) that never touch a disk. They are
+ * sent with sendfile() from a memfd, PERIOD bytes at a time, so only the
+ * network and syscall path is measured.
+ *
+ * The memfd holds 2 * PERIOD bytes of little-endian words n * MULTIPLIER,
+ * n being the word's index in the memfd. Period p of a response is sent from
+ * memfd offset 8 * (p % (PERIOD / 8)), so it starts one word further on than
+ * the period before it: byte offset % 8 of a response is byte offset % 8 of
+ * the word
+ *
+ *   (offset % PERIOD / 8 + offset / PERIOD % (PERIOD / 8)) * MULTIPLIER
+ *
+ * The sequence only repeats after PERIOD * PERIOD / 8 bytes (8 TiB), and
+ * data displaced by a whole number of periods no longer matches; it does
+ * match where displaced by a multiple of PERIOD - 8 bytes instead. A client
+ * can check any range it receives with verify(), and the load generator does
+ * so with --verify.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace synthetic {
+
+constexpr std::string_view PREFIX = "/synthetic/";
+constexpr size_t PERIOD = 8 * 1024 * 1024; ///< Bytes sent per sendfile() run
+constexpr size_t SOURCE_BYTES = 2 * PERIOD; ///< Bytes in the memfd
+constexpr uint64_t MULTIPLIER = 0x9e3779b97f4a7c15ULL;
+
+/**
+ * @brief Where in the memfd the byte at offset of a response is
+ *
+ * Contiguous up to the next multiple of PERIOD.
+ */
+inline uint64_t source_offset(uint64_t offset) {
+  return offset % PERIOD + 8 * (offset / PERIOD % (PERIOD / 8));
+}
+
+/**
+ * @brief The 8-byte word containing offset
+ */
+inline uint64_t word_at(uint64_t offset) {
+  return source_offset(offset) / 8 * MULTIPLIER;
+}
+
+/**
+ * @brief Write the words of fn(position) for [offset, offset + length)
+ */
+template <typename Word>
+inline void fill_words(char *buf, uint64_t offset, size_t length, Word fn) {
+  for (size_t i = 0; i < length;) {
+    uint64_t word = fn(offset + i);
+    size_t skip = (offset + i) % 8;
+    size_t n = std::min<size_t>(8 - skip, length - i);
+    // Little-endian on the wire regardless of the host
+    for (size_t b = 0; b < n; b++) {
+      buf[i + b] = static_cast<char>(word >> (8 * (skip + b)));
+    }
+    i += n;
+  }
+}
+
+/**
+ * @brief Write the pattern for [offset, offset + length) into buf
+ */
+inline void fill(char *buf, uint64_t offset, size_t length) {
+  fill_words(buf, offset, length, word_at);
+}
+
+/**
+ * @brief Check received bytes against the pattern
+ * @param buf Bytes received
+ * @param offset Offset of buf[0] in the file
+ * @param length Bytes in buf
+ * @return true if every byte matches
+ */
+inline bool verify(const char *buf, uint64_t offset, size_t length) {
+  char expected[4096];
+  while (length > 0) {
+    size_t n = std::min(length, sizeof(expected));
+    fill(expected, offset, n);
+    if (memcmp(buf, expected, n) != 0) {
+      return false;
+    }
+    buf += n;
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+ * @brief Parse the part of a target after PREFIX, e.g. "10g" or "4096"
+ * @param spec Size with an optional k, m, g or t suffix; a query is ignored
+ * @param size Receives the size in bytes
+ * @return false if spec is not a valid size
+ */
+inline bool parse_size(std::string_view spec, off_t &size) {
+  spec = spec.substr(0, spec.find_first_of("?#"));
+  int shift = 0;
+  if (!spec.empty()) {
+    switch (spec.back() | 0x20) {
+    case 'k':
+      shift = 10;
+      break;
+    case 'm':
+      shift = 20;
+      break;
+    case 'g':
+      shift = 30;
+      break;
+    case 't':
+      shift = 40;
+      break;
+    }
+  }
+  if (shift != 0) {
+    spec.remove_suffix(1);
+  }
+  if (spec.empty() || spec.size() > 18) {
+    return false;
+  }
+  uint64_t n = 0;
+  for (char c : spec) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    n = n * 10 + (c - '0');
+  }
+  if (n > (static_cast<uint64_t>(INT64_MAX) >> shift)) {
+    return false;
+  }
+  size = static_cast<off_t>(n << shift);
+  return true;
+}
+
+/**
+ * @brief The memfd responses are sent from, see source_offset()
+ */
+class Source {
+  int fd_ = -1;
+
+public:
+  /**
+   * @throws std::system_error if the memfd cannot be created or filled
+   */
+  Source() {
+    fd_ = memfd_create("streamix-synthetic", MFD_CLOEXEC);
+    if (fd_ < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "memfd_create()");
+    }
+    std::vector<char> buf(1 << 20);
+    for (size_t offset = 0; offset < SOURCE_BYTES; offset += buf.size()) {
+      fill_words(buf.data(), offset, buf.size(),
+                 [](uint64_t pos) { return pos / 8 * MULTIPLIER; });
+      if (pwrite(fd_, buf.data(), buf.size(), offset) !=
+          static_cast<ssize_t>(buf.size())) {
+        int err = errno;
+        close(fd_);
+        throw std::system_error(err, std::generic_category(),
+                                "writing synthetic content");
+      }
+    }
+  }
+
+  ~Source() { close(fd_); }
+
+  Source(const Source &) = delete;
+  Source &operator=(const Source &) = delete;
+
+  int fd() const { return fd_; }
+};
+
+} // namespace synthetic
@@ -0,0 +1,176 @@
+/**
+ * @file tcp_sampler.h
+ * @brief Periodic TCP_INFO sampling of client connections
+ *
+ * A slow download can be the disk, the server or the client's network. The
+ * kernel already knows which: TCP_INFO reports the path RTT, congestion
+ * window, retransmissions, delivery rate, and how long the connection spent
+ * limited by the receiver's window or by our own send buffer. Sampling it
+ * every so often during a transfer and once at the end costs one
+ * getsockopt() per interval, plus one for SO_MEMINFO, which gives the
+ * socket buffer memory the connection holds.
+ */
+
+#pragma once
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <linux/sock_diag.h>
+#include <linux/tcp.h>
+#include <sys/socket.h>
+
+/**
+ * @brief Distributions of TCP_INFO values, exported by /metrics
+ */
+struct TcpMetrics {
+  metrics::Histogram rtt_us;        ///< Smoothed RTT per sample
+  metrics::Histogram cwnd;          ///< Congestion window (segments) per sample
+  metrics::Histogram delivery_rate; ///< Bytes per second per sample
+  metrics::Histogram notsent;       ///< Unsent bytes queued, per sample
+  metrics::Histogram retransmits;   ///< Segments retransmitted per connection
+  metrics::Histogram rwnd_limited;  ///< Per mille of busy time, per connection
+  metrics::Histogram sndbuf_limited; ///< Per mille of busy time, per connection
+  std::atomic<int64_t> socket_memory{0}; ///< Queued send plus allocated
+                                         ///< receive memory of open
+                                         ///< connections, as last sampled
+};
+
+/**
+ * @brief What a connection's samples add up to, for the access log
+ */
+struct TcpSummary {
+  uint64_t samples = 0;
+  uint32_t rtt_min_us = 0;
+  uint32_t rtt_avg_us = 0;
+  uint32_t rtt_max_us = 0;
+  uint32_t cwnd_max = 0;        ///< Segments
+  uint32_t retransmits = 0;     ///< Segments retransmitted in total
+  uint64_t delivery_rate_max = 0; ///< Bytes per second
+  uint64_t busy_ms = 0;         ///< Time with data in flight
+  unsigned rwnd_limited = 0;    ///< Per mille of busy time
+  unsigned sndbuf_limited = 0;  ///< Per mille of busy time
+};
+
+/**
+ * @brief Samples TCP_INFO for one connection and summarizes it on finish()
+ */
+class TcpSampler {
+  int fd_;
+  TcpMetrics &metrics_;
+  uint64_t interval_ns_;
+  uint64_t next_ns_; ///< Time of the next periodic sample
+
+  uint64_t samples_ = 0;
+  uint64_t rtt_min_us_ = UINT64_MAX;
+  uint64_t rtt_max_us_ = 0;
+  uint64_t rtt_sum_us_ = 0;
+  uint32_t cwnd_max_ = 0;
+  uint64_t delivery_rate_max_ = 0;
+  tcp_info last_{}; ///< Most recent sample, for the cumulative fields
+  int64_t memory_ = 0; ///< Our share of metrics_.socket_memory
+
+  void sample_memory() {
+    uint32_t meminfo[SK_MEMINFO_VARS] = {};
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(fd_, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0) {
+      return;
+    }
+    int64_t memory = static_cast<int64_t>(meminfo[SK_MEMINFO_WMEM_QUEUED]) +
+                     meminfo[SK_MEMINFO_RMEM_ALLOC];
+    metrics_.socket_memory.fetch_add(memory - memory_,
+                                     std::memory_order_relaxed);
+    memory_ = memory;
+  }
+
+  bool take_sample() {
+    tcp_info info{};
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+      return false;
+    }
+    last_ = info;
+    samples_++;
+    rtt_min_us_ = std::min<uint64_t>(rtt_min_us_, info.tcpi_rtt);
+    rtt_max_us_ = std::max<uint64_t>(rtt_max_us_, info.tcpi_rtt);
+    rtt_sum_us_ += info.tcpi_rtt;
+    cwnd_max_ = std::max(cwnd_max_, info.tcpi_snd_cwnd);
+    delivery_rate_max_ =
+        std::max<uint64_t>(delivery_rate_max_, info.tcpi_delivery_rate);
+
+    metrics_.rtt_us.record(info.tcpi_rtt);
+    metrics_.cwnd.record(info.tcpi_snd_cwnd);
+    if (info.tcpi_delivery_rate > 0) {
+      metrics_.delivery_rate.record(info.tcpi_delivery_rate);
+    }
+    metrics_.notsent.record(info.tcpi_notsent_bytes);
+    sample_memory();
+    return true;
+  }
+
+public:
+  /**
+   * @param fd Connected TCP socket
+   * @param metrics Histograms to record into
+   * @param interval_ms Minimum time between periodic samples, 0 to only
+   *        sample in finish()
+   */
+  TcpSampler(int fd, TcpMetrics &metrics, unsigned interval_ms)
+      : fd_(fd), metrics_(metrics),
+        interval_ns_(static_cast<uint64_t>(interval_ms) * 1000000),
+        next_ns_(metrics::now_ns() + interval_ns_) {}
+
+  ~TcpSampler() {
+    metrics_.socket_memory.fetch_sub(memory_, std::memory_order_relaxed);
+  }
+
+  TcpSampler(const TcpSampler &) = delete;
+  TcpSampler &operator=(const TcpSampler &) = delete;
+
+  /**
+   * @brief Sample if the interval has passed; call between sends
+   */
+  void poll() {
+    if (interval_ns_ == 0) {
+      return;
+    }
+    uint64_t now = metrics::now_ns();
+    if (now >= next_ns_) {
+      next_ns_ = now + interval_ns_;
+      take_sample();
+    }
+  }
+
+  /**
+   * @brief Take a final sample and record the per-connection summary
+   * @param summary Receives the totals for this connection
+   * @return false if TCP_INFO could not be read
+   */
+  bool finish(TcpSummary &summary) {
+    if (!take_sample()) {
+      return false;
+    }
+    const tcp_info &info = last_;
+    summary.samples = samples_;
+    summary.rtt_min_us = rtt_min_us_;
+    summary.rtt_avg_us = rtt_sum_us_ / samples_;
+    summary.rtt_max_us = rtt_max_us_;
+    summary.cwnd_max = cwnd_max_;
+    summary.retransmits = info.tcpi_total_retrans;
+    summary.delivery_rate_max = delivery_rate_max_;
+    summary.busy_ms = info.tcpi_busy_time / 1000;
+    if (info.tcpi_busy_time > 0) {
+      summary.rwnd_limited =
+          info.tcpi_rwnd_limited * 1000 / info.tcpi_busy_time;
+      summary.sndbuf_limited =
+          info.tcpi_sndbuf_limited * 1000 / info.tcpi_busy_time;
+    }
+    metrics_.retransmits.record(summary.retransmits);
+    metrics_.rwnd_limited.record(summary.rwnd_limited);
+    metrics_.sndbuf_limited.record(summary.sndbuf_limited);
+    return true;
+  }
+};
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Check that serving requests does not allocate from the heap once warm.
+#
+# Usage: tests/alloc_check.sh [SERVER]
+#
+# SERVER must be built with -DSTREAMIX_ALLOC_TRACKING (make alloc-check does
+# this). After a warm-up, which lets pools and maps grow to size, a mix of
+# full, range and HEAD requests for a file with a long path is served, and the
+# allocation counters in /metrics must not move.
+
+set -eu
+
+SERVER=${1:-./streamix-alloccheck}
+PORT=${ALLOC_CHECK_PORT:-18480}
+ADMIN_PORT=$((PORT + 1))
+WARMUP=50
+REQUESTS=200
+
+dir=$(mktemp -d)
+mkdir -p "$dir/videos/a-long-directory-name"
+target=/videos/a-long-directory-name/some-video-file.mp4
+head -c 1048576 /dev/urandom >"$dir$target"
+
+"$SERVER" -p "$PORT" --admin-port "$ADMIN_PORT" -r "$dir" \
+  --access-log "$dir/access.log" --status-shm /streamix-alloc-check \
+  >/dev/null &
+pid=$!
+trap 'kill $pid 2>/dev/null; rm -rf "$dir" /dev/shm/streamix-alloc-check' EXIT
+
+allocations() {
+  curl -sf "http://127.0.0.1:$ADMIN_PORT/metrics" |
+    awk '/^streamix_allocations_total/ { n += $2 } END { print n + 0 }'
+}
+
+requests() {
+  i=0
+  while [ "$i" -lt "$1" ]; do
+    curl -sf -o /dev/null "http://127.0.0.1:$PORT$target"
+    curl -sf -o /dev/null -r 1000-199999 "http://127.0.0.1:$PORT$target"
+    curl -sf -o /dev/null -I "http://127.0.0.1:$PORT$target?x=1"
+    i=$((i + 1))
+  done
+}
+
+for _ in 1 2 3 4 5 6 7 8 9 10; do
+  allocations >/dev/null 2>&1 && break
+  sleep 0.2
+done
+
+requests "$WARMUP"
+before=$(allocations)
+requests "$REQUESTS"
+after=$(allocations)
+
+count=$((REQUESTS * 3))
+delta=$((after - before))
+echo "alloc-check: $delta heap allocations over $count requests"
+if [ "$delta" -ne 0 ]; then
+  echo "alloc-check: FAILED, the request path allocates" >&2
+  exit 1
+fi
+echo "alloc-check: OK"
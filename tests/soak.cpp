@@ -0,0 +1,891 @@
+/**
+ * @file soak.cpp
+ * @brief C100K soak test: memory per connection, leaks and latency drift
+ *
+ * Holds a large number of concurrent connections open against a local server
+ * started with --synthetic, for a fixed duration, in four groups:
+ *
+ *   idle   connect and send half a request head, then wait
+ *   slow   download a huge response, reading a little every second
+ *   fast   download 1 MiB responses back to back, with --verify checks
+ *   abort  start a large download and reset the connection shortly after,
+ *          over and over
+ *
+ * A probe measures the latency of small requests throughout, while the
+ * server's RSS, descriptors and threads are sampled from /proc/PID.
+ *
+ * The whole mix is run once as a warm-up and released, so pools, arenas and
+ * stack caches have grown before the baseline sample. After the measured run
+ * every connection is closed and the server is given time to settle. The
+ * test fails if the server exits, if its RSS grows by more than the budget per
+ * connection held, if descriptors or threads stay above their level before
+ * the test, if RSS stays more than the leak allowance above the baseline, or
+ * if a fast download fails verification.
+ *
+ * Connections are spread over several loopback addresses, each with its own
+ * ephemeral port range. The report is one JSON object on stdout; a summary,
+ * compared with --baseline if given, goes to stderr.
+ */
+
+#include "../bench/http_client.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fstream>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using metrics::now_ns;
+
+/// Connections per loopback address, below the default ephemeral port range
+constexpr unsigned PER_ADDRESS = 20000;
+
+struct Config {
+  int port = 8080;
+  pid_t pid = 0;                ///< Server to sample
+  unsigned connections = 100000;
+  double duration_s = 60;       ///< Hold time once every connection is open
+  double warmup_s = 10;         ///< 0 skips the warm-up
+  unsigned mix[4] = {75, 20, 4, 1}; ///< idle, slow, fast, abort weights
+  unsigned ramp_rate = 5000;    ///< New connections per second while ramping
+  unsigned budget_kb = 64;      ///< Max server RSS growth per connection
+  unsigned leak_mb = 16;        ///< Max RSS left above baseline afterwards
+  double settle_s = 30;         ///< Max wait for the server to release
+  unsigned sample_ms = 1000;
+  double probe_rate = 20;       ///< Probe requests per second
+  unsigned slow_read = 1024;    ///< Bytes each slow client reads per second
+  unsigned abort_ms = 1000;     ///< How long an abort client waits to reset
+  std::string baseline;         ///< Earlier report to compare against
+};
+
+enum Group { IDLE, SLOW, FAST, ABORT, GROUPS };
+
+/**
+ * @brief Counters shared by the client threads and the sampler
+ */
+struct Stats {
+  std::atomic<uint64_t> open[GROUPS] = {}; ///< Connections open now
+  std::atomic<uint64_t> closed_by_server{0}; ///< Idle or slow, reopened
+  std::atomic<uint64_t> connect_errors{0};
+  std::atomic<uint64_t> resets{0};           ///< Abort connections reset
+  std::atomic<uint64_t> fast_ok{0};
+  std::atomic<uint64_t> fast_errors{0};      ///< Error or timeout
+  std::atomic<uint64_t> corrupt{0};
+  std::atomic<uint64_t> probe_errors{0};
+  metrics::Histogram probe;                  ///< ns per probe request
+
+  uint64_t open_total() const {
+    uint64_t n = 0;
+    for (const auto &o : open) {
+      n += o.load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+};
+
+/**
+ * @brief What /proc says about the server at one point in time
+ */
+struct ProcessSample {
+  double t = 0;         ///< Seconds since the test started
+  uint64_t rss_kb = 0;
+  uint64_t vsz_kb = 0;
+  unsigned fds = 0;
+  unsigned threads = 0;
+  uint64_t tcp_mem_kb = 0; ///< All TCP buffers on the host, both ends
+  uint64_t open = 0;       ///< Client connections open
+  double p50_ms = 0;       ///< Probe latency since the previous sample
+  double p99_ms = 0;
+};
+
+/**
+ * @brief Read the server's memory, thread and descriptor counts
+ * @return false if the process is gone
+ */
+bool read_process(pid_t pid, ProcessSample &s) {
+  std::string dir = "/proc/" + std::to_string(pid);
+  std::ifstream status(dir + "/status");
+  if (!status || kill(pid, 0) != 0) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(status, line)) {
+    unsigned long long v = 0;
+    if (sscanf(line.c_str(), "VmRSS: %llu", &v) == 1) {
+      s.rss_kb = v;
+    } else if (sscanf(line.c_str(), "VmSize: %llu", &v) == 1) {
+      s.vsz_kb = v;
+    } else if (sscanf(line.c_str(), "Threads: %llu", &v) == 1) {
+      s.threads = v;
+    } else if (line.compare(0, 6, "State:") == 0 &&
+               line.find('Z') != std::string::npos) {
+      return false;
+    }
+  }
+  DIR *fds = opendir((dir + "/fd").c_str());
+  if (fds == nullptr) {
+    return false;
+  }
+  s.fds = 0;
+  while (dirent *e = readdir(fds)) {
+    if (e->d_name[0] != '.') {
+      s.fds++;
+    }
+  }
+  closedir(fds);
+
+  std::ifstream sockstat("/proc/net/sockstat");
+  while (std::getline(sockstat, line)) {
+    unsigned long long pages = 0;
+    size_t mem = line.find(" mem ");
+    if (line.compare(0, 4, "TCP:") == 0 && mem != std::string::npos &&
+        sscanf(line.c_str() + mem, " mem %llu", &pages) == 1) {
+      s.tcp_mem_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+  }
+  return true;
+}
+
+metrics::Histogram::Snapshot diff(const metrics::Histogram::Snapshot &later,
+                                  const metrics::Histogram::Snapshot &earlier) {
+  metrics::Histogram::Snapshot d = later;
+  for (size_t i = 0; i < d.counts.size(); i++) {
+    d.counts[i] -= earlier.counts[i];
+  }
+  d.count -= earlier.count;
+  d.sum -= earlier.sum;
+  return d;
+}
+
+/**
+ * @brief Connect with a blocking connect(), optionally with a small SO_RCVBUF
+ * @return The socket, or -1
+ */
+int open_socket(const sockaddr_in &addr, int rcvbuf) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (rcvbuf > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) <
+      0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Send a whole (small) request on a blocking socket
+ */
+bool send_all(int fd, std::string_view data) {
+  return send(fd, data.data(), data.size(), MSG_NOSIGNAL) ==
+         static_cast<ssize_t>(data.size());
+}
+
+/**
+ * @brief Close with an RST instead of a FIN
+ */
+void reset_socket(int fd) {
+  linger l{1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+  close(fd);
+}
+
+/**
+ * @brief Drives the idle, slow and abort groups with plain blocking sockets
+ *
+ * None of them need a response parsed, so one thread walks the sockets: idle
+ * and slow ones once a second, to read and to notice closes, and abort ones
+ * as their resets fall due.
+ */
+class SocketGroups {
+  const Config &cfg_;
+  Stats &stats_;
+  const std::vector<sockaddr_in> &addrs_;
+  unsigned targets_[GROUPS];
+  std::vector<int> idle_;
+  std::vector<int> slow_;
+  std::deque<std::pair<int, uint64_t>> abort_; ///< fd, when to reset it
+  unsigned next_addr_ = 0;
+  std::string half_request_;
+  std::string big_request_;
+
+  const sockaddr_in &next_addr() {
+    return addrs_[next_addr_++ % addrs_.size()];
+  }
+
+  /// Open one connection of group g, or return -1
+  int open(Group g) {
+    int fd = open_socket(next_addr(), g == SLOW ? 4096 : 0);
+    if (fd < 0) {
+      stats_.connect_errors.fetch_add(1, std::memory_order_relaxed);
+      return -1;
+    }
+    if (!send_all(fd, g == IDLE ? half_request_ : big_request_)) {
+      close(fd);
+      stats_.connect_errors.fetch_add(1, std::memory_order_relaxed);
+      return -1;
+    }
+    stats_.open[g].fetch_add(1, std::memory_order_relaxed);
+    return fd;
+  }
+
+  void drop(Group g, int &fd, bool reset) {
+    if (reset) {
+      reset_socket(fd);
+    } else {
+      close(fd);
+    }
+    fd = -1;
+    stats_.open[g].fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  /// Read from slow sockets and check that idle ones are still open
+  void visit(std::vector<int> &fds, Group g, char *buf) {
+    for (int &fd : fds) {
+      if (fd < 0) {
+        continue;
+      }
+      ssize_t n = g == SLOW ? recv(fd, buf, cfg_.slow_read, MSG_DONTWAIT)
+                            : recv(fd, buf, 1, MSG_DONTWAIT | MSG_PEEK);
+      bool open = (n < 0 && errno == EAGAIN) || (g == SLOW && n > 0);
+      if (!open) {
+        stats_.closed_by_server.fetch_add(1, std::memory_order_relaxed);
+        drop(g, fd, false);
+      }
+    }
+  }
+
+public:
+  SocketGroups(const Config &cfg, Stats &stats,
+               const std::vector<sockaddr_in> &addrs, const unsigned *targets)
+      : cfg_(cfg), stats_(stats), addrs_(addrs) {
+    std::copy(targets, targets + GROUPS, targets_);
+    idle_.reserve(targets_[IDLE]);
+    slow_.reserve(targets_[SLOW]);
+    half_request_ = "GET /synthetic/4k HTTP/1.1\r\nHost: 127.0.0.1\r\n";
+    big_request_ = "GET /synthetic/1t HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                   "Connection: close\r\n\r\n";
+  }
+
+  ~SocketGroups() {
+    for (int fd : idle_) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    for (int fd : slow_) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+    for (auto &a : abort_) {
+      reset_socket(a.first);
+    }
+    for (int g : {IDLE, SLOW, ABORT}) {
+      stats_.open[g].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void run(uint64_t start_ns, const std::atomic<bool> &stop) {
+    std::vector<char> buf(std::max(cfg_.slow_read, 1u));
+    uint64_t next_visit = start_ns + 1000000000;
+    while (!stop.load(std::memory_order_relaxed)) {
+      uint64_t now = now_ns();
+      double elapsed = (now - start_ns) / 1e9;
+      // Ramp each group at its share of the rate, and refill closed slots
+      auto allowed = [&](Group g) {
+        return static_cast<size_t>(std::min<double>(
+            targets_[g], elapsed * cfg_.ramp_rate * targets_[g] /
+                             cfg_.connections));
+      };
+      for (Group g : {IDLE, SLOW}) {
+        std::vector<int> &fds = g == IDLE ? idle_ : slow_;
+        size_t want = allowed(g);
+        while (fds.size() < want && !stop.load(std::memory_order_relaxed)) {
+          fds.push_back(open(g));
+        }
+      }
+      while (!abort_.empty() && abort_.front().second <= now) {
+        reset_socket(abort_.front().first);
+        abort_.pop_front();
+        stats_.open[ABORT].fetch_sub(1, std::memory_order_relaxed);
+        stats_.resets.fetch_add(1, std::memory_order_relaxed);
+      }
+      size_t want = allowed(ABORT);
+      while (abort_.size() < want && !stop.load(std::memory_order_relaxed)) {
+        int fd = open(ABORT);
+        if (fd < 0) {
+          break;
+        }
+        abort_.emplace_back(fd, now_ns() + cfg_.abort_ms * 1000000ULL);
+      }
+
+      if (now >= next_visit) {
+        visit(idle_, IDLE, buf.data());
+        visit(slow_, SLOW, buf.data());
+        for (Group g : {IDLE, SLOW}) {
+          for (int &fd : g == IDLE ? idle_ : slow_) {
+            if (fd < 0) {
+              fd = open(g);
+            }
+          }
+        }
+        next_visit = now + 1000000000;
+      }
+      usleep(10000);
+    }
+  }
+};
+
+/**
+ * @brief Fast downloaders: closed-loop 1 MiB requests, verified
+ */
+void run_fast(const Config &cfg, Stats &stats,
+              const std::vector<sockaddr_in> &addrs, unsigned target,
+              uint64_t start_ns, const std::atomic<bool> &stop) {
+  if (target == 0) {
+    return;
+  }
+  bench::ClientOptions opts;
+  opts.verify = true;
+  bench::ClientLoop loop(addrs, target, opts);
+  const std::string request = "GET /synthetic/1m HTTP/1.1\r\nHost: 127.0.0.1"
+                              "\r\nConnection: close\r\n\r\n";
+  auto on_done = [&](const bench::Response &r) {
+    if (r.outcome == bench::Response::OK) {
+      stats.fast_ok.fetch_add(1, std::memory_order_relaxed);
+    } else if (r.outcome == bench::Response::CORRUPT) {
+      stats.corrupt.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      stats.fast_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+  while (!stop.load(std::memory_order_relaxed)) {
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    size_t allowed = static_cast<size_t>(std::min<double>(
+        target, elapsed * cfg.ramp_rate * target / cfg.connections));
+    while (loop.idle() > 0 && loop.in_flight() < allowed) {
+      loop.start(request, 0);
+    }
+    stats.open[FAST].store(loop.in_flight(), std::memory_order_relaxed);
+    loop.poll(10000000, on_done);
+  }
+  loop.abandon([](const bench::Response &) {});
+  stats.open[FAST].store(0, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Open-loop probe of small requests, for latency drift
+ */
+void run_probe(const Config &cfg, Stats &stats, const sockaddr_in &addr,
+               const std::atomic<bool> &stop) {
+  if (cfg.probe_rate <= 0) {
+    return;
+  }
+  bench::ClientLoop loop(addr, 16, {});
+  const std::string request = "GET /synthetic/4k HTTP/1.1\r\nHost: 127.0.0.1"
+                              "\r\nConnection: close\r\n\r\n";
+  uint64_t interval = static_cast<uint64_t>(1e9 / cfg.probe_rate);
+  uint64_t next_due = now_ns();
+  auto on_done = [&](const bench::Response &r) {
+    if (r.outcome == bench::Response::OK && r.status == 200) {
+      // The tag is the due time, so a stalled accept loop counts
+      stats.probe.record(r.end_ns - r.tag);
+    } else {
+      stats.probe_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+  while (!stop.load(std::memory_order_relaxed)) {
+    uint64_t now = now_ns();
+    while (next_due <= now && loop.idle() > 0) {
+      loop.start(request, next_due);
+      next_due += interval;
+    }
+    loop.poll(next_due > now ? next_due - now : 0, on_done);
+  }
+  loop.abandon([](const bench::Response &) {});
+}
+
+/**
+ * @brief One run of the whole mix, sampled until the duration has passed
+ */
+class Run {
+  const Config &cfg_;
+  const std::vector<sockaddr_in> &addrs_;
+  Stats &stats_;
+  std::atomic<bool> stop_{false};
+  std::vector<std::thread> threads_;
+
+public:
+  Run(const Config &cfg, const std::vector<sockaddr_in> &addrs, Stats &stats)
+      : cfg_(cfg), addrs_(addrs), stats_(stats) {
+    unsigned sum = cfg.mix[0] + cfg.mix[1] + cfg.mix[2] + cfg.mix[3];
+    unsigned targets[GROUPS];
+    unsigned assigned = 0;
+    for (int g = GROUPS - 1; g > IDLE; g--) {
+      targets[g] = static_cast<uint64_t>(cfg.connections) * cfg.mix[g] / sum;
+      assigned += targets[g];
+    }
+    targets[IDLE] = cfg.connections - assigned;
+
+    uint64_t start = now_ns();
+    threads_.emplace_back([this, targets, start] {
+      SocketGroups groups(cfg_, stats_, addrs_, targets);
+      groups.run(start, stop_);
+    });
+    threads_.emplace_back([this, targets, start] {
+      run_fast(cfg_, stats_, addrs_, targets[FAST], start, stop_);
+    });
+    threads_.emplace_back(
+        [this] { run_probe(cfg_, stats_, addrs_.front(), stop_); });
+  }
+
+  /// Close every connection
+  ~Run() {
+    stop_.store(true);
+    for (std::thread &t : threads_) {
+      t.join();
+    }
+  }
+
+  Run(const Run &) = delete;
+  Run &operator=(const Run &) = delete;
+};
+
+std::string sample_json(const ProcessSample &s) {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "{\"t\":%.1f,\"rss_kb\":%llu,\"vsz_kb\":%llu,\"fds\":%u,"
+           "\"threads\":%u,\"tcp_mem_kb\":%llu,\"open\":%llu,"
+           "\"p50_ms\":%.3f,\"p99_ms\":%.3f}",
+           s.t, static_cast<unsigned long long>(s.rss_kb),
+           static_cast<unsigned long long>(s.vsz_kb), s.fds, s.threads,
+           static_cast<unsigned long long>(s.tcp_mem_kb),
+           static_cast<unsigned long long>(s.open), s.p50_ms, s.p99_ms);
+  return buf;
+}
+
+/**
+ * @brief Find "key":NUMBER in an earlier report
+ * @return NAN if missing
+ */
+double json_number(const std::string &json, const char *key) {
+  std::string needle = std::string("\"") + key + "\":";
+  size_t at = json.find(needle);
+  if (at == std::string::npos) {
+    return NAN;
+  }
+  return strtod(json.c_str() + at + needle.size(), nullptr);
+}
+
+void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s --pid PID [options]\n"
+          "  -p, --port PORT         Server port (default 8080)\n"
+          "      --pid PID           Server process to sample\n"
+          "  -n, --connections N     Concurrent connections (default 100000)\n"
+          "  -d, --duration SECS     Hold time at full count (default 60)\n"
+          "      --warmup SECS       Warm-up run before the baseline\n"
+          "                          (default 10, 0 skips it)\n"
+          "      --mix I:S:F:A       Weights of idle, slow, fast and abort\n"
+          "                          clients (default 75:20:4:1)\n"
+          "      --ramp-rate N       New connections per second (default 5000)\n"
+          "      --budget-kb KB      Max server RSS per connection (default 64)\n"
+          "      --leak-mb MB        Max RSS left above baseline (default 16)\n"
+          "      --settle SECS       Max wait for the server to release\n"
+          "                          connections (default 30)\n"
+          "      --sample-ms N       Sampling interval (default 1000)\n"
+          "      --probe-rate N      Probe requests per second (default 20)\n"
+          "      --baseline FILE     Earlier report to compare against\n"
+          "The server must be local and run with --synthetic.\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  enum {
+    OPT_PID = 256,
+    OPT_WARMUP,
+    OPT_MIX,
+    OPT_RAMP_RATE,
+    OPT_BUDGET_KB,
+    OPT_LEAK_MB,
+    OPT_SETTLE,
+    OPT_SAMPLE_MS,
+    OPT_PROBE_RATE,
+    OPT_BASELINE,
+  };
+  static const option long_options[] = {
+      {"port", required_argument, nullptr, 'p'},
+      {"pid", required_argument, nullptr, OPT_PID},
+      {"connections", required_argument, nullptr, 'n'},
+      {"duration", required_argument, nullptr, 'd'},
+      {"warmup", required_argument, nullptr, OPT_WARMUP},
+      {"mix", required_argument, nullptr, OPT_MIX},
+      {"ramp-rate", required_argument, nullptr, OPT_RAMP_RATE},
+      {"budget-kb", required_argument, nullptr, OPT_BUDGET_KB},
+      {"leak-mb", required_argument, nullptr, OPT_LEAK_MB},
+      {"settle", required_argument, nullptr, OPT_SETTLE},
+      {"sample-ms", required_argument, nullptr, OPT_SAMPLE_MS},
+      {"probe-rate", required_argument, nullptr, OPT_PROBE_RATE},
+      {"baseline", required_argument, nullptr, OPT_BASELINE},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  Config cfg;
+  int c;
+  while ((c = getopt_long(argc, argv, "p:n:d:h", long_options, nullptr)) !=
+         -1) {
+    switch (c) {
+    case 'p':
+      cfg.port = atoi(optarg);
+      break;
+    case OPT_PID:
+      cfg.pid = atoi(optarg);
+      break;
+    case 'n':
+      cfg.connections = atoi(optarg);
+      break;
+    case 'd':
+      cfg.duration_s = atof(optarg);
+      break;
+    case OPT_WARMUP:
+      cfg.warmup_s = atof(optarg);
+      break;
+    case OPT_MIX:
+      if (sscanf(optarg, "%u:%u:%u:%u", &cfg.mix[0], &cfg.mix[1], &cfg.mix[2],
+                 &cfg.mix[3]) != 4 ||
+          cfg.mix[0] + cfg.mix[1] + cfg.mix[2] + cfg.mix[3] == 0) {
+        fprintf(stderr, "Invalid --mix: %s\n", optarg);
+        return 2;
+      }
+      break;
+    case OPT_RAMP_RATE:
+      cfg.ramp_rate = std::max(1, atoi(optarg));
+      break;
+    case OPT_BUDGET_KB:
+      cfg.budget_kb = atoi(optarg);
+      break;
+    case OPT_LEAK_MB:
+      cfg.leak_mb = atoi(optarg);
+      break;
+    case OPT_SETTLE:
+      cfg.settle_s = atof(optarg);
+      break;
+    case OPT_SAMPLE_MS:
+      cfg.sample_ms = std::max(10, atoi(optarg));
+      break;
+    case OPT_PROBE_RATE:
+      cfg.probe_rate = atof(optarg);
+      break;
+    case OPT_BASELINE:
+      cfg.baseline = optarg;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+  if (cfg.pid <= 0 || cfg.connections == 0 || cfg.duration_s <= 0) {
+    print_usage(argv[0]);
+    return 2;
+  }
+
+  // Every connection needs a descriptor here, and one in the server
+  rlimit nofile;
+  if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 &&
+      nofile.rlim_cur < nofile.rlim_max) {
+    nofile.rlim_cur = nofile.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &nofile);
+  }
+  if (nofile.rlim_cur < cfg.connections + 100) {
+    fprintf(stderr,
+            "soak: %llu descriptors allowed, %u connections need more; "
+            "raise the hard limit (ulimit -Hn) or lower -n\n",
+            static_cast<unsigned long long>(nofile.rlim_cur),
+            cfg.connections);
+    return 2;
+  }
+
+  std::vector<sockaddr_in> addrs((cfg.connections + PER_ADDRESS - 1) /
+                                 PER_ADDRESS);
+  for (size_t i = 0; i < addrs.size(); i++) {
+    addrs[i].sin_family = AF_INET;
+    addrs[i].sin_port = htons(cfg.port);
+    addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK + i);
+  }
+
+  Stats stats;
+  std::vector<std::string> failures;
+  uint64_t test_start = now_ns();
+  bool server_exited = false;
+  auto sample = [&](ProcessSample &s) {
+    s.t = (now_ns() - test_start) / 1e9;
+    s.open = stats.open_total();
+    if (!server_exited && !read_process(cfg.pid, s)) {
+      server_exited = true;
+      failures.push_back("server exited");
+    }
+    return !server_exited;
+  };
+
+  // Wait for the server to let go of every connection, then sample
+  auto settle = [&](ProcessSample &s, const ProcessSample &target) {
+    uint64_t deadline = now_ns() + static_cast<uint64_t>(cfg.settle_s * 1e9);
+    while (sample(s) && (s.fds > target.fds || s.threads > target.threads) &&
+           now_ns() < deadline) {
+      usleep(200000);
+    }
+  };
+
+  ProcessSample initial;
+  if (!sample(initial)) {
+    fprintf(stderr, "soak: no process %d\n", static_cast<int>(cfg.pid));
+    return 2;
+  }
+  double ramp_s = static_cast<double>(cfg.connections) / cfg.ramp_rate;
+  if (cfg.warmup_s > 0) {
+    fprintf(stderr, "soak: warm-up, %u connections for %.0fs\n",
+            cfg.connections, ramp_s + cfg.warmup_s);
+    {
+      Run warmup(cfg, addrs, stats);
+      uint64_t end = now_ns() + static_cast<uint64_t>(
+                                    (ramp_s + cfg.warmup_s) * 1e9);
+      ProcessSample s;
+      while (now_ns() < end && sample(s)) {
+        usleep(cfg.sample_ms * 1000);
+      }
+    }
+  }
+  ProcessSample baseline;
+  settle(baseline, initial);
+
+  // The measured run
+  std::vector<ProcessSample> samples;
+  ProcessSample peak = baseline;
+  uint64_t peak_open = 0;
+  std::vector<metrics::Histogram::Snapshot> windows;
+  uint64_t fast_before = stats.fast_ok.load();
+  uint64_t resets_before = stats.resets.load();
+  uint64_t closed_before = stats.closed_by_server.load();
+  uint64_t connect_errors_before = stats.connect_errors.load();
+  uint64_t fast_errors_before = stats.fast_errors.load();
+  uint64_t probe_errors_before = stats.probe_errors.load();
+  double hold_start_t = 0;
+  if (!server_exited) {
+    fprintf(stderr, "soak: %u connections, %.0fs ramp, %.0fs hold\n",
+            cfg.connections, ramp_s, cfg.duration_s);
+    Run run(cfg, addrs, stats);
+    uint64_t run_start = now_ns();
+    uint64_t end = run_start + static_cast<uint64_t>(
+                                   (ramp_s + cfg.duration_s) * 1e9);
+    hold_start_t = (run_start - test_start) / 1e9 + ramp_s;
+    metrics::Histogram::Snapshot last = stats.probe.snapshot();
+    windows.push_back(last);
+    while (now_ns() < end) {
+      usleep(cfg.sample_ms * 1000);
+      ProcessSample s;
+      if (!sample(s)) {
+        break;
+      }
+      metrics::Histogram::Snapshot now = stats.probe.snapshot();
+      metrics::Histogram::Snapshot window = diff(now, last);
+      s.p50_ms = window.quantile(0.5) / 1e6;
+      s.p99_ms = window.quantile(0.99) / 1e6;
+      last = now;
+      windows.push_back(now);
+      samples.push_back(s);
+      if (s.rss_kb > peak.rss_kb) {
+        peak = s;
+      }
+      peak.fds = std::max(peak.fds, s.fds);
+      peak.threads = std::max(peak.threads, s.threads);
+      peak.vsz_kb = std::max(peak.vsz_kb, s.vsz_kb);
+      peak_open = std::max(peak_open, s.open);
+      fprintf(stderr,
+              "soak: %6.1fs %7llu open, rss %llu MiB, %u fds, %u threads, "
+              "probe p99 %.2f ms\n",
+              s.t, static_cast<unsigned long long>(s.open),
+              static_cast<unsigned long long>(s.rss_kb / 1024), s.fds,
+              s.threads, s.p99_ms);
+    }
+  }
+  ProcessSample final_sample;
+  if (!server_exited) {
+    settle(final_sample, initial);
+  }
+
+  // Latency drift: the first tenth of the hold against the last tenth
+  metrics::Histogram::Snapshot first, last;
+  // Skip samples whose window began during the ramp
+  size_t hold_from = 1;
+  while (hold_from < samples.size() &&
+         samples[hold_from - 1].t < hold_start_t) {
+    hold_from++;
+  }
+  size_t held = samples.size() > hold_from ? samples.size() - hold_from : 0;
+  if (held >= 2) {
+    size_t tenth = std::max<size_t>(1, held / 10);
+    first = diff(windows[hold_from + tenth], windows[hold_from]);
+    last = diff(windows.back(), windows[windows.size() - 1 - tenth]);
+  }
+  double first_p50 = first.quantile(0.5) / 1e6;
+  double first_p99 = first.quantile(0.99) / 1e6;
+  double last_p50 = last.quantile(0.5) / 1e6;
+  double last_p99 = last.quantile(0.99) / 1e6;
+  double drift = first_p99 > 0 ? last_p99 / first_p99 : 0;
+
+  double per_conn = 0, vsz_per_conn = 0, threads_per_conn = 0,
+         fds_per_conn = 0;
+  if (peak_open > 0) {
+    per_conn = (static_cast<double>(peak.rss_kb) - baseline.rss_kb) /
+               peak_open;
+    vsz_per_conn = (static_cast<double>(peak.vsz_kb) - baseline.vsz_kb) /
+                   peak_open;
+    threads_per_conn =
+        (static_cast<double>(peak.threads) - baseline.threads) / peak_open;
+    fds_per_conn = (static_cast<double>(peak.fds) - baseline.fds) / peak_open;
+  }
+  if (peak_open < cfg.connections && !server_exited) {
+    failures.push_back("only " + std::to_string(peak_open) + " of " +
+                       std::to_string(cfg.connections) +
+                       " connections were open at once");
+  }
+  if (per_conn > cfg.budget_kb) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "%.1f KiB RSS per connection, budget %u KiB",
+             per_conn, cfg.budget_kb);
+    failures.push_back(msg);
+  }
+  if (!server_exited) {
+    if (final_sample.fds > initial.fds) {
+      failures.push_back(std::to_string(final_sample.fds - initial.fds) +
+                         " descriptors leaked");
+    }
+    if (final_sample.threads > initial.threads) {
+      failures.push_back(std::to_string(final_sample.threads -
+                                        initial.threads) +
+                         " threads leaked");
+    }
+    if (final_sample.rss_kb > baseline.rss_kb + cfg.leak_mb * 1024ULL) {
+      failures.push_back(
+          std::to_string((final_sample.rss_kb - baseline.rss_kb) / 1024) +
+          " MiB RSS not returned");
+    }
+  }
+  if (stats.corrupt.load() > 0) {
+    failures.push_back(std::to_string(stats.corrupt.load()) +
+                       " corrupt downloads");
+  }
+
+  // Report
+  std::string out = "{\"connections\":" + std::to_string(cfg.connections);
+  char buf[1024];
+  snprintf(buf, sizeof(buf),
+           ",\"mix\":{\"idle\":%u,\"slow\":%u,\"fast\":%u,\"abort\":%u},"
+           "\"duration_s\":%.1f,\"addresses\":%zu,\"server_exited\":%s,"
+           "\"open_peak\":%llu,",
+           cfg.mix[0], cfg.mix[1], cfg.mix[2], cfg.mix[3], cfg.duration_s,
+           addrs.size(), server_exited ? "true" : "false",
+           static_cast<unsigned long long>(peak_open));
+  out += buf;
+  out += "\"initial\":" + sample_json(initial);
+  out += ",\"baseline\":" + sample_json(baseline);
+  out += ",\"peak\":" + sample_json(peak);
+  out += ",\"final\":" + sample_json(final_sample);
+  snprintf(buf, sizeof(buf),
+           ",\"rss_per_connection_kb\":%.2f,\"vsz_per_connection_kb\":%.1f,"
+           "\"threads_per_connection\":%.3f,\"fds_per_connection\":%.3f,"
+           "\"budget_kb\":%u,\"probe\":{\"first_p50_ms\":%.3f,"
+           "\"first_p99_ms\":%.3f,\"last_p50_ms\":%.3f,\"last_p99_ms\":%.3f,"
+           "\"p99_drift\":%.2f,\"errors\":%llu},\"fast\":{\"responses\":%llu,"
+           "\"errors\":%llu,\"corrupt\":%llu},\"resets\":%llu,"
+           "\"closed_by_server\":%llu,\"connect_errors\":%llu,",
+           per_conn, vsz_per_conn, threads_per_conn, fds_per_conn,
+           cfg.budget_kb, first_p50, first_p99, last_p50, last_p99, drift,
+           static_cast<unsigned long long>(stats.probe_errors.load() -
+                                           probe_errors_before),
+           static_cast<unsigned long long>(stats.fast_ok.load() - fast_before),
+           static_cast<unsigned long long>(stats.fast_errors.load() -
+                                           fast_errors_before),
+           static_cast<unsigned long long>(stats.corrupt.load()),
+           static_cast<unsigned long long>(stats.resets.load() -
+                                           resets_before),
+           static_cast<unsigned long long>(stats.closed_by_server.load() -
+                                           closed_before),
+           static_cast<unsigned long long>(stats.connect_errors.load() -
+                                           connect_errors_before));
+  out += buf;
+  out += "\"failures\":[";
+  for (size_t i = 0; i < failures.size(); i++) {
+    out += (i > 0 ? ",\"" : "\"") + failures[i] + "\"";
+  }
+  out += "],\"samples\":[";
+  for (size_t i = 0; i < samples.size(); i++) {
+    out += (i > 0 ? "," : "") + sample_json(samples[i]);
+  }
+  out += "]}\n";
+  fputs(out.c_str(), stdout);
+
+  fprintf(stderr,
+          "soak: %llu connections held, %.2f KiB RSS, %.1f KiB virtual, "
+          "%.3f threads and %.3f fds per connection; probe p99 %.2f -> "
+          "%.2f ms\n",
+          static_cast<unsigned long long>(peak_open), per_conn, vsz_per_conn,
+          threads_per_conn, fds_per_conn, first_p99, last_p99);
+  if (!cfg.baseline.empty()) {
+    std::ifstream in(cfg.baseline);
+    std::stringstream ref;
+    ref << in.rdbuf();
+    std::string json = ref.str();
+    double ref_conn = json_number(json, "rss_per_connection_kb");
+    if (json.empty() || std::isnan(ref_conn)) {
+      fprintf(stderr, "soak: cannot read baseline %s\n",
+              cfg.baseline.c_str());
+    } else {
+      fprintf(stderr,
+              "soak: baseline %s: %.0f connections held, %.2f KiB RSS, "
+              "%.3f threads per connection, probe p99 %.2f ms%s\n",
+              cfg.baseline.c_str(), json_number(json, "open_peak"), ref_conn,
+              json_number(json, "threads_per_connection"),
+              json_number(json, "last_p99_ms"),
+              json.find("\"server_exited\":true") != std::string::npos
+                  ? ", server exited"
+                  : "");
+      if (ref_conn > 0 && per_conn > 0) {
+        fprintf(stderr, "soak: RSS per connection is %.2fx the baseline\n",
+                per_conn / ref_conn);
+      }
+    }
+  }
+  for (const std::string &f : failures) {
+    fprintf(stderr, "soak: FAILED: %s\n", f.c_str());
+  }
+  if (failures.empty()) {
+    fprintf(stderr, "soak: OK\n");
+  }
+  return failures.empty() ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Hold C100K connections against a local server and check memory and leaks.
+#
+# Usage: tests/soak.sh [SERVER]
+#
+# Starts SERVER with --synthetic and runs tests/streamix-soak against it (make
+# soak builds both and runs this): idle clients, slow readers, fast
+# downloaders and abrupt disconnects, while the server's RSS, descriptors,
+# threads and probe latency are sampled. The run fails if RSS per connection
+# exceeds the budget, if anything is still held once the clients are gone, or
+# if the server dies. The summary is compared with tests/soak_baseline.json,
+# a report from the thread-per-connection server.
+#
+# Environment:
+#   SOAK_REPORT       Output file (default soak_report.json)
+#   SOAK_CONNECTIONS  Concurrent connections (default 100000)
+#   SOAK_DURATION     Seconds to hold them (default 60)
+#   SOAK_BUDGET_KB    Max server RSS per connection (default 64)
+#   SOAK_PORT         Server port (default 18580; PORT+1 is the admin port)
+#   SOAK_ARGS         Extra tests/streamix-soak options, e.g. --mix 90:10:0:0
+
+set -eu
+
+SERVER=${1:-./streamix}
+SOAK=${SOAK:-./tests/streamix-soak}
+REPORT=${SOAK_REPORT:-soak_report.json}
+CONNECTIONS=${SOAK_CONNECTIONS:-100000}
+DURATION=${SOAK_DURATION:-60}
+BUDGET_KB=${SOAK_BUDGET_KB:-64}
+PORT=${SOAK_PORT:-18580}
+ADMIN_PORT=$((PORT + 1))
+BASELINE=tests/soak_baseline.json
+
+# Both ends need a descriptor per connection
+ulimit -n "$(ulimit -Hn)" 2>/dev/null || true
+
+# Idle clients hold half a request head for the whole run, so the header
+# deadline is off: the point is what holding them costs
+dir=$(mktemp -d)
+"$SERVER" -p "$PORT" --admin-port "$ADMIN_PORT" -r "$dir" --synthetic \
+  --header-timeout-ms 0 --access-log off --status-shm off \
+  >"$dir/server.log" 2>&1 &
+pid=$!
+trap 'kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+
+for _ in 1 2 3 4 5 6 7 8 9 10; do
+  curl -sf -o /dev/null "http://127.0.0.1:$ADMIN_PORT/metrics" && break
+  sleep 0.2
+done
+
+# shellcheck disable=SC2086
+"$SOAK" -p "$PORT" --pid "$pid" -n "$CONNECTIONS" -d "$DURATION" \
+  --budget-kb "$BUDGET_KB" --baseline "$BASELINE" ${SOAK_ARGS:-} \
+  >"$REPORT" || status=$?
+echo "soak: report written to $REPORT"
+exit "${status:-0}"
@@ -0,0 +1,387 @@
+/**
+ * @file tiering.h
+ * @brief Promotion of popular files from a slow root to a fast root
+ *
+ * Every request bumps an exponentially decaying popularity score for its
+ * path. A background thread copies the hottest files into the fast root with
+ * copy_file_range() while they fit in a size budget, then switches the entry
+ * to the fast copy. Requests hold a shared_ptr to the File they started with,
+ * so switching (or demoting and unlinking the fast copy) never disturbs a
+ * transfer that is already running.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <fcntl.h>
+#include <linux/ioprio.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Settings for TieredStore
+ */
+struct TierConfig {
+  std::string slow_root;        ///< Authoritative copy of every file
+  std::string fast_root;        ///< Directory promoted copies are written to
+  uint64_t fast_budget = 0;     ///< Max bytes of promoted copies
+  double promote_score = 8.0;   ///< Score at which a file becomes a candidate
+  double half_life_secs = 300;  ///< Time for a score to decay by half
+  unsigned interval_ms = 1000;  ///< How often placement is re-evaluated
+};
+
+/**
+ * @brief Two-tier file store with popularity-driven placement
+ *
+ * @tparam FileT RAII file type constructible from a path, exposing size()
+ */
+template <typename FileT> class TieredStore {
+public:
+  /**
+   * @brief Counters exported for monitoring
+   */
+  struct Stats {
+    std::atomic<uint64_t> promotions{0};      ///< Copies switched in
+    std::atomic<uint64_t> demotions{0};       ///< Copies dropped
+    std::atomic<uint64_t> promote_errors{0};  ///< Copies that failed
+    std::atomic<uint64_t> fast_hits{0};       ///< Requests served from fast
+    std::atomic<uint64_t> slow_hits{0};       ///< Requests served from slow
+    std::atomic<uint64_t> fast_bytes{0};      ///< Bytes currently promoted
+  };
+
+private:
+  struct Entry {
+    double score = 0;         ///< Popularity as of last_update
+    int64_t last_update = 0;  ///< steady_clock nanoseconds
+    std::shared_ptr<FileT> fast; ///< Open fast copy, null if not promoted
+    off_t size = 0;           ///< Size of the slow file when promoted
+    int64_t mtime_ns = 0;     ///< mtime of the slow file when promoted
+  };
+
+  TierConfig cfg_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  Stats stats_;
+
+  std::mutex wake_mutex_;
+  std::condition_variable wake_cv_;
+  bool stopping_ = false;
+  std::thread thread_;
+
+  static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static int64_t mtime_of(const struct stat &st) {
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+
+  /**
+   * @brief Score of an entry decayed to the given time (mutex_ held)
+   */
+  double decayed(const Entry &e, int64_t now) const {
+    double elapsed = (now - e.last_update) / 1e9;
+    return e.score * std::exp2(-elapsed / cfg_.half_life_secs);
+  }
+
+  std::string slow_path(const std::string &rel) const {
+    return cfg_.slow_root + "/" + rel;
+  }
+
+  std::string fast_path(const std::string &rel) const {
+    return cfg_.fast_root + "/" + rel;
+  }
+
+  /**
+   * @brief Create the parent directories of a path under the fast root
+   */
+  bool make_parents(const std::string &path) {
+    for (size_t slash = path.find('/', cfg_.fast_root.size() + 1);
+         slash != std::string::npos; slash = path.find('/', slash + 1)) {
+      std::string dir = path.substr(0, slash);
+      if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Copy the slow file into the fast root under a temporary name
+   *
+   * Uses copy_file_range() so the data stays in the kernel (and can be
+   * offloaded by the filesystem); falls back to sendfile() between files
+   * when the two roots are on filesystems that cannot copy to each other.
+   *
+   * @return true if the whole file was copied
+   */
+  static bool copy_file(int in, int out, off_t size) {
+    off_t in_off = 0;
+    off_t out_off = 0;
+    bool use_cfr = true;
+    while (in_off < size) {
+      size_t want =
+          static_cast<size_t>(std::min<off_t>(size - in_off, 1 << 30));
+      ssize_t n;
+      if (use_cfr) {
+        n = copy_file_range(in, &in_off, out, &out_off, want, 0);
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                      errno == EOPNOTSUPP)) {
+          use_cfr = false;
+          continue;
+        }
+      } else {
+        if (lseek(out, out_off, SEEK_SET) < 0) {
+          return false;
+        }
+        n = sendfile(out, in, &in_off, want);
+        if (n > 0) {
+          out_off += n;
+        }
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Copy a file to the fast tier and switch new requests to it
+   */
+  void promote(const std::string &rel) {
+    std::string src = slow_path(rel);
+    std::string dst = fast_path(rel);
+    std::string tmp = dst + ".streamix-tmp";
+
+    int in = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) < 0 || !make_parents(dst)) {
+      if (in >= 0) {
+        close(in);
+      }
+      stats_.promote_errors.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    int out =
+        ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = out >= 0 && copy_file(in, out, st.st_size);
+    close(in);
+    if (out >= 0) {
+      ok = ok && close(out) == 0;
+    }
+    if (!ok || rename(tmp.c_str(), dst.c_str()) < 0) {
+      unlink(tmp.c_str());
+      stats_.promote_errors.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    std::shared_ptr<FileT> fast;
+    try {
+      fast = std::make_shared<FileT>(dst.c_str());
+    } catch (const std::exception &) {
+      unlink(dst.c_str());
+      stats_.promote_errors.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry &e = entries_[rel];
+    e.fast = std::move(fast);
+    e.size = st.st_size;
+    e.mtime_ns = mtime_of(st);
+    stats_.fast_bytes.fetch_add(st.st_size, std::memory_order_relaxed);
+    stats_.promotions.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Switch an entry back to the slow tier (mutex_ held)
+   *
+   * The fast copy is unlinked right away; transfers that still hold it keep
+   * reading the open file until they finish.
+   */
+  void demote(const std::string &rel, Entry &e) {
+    if (!e.fast) {
+      return;
+    }
+    unlink(fast_path(rel).c_str());
+    e.fast.reset();
+    stats_.fast_bytes.fetch_sub(e.size, std::memory_order_relaxed);
+    stats_.demotions.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Decide what to promote and demote, then do the copies
+   *
+   * Candidates are taken hottest first. A candidate that does not fit in the
+   * budget may displace promoted files that are colder than it; promoted
+   * files whose score has decayed below half the promotion threshold are
+   * demoted regardless. The slow tier is only stat()ed with the lock
+   * released, so a slow disk cannot hold up request lookups.
+   */
+  void rebalance() {
+    struct Candidate {
+      std::string rel;
+      double score;
+      uint64_t size;
+    };
+    std::vector<Candidate> hot;
+    std::vector<Candidate> promoted;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      int64_t now = now_ns();
+      for (auto it = entries_.begin(); it != entries_.end();) {
+        double score = decayed(it->second, now);
+        if (it->second.fast) {
+          if (score < cfg_.promote_score / 2) {
+            demote(it->first, it->second);
+          } else {
+            promoted.push_back(
+                {it->first, score, static_cast<uint64_t>(it->second.size)});
+          }
+        } else if (score >= cfg_.promote_score) {
+          hot.push_back({it->first, score, 0});
+        } else if (score < 0.01) {
+          it = entries_.erase(it); // Forget paths that went cold
+          continue;
+        }
+        ++it;
+      }
+    }
+    if (hot.empty()) {
+      return;
+    }
+
+    for (Candidate &c : hot) {
+      struct stat st;
+      bool ok = stat(slow_path(c.rel).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+      c.size = ok ? st.st_size : UINT64_MAX;
+    }
+    std::sort(hot.begin(), hot.end(),
+              [](auto &a, auto &b) { return a.score > b.score; });
+    std::sort(promoted.begin(), promoted.end(),
+              [](auto &a, auto &b) { return a.score < b.score; });
+
+    std::vector<std::string> to_promote;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      uint64_t used = stats_.fast_bytes.load(std::memory_order_relaxed);
+      size_t coldest = 0;
+      for (const Candidate &c : hot) {
+        if (c.size > cfg_.fast_budget) {
+          continue; // Missing, not a regular file, or can never fit
+        }
+        while (used + c.size > cfg_.fast_budget &&
+               coldest < promoted.size() && promoted[coldest].score < c.score) {
+          auto it = entries_.find(promoted[coldest].rel);
+          if (it != entries_.end()) {
+            used -= it->second.size;
+            demote(it->first, it->second);
+          }
+          coldest++;
+        }
+        if (used + c.size > cfg_.fast_budget) {
+          break;
+        }
+        used += c.size;
+        to_promote.push_back(c.rel);
+      }
+    }
+
+    for (const std::string &rel : to_promote) {
+      promote(rel);
+    }
+  }
+
+  void run() {
+    // Copies are background work; keep them out of the way of reads
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+            IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    while (!wake_cv_.wait_for(lock, std::chrono::milliseconds(cfg_.interval_ms),
+                              [this] { return stopping_; })) {
+      lock.unlock();
+      rebalance();
+      lock.lock();
+    }
+  }
+
+public:
+  explicit TieredStore(const TierConfig &cfg) : cfg_(cfg) {
+    thread_ = std::thread(&TieredStore::run, this);
+  }
+
+  ~TieredStore() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      stopping_ = true;
+    }
+    wake_cv_.notify_all();
+    thread_.join();
+  }
+
+  TieredStore(const TieredStore &) = delete;
+  TieredStore &operator=(const TieredStore &) = delete;
+
+  /**
+   * @brief Record a request for a path and open the copy to serve it from
+   *
+   * A promoted copy is only used while the slow file still has the size and
+   * mtime it had when copied; otherwise it is demoted on the spot.
+   *
+   * @param rel Path relative to the roots (already normalized)
+   * @return The file to serve, shared with the store if promoted
+   * @throws std::system_error if the slow file cannot be opened
+   */
+  std::shared_ptr<FileT> open(const std::string &rel) {
+    struct stat st;
+    bool have_stat = stat(slow_path(rel).c_str(), &st) == 0;
+    if (!have_stat) {
+      // No entry for a path that does not exist, so a scan of random URLs
+      // leaves nothing behind; a copy of a file deleted since is dropped
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(rel);
+      if (it != entries_.end()) {
+        demote(rel, it->second);
+      }
+    } else {
+      std::lock_guard<std::mutex> lock(mutex_);
+      int64_t now = now_ns();
+      Entry &e = entries_[rel];
+      e.score = decayed(e, now) + 1;
+      e.last_update = now;
+
+      if (e.fast) {
+        if (st.st_size == e.size && mtime_of(st) == e.mtime_ns) {
+          stats_.fast_hits.fetch_add(1, std::memory_order_relaxed);
+          return e.fast;
+        }
+        demote(rel, e); // Slow copy changed underneath us
+      }
+    }
+    stats_.slow_hits.fetch_add(1, std::memory_order_relaxed);
+    return std::make_shared<FileT>(slow_path(rel).c_str());
+  }
+
+  const Stats &stats() const { return stats_; }
+};
@@ -0,0 +1,436 @@
+/**
+ * @file logq.cpp
+ * @brief Filter and aggregate binary access-log segments
+ *
+ * Reads the segments written with --access-log-format binary (see binlog.h).
+ * Each block is scanned column by column: every filter is one pass over one
+ * array that narrows a per-record selection mask, and aggregates are masked
+ * sums over the arrays they need. Those loops have no branches or
+ * cross-iteration dependencies, so the compiler vectorizes them, and
+ * columns a query does not touch are never read from disk.
+ */
+
+#include "../binlog.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using binlog::Block;
+using binlog::BLOCK_RECORDS;
+using binlog::SegmentReader;
+
+/**
+ * @brief Conditions a record must meet to be counted
+ */
+struct Filter {
+  uint16_t status_min = 0;
+  uint16_t status_max = UINT16_MAX;
+  int64_t since_ns = INT64_MIN;
+  int64_t until_ns = INT64_MAX;
+  bool by_client = false;
+  uint32_t client_ip = 0; ///< Network byte order
+  uint64_t min_duration_us = 0;
+  std::string path_prefix;
+};
+
+/**
+ * @brief Mark the records of a block that pass the filter
+ * @param b Block to scan
+ * @param n Records in use in the block
+ * @param f Filter
+ * @param paths If set, only records whose path hash is in it pass
+ * @param keep Receives 1 for selected records, 0 otherwise
+ * @return size_t Number of records selected
+ */
+size_t select(const Block &b, size_t n, const Filter &f,
+              const std::unordered_set<uint64_t> *paths, uint8_t *keep) {
+  for (size_t i = 0; i < BLOCK_RECORDS; i++) {
+    keep[i] = i < n;
+  }
+  if (f.status_min != 0 || f.status_max != UINT16_MAX) {
+    for (size_t i = 0; i < BLOCK_RECORDS; i++) {
+      keep[i] &= (b.status[i] >= f.status_min) & (b.status[i] <= f.status_max);
+    }
+  }
+  if (f.since_ns != INT64_MIN || f.until_ns != INT64_MAX) {
+    for (size_t i = 0; i < BLOCK_RECORDS; i++) {
+      keep[i] &= (b.time_ns[i] >= f.since_ns) & (b.time_ns[i] < f.until_ns);
+    }
+  }
+  if (f.by_client) {
+    for (size_t i = 0; i < BLOCK_RECORDS; i++) {
+      keep[i] &= b.client_ip[i] == f.client_ip;
+    }
+  }
+  if (f.min_duration_us != 0) {
+    for (size_t i = 0; i < BLOCK_RECORDS; i++) {
+      keep[i] &= b.duration_us[i] >= f.min_duration_us;
+    }
+  }
+  if (paths != nullptr) {
+    for (size_t i = 0; i < n; i++) {
+      keep[i] &= paths->count(b.path_hash[i]) != 0;
+    }
+  }
+  size_t selected = 0;
+  for (size_t i = 0; i < BLOCK_RECORDS; i++) {
+    selected += keep[i];
+  }
+  return selected;
+}
+
+/**
+ * @brief Calls fn(block, records in use, keep mask, segment) for every
+ *        block of every segment that has selected records
+ */
+template <typename Fn>
+void scan(const std::vector<std::string> &files, const Filter &filter, Fn fn) {
+  alignas(64) uint8_t keep[BLOCK_RECORDS];
+  for (const std::string &path : files) {
+    SegmentReader segment(path);
+    std::unordered_set<uint64_t> matching;
+    const std::unordered_set<uint64_t> *paths = nullptr;
+    if (!filter.path_prefix.empty()) {
+      for (const auto &[hash, name] : segment.paths()) {
+        if (name.compare(0, filter.path_prefix.size(), filter.path_prefix) ==
+            0) {
+          matching.insert(hash);
+        }
+      }
+      paths = &matching;
+    }
+    for (size_t b = 0; b < segment.blocks(); b++) {
+      const Block &block = segment.block(b);
+      size_t n = segment.block_count(b);
+      if (select(block, n, filter, paths, keep) > 0) {
+        fn(block, n, keep, segment);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Value at quantile q of a sample, sorting it in place
+ */
+double percentile(std::vector<uint64_t> &values, double q) {
+  if (values.empty()) {
+    return 0;
+  }
+  size_t rank = std::min(values.size() - 1,
+                         static_cast<size_t>(q * (values.size() - 1) + 0.5));
+  std::nth_element(values.begin(), values.begin() + rank, values.end());
+  return values[rank];
+}
+
+void cmd_summary(const std::vector<std::string> &files, const Filter &filter) {
+  uint64_t records = 0;
+  uint64_t bytes = 0;
+  int64_t first = INT64_MAX;
+  int64_t last = INT64_MIN;
+  std::vector<uint64_t> by_status(600);
+  scan(files, filter,
+       [&](const Block &b, size_t n, const uint8_t *keep, const SegmentReader &) {
+         for (size_t i = 0; i < BLOCK_RECORDS; i++) {
+           records += keep[i];
+           bytes += keep[i] ? b.bytes_sent[i] : 0;
+         }
+         for (size_t i = 0; i < n; i++) {
+           if (keep[i]) {
+             first = std::min(first, b.time_ns[i]);
+             last = std::max(last, b.time_ns[i]);
+             by_status[std::min<size_t>(b.status[i], 599)]++;
+           }
+         }
+       });
+  printf("records: %llu\nbytes:   %llu\n",
+         static_cast<unsigned long long>(records),
+         static_cast<unsigned long long>(bytes));
+  if (records == 0) {
+    return;
+  }
+  printf("span:    %.3f s\n", (last - first) / 1e9);
+  for (size_t status = 0; status < by_status.size(); status++) {
+    if (by_status[status] != 0) {
+      printf("status %3zu: %llu\n", status,
+             static_cast<unsigned long long>(by_status[status]));
+    }
+  }
+}
+
+/**
+ * @brief Requests and bytes per key, for the top-N commands
+ */
+struct Tally {
+  uint64_t requests = 0;
+  uint64_t bytes = 0;
+};
+
+template <typename Key>
+std::vector<std::pair<Key, Tally>>
+top(const std::unordered_map<Key, Tally> &tallies, size_t limit,
+    bool by_bytes) {
+  std::vector<std::pair<Key, Tally>> sorted(tallies.begin(), tallies.end());
+  auto order = [by_bytes](const auto &a, const auto &b) {
+    return by_bytes ? a.second.bytes > b.second.bytes
+                    : a.second.requests > b.second.requests;
+  };
+  if (sorted.size() > limit) {
+    std::partial_sort(sorted.begin(), sorted.begin() + limit, sorted.end(),
+                      order);
+    sorted.resize(limit);
+  } else {
+    std::sort(sorted.begin(), sorted.end(), order);
+  }
+  return sorted;
+}
+
+void cmd_top_paths(const std::vector<std::string> &files, const Filter &filter,
+                   size_t limit, bool by_bytes) {
+  std::unordered_map<uint64_t, Tally> tallies;
+  std::unordered_map<uint64_t, std::string> names;
+  scan(files, filter,
+       [&](const Block &b, size_t n, const uint8_t *keep,
+           const SegmentReader &segment) {
+         for (size_t i = 0; i < n; i++) {
+           if (keep[i]) {
+             Tally &t = tallies[b.path_hash[i]];
+             t.requests++;
+             t.bytes += b.bytes_sent[i];
+           }
+         }
+         if (names.size() < tallies.size()) {
+           for (const auto &[hash, name] : segment.paths()) {
+             names.emplace(hash, name);
+           }
+         }
+       });
+  printf("%12s %16s  %s\n", "requests", "bytes", "path");
+  for (const auto &[hash, t] : top(tallies, limit, by_bytes)) {
+    auto name = names.find(hash);
+    printf("%12llu %16llu  %s\n", static_cast<unsigned long long>(t.requests),
+           static_cast<unsigned long long>(t.bytes),
+           name == names.end() ? "?" : name->second.c_str());
+  }
+}
+
+void cmd_top_clients(const std::vector<std::string> &files,
+                     const Filter &filter, size_t limit, bool by_bytes) {
+  std::unordered_map<uint32_t, Tally> tallies;
+  scan(files, filter,
+       [&](const Block &b, size_t n, const uint8_t *keep, const SegmentReader &) {
+         for (size_t i = 0; i < n; i++) {
+           if (keep[i]) {
+             Tally &t = tallies[b.client_ip[i]];
+             t.requests++;
+             t.bytes += b.bytes_sent[i];
+           }
+         }
+       });
+  printf("%12s %16s  %s\n", "requests", "bytes", "client");
+  for (const auto &[ip, t] : top(tallies, limit, by_bytes)) {
+    char text[INET_ADDRSTRLEN];
+    in_addr addr{ip};
+    inet_ntop(AF_INET, &addr, text, sizeof(text));
+    printf("%12llu %16llu  %s\n", static_cast<unsigned long long>(t.requests),
+           static_cast<unsigned long long>(t.bytes), text);
+  }
+}
+
+void cmd_latency(const std::vector<std::string> &files, const Filter &filter) {
+  std::vector<uint64_t> duration;
+  std::vector<uint64_t> ttfb;
+  std::vector<uint64_t> rtt;
+  scan(files, filter,
+       [&](const Block &b, size_t n, const uint8_t *keep, const SegmentReader &) {
+         for (size_t i = 0; i < n; i++) {
+           if (keep[i]) {
+             duration.push_back(b.duration_us[i]);
+             if (b.ttfb_us[i] != 0) {
+               ttfb.push_back(b.ttfb_us[i]);
+             }
+             if (b.rtt_us[i] != 0) {
+               rtt.push_back(b.rtt_us[i]);
+             }
+           }
+         }
+       });
+  printf("%-12s %10s %10s %10s %10s %10s %10s\n", "(us)", "count", "p50",
+         "p90", "p99", "p99.9", "max");
+  for (auto &[name, values] :
+       {std::pair<const char *, std::vector<uint64_t> *>{"duration", &duration},
+        {"ttfb", &ttfb},
+        {"rtt", &rtt}}) {
+    std::vector<uint64_t> &v = *values;
+    printf("%-12s %10zu %10.0f %10.0f %10.0f %10.0f %10.0f\n", name, v.size(),
+           percentile(v, 0.5), percentile(v, 0.9), percentile(v, 0.99),
+           percentile(v, 0.999), percentile(v, 1.0));
+  }
+}
+
+void cmd_dump(const std::vector<std::string> &files, const Filter &filter) {
+  std::string out;
+  scan(files, filter,
+       [&](const Block &b, size_t n, const uint8_t *keep,
+           const SegmentReader &segment) {
+         for (size_t i = 0; i < n; i++) {
+           if (!keep[i]) {
+             continue;
+           }
+           AccessRecord r;
+           r.time_ns = b.time_ns[i];
+           r.client_ip = b.client_ip[i];
+           r.client_port = b.client_port[i];
+           r.status = b.status[i];
+           r.bytes_sent = b.bytes_sent[i];
+           r.content_size = b.content_size[i];
+           r.range_start = b.range_start[i];
+           r.range_length = b.range_length[i];
+           r.duration_us = b.duration_us[i];
+           r.ttfb_us = b.ttfb_us[i];
+           r.rtt_us = b.rtt_us[i];
+           r.retransmits = b.retransmits[i];
+           r.rwnd_limited = b.rwnd_limited[i];
+           r.sndbuf_limited = b.sndbuf_limited[i];
+           AccessRecord::set(r.method, binlog::decode_method(b.method[i]));
+           auto name = segment.paths().find(b.path_hash[i]);
+           AccessRecord::set(r.path, name == segment.paths().end()
+                                         ? "?"
+                                         : name->second);
+           out.clear();
+           format_json(out, r);
+           fwrite(out.data(), 1, out.size(), stdout);
+         }
+       });
+}
+
+void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] COMMAND SEGMENT|DIR...\n"
+          "Commands:\n"
+          "  summary       Record and byte counts, status breakdown\n"
+          "  top-paths     Most requested paths\n"
+          "  top-clients   Clients by requests\n"
+          "  latency       Duration, TTFB and RTT percentiles\n"
+          "  dump          Print matching records as JSON lines\n"
+          "Filters:\n"
+          "  --status CODE       e.g. 404, or 5xx for a class\n"
+          "  --since SECS        Records at or after this Unix time\n"
+          "  --until SECS        Records before this Unix time\n"
+          "  --client IP         Records from this IPv4 address\n"
+          "  --path-prefix P     Records whose path starts with P\n"
+          "  --min-duration-ms N Records that took at least N ms\n"
+          "Output:\n"
+          "  -n, --limit N       Rows for top-* (default 20)\n"
+          "      --by-bytes      Rank top-* by bytes instead of requests\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  enum {
+    OPT_STATUS = 256,
+    OPT_SINCE,
+    OPT_UNTIL,
+    OPT_CLIENT,
+    OPT_PATH_PREFIX,
+    OPT_MIN_DURATION_MS,
+    OPT_BY_BYTES,
+  };
+  static const option long_options[] = {
+      {"status", required_argument, nullptr, OPT_STATUS},
+      {"since", required_argument, nullptr, OPT_SINCE},
+      {"until", required_argument, nullptr, OPT_UNTIL},
+      {"client", required_argument, nullptr, OPT_CLIENT},
+      {"path-prefix", required_argument, nullptr, OPT_PATH_PREFIX},
+      {"min-duration-ms", required_argument, nullptr, OPT_MIN_DURATION_MS},
+      {"limit", required_argument, nullptr, 'n'},
+      {"by-bytes", no_argument, nullptr, OPT_BY_BYTES},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  Filter filter;
+  size_t limit = 20;
+  bool by_bytes = false;
+  int c;
+  while ((c = getopt_long(argc, argv, "n:h", long_options, nullptr)) != -1) {
+    switch (c) {
+    case OPT_STATUS:
+      if (strlen(optarg) == 3 && strcmp(optarg + 1, "xx") == 0 &&
+          optarg[0] >= '1' && optarg[0] <= '5') {
+        filter.status_min = (optarg[0] - '0') * 100;
+        filter.status_max = filter.status_min + 99;
+      } else {
+        filter.status_min = filter.status_max = atoi(optarg);
+      }
+      break;
+    case OPT_SINCE:
+      filter.since_ns = atoll(optarg) * 1000000000LL;
+      break;
+    case OPT_UNTIL:
+      filter.until_ns = atoll(optarg) * 1000000000LL;
+      break;
+    case OPT_CLIENT:
+      if (inet_pton(AF_INET, optarg, &filter.client_ip) != 1) {
+        fprintf(stderr, "Invalid value for --client: %s\n", optarg);
+        return 2;
+      }
+      filter.by_client = true;
+      break;
+    case OPT_PATH_PREFIX:
+      filter.path_prefix = optarg;
+      break;
+    case OPT_MIN_DURATION_MS:
+      filter.min_duration_us = strtoull(optarg, nullptr, 10) * 1000;
+      break;
+    case 'n':
+      limit = atoi(optarg);
+      break;
+    case OPT_BY_BYTES:
+      by_bytes = true;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind < 2) {
+    print_usage(argv[0]);
+    return 2;
+  }
+  std::string command = argv[optind];
+  std::vector<std::string> files =
+      binlog::list_segments(argv + optind + 1, argc - optind - 1);
+
+  try {
+    if (command == "summary") {
+      cmd_summary(files, filter);
+    } else if (command == "top-paths") {
+      cmd_top_paths(files, filter, limit, by_bytes);
+    } else if (command == "top-clients") {
+      cmd_top_clients(files, filter, limit, by_bytes);
+    } else if (command == "latency") {
+      cmd_latency(files, filter);
+    } else if (command == "dump") {
+      cmd_dump(files, filter);
+    } else {
+      print_usage(argv[0]);
+      return 2;
+    }
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,246 @@
+/**
+ * @file top.cpp
+ * @brief Live view of a running server's connections
+ *
+ * Maps the server's status region (see status_shm.h) read-only and redraws a
+ * table of its connections every interval. Nothing is asked of the server:
+ * every value is read straight from shared memory, so watching a busy server
+ * does not slow it down. Per-connection rates are the bytes sent between two
+ * refreshes, keyed by slot and accept time so a reused slot starts over.
+ */
+
+#include "../status_shm.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <map>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using status::ConnectionView;
+
+uint64_t now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Format a byte count with a binary unit, e.g. "12.5M"
+ */
+std::string human(double bytes) {
+  static constexpr const char UNITS[] = "BKMGTP";
+  size_t unit = 0;
+  while (bytes >= 1024 && unit + 1 < sizeof(UNITS) - 1) {
+    bytes /= 1024;
+    unit++;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), unit == 0 ? "%.0f%c" : "%.1f%c", bytes,
+           UNITS[unit]);
+  return buf;
+}
+
+/**
+ * @brief Format a duration in seconds compactly, e.g. "3m05s"
+ */
+std::string age(uint64_t ns) {
+  uint64_t s = ns / 1000000000;
+  char buf[32];
+  if (s < 60) {
+    snprintf(buf, sizeof(buf), "%.1fs", ns / 1e9);
+  } else if (s < 3600) {
+    snprintf(buf, sizeof(buf), "%llum%02llus",
+             static_cast<unsigned long long>(s / 60),
+             static_cast<unsigned long long>(s % 60));
+  } else {
+    snprintf(buf, sizeof(buf), "%lluh%02llum",
+             static_cast<unsigned long long>(s / 3600),
+             static_cast<unsigned long long>(s / 60 % 60));
+  }
+  return buf;
+}
+
+/**
+ * @brief What one refresh saw, kept to compute rates on the next
+ */
+struct Frame {
+  uint64_t at_ns = 0;
+  status::Counters counters;
+  std::map<std::pair<uint32_t, uint64_t>, uint64_t> sent; ///< By slot, start
+};
+
+/**
+ * @brief Draw one screen
+ * @param prev Previous refresh, replaced by this one
+ * @param limit Most connections to list
+ */
+void draw(const status::Region &region, Frame &prev, size_t limit,
+          bool clear) {
+  Frame cur;
+  uint64_t heartbeat = 0;
+  cur.counters = region.counters(heartbeat);
+  std::vector<ConnectionView> conns = region.connections();
+  cur.at_ns = now_ns();
+  double elapsed = prev.at_ns != 0 ? (cur.at_ns - prev.at_ns) / 1e9 : 0;
+
+  struct Row {
+    const ConnectionView *view;
+    double rate;
+  };
+  std::vector<Row> rows;
+  for (const ConnectionView &v : conns) {
+    auto key = std::make_pair(v.index, v.started_mono_ns);
+    cur.sent[key] = v.bytes_sent;
+    double rate;
+    auto before = prev.sent.find(key);
+    if (elapsed > 0 && before != prev.sent.end()) {
+      rate = (v.bytes_sent - before->second) / elapsed;
+    } else {
+      // New since the last refresh: average over its lifetime
+      double lifetime = (cur.at_ns - v.started_mono_ns) / 1e9;
+      rate = lifetime > 0 ? v.bytes_sent / lifetime : 0;
+    }
+    rows.push_back({&v, rate});
+  }
+  std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) {
+    return a.rate != b.rate ? a.rate > b.rate
+                            : a.view->started_mono_ns < b.view->started_mono_ns;
+  });
+
+  const status::Counters &c = cur.counters;
+  double accept_rate = 0;
+  double send_rate = 0;
+  if (elapsed > 0) {
+    accept_rate = (c.accepted - prev.counters.accepted) / elapsed;
+    send_rate = (c.bytes_sent - prev.counters.bytes_sent) / elapsed;
+  }
+  if (clear) {
+    fputs("\033[H\033[2J", stdout);
+  }
+  printf("streamix pid %d  up %s  %s\n", region.pid(),
+         age(cur.at_ns - region.started_mono_ns()).c_str(),
+         cur.at_ns - heartbeat > 5000000000ULL ? "(not updating)" : "");
+  printf("active %llu  accepted %llu (%.0f/s)  sent %s (%s/s)  untracked %llu"
+         "\n",
+         static_cast<unsigned long long>(c.active),
+         static_cast<unsigned long long>(c.accepted), accept_rate,
+         human(c.bytes_sent).c_str(), human(send_rate).c_str(),
+         static_cast<unsigned long long>(c.untracked));
+  printf("responses 2xx %llu  3xx %llu  4xx %llu  5xx %llu\n\n",
+         static_cast<unsigned long long>(c.responses[2]),
+         static_cast<unsigned long long>(c.responses[3]),
+         static_cast<unsigned long long>(c.responses[4]),
+         static_cast<unsigned long long>(c.responses[5]));
+  printf("%-21s %-5s %8s %8s %8s %10s  %s\n", "CLIENT", "PHASE", "AGE", "SENT",
+         "TOTAL", "RATE", "PATH");
+  for (size_t i = 0; i < rows.size() && i < limit; i++) {
+    const ConnectionView &v = *rows[i].view;
+    char ip[INET_ADDRSTRLEN];
+    in_addr addr{v.client_ip};
+    inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+    std::string client = std::string(ip) + ":" + std::to_string(v.client_port);
+    printf("%-21s %-5s %8s %8s %8s %8s/s  %s\n", client.c_str(),
+           status::phase_name(v.phase),
+           age(cur.at_ns - v.started_mono_ns).c_str(),
+           human(v.bytes_sent).c_str(),
+           v.bytes_total > 0 ? human(v.bytes_total).c_str() : "-",
+           human(rows[i].rate).c_str(), v.path.c_str());
+  }
+  if (rows.size() > limit) {
+    printf("... %zu more\n", rows.size() - limit);
+  }
+  fflush(stdout);
+  prev = std::move(cur);
+}
+
+void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [PORT|NAME]\n"
+          "Shows the connections of the server on PORT (default 8080), or\n"
+          "publishing to the shared-memory object NAME (--status-shm).\n"
+          "  -d, --delay SECS    Refresh interval (default 1)\n"
+          "  -i, --iterations N  Exit after N refreshes (default: run until\n"
+          "                      interrupted)\n"
+          "  -n, --limit N       Connections to list (default 40)\n"
+          "  -b, --batch         Do not clear the screen between refreshes\n",
+          prog);
+}
+
+int main(int argc, char *argv[]) {
+  static const option long_options[] = {
+      {"delay", required_argument, nullptr, 'd'},
+      {"iterations", required_argument, nullptr, 'i'},
+      {"limit", required_argument, nullptr, 'n'},
+      {"batch", no_argument, nullptr, 'b'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  double delay = 1;
+  long iterations = -1;
+  size_t limit = 40;
+  bool batch = !isatty(STDOUT_FILENO);
+  int c;
+  while ((c = getopt_long(argc, argv, "d:i:n:bh", long_options, nullptr)) !=
+         -1) {
+    switch (c) {
+    case 'd':
+      delay = atof(optarg);
+      if (delay <= 0) {
+        fprintf(stderr, "Invalid value for --delay: %s\n", optarg);
+        return 2;
+      }
+      break;
+    case 'i':
+      iterations = atol(optarg);
+      break;
+    case 'n':
+      limit = atoi(optarg);
+      break;
+    case 'b':
+      batch = true;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - optind > 1) {
+    print_usage(argv[0]);
+    return 2;
+  }
+  std::string name = "/streamix.8080";
+  if (optind < argc) {
+    name = argv[optind][0] == '/' ? argv[optind]
+                                  : std::string("/streamix.") + argv[optind];
+  }
+
+  try {
+    auto region = status::Region::open_readonly(name);
+    Frame prev;
+    for (long n = 0; iterations < 0 || n < iterations; n++) {
+      if (n > 0) {
+        usleep(static_cast<useconds_t>(delay * 1e6));
+        if (batch) {
+          putchar('\n');
+        }
+      }
+      draw(*region, prev, limit, !batch);
+    }
+  } catch (const std::exception &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * @file trace.h
+ * @brief Static user-space tracepoints (USDT) on the request path
+ *
+ * Each STREAMIX_TRACE() site compiles to a test of the probe's semaphore,
+ * a nop and an ELF note that records where the probe is and where its
+ * arguments live. Tools such as perf, bpftrace and SystemTap find the probes
+ * in the binary; while one is attached it raises the semaphore and patches
+ * the nop, so a production build can be traced without rebuilding or turning
+ * on verbose logging:
+ *
+ *     bpftrace -l 'usdt:./streamix:*'
+ *     bpftrace -e 'usdt:./streamix:streamix:sendfile { @ = hist(arg3); }'
+ *
+ * While nothing is attached the arguments are not evaluated, and anything
+ * computed only for a probe (such as a duration) should be guarded with
+ * STREAMIX_TRACE_ENABLED(). The notes come from usdt.h, so no SDK is needed;
+ * on targets it does not support, or with -DSTREAMIX_NO_USDT, both macros
+ * compile to nothing and the build says so.
+ *
+ * Probes (provider "streamix"):
+ *   accept(fd, accepted_ns)
+ *   request_parsed(fd, method, path)               strings
+ *   file_opened(fd, path, size)                    path is a string
+ *   sendfile(fd, offset, bytes, duration_ns)       one per sendfile() call
+ *   response_complete(fd, status, bytes, duration_ns)
+ *   error(fd, errno, message)                      message is a string
+ */
+
+#pragma once
+
+#ifndef STREAMIX_NO_USDT
+#include "usdt.h"
+#ifdef USDT_SUPPORTED
+#define STREAMIX_USDT 1
+#else
+#warning "USDT probes are not supported on this target; building without them"
+#endif
+#endif
+
+#ifdef STREAMIX_USDT
+USDT_DEFINE_SEMAPHORE(streamix, accept)
+USDT_DEFINE_SEMAPHORE(streamix, request_parsed)
+USDT_DEFINE_SEMAPHORE(streamix, file_opened)
+USDT_DEFINE_SEMAPHORE(streamix, sendfile)
+USDT_DEFINE_SEMAPHORE(streamix, response_complete)
+USDT_DEFINE_SEMAPHORE(streamix, error)
+
+#define STREAMIX_TRACE_ENABLED(name) USDT_ENABLED(streamix, name)
+#define STREAMIX_TRACE(name, ...)                                              \
+  do {                                                                         \
+    if (STREAMIX_TRACE_ENABLED(name)) {                                        \
+      USDT_PROBE(streamix, name, __VA_ARGS__);                                 \
+    }                                                                          \
+  } while (0)
+#else
+namespace trace {
+template <typename... Args> int discard(const Args &...);
+} // namespace trace
+#define STREAMIX_TRACE_ENABLED(name) false
+// Unevaluated, but keeps the arguments "used" for -Wunused
+#define STREAMIX_TRACE(name, ...)                                              \
+  static_cast<void>(sizeof(trace::discard(__VA_ARGS__)))
+#endif
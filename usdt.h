@@ -0,0 +1,110 @@
+/**
+ * @file usdt.h
+ * @brief Minimal USDT probe support, compatible with <sys/sdt.h>
+ *
+ * Emits the same ELF notes as SystemTap's <sys/sdt.h> (".note.stapsdt",
+ * version 3, with semaphores), so perf, bpftrace and SystemTap find the
+ * probes, without needing systemtap-sdt-dev on the build host. Only what
+ * trace.h uses is provided: probes with 1 to 6 integer or pointer
+ * arguments, each guarded by a semaphore that tracers increment while they
+ * are attached.
+ *
+ * A probe site is a nop plus a note recording its address, its semaphore
+ * and where each argument lives ("SIZE@OPERAND", negative SIZE for signed
+ * types). USDT_DEFINE_SEMAPHORE() must be used once per probe, and
+ * USDT_ENABLED() read before USDT_PROBE() so that the arguments are only
+ * computed while someone is listening.
+ *
+ * x86-64 and AArch64 only; elsewhere USDT_SUPPORTED is left undefined.
+ */
+
+#pragma once
+
+#if defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+#define USDT_SUPPORTED 1
+
+#include <type_traits>
+
+namespace usdt {
+
+/// Decays arrays to pointers without promoting small integers
+template <typename T> inline T value(T x) { return x; }
+
+/// The SIZE of an argument in its "SIZE@OPERAND" descriptor
+template <typename T> constexpr int spec() {
+  constexpr int size = std::is_pointer_v<T> ? sizeof(void *) : sizeof(T);
+  return std::is_signed_v<T> ? -size : size;
+}
+
+} // namespace usdt
+
+/// Counter a tracer raises while attached to provider:name
+#define USDT_DEFINE_SEMAPHORE(provider, name)                                  \
+  extern "C" {                                                                 \
+  __attribute__((weak, section(".probes"), visibility("hidden")))              \
+  volatile unsigned short provider##_##name##_semaphore = 0;                   \
+  }
+
+#define USDT_ENABLED(provider, name)                                           \
+  __builtin_expect(provider##_##name##_semaphore != 0, 0)
+
+#define USDT_STR_(x) #x
+#define USDT_STR(x) USDT_STR_(x)
+
+// Argument descriptors and operands, by argument count
+#define USDT_ARG(n) "%c[s" #n "]@%[a" #n "]"
+#define USDT_FMT1 USDT_ARG(0)
+#define USDT_FMT2 USDT_FMT1 " " USDT_ARG(1)
+#define USDT_FMT3 USDT_FMT2 " " USDT_ARG(2)
+#define USDT_FMT4 USDT_FMT3 " " USDT_ARG(3)
+#define USDT_FMT5 USDT_FMT4 " " USDT_ARG(4)
+#define USDT_FMT6 USDT_FMT5 " " USDT_ARG(5)
+
+#define USDT_OP(n, x)                                                          \
+  [s##n] "n"(usdt::spec<decltype(usdt::value(x))>()),                          \
+      [a##n] "nor"(usdt::value(x))
+#define USDT_OPS1(a) USDT_OP(0, a)
+#define USDT_OPS2(a, b) USDT_OPS1(a), USDT_OP(1, b)
+#define USDT_OPS3(a, b, c) USDT_OPS2(a, b), USDT_OP(2, c)
+#define USDT_OPS4(a, b, c, d) USDT_OPS3(a, b, c), USDT_OP(3, d)
+#define USDT_OPS5(a, b, c, d, e) USDT_OPS4(a, b, c, d), USDT_OP(4, e)
+#define USDT_OPS6(a, b, c, d, e, f) USDT_OPS5(a, b, c, d, e), USDT_OP(5, f)
+
+#define USDT_NARG_(_1, _2, _3, _4, _5, _6, n, ...) n
+#define USDT_NARG(...) USDT_NARG_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define USDT_CAT_(a, b) a##b
+#define USDT_CAT(a, b) USDT_CAT_(a, b)
+
+// The note layout and the shared .stapsdt.base anchor follow <sys/sdt.h>
+#define USDT_NOTE(provider, name, args)                                        \
+  "990: nop\n"                                                                 \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                \
+  ".balign 4\n"                                                                \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                           \
+  "991: .asciz \"stapsdt\"\n"                                                  \
+  "992: .balign 4\n"                                                           \
+  "993: .8byte 990b\n"                                                         \
+  ".8byte _.stapsdt.base\n"                                                    \
+  ".8byte " USDT_STR(provider##_##name##_semaphore) "\n"                       \
+  ".asciz \"" USDT_STR(provider) "\"\n"                                        \
+  ".asciz \"" USDT_STR(name) "\"\n"                                            \
+  ".asciz \"" args "\"\n"                                                      \
+  "994: .balign 4\n"                                                           \
+  ".popsection\n"                                                              \
+  ".ifndef _.stapsdt.base\n"                                                   \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"      \
+  ".weak _.stapsdt.base\n"                                                     \
+  ".hidden _.stapsdt.base\n"                                                   \
+  "_.stapsdt.base: .space 1\n"                                                 \
+  ".size _.stapsdt.base, 1\n"                                                  \
+  ".popsection\n"                                                              \
+  ".endif\n"
+
+/// Fire provider:name with 1 to 6 integer or pointer arguments
+#define USDT_PROBE(provider, name, ...)                                        \
+  __asm__ __volatile__(                                                        \
+      USDT_NOTE(provider, name,                                                \
+                USDT_CAT(USDT_FMT, USDT_NARG(__VA_ARGS__)))::USDT_CAT(         \
+          USDT_OPS, USDT_NARG(__VA_ARGS__))(__VA_ARGS__))
+
+#endif